@@ -53,6 +53,12 @@ namespace F2B
             Console.WriteLine("  -i interv   subscribe interval in seconds (default 60, disable 0)");
             Console.WriteLine("  -n interv   cleanup interval for expired filter rules in seconds (default 30, disable 0)");
             Console.WriteLine("  -m size     maximum number of filter rules in WFP (default 0 - no limit)");
+            Console.WriteLine("  --eviction policy    new rule when maximum is reached: None, SoonestExpiring, LeastRecentlyTriggered, CoalescePrefix");
+            Console.WriteLine("  -b size     maximum number of addresses in one bucket filter rule (default 0 - no buckets)");
+            Console.WriteLine("  --bucket-granularity interv  addresses with expiration within interval seconds share bucket filter (default 300)");
+            Console.WriteLine("  --coalesce-ipv4 thr  replace dense IPv4 addresses with covering prefix, thr format \"prefix:count[,prefix:count...]\"");
+            Console.WriteLine("  --coalesce-ipv6 thr  replace dense IPv6 addresses with covering prefix (same format as IPv4)");
+            Console.WriteLine("  --state-file file    snapshot of installed filter rules used for fast startup");
         }
 
         public static void Examples()
@@ -100,6 +106,12 @@ namespace F2B
             int registrationInterval = 60;
             int cleanupExpiredInterval = 30;
             int maxFilterRules = 0;
+            int bucketSize = 0;
+            int bucketGranularity = 300;
+            string coalesceIPv4 = null;
+            string coalesceIPv6 = null;
+            F2B.FwEvictionPolicy eviction = F2B.FwEvictionPolicy.None;
+            string stateFile = null;
 
             while (i < args.Length)
             {
@@ -232,6 +244,54 @@ namespace F2B
                         maxFilterRules = int.Parse(args[i]);
                     }
                 }
+                else if (param == "-b" || param == "-bucket-size" || param == "--bucket-size")
+                {
+                    if (i + 1 < args.Length)
+                    {
+                        i++;
+                        bucketSize = int.Parse(args[i]);
+                    }
+                }
+                else if (param == "-bucket-granularity" || param == "--bucket-granularity")
+                {
+                    if (i + 1 < args.Length)
+                    {
+                        i++;
+                        bucketGranularity = int.Parse(args[i]);
+                    }
+                }
+                else if (param == "-coalesce-ipv4" || param == "--coalesce-ipv4")
+                {
+                    if (i + 1 < args.Length)
+                    {
+                        i++;
+                        coalesceIPv4 = args[i];
+                    }
+                }
+                else if (param == "-coalesce-ipv6" || param == "--coalesce-ipv6")
+                {
+                    if (i + 1 < args.Length)
+                    {
+                        i++;
+                        coalesceIPv6 = args[i];
+                    }
+                }
+                else if (param == "-eviction" || param == "--eviction")
+                {
+                    if (i + 1 < args.Length)
+                    {
+                        i++;
+                        eviction = (F2B.FwEvictionPolicy)Enum.Parse(typeof(F2B.FwEvictionPolicy), args[i], true);
+                    }
+                }
+                else if (param == "-state-file" || param == "--state-file")
+                {
+                    if (i + 1 < args.Length)
+                    {
+                        i++;
+                        stateFile = args[i];
+                    }
+                }
                 else if (param.Length > 0 && param[0] == '-')
                 {
                     Log.Error("Unknown argument #" + i + " (" + args[i] + ")");
@@ -469,6 +529,22 @@ namespace F2B
                     Log.Warn("Running without specifying cleanup interval doesn't make too much sense");
                 }
 
+                // must be configured before first FwManager.Instance use
+                if (!string.IsNullOrEmpty(stateFile))
+                {
+                    F2B.FwManager.StateFile = stateFile;
+                }
+
+                if (bucketSize > 1)
+                {
+                    F2B.FwManager.Instance.BucketSize = bucketSize;
+                    F2B.FwManager.Instance.BucketGranularity = (bucketGranularity > 0 ? bucketGranularity : 300) * TimeSpan.TicksPerSecond;
+                }
+
+                F2B.FwManager.Instance.CoalesceIPv4 = coalesceIPv4;
+                F2B.FwManager.Instance.CoalesceIPv6 = coalesceIPv6;
+                F2B.FwManager.Instance.EvictionPolicy = eviction;
+
                 // Initialize the service to start
                 ServiceBase[] servicesToRun = new ServiceBase[]
                 {
@@ -296,6 +296,25 @@ namespace F2B
 
 
         private void processFwStream(Stream stream)
+        {
+            // all filter rules from one message are installed
+            // together using (size capped) WFP transactions
+            List<FwData> fwdatas = new List<FwData>();
+            try
+            {
+                processFwStream(stream, fwdatas);
+            }
+            finally
+            {
+                if (fwdatas.Count > 0)
+                {
+                    F2B.FwManager.Instance.Add(fwdatas);
+                }
+            }
+        }
+
+
+        private void processFwStream(Stream stream, List<FwData> fwdatas)
         {
             BinaryReader binStream = new BinaryReader(stream);
 
@@ -320,7 +339,7 @@ namespace F2B
                     long pos = stream.Position;
 
                     GZipStream innerStream = new GZipStream(stream, CompressionMode.Decompress);
-                    processFwStream(innerStream);
+                    processFwStream(innerStream, fwdatas);
                     innerStream.Dispose();
 
                     if (stream.Position != pos + size)
@@ -334,8 +353,7 @@ namespace F2B
 
                     int size = IPAddress.NetworkToHostOrder(binStream.ReadInt32()); // record size
                     byte[] buf = binStream.ReadBytes(size);
-                    FwData fwdata = new FwData(buf);
-                    F2B.FwManager.Instance.Add(fwdata);
+                    fwdatas.Add(new FwData(buf));
                 }
                 else
                 {
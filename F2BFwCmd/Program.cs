@@ -1,6 +1,8 @@
 ﻿using System;
+using System.Collections.Generic;
 using System.Configuration;
 using System.Diagnostics;
+using System.IO;
 using System.Net;
 using System.Reflection;
 
@@ -31,6 +33,11 @@ namespace F2B
             Console.WriteLine("  remove-filters      remove all F2BFW filters");
             Console.WriteLine("  remove-expired-filters remove expired F2BFW filters");
             Console.WriteLine("  remove-unknown-filters remove F2BFW filters with invalid name");
+            Console.WriteLine("  stats               list F2BFW filters and show WFP operation statistics");
+            Console.WriteLine("  benchmark-expiry    compare data structures for filter expiration");
+            Console.WriteLine("  benchmark-fwdata    measure time and allocations of FwData encoding / decoding");
+            Console.WriteLine("  stress-add          concurrently add WFP filters for 198.18.0.0/15 using FwManager");
+            Console.WriteLine("  selftest            verify firewall rule data structures and FwManager (no WFP changes)");
             Console.WriteLine("  list-wfp            show F2B WFP structures");
             Console.WriteLine("  add-wfp             add F2B WFP structures");
             Console.WriteLine("  remove-wfp          remove F2B WFP structures");
@@ -69,6 +76,16 @@ namespace F2B
             Console.WriteLine("  {0} add-filter --address 192.0.2.234 --weight 18446744073709551615 --permit --persistent", pname);
             Console.WriteLine("  # remove filter with ID 12345678 (only F2B rules can be removed)");
             Console.WriteLine("  {0} remove-filter --filter-id 12345678", pname);
+            Console.WriteLine("  # show number of F2B filter rules and WFP call latency (measured by this command)");
+            Console.WriteLine("  {0} stats", pname);
+            Console.WriteLine("  # measure expiration bookkeeping for 10k, 100k and 1M filter rules (no WFP calls)");
+            Console.WriteLine("  {0} benchmark-expiry", pname);
+            Console.WriteLine("  # measure FwData codec with new and reused objects (no WFP calls)");
+            Console.WriteLine("  {0} benchmark-fwdata", pname);
+            Console.WriteLine("  # add 4096 filters from 8 threads with colliding requests, verify no duplicates and remove them");
+            Console.WriteLine("  {0} stress-add", pname);
+            Console.WriteLine("  # verify filter conditions created from FwData and prefix trie used for coalescing");
+            Console.WriteLine("  {0} selftest", pname);
             Console.WriteLine("  # show debug info using DbgView from SysInternals");
             Console.WriteLine("  DbgView.exe");
             Console.WriteLine("Manage service manually:");
@@ -399,11 +416,56 @@ namespace F2B
                         Environment.Exit(1);
                     }
                 }
+                else if (command.ToLower() == "stats")
+                {
+                    try
+                    {
+                        // statistics are collected per process, list
+                        // filters to get their number and List latency
+                        F2B.Firewall.Instance.List();
+                        Console.Write(F2B.Firewall.Instance.Stats.ToString());
+                        Console.WriteLine("enumeration: scanned {0} matched {1}",
+                            F2B.Firewall.Instance.EnumScanned, F2B.Firewall.Instance.EnumMatched);
+                    }
+                    catch (FirewallException ex)
+                    {
+                        Log.Error("Unable to get firewall statistics: " + ex.Message);
+                        Environment.Exit(1);
+                    }
+                }
+                else if (command.ToLower() == "benchmark-expiry")
+                {
+                    foreach (int count in new int[] { 10000, 100000, 1000000 })
+                    {
+                        BenchmarkExpiry(count);
+                    }
+                }
+                else if (command.ToLower() == "benchmark-fwdata")
+                {
+                    BenchmarkFwData(1000000);
+                }
+                else if (command.ToLower() == "stress-add")
+                {
+                    if (!StressAdd(8, 4096, 5))
+                    {
+                        Environment.Exit(1);
+                    }
+                }
+                else if (command.ToLower() == "selftest")
+                {
+                    if (!SelfTest.Run())
+                    {
+                        Environment.Exit(1);
+                    }
+                }
                 else if (command.ToLower() == "remove-filters")
                 {
                     try
                     {
                         F2B.Firewall.Instance.Cleanup();
+                        Log.Info("Removed all F2BFW filters (WFP enumeration scanned "
+                            + F2B.Firewall.Instance.EnumScanned + " filters, matched "
+                            + F2B.Firewall.Instance.EnumMatched + ")");
                     }
                     catch (FirewallException ex)
                     {
@@ -417,24 +479,29 @@ namespace F2B
 
                     try
                     {
-                        foreach (var item in F2B.Firewall.Instance.List())
+                        foreach (var item in F2B.Firewall.Instance.ListFilters())
                         {
                             try
                             {
-                                Tuple<long, byte[]> fwname = FwData.DecodeName(item.Value);
+                                Tuple<long, byte[]> fwname;
+                                if (item.HasMetadata)
+                                    fwname = new Tuple<long, byte[]>(item.Expiration, item.Hash);
+                                else
+                                    fwname = FwData.DecodeName(item.Name);
+
                                 if (currTime > fwname.Item1)
                                 {
-                                    Log.Info("Remove expired filter #" + item.Key
+                                    Log.Info("Remove expired filter #" + item.Id
                                         + " (expiration=" + fwname.Item1 + ", md5="
                                         + BitConverter.ToString(fwname.Item2).Replace("-", ":")
                                         + ")");
-                                    F2B.Firewall.Instance.Remove(item.Key);
+                                    F2B.Firewall.Instance.Remove(item.Id);
                                 }
                             }
                             catch (ArgumentException)
                             {
                                 // can't parse filter rule name to F2B structured data
-                                Log.Info("Unable to parse expiration time from filter #" + item.Key);
+                                Log.Info("Unable to parse expiration time from filter #" + item.Id);
                             }
                         }
                     }
@@ -448,17 +515,20 @@ namespace F2B
                 {
                     try
                     {
-                        foreach (var item in F2B.Firewall.Instance.List())
+                        foreach (var item in F2B.Firewall.Instance.ListFilters())
                         {
+                            if (item.HasMetadata)
+                                continue;
+
                             try
                             {
-                                Tuple<long, byte[]> fwname = FwData.DecodeName(item.Value);
+                                Tuple<long, byte[]> fwname = FwData.DecodeName(item.Name);
                             }
                             catch (ArgumentException)
                             {
                                 // can't parse filter rule name to F2B structured data
-                                Log.Info("Remove filter #" + item.Key + " with unparsable filter name: " + item.Value);
-                                F2B.Firewall.Instance.Remove(item.Key);
+                                Log.Info("Remove filter #" + item.Id + " with unparsable filter name: " + item.Name);
+                                F2B.Firewall.Instance.Remove(item.Id);
                             }
                         }
                     }
@@ -581,5 +651,242 @@ namespace F2B
 
             Log.Info("F2BFwCmd main finished");
         }
+
+
+        // Compare SortedDictionary with unique expiration keys (used by
+        // FwManager before) and TimingWheel on rules with few distinct
+        // bantimes: insert, reschedule of 10% rules and 10s cleanup sweeps
+        private static void BenchmarkExpiry(int count)
+        {
+            long[] bantimes = { 300, 600, 3600, 86400 };
+            long start = DateTime.UtcNow.Ticks;
+            long[] expirations = new long[count];
+            byte[][] hashes = new byte[count][];
+            for (int i = 0; i < count; i++)
+            {
+                long time = start + (i % 3600) * TimeSpan.TicksPerSecond;
+                expirations[i] = time + bantimes[i % bantimes.Length] * TimeSpan.TicksPerSecond;
+                hashes[i] = BitConverter.GetBytes((long)i);
+            }
+            long end = start + (3600 + 86400 + 10) * TimeSpan.TicksPerSecond;
+            long step = 10 * TimeSpan.TicksPerSecond;
+
+            GC.Collect();
+            Stopwatch sw = Stopwatch.StartNew();
+            SortedDictionary<long, UInt64> sorted = new SortedDictionary<long, UInt64>();
+            IDictionary<byte[], long> expire = new Dictionary<byte[], long>(new ByteArrayComparer());
+            for (int i = 0; i < count; i++)
+            {
+                long expiration = expirations[i];
+                while (sorted.ContainsKey(expiration))
+                {
+                    expiration++;
+                }
+                sorted[expiration] = (UInt64)i;
+                expire[hashes[i]] = expiration;
+            }
+            long sortedInsert = sw.ElapsedMilliseconds;
+            for (int i = 0; i < count; i += 10)
+            {
+                sorted.Remove(expire[hashes[i]]);
+                long expiration = expirations[i] + step;
+                while (sorted.ContainsKey(expiration))
+                {
+                    expiration++;
+                }
+                sorted[expiration] = (UInt64)i;
+                expire[hashes[i]] = expiration;
+            }
+            long sortedUpdate = sw.ElapsedMilliseconds - sortedInsert;
+            int sortedRemoved = 0;
+            for (long currtime = start; currtime <= end; currtime += step)
+            {
+                List<long> remove = new List<long>();
+                foreach (var item in sorted)
+                {
+                    if (item.Key > currtime)
+                        break;
+                    remove.Add(item.Key);
+                }
+                foreach (long expiration in remove)
+                {
+                    sorted.Remove(expiration);
+                }
+                sortedRemoved += remove.Count;
+            }
+            long sortedSweep = sw.ElapsedMilliseconds - sortedInsert - sortedUpdate;
+
+            GC.Collect();
+            sw.Restart();
+            TimingWheel<byte[], UInt64> wheel = new TimingWheel<byte[], UInt64>(TimeSpan.TicksPerSecond, start, new ByteArrayComparer());
+            for (int i = 0; i < count; i++)
+            {
+                wheel.Add(hashes[i], expirations[i], (UInt64)i);
+            }
+            long wheelInsert = sw.ElapsedMilliseconds;
+            for (int i = 0; i < count; i += 10)
+            {
+                wheel.Add(hashes[i], expirations[i] + step, (UInt64)i);
+            }
+            long wheelUpdate = sw.ElapsedMilliseconds - wheelInsert;
+            int wheelRemoved = 0;
+            for (long currtime = start; currtime <= end; currtime += step)
+            {
+                wheelRemoved += wheel.Expire(currtime).Count;
+            }
+            long wheelSweep = sw.ElapsedMilliseconds - wheelInsert - wheelUpdate;
+
+            Console.WriteLine("{0} rules: insert/reschedule/sweep [ms]", count);
+            Console.WriteLine("  SortedDictionary: {0}/{1}/{2} (removed {3})", sortedInsert, sortedUpdate, sortedSweep, sortedRemoved);
+            Console.WriteLine("  TimingWheel:      {0}/{1}/{2} (removed {3})", wheelInsert, wheelUpdate, wheelSweep, wheelRemoved);
+        }
+
+
+        private static void BenchmarkFwData(int count)
+        {
+            AppDomain.MonitoringIsEnabled = true;
+
+            long expiration = DateTime.UtcNow.Ticks;
+            IPAddress addr = IPAddress.Parse("192.0.2.123");
+            byte[] data = new FwData(expiration, addr, 32).ToArray();
+            MemoryStream output = new MemoryStream(data.Length);
+            FwData fwdata = new FwData(expiration);
+            byte[] hash = new byte[Md5.HashSize];
+            IPAddress tmpAddr;
+            int tmpPrefix;
+
+            string[] names = { "encode (new FwData)", "encode (reused FwData)", "decode (new FwData)", "decode (reused FwData)", "decode (static)" };
+            Console.WriteLine("{0} operations: time [ms], allocated [bytes/op]", count);
+            for (int test = 0; test < names.Length; test++)
+            {
+                GC.Collect();
+                long allocated = AppDomain.CurrentDomain.MonitoringTotalAllocatedMemorySize;
+                Stopwatch sw = Stopwatch.StartNew();
+                for (int i = 0; i < count; i++)
+                {
+                    switch (test)
+                    {
+                        case 0:
+                            FwData tmp = new FwData(expiration + i, addr, 32);
+                            output.SetLength(0);
+                            tmp.WriteTo(output);
+                            tmp.WriteHash(hash, 0);
+                            break;
+                        case 1:
+                            fwdata.Reset(expiration + i);
+                            fwdata.Add(addr, 32);
+                            output.SetLength(0);
+                            fwdata.WriteTo(output);
+                            fwdata.WriteHash(hash, 0);
+                            break;
+                        case 2:
+                            FwData.Expiration(data);
+                            new FwData(data).SingleAddress(out tmpAddr, out tmpPrefix);
+                            break;
+                        case 3:
+                            fwdata.Load(data);
+                            fwdata.WriteHash(hash, 0);
+                            break;
+                        case 4:
+                            FwData.Expiration(data);
+                            FwData.GetHash(data);
+                            break;
+                    }
+                }
+                long elapsed = sw.ElapsedMilliseconds;
+                allocated = AppDomain.CurrentDomain.MonitoringTotalAllocatedMemorySize - allocated;
+                Console.WriteLine("  {0,-24} {1,6} {2,8:F1}", names[test], elapsed, (double)allocated / count);
+            }
+        }
+
+
+        // Add same set of rules from many threads (each thread starts
+        // with different address, expiration grows with every round so
+        // rules are also replaced) and verify that WFP contains exactly
+        // one filter for each address, all created filters are removed
+        internal static bool StressAdd(int threads, int rules, int rounds)
+        {
+            long start = DateTime.UtcNow.Ticks;
+            FwManager.Instance.MaxSize = 0;
+
+            Stopwatch sw = Stopwatch.StartNew();
+            List<System.Threading.Thread> workers = new List<System.Threading.Thread>();
+            for (int t = 0; t < threads; t++)
+            {
+                int offset = t * rules / threads;
+                System.Threading.Thread worker = new System.Threading.Thread(() =>
+                {
+                    for (int round = 0; round < rounds; round++)
+                    {
+                        long expiration = start + (10 + 5 * round) * 60 * TimeSpan.TicksPerSecond;
+                        for (int n = 0; n < rules; n++)
+                        {
+                            int i = (offset + n) % rules;
+                            IPAddress addr = new IPAddress(new byte[] { 198, (byte)(18 + (i >> 16)), (byte)(i >> 8), (byte)i });
+                            FwManager.Instance.Add(new FwData(expiration, addr, 32));
+                        }
+                    }
+                });
+                workers.Add(worker);
+                worker.Start();
+            }
+            foreach (System.Threading.Thread worker in workers)
+            {
+                worker.Join();
+            }
+            long elapsed = sw.ElapsedMilliseconds;
+
+            // IPv4 filters have cleared lowest bit of rule hash
+            ByteArrayComparer comparer = new ByteArrayComparer();
+            IDictionary<byte[], int> hashes = new Dictionary<byte[], int>(comparer);
+            for (int i = 0; i < rules; i++)
+            {
+                IPAddress addr = new IPAddress(new byte[] { 198, (byte)(18 + (i >> 16)), (byte)(i >> 8), (byte)i });
+                byte[] hash = new FwData(start, addr, 32).Hash;
+                hash[hash.Length - 1] &= 0xfe;
+                hashes[hash] = 0;
+            }
+
+            List<UInt64> remove = new List<UInt64>();
+            try
+            {
+                foreach (FirewallFilter filter in F2B.Firewall.Instance.ListFilters())
+                {
+                    if (filter.HasMetadata && hashes.ContainsKey(filter.Hash))
+                    {
+                        hashes[filter.Hash]++;
+                        remove.Add(filter.Id);
+                    }
+                }
+            }
+            catch (FirewallException ex)
+            {
+                Console.WriteLine("Unable to list F2B firewall filters: " + ex.Message);
+                return false;
+            }
+
+            int missing = 0, duplicate = 0;
+            foreach (int count in hashes.Values)
+            {
+                if (count == 0)
+                    missing++;
+                else if (count > 1)
+                    duplicate += count - 1;
+            }
+
+            Console.WriteLine("{0} threads x {1} rounds x {2} rules: {3} ms, {4} filters (missing {5}, duplicate {6})",
+                threads, rounds, rules, elapsed, remove.Count, missing, duplicate);
+
+            try
+            {
+                F2B.Firewall.Instance.RemoveMany(remove);
+            }
+            catch (FirewallException ex)
+            {
+                Console.WriteLine("Unable to remove " + remove.Count + " filters: " + ex.Message);
+            }
+
+            return missing == 0 && duplicate == 0;
+        }
     }
 }
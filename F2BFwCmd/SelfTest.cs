@@ -0,0 +1,439 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Net;
+using System.Net.Sockets;
+using System.Text.RegularExpressions;
+
+namespace F2B
+{
+    /// <summary>
+    /// Tests of firewall rule data structures started by "selftest"
+    /// command (they don't modify WFP filters, FwManager tests use
+    /// in-memory filter engine).
+    /// </summary>
+    static class SelfTest
+    {
+        private static int failures;
+
+        private static void Check(bool condition, string message)
+        {
+            if (!condition)
+            {
+                Console.WriteLine("FAILED: " + message);
+                failures++;
+            }
+        }
+
+        public static bool Run()
+        {
+            failures = 0;
+
+            // must be called before first use of firewall instance
+            F2B.Firewall.UseMemoryEngine();
+
+            ConditionsParity();
+            PrefixTrieCounts();
+            Check(Program.StressAdd(4, 1024, 2), "concurrent FwManager.Add with in-memory engine");
+            CoalesceCover();
+            CoalesceSplit();
+            BucketMembers();
+
+            Console.WriteLine(failures == 0 ? "selftest passed" : ("selftest failed (" + failures + " checks)"));
+            return failures == 0;
+        }
+
+
+        // One FwData record with arguments for corresponding Add method
+        private class Record
+        {
+            public IPAddress Addr;
+            public IPAddress AddrHigh;
+            public int Prefix = -1;
+            public short Port;
+            public short PortHigh;
+            public ProtocolType Protocol = ProtocolType.Unknown;
+
+            public void AddTo(FwData fwdata)
+            {
+                if (AddrHigh != null) fwdata.Add(Addr, AddrHigh);
+                else if (Addr != null && Prefix >= 0) fwdata.Add(Addr, Prefix);
+                else if (Addr != null) fwdata.Add(Addr);
+                else if (PortHigh != 0) fwdata.Add(Port, PortHigh);
+                else if (Port != 0) fwdata.Add(Port);
+                else fwdata.Add(Protocol);
+            }
+
+            public void AddTo(FirewallConditions conds)
+            {
+                if (AddrHigh != null) conds.Add(Addr, AddrHigh);
+                else if (Addr != null && Prefix >= 0) conds.Add(Addr, Prefix);
+                else if (Addr != null) conds.Add(Addr);
+                else if (PortHigh != 0) conds.Add(Port, PortHigh);
+                else if (Port != 0) conds.Add(Port);
+                else conds.Add(Protocol);
+            }
+        }
+
+        private static Record Addr(string addr, int prefix = -1)
+        {
+            return new Record { Addr = IPAddress.Parse(addr), Prefix = prefix };
+        }
+
+        private static Record Range(string addrLow, string addrHigh)
+        {
+            return new Record { Addr = IPAddress.Parse(addrLow), AddrHigh = IPAddress.Parse(addrHigh) };
+        }
+
+        private static Record Port(int port, int portHigh = 0)
+        {
+            return new Record { Port = unchecked((short)port), PortHigh = unchecked((short)portHigh) };
+        }
+
+        private static Record Protocol(ProtocolType protocol)
+        {
+            return new Record { Protocol = protocol };
+        }
+
+        // Conditions created by Add methods (used before FwData records were
+        // decoded natively) and by FirewallConditions.FromFwData must match
+        private static void ConditionsParity()
+        {
+            List<Record[]> rules = new List<Record[]>
+            {
+                new[] { Addr("192.0.2.123") },
+                new[] { Addr("192.0.2.123", 24) },
+                new[] { Addr("192.0.2.123", 32) },
+                new[] { Addr("192.0.2.123", 0) },
+                new[] { Addr("192.0.2.123", 40) },
+                new[] { Addr("2001:db8::1") },
+                new[] { Addr("2001:db8::1", 64) },
+                new[] { Addr("2001:db8::1", 0) },
+                new[] { Addr("2001:db8::1", 200) },
+                new[] { Addr("::ffff:192.0.2.123") },
+                new[] { Addr("::ffff:192.0.2.123", 120) },
+                new[] { Addr("::ffff:192.0.2.123", 96) },
+                new[] { Addr("::ffff:192.0.2.123", 95) },
+                new[] { Addr("::ffff:192.0.2.123", 64) },
+                new[] { Addr("::ffff:192.0.2.123", 0) },
+                new[] { Range("192.0.2.1", "192.0.2.200") },
+                new[] { Range("2001:db8::1", "2001:db8::ff:1") },
+                new[] { Range("::ffff:192.0.2.1", "::ffff:192.0.2.200") },
+                new[] { Range("192.0.2.1", "::ffff:192.0.2.200"), Addr("2001:db8::1") },
+                new[] { Addr("192.0.2.123"), Port(22) },
+                new[] { Addr("192.0.2.123"), Port(65000) },
+                new[] { Addr("2001:db8::1", 48), Port(1000, 2000) },
+                new[] { Addr("192.0.2.123", 24), Port(1000, 65000), Protocol(ProtocolType.Tcp) },
+                new[] { Addr("192.0.2.123"), Addr("2001:db8::1"), Protocol(ProtocolType.Udp) },
+                new[] { Port(443), Protocol(ProtocolType.Tcp) },
+                // invalid rules must be rejected by both builders
+                new[] { Range("192.0.2.200", "192.0.2.1") },
+                new[] { Range("2001:db8::ff:1", "2001:db8::1") },
+                new[] { Range("192.0.2.1", "2001:db8::1") },
+                new[] { Port(2000, 1000) },
+                new[] { Port(65000, 1000) },
+            };
+
+            foreach (Record[] rule in rules)
+            {
+                string expected;
+                try
+                {
+                    using (FirewallConditions conds = new FirewallConditions())
+                    {
+                        foreach (Record record in rule)
+                            record.AddTo(conds);
+                        expected = conds.ToString();
+                    }
+                }
+                catch (ArgumentException ex)
+                {
+                    expected = ex.GetType().Name;
+                }
+
+                string actual;
+                string description = "";
+                try
+                {
+                    FwData fwdata = new FwData(DateTime.UtcNow.Ticks);
+                    foreach (Record record in rule)
+                        record.AddTo(fwdata);
+                    description = fwdata.ToString();
+                    using (FirewallConditions conds = FirewallConditions.FromFwData(fwdata.ToArray()))
+                    {
+                        actual = conds.ToString();
+                    }
+                }
+                catch (ArgumentException ex)
+                {
+                    actual = ex.GetType().Name;
+                }
+
+                Check(expected == actual, "conditions for " + description + ": Add " + expected + " != FromFwData " + actual);
+            }
+
+            // mapped address with prefix shorter than 96 is IPv6 prefix
+            IPAddress addr;
+            int prefix;
+            FwData mapped = new FwData(DateTime.UtcNow.Ticks);
+            mapped.Add(IPAddress.Parse("::ffff:192.0.2.123"), 64);
+            Check(mapped.SingleAddress(out addr, out prefix) && addr.AddressFamily == AddressFamily.InterNetworkV6 && prefix == 64,
+                "mapped address with prefix 64 decoded as " + addr + "/" + prefix);
+            mapped = new FwData(DateTime.UtcNow.Ticks);
+            mapped.Add(IPAddress.Parse("::ffff:192.0.2.123"), 120);
+            Check(mapped.SingleAddress(out addr, out prefix) && addr.Equals(IPAddress.Parse("192.0.2.123")) && prefix == 24,
+                "mapped address with prefix 120 decoded as " + addr + "/" + prefix);
+        }
+
+
+        // Number of entries within prefix is used for coalescing
+        // thresholds (e.g. "24:32" creates cover with 32nd address)
+        private static void PrefixTrieCounts()
+        {
+            PrefixTrie<int> trie = new PrefixTrie<int>();
+            IPAddress net24 = IPAddress.Parse("192.0.2.0");
+
+            for (int i = 0; i < 32; i++)
+            {
+                Check(trie.CountWithin(net24, 24) == i, "count within /24 before address " + i + ": " + trie.CountWithin(net24, 24));
+                Check(trie.Add(IPAddress.Parse("192.0.2." + (2 * i)), 32, i), "new address 192.0.2." + (2 * i));
+            }
+            Check(trie.CountWithin(net24, 24) >= 32, "threshold 24:32 not reached");
+            Check(trie.CountWithin(IPAddress.Parse("192.0.2.0"), 26) == 32, "count within 192.0.2.0/26: " + trie.CountWithin(IPAddress.Parse("192.0.2.0"), 26));
+            Check(trie.CountWithin(IPAddress.Parse("192.0.2.64"), 26) == 0, "count within 192.0.2.64/26: " + trie.CountWithin(IPAddress.Parse("192.0.2.64"), 26));
+            Check(trie.CountWithin(IPAddress.Parse("192.0.2.4"), 31) == 1, "count within 192.0.2.4/31: " + trie.CountWithin(IPAddress.Parse("192.0.2.4"), 31));
+            Check(trie.CountWithin(IPAddress.Parse("192.0.0.0"), 16) == 32, "count within 192.0.0.0/16: " + trie.CountWithin(IPAddress.Parse("192.0.0.0"), 16));
+
+            // update of existing entry doesn't change counts
+            Check(!trie.Add(IPAddress.Parse("192.0.2.0"), 32, 100), "existing address added as new");
+            int value;
+            Check(trie.TryGetValue(IPAddress.Parse("192.0.2.0"), 32, out value) && value == 100, "updated value " + value);
+            Check(trie.Count == 32, "count after update: " + trie.Count);
+
+            // IPv4 mapped address is counted as IPv4 address
+            Check(!trie.Add(IPAddress.Parse("::ffff:192.0.2.2"), 128, 1), "mapped address added as new");
+            Check(trie.Add(IPAddress.Parse("::ffff:192.0.2.1"), 128, 1), "new mapped address");
+            Check(trie.CountWithin(net24, 24) == 33, "count within /24 with mapped address: " + trie.CountWithin(net24, 24));
+
+            // mapped prefix shorter than 96 is IPv6 prefix
+            Check(trie.Add(IPAddress.Parse("::ffff:192.0.2.1"), 64, 1), "new mapped /64 prefix");
+            Check(trie.CountWithin(net24, 24) == 33, "count within /24 with mapped /64: " + trie.CountWithin(net24, 24));
+            Check(trie.CountWithin(IPAddress.Parse("::"), 64) == 1, "count within ::/64: " + trie.CountWithin(IPAddress.Parse("::"), 64));
+
+            // entries with shorter prefix than queried are not within
+            Check(trie.Add(IPAddress.Parse("192.0.0.0"), 16, 1), "new /16 prefix");
+            Check(trie.CountWithin(net24, 24) == 33, "count within /24 with /16 prefix: " + trie.CountWithin(net24, 24));
+            Check(trie.CountWithin(IPAddress.Parse("192.0.0.0"), 16) == 34, "count within /16: " + trie.CountWithin(IPAddress.Parse("192.0.0.0"), 16));
+            Check(trie.Within(IPAddress.Parse("192.0.0.0"), 16).Count == 34, "entries within /16: " + trie.Within(IPAddress.Parse("192.0.0.0"), 16).Count);
+            Check(trie.Entries().Count == trie.Count, "entries " + trie.Entries().Count + " != count " + trie.Count);
+
+            // removed entries drop count below threshold again
+            Check(trie.Remove(IPAddress.Parse("192.0.2.1"), 32), "remove mapped address");
+            Check(!trie.Remove(IPAddress.Parse("192.0.2.1"), 32), "remove missing address");
+            Check(trie.Remove(IPAddress.Parse("192.0.2.0"), 32), "remove address");
+            Check(trie.CountWithin(net24, 24) == 31, "count within /24 after removal: " + trie.CountWithin(net24, 24));
+            Check(trie.CountWithin(IPAddress.Parse("192.0.2.0"), 31) == 0, "count within removed /31: " + trie.CountWithin(IPAddress.Parse("192.0.2.0"), 31));
+
+            Check(PrefixTrie<int>.Network(IPAddress.Parse("192.0.2.123"), 24).Equals(net24), "network of 192.0.2.123/24");
+            Check(PrefixTrie<int>.Network(IPAddress.Parse("2001:db8:1:2::1"), 32).Equals(IPAddress.Parse("2001:db8::")), "network of 2001:db8:1:2::1/32");
+        }
+
+
+        // Addresses in conditions of installed filters with addresses
+        // that starts with given string (filter id -> addresses)
+        private static IDictionary<UInt64, List<string>> FilterAddresses(string network)
+        {
+            IDictionary<UInt64, List<string>> ret = new Dictionary<UInt64, List<string>>();
+            foreach (var item in F2B.Firewall.Instance.List(true))
+            {
+                List<string> addrs = new List<string>();
+                foreach (Match match in Regex.Matches(item.Value, @"IPv4=([0-9.]+/[0-9]+)"))
+                {
+                    addrs.Add(match.Groups[1].Value);
+                }
+                if (addrs.Exists(a => a.StartsWith(network)))
+                {
+                    addrs.Sort();
+                    ret[item.Key] = addrs;
+                }
+            }
+            return ret;
+        }
+
+        private static FirewallFilter? FindFilter(UInt64 id)
+        {
+            foreach (FirewallFilter filter in F2B.Firewall.Instance.ListFilters())
+            {
+                if (filter.Id == id)
+                    return filter;
+            }
+            return null;
+        }
+
+        // IPv4 filters have cleared lowest bit of rule hash
+        private static byte[] RuleHash(FwData fwdata)
+        {
+            byte[] hash = fwdata.Hash;
+            hash[hash.Length - 1] &= 0xfe;
+            return hash;
+        }
+
+        // Dense addresses are replaced by one covering rule and rules
+        // of covered addresses are removed (threshold "24:4")
+        private static void CoalesceCover()
+        {
+            FwManager fw = FwManager.Instance;
+            string thresholds = fw.CoalesceIPv4;
+            fw.CoalesceIPv4 = "24:4";
+
+            try
+            {
+                long expiration = DateTime.UtcNow.Ticks + 10 * 60 * TimeSpan.TicksPerSecond;
+                ByteArrayComparer comparer = new ByteArrayComparer();
+                IDictionary<byte[], bool> members = new Dictionary<byte[], bool>(comparer);
+                for (int i = 1; i <= 5; i++)
+                {
+                    IPAddress addr = IPAddress.Parse("198.19.1." + i);
+                    fw.Add(new FwData(expiration + i, addr, 32));
+                    members[RuleHash(new FwData(expiration, addr, 32))] = true;
+                }
+
+                byte[] cover = RuleHash(new FwData(expiration, IPAddress.Parse("198.19.1.0"), 24));
+                int covers = 0, uncovered = 0;
+                foreach (FirewallFilter filter in F2B.Firewall.Instance.ListFilters())
+                {
+                    if (!filter.HasMetadata)
+                        continue;
+
+                    if (comparer.Equals(filter.Hash, cover))
+                    {
+                        covers++;
+                        Check(filter.Expiration >= expiration + 4, "cover expiration " + filter.Expiration + " < expiration of members");
+                    }
+                    else if (members.ContainsKey(filter.Hash))
+                    {
+                        uncovered++;
+                    }
+                }
+
+                Check(covers == 1, "cover rules for 198.19.1.0/24: " + covers);
+                Check(uncovered == 0, "member rules left after coalescing: " + uncovered);
+            }
+            finally
+            {
+                fw.CoalesceIPv4 = thresholds;
+            }
+        }
+
+        // Cover with less than threshold active members is split back
+        // to separate rules with original expiration of each member
+        private static void CoalesceSplit()
+        {
+            FwManager fw = FwManager.Instance;
+            string thresholds = fw.CoalesceIPv4;
+            fw.CoalesceIPv4 = "24:4";
+
+            try
+            {
+                long expiration = DateTime.UtcNow.Ticks + 20 * 60 * TimeSpan.TicksPerSecond;
+                for (int i = 1; i <= 5; i++)
+                {
+                    fw.Add(new FwData(expiration + i, IPAddress.Parse("198.19.2." + i), 32));
+                }
+
+                // two members expire and only three remain
+                fw.CleanupExpired(expiration + 2);
+
+                ByteArrayComparer comparer = new ByteArrayComparer();
+                byte[] cover = RuleHash(new FwData(expiration, IPAddress.Parse("198.19.2.0"), 24));
+                IDictionary<byte[], long> rules = new Dictionary<byte[], long>(comparer);
+                foreach (FirewallFilter filter in F2B.Firewall.Instance.ListFilters())
+                {
+                    if (filter.HasMetadata)
+                        rules[filter.Hash] = filter.Expiration;
+                }
+
+                Check(!rules.ContainsKey(cover), "cover rule for 198.19.2.0/24 left after split");
+                for (int i = 1; i <= 5; i++)
+                {
+                    byte[] hash = RuleHash(new FwData(expiration, IPAddress.Parse("198.19.2." + i), 32));
+                    long ruleExpiration;
+                    bool installed = rules.TryGetValue(hash, out ruleExpiration);
+                    if (i <= 2)
+                    {
+                        Check(!installed, "expired member 198.19.2." + i + " installed after split");
+                    }
+                    else
+                    {
+                        Check(installed && ruleExpiration == expiration + i, "member 198.19.2." + i + " after split: "
+                            + (installed ? "expiration " + ruleExpiration + " != " + (expiration + i) : "missing"));
+                    }
+                }
+                Check(FilterAddresses("198.19.2.").Count == 3, "filters for 198.19.2.0/24 after split: " + FilterAddresses("198.19.2.").Count);
+            }
+            finally
+            {
+                fw.CoalesceIPv4 = thresholds;
+            }
+        }
+
+        // Bucket filter has condition for each member, it is rebuilt
+        // without expired members (each member keeps its own expiration)
+        // and removed with last member
+        private static void BucketMembers()
+        {
+            FwManager fw = FwManager.Instance;
+            int bucketSize = fw.BucketSize;
+            fw.BucketSize = 4;
+
+            try
+            {
+                // all members within one bucket granularity interval
+                long granularity = fw.BucketGranularity;
+                long expiration = (DateTime.UtcNow.Ticks / granularity + 2) * granularity;
+                string[] addrs = { "198.18.5.1/32", "198.18.5.2/32", "198.18.5.3/32" };
+                for (int i = 0; i < addrs.Length; i++)
+                {
+                    fw.Add(new FwData(expiration + i + 1, IPAddress.Parse(addrs[i].Split('/')[0]), 32));
+                }
+
+                IDictionary<UInt64, List<string>> filters = FilterAddresses("198.18.5.");
+                Check(filters.Count == 1, "bucket filters for 3 addresses: " + filters.Count);
+                foreach (var item in filters)
+                {
+                    Check(string.Join(",", item.Value) == string.Join(",", addrs), "bucket filter addresses: " + string.Join(",", item.Value));
+                }
+
+                // extended member expiration is used in bucket filter
+                long extended = expiration + granularity / 2;
+                fw.Add(new FwData(extended, IPAddress.Parse("198.18.5.2"), 32));
+
+                fw.CleanupExpired(expiration + 1);
+                filters = FilterAddresses("198.18.5.");
+                Check(filters.Count == 1, "bucket filters after first member expired: " + filters.Count);
+                foreach (var item in filters)
+                {
+                    Check(string.Join(",", item.Value) == "198.18.5.2/32,198.18.5.3/32", "bucket filter addresses after first member expired: " + string.Join(",", item.Value));
+                }
+
+                fw.CleanupExpired(expiration + 3);
+                filters = FilterAddresses("198.18.5.");
+                Check(filters.Count == 1, "bucket filters after original expiration of all members: " + filters.Count);
+                foreach (var item in filters)
+                {
+                    Check(string.Join(",", item.Value) == "198.18.5.2/32", "bucket filter addresses with extended member: " + string.Join(",", item.Value));
+                    FirewallFilter? filter = FindFilter(item.Key);
+                    Check(filter.HasValue && filter.Value.Expiration == extended, "bucket filter expiration "
+                        + (filter.HasValue ? filter.Value.Expiration.ToString() : "missing") + " != extended expiration " + extended);
+                }
+
+                fw.CleanupExpired(extended);
+                filters = FilterAddresses("198.18.5.");
+                Check(filters.Count == 0, "bucket filters after all members expired: " + filters.Count);
+            }
+            finally
+            {
+                fw.BucketSize = bucketSize;
+            }
+        }
+    }
+}
@@ -37,6 +37,10 @@ namespace F2B
             Console.WriteLine("  uninstall             uninstall windows service");
             Console.WriteLine("  start                 start installed service");
             Console.WriteLine("  stop                  stop installed service");
+#if DEBUG
+            Console.WriteLine("  benchmark             memory, update time and throughput of fail2ban history");
+            Console.WriteLine("  selftest              verify packed firewall rules with in-memory rule store");
+#endif
             Console.WriteLine("Options");
             Console.WriteLine("  -h, --help            show this help");
             Console.WriteLine("  -l, --log-level       log severity level (INFO, WARN, ERROR)");
@@ -306,6 +310,23 @@ namespace F2B
 
                     Log.Info("Debug F2B service finished");
                 }
+#if DEBUG
+                else if (command.ToLower() == "benchmark")
+                {
+                    F2B.processors.Fail2banProcessor.Benchmark(1000000);
+                    F2B.processors.Fail2banProcessor.BenchmarkFindtime(2000, 1000);
+                    F2B.processors.Fail2banProcessor.BenchmarkLevels(10000000);
+                    F2B.processors.Fail2banProcessor.BenchmarkShards(10000000);
+                    F2B.processors.Fail2banProcessor.BenchmarkState(1000000);
+                }
+                else if (command.ToLower() == "selftest")
+                {
+                    if (!F2B.processors.FwPackedManager.SelfTest())
+                    {
+                        Environment.Exit(1);
+                    }
+                }
+#endif
                 else if (command.ToLower() == "install" || command.ToLower() == "uninstall")
                 {
                     List<string> l = new List<string>();
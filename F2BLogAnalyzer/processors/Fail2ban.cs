@@ -1,41 +1,72 @@
 ﻿#region Imports
 using System;
+using System.Collections.Concurrent;
 using System.Collections.Generic;
+using System.Diagnostics;
 using System.IO;
 using System.Linq;
 using System.Net;
+using System.Threading.Tasks;
 using System.Timers;
 #endregion
 
 namespace F2B.processors
 {
-    public class Fail2banProcessor : BaseProcessor, IThreadSafeProcessor
+    public partial class Fail2banProcessor : BaseProcessor, IThreadSafeProcessor
     {
         #region Fields
         private string address;
         private string stateFile;
+        private int state_journal;
+        private int state_snapshot;
         private long findtime;
         private int ipv4_prefix;
         private int ipv6_prefix;
+        private int shards;
+        private TimeType time;
+        private int time_lateness;
 
         private HistoryType history;
         private int history_fixed_count;
         private double history_fixed_decay;
         private int history_rrd_count;
         private int history_rrd_repeat;
+        private int history_sketch_count;
+        private double history_sketch_epsilon;
+        private double history_sketch_delta;
+        private int history_sketch_heavy;
 
         private List<Treshold> tresholds;
 
         //        private Dictionary<IPAddress, Queue<long>> data;
         //        private Dictionary<IPAddress, long> dataLast;
-        private Dictionary<IPAddress, IFail> data;
+        private Shard[] data; // failed login history partitioned by address hash
+        private int shardIPv4Prefix; // shortest prefix of all levels
+        private int shardIPv6Prefix;
         private int cleanup;
         private Timer cleanup_timer;
         private long clockskew;
 
-        private Object thisLock = new Object();
+        // event time processing (processor clock driven by log timestamps)
+        private long clock; // watermark (newest timestamp - lateness)
+        private long newest;
+        private long newestArrival; // current time when newest was seen
+        private bool aligned; // history moved to event time clock
+        private long lateEvents;
+        private int pendingCount;
+        private SortedDictionary<long, List<Failure>> pending;
+
+        private Timer journal_timer;
+        private Timer snapshot_timer;
+
+        private Object orderLock = new Object(); // event time reorder buffer
+        private Object stateLock = new Object(); // state file and journal writes
 
         private static int MAX_COUNT = 10000;
+        private static long CLEANUP_SLICE = 10 * TimeSpan.TicksPerMillisecond;
+        private static long CLEANUP_SLICE_MIN = TimeSpan.TicksPerMillisecond;
+        private static int STATE_MAGIC = 0x4a423246; // "F2BJ" (snapshot with journal sequence)
+        private static int LEVEL_MAGIC = 0x4c423246; // "F2BL" (state of additional level)
         #endregion
 
         private enum HistoryType
@@ -44,6 +75,13 @@ namespace F2B.processors
             ONE,
             FIXED,
             RRD,
+            SKETCH,
+        }
+
+        private enum TimeType
+        {
+            PROCESSING,
+            EVENT,
         }
 
         private enum TresholdFunction
@@ -59,7 +97,18 @@ namespace F2B.processors
             public int MaxRetry { get; private set; }
             public int Bantime { get; private set; }
             public string Action { get; private set; }
+            public int IPv4Prefix { get; set; } // -1 .. processor ipv4_prefix
+            public int IPv6Prefix { get; set; } // -1 .. processor ipv6_prefix
+            public int Level { get; set; }
             public IDictionary<IPAddress, long> Last { get; set; }
+            // maximum age of Last entry (ticks), 0 when entries are removed
+            // together with expired address history (sketch history
+            // doesn't know addresses, so it can't remove them)
+            public long Horizon { get; set; }
+            // addresses in order of their Last time (used to expire
+            // repeat interval without scanning whole Last dictionary)
+            private Queue<KeyValuePair<IPAddress, long>> lastOrder = new Queue<KeyValuePair<IPAddress, long>>();
+
             public Treshold(string name, TresholdFunction function, int maxretry, int repeat, int bantime, string action)
             {
                 Name = name;
@@ -68,6 +117,9 @@ namespace F2B.processors
                 Repeat = repeat;
                 Bantime = bantime;
                 Action = action;
+                IPv4Prefix = -1;
+                IPv6Prefix = -1;
+                Level = 0;
                 Last = new Dictionary<IPAddress, long>();
             }
             public Treshold(ProcessorElement config, string name)
@@ -78,6 +130,9 @@ namespace F2B.processors
                 Repeat = 0;
                 Bantime = -1;
                 Action = null;
+                IPv4Prefix = -1;
+                IPv6Prefix = -1;
+                Level = 0;
                 Last = new Dictionary<IPAddress, long>();
 
                 if (config.Options["treshold." + name + ".function"] != null)
@@ -104,6 +159,18 @@ namespace F2B.processors
                 {
                     MaxRetry = int.Parse(config.Options["treshold." + name + ".maxretry"].Value);
                 }
+                if (config.Options["treshold." + name + ".ipv4_prefix"] != null)
+                {
+                    IPv4Prefix = int.Parse(config.Options["treshold." + name + ".ipv4_prefix"].Value);
+                    if (IPv4Prefix < 128 - 32)
+                    {
+                        IPv4Prefix += (128 - 32);
+                    }
+                }
+                if (config.Options["treshold." + name + ".ipv6_prefix"] != null)
+                {
+                    IPv6Prefix = int.Parse(config.Options["treshold." + name + ".ipv6_prefix"].Value);
+                }
                 //if (config.Options["treshold." + name + ".actions"] != null)
                 //{
                 //    foreach (string action in config.Options["treshold." + name + ".actions"].Value.Split(','))
@@ -116,500 +183,336 @@ namespace F2B.processors
                     Action = config.Options["treshold." + name + ".action"].Value;
                 }
             }
-        }
-
-        private interface IFail
-        {
-            int Count { get; }
-            int Add(long timestamp);
-            void Load(BinaryReader reader);
-            void Save(BinaryWriter writer);
-#if DEBUG
-            void Debug(StreamWriter output);
-#endif
-        }
-
-        private class FailAll : IFail
-        {
-            private long findtime;
-            private Queue<long> data;
-            private long last;
-
-            public FailAll(long findtime)
-            {
-                Init(findtime);
+            // copy of treshold configuration with empty state (shard)
+            public Treshold(Treshold treshold)
+            {
+                Name = treshold.Name;
+                Function = treshold.Function;
+                MaxRetry = treshold.MaxRetry;
+                Repeat = treshold.Repeat;
+                Bantime = treshold.Bantime;
+                Action = treshold.Action;
+                IPv4Prefix = treshold.IPv4Prefix;
+                IPv6Prefix = treshold.IPv6Prefix;
+                Level = treshold.Level;
+                Last = new Dictionary<IPAddress, long>();
             }
 
-            public FailAll(BinaryReader reader, long findtime)
+            public bool Check(IPAddress addr, int cnt, long now)
             {
-                this.findtime = findtime;
+                bool over = false;
+                long last = 0;
+                bool hasLast = Last.TryGetValue(addr, out last);
 
-                Load(reader);
-            }
+                //Log.Error("XXX addr=" + addr
+                //    + ", cnt=" + cnt
+                //    + ", Name=" + Name
+                //    + ", MaxRetry=" + MaxRetry
+                //    + ", Repeat=" + Repeat
+                //    + ", Last(" + Last.Count + ")=" + last
+                //    + ", now=" + now);
+                // is number of failed logins over treshold according
+                // configured treshold function and number of failed logins
+                if (Function == TresholdFunction.SIMPLE)
+                {
+                    if (cnt > MaxRetry)
+                    {
+                        over = true;
+                    }
+                }
 
-            private void Init(long findtime)
-            {
-                this.findtime = findtime;
-                this.data = new Queue<long>();
-                this.last = DateTime.Now.Ticks - findtime;
-            }
+                if (!over)
+                {
+                    if (hasLast)
+                    {
+                        Last.Remove(addr);
+                    }
 
-            // clear expired entries
-            private void Cleanup(long now)
-            {
-                if (last + findtime <= now)
+                    return false;
+                }
+
+                // check rules for repeated over treshold notifications
+                if (Repeat == 0 && last != 0)
                 {
-                    data.Clear();
+                    return false;
+                }
+                else if (Repeat > 0 && last + Repeat * TimeSpan.TicksPerSecond > now)
+                {
+                    return false;
                 }
                 else
                 {
-                    while (data.Peek() + findtime < now)
-                    {
-                        data.Dequeue();
-                    }
+                    SetLast(addr, now);
+                    return true;
                 }
             }
 
-            public int Count
+            // time after which Last entry is no longer needed
+            private long LastLifetime
             {
                 get
                 {
-                    Cleanup(DateTime.Now.Ticks);
-
-                    return data.Count;
+                    long repeat = Repeat * TimeSpan.TicksPerSecond;
+                    if (Repeat > 0 && Horizon > 0)
+                        return Math.Min(repeat, Horizon);
+                    return Repeat > 0 ? repeat : Horizon;
                 }
             }
 
-            public int Add(long timestamp)
+            public void SetLast(IPAddress addr, long now)
             {
-                long now = DateTime.Now.Ticks;
-
-                Cleanup(now);
+                Last[addr] = now;
 
-                // skip old log data
-                if (timestamp + findtime < now)
+                if (Repeat > 0 || Horizon > 0)
                 {
-                    return data.Count;
+                    lastOrder.Enqueue(new KeyValuePair<IPAddress, long>(addr, now));
                 }
-
-                // NOTE: we should use "timestamp" instead of "now"
-                // but that needs sortable "data" collection
-                // and changes in Cleanup function
-                data.Enqueue(now);
-                last = now;
-
-                return data.Count;
             }
 
-            public void Load(BinaryReader reader)
+            // remove addresses with expired repeat interval, returns false
+            // when stopped because it took more than budget (ticks)
+            public bool ExpireLast(long now, long budget)
             {
-                long tmpFindtime = reader.ReadInt64();
-                int tmpCount = reader.ReadInt32();
+                Stopwatch sw = Stopwatch.StartNew();
 
-                this.data = new Queue<long>(Math.Min(tmpCount, Fail2banProcessor.MAX_COUNT));
-                for (int i = 0; i < tmpCount; i++)
+                while (lastOrder.Count > 0)
                 {
-                    this.data.Enqueue(reader.ReadInt64());
-                }
-
-                this.last = reader.ReadInt64();
+                    KeyValuePair<IPAddress, long> item = lastOrder.Peek();
+                    if (item.Value + LastLifetime > now)
+                    {
+                        break;
+                    }
 
-                if (tmpFindtime != this.findtime)
-                {
-                    // different configuration
-                    Init(findtime);
-                }
-            }
+                    if (sw.Elapsed.Ticks > budget)
+                    {
+                        return false;
+                    }
 
-            public void Save(BinaryWriter writer)
-            {
-                writer.Write(findtime);
-                writer.Write(data.Count);
-                foreach (var item in data)
-                {
-                    writer.Write(item);
+                    // address could be removed or updated in the meantime
+                    lastOrder.Dequeue();
+                    long last;
+                    if (Last.TryGetValue(item.Key, out last) && last == item.Value)
+                    {
+                        Last.Remove(item.Key);
+                    }
                 }
-                writer.Write(last);
-            }
 
-#if DEBUG
-            public void Debug(StreamWriter output)
-            {
-                output.WriteLine("status " + GetType() + " findtime: " + findtime);
-                output.WriteLine("status " + GetType() + " last: " + last);
-                output.WriteLine("status " + GetType() + " data(" + data.Count
-                    + "): " + string.Join<long>(",", data));
+                return true;
             }
-#endif
         }
 
-        private class FailOne : IFail
+        // Failed login history aggregated by address prefix. First level
+        // uses processor ipv4_prefix/ipv6_prefix and additional levels
+        // with shorter prefixes are created for tresholds that count
+        // failed logins from whole network (e.g. slow attack distributed
+        // across /24). All levels are updated with one event using keys
+        // derived from the same address key (just masked), so each level
+        // costs one table lookup.
+        private class Level
         {
-            private long findtime;
-            private int data;
-            private long last; // last cleanup
+            public int IPv4Prefix { get; private set; }
+            public int IPv6Prefix { get; private set; }
+            public FailTable Data { get; private set; }
+            public FailSketch Sketch { get; private set; }
 
-            public FailOne(long findtime)
+            public Level(int ipv4Prefix, int ipv6Prefix, FailTable data, FailSketch sketch)
             {
-                Init(findtime);
+                IPv4Prefix = ipv4Prefix;
+                IPv6Prefix = ipv6Prefix;
+                Data = data;
+                Sketch = sketch;
             }
 
-            public FailOne(BinaryReader reader, long findtime)
+            public int Prefix(ulong hi, ulong lo)
             {
-                this.findtime = findtime;
-
-                Load(reader);
-            }
-
-            private void Init(long findtime)
-            {
-                this.findtime = findtime;
-                this.data = 0;
-                this.last = DateTime.Now.Ticks - findtime;
+                return FailTable.IsIPv4(hi, lo) ? IPv4Prefix : IPv6Prefix;
             }
 
-            public int Count
+            // network address on this level
+            public IPAddress Network(ulong hi, ulong lo)
             {
-                get
-                {
-                    Cleanup(DateTime.Now.Ticks);
-
-                    return data;
-                }
+                FailTable.Network(Prefix(hi, lo), ref hi, ref lo);
+                return FailTable.Address(hi, lo);
             }
 
-            private void Cleanup(long now)
+            public int Add(ulong hi, ulong lo, long timestamp, long now)
             {
-                // no or empty history (reset last cleanup time)
-                if (data == 0)
-                {
-                    last = now;
-                    return;
-                }
-
-                // history data too old (older than findtime, reset last cleanup time)
-                if (last + findtime <= now)
-                {
-                    data = 0;
-                    last = now;
-                    return;
-                }
+                FailTable.Network(Prefix(hi, lo), ref hi, ref lo);
 
-                // substract from treshold data number that corresponds
-                // data fraction from last call to cleanup
-                double findtime_fraction = (double)(now - last) / findtime;
-                int substract = (int)(findtime_fraction * data);
-
-                if (substract == 0)
-                {
-                    return;
-                }
-
-                if (substract > data)
+                if (Sketch != null)
                 {
-                    data = 0;
+                    return Sketch.Add(hi, lo, timestamp, now);
                 }
                 else
                 {
-                    data -= substract;
-                }
-                last = now;
-            }
-
-            public int Add(long timestamp)
-            {
-                long now = DateTime.Now.Ticks;
-
-                Cleanup(now);
-
-                // skip old log data
-                if (timestamp + findtime < now)
-                {
-                    return data;
+                    return Data.Add(hi, lo, timestamp, now);
                 }
-
-                data++;
-
-                return data;
             }
 
-            public void Load(BinaryReader reader)
+            // read-only copy used to save state
+            public Level Snapshot()
             {
-                long tmpFindtime = reader.ReadInt64();
-                this.data = reader.ReadInt32();
-                this.last = reader.ReadInt64();
-
-                if (tmpFindtime != this.findtime)
-                {
-                    // different configuration
-                    Init(findtime);
-                }
+                return new Level(IPv4Prefix, IPv6Prefix, Data.Snapshot(),
+                    Sketch != null ? Sketch.Snapshot() : null);
             }
+        }
 
-            public void Save(BinaryWriter writer)
-            {
-                writer.Write(findtime);
-                writer.Write(data);
-                writer.Write(last);
-            }
+        // Part of failed login history for addresses with same hash of
+        // network with the shortest prefix used by any level, so all levels
+        // for one address are in the same shard. Each shard has its own
+        // lock, history, treshold state, journal and state file, so events
+        // from addresses in different shards are processed in parallel.
+        private class Shard
+        {
+            public Object Lock { get; private set; }
+            public List<Level> Levels { get; private set; }
+            public List<Treshold> Tresholds { get; private set; }
+            public FailJournal Journal { get; private set; }
+            public string StateFile { get; private set; }
+            // events released by event time reorder buffer in timestamp
+            // order (added with orderLock, applied with shard lock)
+            public ConcurrentQueue<Failure> Released { get; private set; }
 
-#if DEBUG
-            public void Debug(StreamWriter output)
+            public Shard(List<Level> levels, List<Treshold> tresholds, FailJournal journal, string stateFile)
             {
-                output.WriteLine("status " + GetType() + " findtime: " + findtime);
-                output.WriteLine("status " + GetType() + " last: " + last);
-                output.WriteLine("status " + GetType() + " data: " + data);
+                Lock = new Object();
+                Levels = levels;
+                Tresholds = tresholds;
+                Journal = journal;
+                StateFile = stateFile;
+                Released = new ConcurrentQueue<Failure>();
             }
-#endif
-        }
-
-        private class FailFixed : IFail
-        {
-            private long findtime;
-            private int count;
-            private double[] decay;
-            private int[] data;
-            private long start;
-            private long last;
-            private int sum;
 
-            public FailFixed(long findtime, int count, double decay = 1.0)
+            public int Count
             {
-                Init(findtime, count);
+                get { return Levels.Sum(l => l.Data.Count); }
             }
 
-            public FailFixed(BinaryReader reader, long findtime, int count, double decay = 1.0)
+            // update history (all prefix levels) and check tresholds using
+            // given processor clock (must be called with shard lock)
+            public void Update(Failure failure, long now)
             {
-                this.findtime = findtime;
-                this.count = count;
-                this.decay = null;
+                failure.now = now;
+                for (int i = 0; i < Levels.Count; i++)
+                {
+                    failure.failcnt[i] = Levels[i].Add(failure.hi, failure.lo, failure.timestamp, now);
+                }
+                if (Journal != null)
+                {
+                    Journal.Append(failure.hi, failure.lo, failure.timestamp, now);
+                }
 
-                if (decay != 1.0)
+                for (int i = 0; i < Tresholds.Count; i++)
                 {
-                    this.decay = new double[count];
-                    this.decay[0] = 1.0;
-                    for (int i = 1; i < count; i++)
+                    int level = Tresholds[i].Level;
+                    if (failure.network[level] == null)
                     {
-                        this.decay[i] = this.decay[i - 1] * decay;
+                        failure.network[level] = Levels[level].Network(failure.hi, failure.lo);
                     }
+                    failure.check[i] = Tresholds[i].Check(failure.network[level], failure.failcnt[level], now);
                 }
-
-                Load(reader);
-            }
-
-            private void Init(long findtime, int count)
-            {
-                long now = DateTime.Now.Ticks;
-
-                this.findtime = findtime;
-                this.count = count;
-                this.data = new int[count];
-                this.start = now;
-                this.last = now - findtime;
-                this.sum = 0;
             }
 
-            public int Count
+            // update history with all released events, events that were
+            // not buffered are left for their Execute caller (must be
+            // called with shard lock)
+            public void Apply(List<Failure> ready)
             {
-                get
+                Failure failure;
+                while (Released.TryDequeue(out failure))
                 {
-                    Cleanup(DateTime.Now.Ticks);
-
-                    if (decay == null)
-                    {
-                        return sum;
-                    }
-                    else
+                    Update(failure, failure.now);
+                    if (!failure.direct)
                     {
-                        double tmp = 0;
-                        for (int i = 0; i < data.Length; i++)
-                        {
-                            tmp += data[i] * decay[i];
-                        }
-
-                        return (int) tmp;
+                        ready.Add(failure);
                     }
                 }
             }
 
-            private void Cleanup(long now)
+            // remove expired history and treshold state, returns false
+            // when stopped because it took more than budget (ticks)
+            // (must be called with shard lock)
+            public bool Expire(long now, long budget)
             {
-                if (sum == 0)
-                {
-                    return;
-                }
+                Stopwatch sw = Stopwatch.StartNew();
+                bool done = true;
 
-                if (now < start)
+                for (int i = 0; i < Levels.Count; i++)
                 {
-                    Log.Warn("Fail2ban::FailFixed: now(" + now
-                        + ") < start(" + start + ") ... fixing to "
-                        + ((now / findtime) * findtime + start % findtime));
-                    start = (now / findtime) * findtime + start % findtime;
-                }
+                    List<Treshold> levelTresholds = Tresholds.FindAll(t => t.Level == i && t.Last.Count > 0);
 
-                if (last + findtime <= now || last > now)
-                {
-                    if (last > now)
+                    List<IPAddress> removed = null;
+                    if (levelTresholds.Count > 0)
                     {
-                        Log.Warn("Fail2ban::FailFixed: last(" + last + ") > now(" + now + ")");
+                        removed = new List<IPAddress>();
                     }
 
-                    for (int i = 0; i < data.Length; i++)
+                    if (!Levels[i].Data.Expire(now, Remaining(budget, sw), removed))
                     {
-                        data[i] = 0;
+                        done = false;
                     }
 
-                    sum = 0;
-                }
-                else
-                {
-                    long pos = (long)(((double)(now - start) / findtime) * data.Length) % data.Length;
-                    long lastpos = (long)(((double)(last - start) / findtime) * data.Length) % data.Length;
-
-                    if (lastpos != pos)
+                    if (removed != null)
                     {
-                        long endpos = (pos > lastpos) ? pos : pos + data.Length;
-                        for (long i = lastpos + 1; i <= endpos; i++)
+                        foreach (IPAddress addr in removed)
                         {
-                            long currpos = i % data.Length;
-                            sum -= data[currpos];
-                            data[currpos] = 0;
+                            foreach (Treshold treshold in levelTresholds)
+                            {
+                                treshold.Last.Remove(addr);
+                            }
                         }
                     }
                 }
-            }
-
-            public int Add(long timestamp)
-            {
-                long now = DateTime.Now.Ticks;
-
-                Cleanup(now);
-
-                // skip old log data
-                if (timestamp + findtime < now)
-                {
-                    return sum;
-                }
 
-                // NOTE: we should use "timestamp" instead of "now"
-                // but that requires also changes in Cleanup function
-                long pos = (long)(((double)(now - start) / findtime) * data.Length) % data.Length;
-                data[pos]++;
-                sum++;
-                last = now;
-
-                return sum;
-            }
-
-            public void Load(BinaryReader reader)
-            {
-                long tmpFindtime = reader.ReadInt64();
-                int tmpCount = reader.ReadInt32();
-                if (tmpCount > Fail2banProcessor.MAX_COUNT)
-                {
-                    throw new InvalidDataException("invalid state file data count = " + tmpCount);
-                }
-
-                this.data = new int[tmpCount];
-                for (int i = 0; i < tmpCount; i++)
-                {
-                    this.data[i] = reader.ReadInt32();
-                }
-
-                this.start = reader.ReadInt64();
-                this.last = reader.ReadInt64();
-                this.sum = reader.ReadInt32();
-
-                if (tmpFindtime != this.findtime || tmpCount != this.count)
+                foreach (Treshold treshold in Tresholds)
                 {
-                    // different configuration
-                    Init(findtime, count);
+                    if (!treshold.ExpireLast(now, Remaining(budget, sw)))
+                    {
+                        done = false;
+                    }
                 }
-            }
 
-            public void Save(BinaryWriter writer)
-            {
-                writer.Write(findtime);
-                writer.Write(data.Length);
-                foreach (var item in data)
-                {
-                    writer.Write(item);
-                }
-                writer.Write(start);
-                writer.Write(last);
-                writer.Write(sum);
+                return done;
             }
 
-#if DEBUG
-            public void Debug(StreamWriter output)
+            // rest of the budget, each part of cleanup gets at least
+            // CLEANUP_SLICE_MIN (otherwise part that comes later would
+            // never make progress when earlier parts used whole budget)
+            private static long Remaining(long budget, Stopwatch sw)
             {
-                output.WriteLine("status " + GetType() + " findtime: " + findtime);
-                output.WriteLine("status " + GetType() + " last: " + last);
-                output.WriteLine("status " + GetType() + " start: " + start);
-                output.WriteLine("status " + GetType() + " sum: " + sum);
-                output.WriteLine("status " + GetType() + " data(" + data.Length
-                    + "): " + string.Join<int>(",", data));
+                return Math.Max(budget - sw.Elapsed.Ticks, CLEANUP_SLICE_MIN);
             }
-#endif
         }
 
-        private class FailRRD : IFail
+        // failed login with results of history update (copied from
+        // shard lock to produce treshold actions)
+        private class Failure
         {
-            private long findtime;
-            private int count;
-            private int repeat;
-
-            public FailRRD(long findtime, int count, int repeat)
-            {
-                Init(findtime, count, repeat);
-            }
-
-            public FailRRD(BinaryReader reader, long findtime, int count, int repeat)
-            {
-                this.findtime = findtime;
-                this.count = count;
-                this.repeat = repeat;
-
-                Init(findtime, count, repeat);
-            }
-
-            private void Init(long findtime, int count, int repeat)
-            {
-                this.findtime = findtime;
-                this.count = count;
-                this.repeat = repeat;
-                throw new NotImplementedException("FailRRD is not implemented");
-            }
-
-            public int Count
-            {
-                get { throw new NotImplementedException(); }
+            public EventEntry evtlog;
+            public Shard shard;
+            public ulong hi;
+            public ulong lo;
+            public long timestamp; // log time
+            public long now; // processor clock used to update history
+            public bool direct; // not buffered, evtlog is still used by Execute
+            public int[] failcnt;
+            public IPAddress[] network;
+            public bool[] check;
+
+            public Failure(EventEntry evtlog, Shard shard, ulong hi, ulong lo, long timestamp, int levels, int tresholds)
+            {
+                this.evtlog = evtlog;
+                this.shard = shard;
+                this.hi = hi;
+                this.lo = lo;
+                this.timestamp = timestamp;
+                this.now = 0;
+                this.failcnt = new int[levels];
+                this.network = new IPAddress[levels];
+                this.check = new bool[tresholds];
             }
-
-            public int Add(long timestamp)
-            {
-                throw new NotImplementedException();
-            }
-
-            public void Load(BinaryReader reader)
-            {
-                throw new NotImplementedException();
-            }
-
-            public void Save(BinaryWriter writer)
-            {
-                throw new NotImplementedException();
-            }
-
-#if DEBUG
-            public void Debug(StreamWriter output)
-            {
-                throw new NotImplementedException();
-            }
-#endif
         }
 
-
         #region Constructors
         public Fail2banProcessor(ProcessorElement config, Service service)
             : base(config, service)
@@ -617,9 +520,14 @@ namespace F2B.processors
             // default values
             address = "Event.Address";
             stateFile = null;
+            state_journal = 0;
+            state_snapshot = 3600;
             findtime = 600;
             ipv4_prefix = 32;
             ipv6_prefix = 64;
+            shards = 1;
+            time = TimeType.PROCESSING;
+            time_lateness = 0;
             cleanup = 300;
 
             history = HistoryType.ALL;
@@ -627,6 +535,10 @@ namespace F2B.processors
             history_fixed_decay = 1.0;
             history_rrd_count = 2;
             history_rrd_repeat = 2;
+            history_sketch_count = 10;
+            history_sketch_epsilon = 0.0001;
+            history_sketch_delta = 0.01;
+            history_sketch_heavy = 0;
 
             tresholds = new List<Fail2banProcessor.Treshold>();
 
@@ -640,6 +552,14 @@ namespace F2B.processors
             {
                 stateFile = config.Options["state"].Value;
             }
+            if (config.Options["state.journal"] != null)
+            {
+                state_journal = int.Parse(config.Options["state.journal"].Value);
+            }
+            if (config.Options["state.snapshot"] != null)
+            {
+                state_snapshot = int.Parse(config.Options["state.snapshot"].Value);
+            }
 
             if (config.Options["findtime"] != null)
             {
@@ -657,6 +577,25 @@ namespace F2B.processors
             {
                 ipv6_prefix = int.Parse(config.Options["ipv6_prefix"].Value);
             }
+            if (config.Options["shards"] != null)
+            {
+                shards = Math.Max(1, int.Parse(config.Options["shards"].Value));
+            }
+            if (config.Options["time"] != null)
+            {
+                switch (config.Options["time"].Value.ToLower())
+                {
+                    case "processing": time = TimeType.PROCESSING; break;
+                    case "event": time = TimeType.EVENT; break;
+                    default:
+                        throw new ArgumentException("Unknown time type: "
+                   + config.Options["time"].Value.ToLower());
+                }
+            }
+            if (config.Options["time.lateness"] != null)
+            {
+                time_lateness = int.Parse(config.Options["time.lateness"].Value);
+            }
             if (config.Options["cleanup"] != null)
             {
                 cleanup = int.Parse(config.Options["cleanup"].Value);
@@ -670,6 +609,7 @@ namespace F2B.processors
                     case "one": history = HistoryType.ONE; break;
                     case "fixed": history = HistoryType.FIXED; break;
                     case "rrd": history = HistoryType.RRD; break;
+                    case "sketch": history = HistoryType.SKETCH; break;
                     default:
                         throw new ArgumentException("Unknown history type: "
                    + config.Options["history"].Value.ToLower());
@@ -691,6 +631,22 @@ namespace F2B.processors
             {
                 history_rrd_repeat = int.Parse(config.Options["history.rrd.repeat"].Value);
             }
+            if (config.Options["history.sketch.count"] != null)
+            {
+                history_sketch_count = int.Parse(config.Options["history.sketch.count"].Value);
+            }
+            if (config.Options["history.sketch.epsilon"] != null)
+            {
+                history_sketch_epsilon = double.Parse(config.Options["history.sketch.epsilon"].Value);
+            }
+            if (config.Options["history.sketch.delta"] != null)
+            {
+                history_sketch_delta = double.Parse(config.Options["history.sketch.delta"].Value);
+            }
+            if (config.Options["history.sketch.heavy"] != null)
+            {
+                history_sketch_heavy = int.Parse(config.Options["history.sketch.heavy"].Value);
+            }
 
             if (config.Options["tresholds"].Value != null)
             {
@@ -700,7 +656,58 @@ namespace F2B.processors
                 }
             }
 
-            data = new Dictionary<IPAddress, IFail>();
+            // history for processor prefix and for shorter prefixes
+            // used by tresholds
+            int levelIPv4Prefix = (ipv4_prefix <= 32 ? ipv4_prefix + 96 : ipv4_prefix);
+            List<Tuple<int, int>> levels = new List<Tuple<int, int>>();
+            levels.Add(new Tuple<int, int>(levelIPv4Prefix, ipv6_prefix));
+            foreach (Treshold treshold in tresholds)
+            {
+                int tmpIPv4Prefix = (treshold.IPv4Prefix < 0 ? levelIPv4Prefix : treshold.IPv4Prefix);
+                int tmpIPv6Prefix = (treshold.IPv6Prefix < 0 ? ipv6_prefix : treshold.IPv6Prefix);
+                if (tmpIPv4Prefix > levelIPv4Prefix || tmpIPv6Prefix > ipv6_prefix)
+                {
+                    Log.Error("Fail2ban[" + Name + "]: treshold " + treshold.Name
+                        + " prefix can't be longer than processor prefix");
+                    tmpIPv4Prefix = Math.Min(tmpIPv4Prefix, levelIPv4Prefix);
+                    tmpIPv6Prefix = Math.Min(tmpIPv6Prefix, ipv6_prefix);
+                }
+                treshold.IPv4Prefix = tmpIPv4Prefix;
+                treshold.IPv6Prefix = tmpIPv6Prefix;
+
+                treshold.Level = levels.FindIndex(l => l.Item1 == tmpIPv4Prefix && l.Item2 == tmpIPv6Prefix);
+                if (treshold.Level < 0)
+                {
+                    levels.Add(new Tuple<int, int>(tmpIPv4Prefix, tmpIPv6Prefix));
+                    treshold.Level = levels.Count - 1;
+                }
+            }
+
+            // history partitioned in shards, each with its own state file
+            // and journal with failed logins since last state snapshot
+            shardIPv4Prefix = levels.Min(l => l.Item1);
+            shardIPv6Prefix = levels.Min(l => l.Item2);
+            data = new Shard[shards];
+            for (int i = 0; i < shards; i++)
+            {
+                string tmpStateFile = stateFile;
+                if (stateFile != null && shards > 1)
+                {
+                    // different name for each number of shards, because
+                    // addresses are assigned to shards using hash modulo
+                    tmpStateFile = stateFile + "." + i + "of" + shards;
+                }
+
+                FailJournal tmpJournal = null;
+                if (tmpStateFile != null && state_journal > 0)
+                {
+                    tmpJournal = new FailJournal(tmpStateFile + ".journal");
+                }
+
+                data[i] = new Shard(levels.Select(l => CreateLevel(l.Item1, l.Item2)).ToList(),
+                    tresholds.Select(t => CreateTreshold(t)).ToList(), tmpJournal, tmpStateFile);
+            }
+
             // create timer to periodically cleanup expired data
             if (cleanup > 0)
             {
@@ -710,6 +717,14 @@ namespace F2B.processors
             }
 
             clockskew = 0;
+
+            clock = 0;
+            newest = 0;
+            newestArrival = 0;
+            aligned = false;
+            lateEvents = 0;
+            pendingCount = 0;
+            pending = new SortedDictionary<long, List<Failure>>();
         }
 
 
@@ -720,229 +735,759 @@ namespace F2B.processors
                 cleanup_timer.Enabled = false;
                 cleanup_timer.Dispose();
             }
+            if (journal_timer != null && journal_timer.Enabled)
+            {
+                journal_timer.Enabled = false;
+                journal_timer.Dispose();
+            }
+            if (snapshot_timer != null && snapshot_timer.Enabled)
+            {
+                snapshot_timer.Enabled = false;
+                snapshot_timer.Dispose();
+            }
         }
         #endregion
 
         #region Methods
-        private void Cleanup(object sender, ElapsedEventArgs e)
+        private Level CreateLevel(int ipv4Prefix, int ipv6Prefix)
         {
-            if (!cleanup_timer.Enabled)
+            FailTable table;
+            if (history == HistoryType.RRD)
             {
-                // this should prevent race condition, because elapsed
-                // event is queued for execution on a thread poole thread
-                return;
+                table = new FailTable(history, findtime * TimeSpan.TicksPerSecond, history_rrd_count, 1.0, history_rrd_repeat);
+            }
+            else
+            {
+                table = new FailTable(history, findtime * TimeSpan.TicksPerSecond, history_fixed_count, history_fixed_decay);
+            }
+            FailSketch approx = null;
+            if (history == HistoryType.SKETCH)
+            {
+                // sketch in each shard counts only part of failed logins,
+                // so the same error bound needs shards times less counters
+                approx = new FailSketch(findtime * TimeSpan.TicksPerSecond, history_sketch_count, shards * history_sketch_epsilon, history_sketch_delta, history_sketch_heavy);
             }
 
-            Cleanup();
+            return new Level(ipv4Prefix, ipv6Prefix, table, approx);
         }
 
-        private void Cleanup()
+        // treshold with empty state for one shard
+        private Treshold CreateTreshold(Treshold treshold)
         {
-            int dataCountBefore, dataCountAfter;
-            DateTime dataTimeBefore, dataTimeAfter;
-            int[] tresholdCountBefore = new int[tresholds.Count];
-            int[] tresholdCountAfter = new int[tresholds.Count];
-            DateTime tresholdTimeBefore, tresholdTimeAfter;
+            Treshold ret = new Treshold(treshold);
+            if (history == HistoryType.SKETCH)
+            {
+                // over treshold address is not notified again while it
+                // can still have failed logins in findtime or is banned
+                ret.Horizon = Math.Max(findtime, treshold.Bantime) * TimeSpan.TicksPerSecond;
+            }
 
-            // cleanup empty / expired fail objects from "data" dictionary
-            Log.Info("Fail2ban[" + Name + "]: cleanup expired data started");
+            return ret;
+        }
 
-            lock (thisLock)
+        // Shard for address key is chosen by network with the shortest
+        // prefix of all levels. Hash is different from hash used by
+        // FailTable slots, otherwise each shard would use just part
+        // of its table slots.
+        private static int ShardIndex(ulong hi, ulong lo, int ipv4Prefix, int ipv6Prefix, int count)
+        {
+            if (count == 1)
             {
-                dataCountBefore = data.Count;
-                dataTimeBefore = DateTime.UtcNow;
+                return 0;
+            }
 
-                foreach (var s in data.Where(kv => kv.Value.Count == 0).ToList())
-                {
-                    data.Remove(s.Key);
+            FailTable.Network(FailTable.IsIPv4(hi, lo) ? ipv4Prefix : ipv6Prefix, ref hi, ref lo);
 
-                    foreach (Treshold treshold in tresholds)
-                    {
-                        if (treshold.Last.ContainsKey(s.Key))
-                        {
-                            treshold.Last.Remove(s.Key);
-                        }
-                    }
-                }
+            unchecked
+            {
+                ulong h = lo ^ (hi * 0xC2B2AE3D27D4EB4FUL);
+                h = (h ^ (h >> 33)) * 0xFF51AFD7ED558CCDUL;
+                h = (h ^ (h >> 33)) * 0xC4CEB9FE1A85EC53UL;
+                h ^= h >> 33;
+                return (int)((h >> 32) % (ulong)count);
+            }
+        }
+
+        // processor clock
+        private long Now()
+        {
+            return time == TimeType.EVENT ? System.Threading.Interlocked.Read(ref clock) : DateTime.Now.Ticks;
+        }
+
+        private void Cleanup(object sender, ElapsedEventArgs e)
+        {
+            if (!cleanup_timer.Enabled)
+            {
+                // this should prevent race condition, because elapsed
+                // event is queued for execution on a thread poole thread
+                return;
+            }
 
-                dataTimeAfter = DateTime.UtcNow;
-                dataCountAfter = data.Count;
+            if (time == TimeType.EVENT)
+            {
+                AdvanceIdle();
+            }
 
-                tresholdTimeBefore = DateTime.UtcNow;
+            Cleanup();
+        }
 
-                int tresholdIndex = 0;
-                long now = DateTime.Now.Ticks;
-                foreach (Treshold treshold in tresholds)
+        // Expired data are removed in short slices (each slice holds
+        // one shard lock at most CLEANUP_SLICE), so processing of new
+        // events is not blocked by cleanup of huge number of addresses
+        private void Cleanup()
+        {
+            int dataCountBefore = 0, dataCountAfter = 0;
+            int[] tresholdCountBefore = new int[tresholds.Count];
+            int[] tresholdCountAfter = new int[tresholds.Count];
+            double[] sketchError = new double[data[0].Levels.Count];
+            int slices = 0;
+            double sliceMax = 0;
+
+            // cleanup empty / expired fail objects from "data" table
+            Log.Info("Fail2ban[" + Name + "]: cleanup expired data started");
+
+            Stopwatch sw = Stopwatch.StartNew();
+
+            foreach (Shard shard in data)
+            {
+                lock (shard.Lock)
                 {
-                    tresholdCountBefore[tresholdIndex] = treshold.Last.Count;
-                    tresholdCountAfter[tresholdIndex] = treshold.Last.Count;
-                    tresholdIndex++;
+                    dataCountBefore += shard.Count;
+                    for (int i = 0; i < tresholds.Count; i++)
+                    {
+                        tresholdCountBefore[i] += shard.Tresholds[i].Last.Count;
+                    }
+                }
 
-                    if (treshold.Repeat == 0)
-                        continue;
+                bool done = false;
+                while (!done)
+                {
+                    Stopwatch slice = Stopwatch.StartNew();
 
-                    foreach (var s in treshold.Last.Where(kv => kv.Value + treshold.Repeat * TimeSpan.TicksPerSecond <= now).ToList())
+                    lock (shard.Lock)
                     {
-                        treshold.Last.Remove(s.Key);
+                        done = shard.Expire(Now(), CLEANUP_SLICE);
                     }
 
-                    tresholdCountAfter[0] = treshold.Last.Count;
+                    slices++;
+                    sliceMax = Math.Max(sliceMax, slice.Elapsed.TotalMilliseconds);
                 }
 
-                tresholdTimeAfter = DateTime.UtcNow;
+                lock (shard.Lock)
+                {
+                    dataCountAfter += shard.Count;
+                    for (int i = 0; i < tresholds.Count; i++)
+                    {
+                        tresholdCountAfter[i] += shard.Tresholds[i].Last.Count;
+                    }
+                    for (int i = 0; i < shard.Levels.Count; i++)
+                    {
+                        if (shard.Levels[i].Sketch != null)
+                        {
+                            sketchError[i] = Math.Max(sketchError[i], shard.Levels[i].Sketch.Error(Now()));
+                        }
+                    }
+                }
             }
 
-            Log.Info("Fail2ban[" + Name + "]: cleanup expired data ("
-                + dataCountBefore + " -> " + dataCountAfter + ") in "
-                + dataTimeAfter.Subtract(dataTimeBefore).TotalMilliseconds
-                + "ms");
+            // estimates of approximate history are not reliable when
+            // possible error reaches treshold
+            for (int i = 0; i < sketchError.Length; i++)
+            {
+                List<Treshold> levelTresholds = tresholds.FindAll(t => t.Level == i);
+                if (data[0].Levels[i].Sketch == null || levelTresholds.Count == 0)
+                    continue;
 
-            Log.Info("Fail2ban[" + Name + "]: cleanup expired tresholds ("
-                + string.Join("/", tresholds) + ": "
+                int maxretry = levelTresholds.Min(t => t.MaxRetry);
+                if (sketchError[i] >= maxretry)
+                {
+                    Log.Warn("Fail2ban[" + Name + "]: history sketch error " + sketchError[i]
+                        + " reached treshold maxretry " + maxretry
+                        + " (decrease history.sketch.epsilon)");
+                }
+            }
+
+            Log.Info("Fail2ban[" + Name + "]: cleanup expired data ("
+                + dataCountBefore + " -> " + dataCountAfter + ", tresholds "
+                + string.Join("/", tresholds.Select(t => t.Name)) + ": "
                 + string.Join("/", tresholdCountBefore) + " -> "
                 + string.Join("/", tresholdCountAfter) + ") in "
-                + tresholdTimeAfter.Subtract(tresholdTimeBefore).TotalMilliseconds
-                + "ms");
-        }
+                + sw.Elapsed.TotalMilliseconds + "ms ("
+                + slices + " slices, longest " + sliceMax + "ms)");
 
+            if (time == TimeType.EVENT && lateEvents > 0)
+            {
+                Log.Info("Fail2ban[" + Name + "]: " + lateEvents
+                    + " events arrived later than " + time_lateness
+                    + " seconds behind newest log timestamp");
+            }
+        }
 
-        private bool Check(IPAddress addr, Treshold treshold, int cnt)
+        // Event time processing: processor clock is driven by log
+        // timestamps instead of current time. Events are buffered until
+        // watermark (newest log timestamp - time.lateness) passes their
+        // timestamp and history is updated in timestamp order, so result
+        // doesn't depend on arrival order of events from different inputs
+        // (within lateness) or on processing speed (log replay). Events
+        // older than watermark are counted at watermark time. Due events
+        // are only queued in their shard and shards with queued events are
+        // added in "released" list, history is updated by Apply outside
+        // orderLock (must be called with orderLock).
+        private void Reorder(Failure failure, List<Shard> released)
         {
-            bool over = false;
-            long last = 0;
-            bool hasLast = treshold.Last.TryGetValue(addr, out last);
-
-            //Log.Error("XXX addr=" + addr
-            //    + ", cnt=" + cnt
-            //    + ", Name=" + treshold.Name
-            //    + ", MaxRetry=" + treshold.MaxRetry
-            //    + ", Repeat=" + treshold.Repeat
-            //    + ", Last(" + treshold.Last.Count + ")=" + last
-            //    + ", now=" + DateTime.Now.Ticks);
-            // is number of failed logins over treshold according
-            // configured treshold function and number of failed logins
-            if (treshold.Function == TresholdFunction.SIMPLE)
+            if (!aligned)
             {
-                if (cnt > treshold.MaxRetry)
+                // first event, move history (also loaded from state file
+                // written with different clock) to event time clock
+                // restored from journal or to the first event time
+                long start = (clock > 0 ? clock : failure.timestamp);
+                foreach (Shard shard in data)
                 {
-                    over = true;
+                    lock (shard.Lock)
+                    {
+                        foreach (Level level in shard.Levels)
+                        {
+                            level.Data.Align(start);
+                            if (level.Sketch != null)
+                            {
+                                level.Sketch.Align(start);
+                            }
+                        }
+                    }
                 }
+                aligned = true;
+                newestArrival = DateTime.Now.Ticks;
+            }
+
+            if (failure.timestamp >= newest)
+            {
+                newest = failure.timestamp;
+                newestArrival = DateTime.Now.Ticks;
+            }
+            System.Threading.Interlocked.Exchange(ref clock, Math.Max(clock, newest - time_lateness * TimeSpan.TicksPerSecond));
+
+            long due = failure.timestamp;
+            if (due < clock)
+            {
+                lateEvents++;
+                due = clock;
+            }
+
+            if (pendingCount == 0 && due <= clock)
+            {
+                // in order event, no need to buffer
+                failure.direct = true;
+                Enqueue(failure, due, released);
+                return;
+            }
+
+            // buffered event continues in processor chain, treshold
+            // actions are produced later from its private copy
+            failure.evtlog = new EventEntry(failure.evtlog);
+
+            List<Failure> list;
+            if (!pending.TryGetValue(due, out list))
+            {
+                list = new List<Failure>(1);
+                pending[due] = list;
             }
+            list.Add(failure);
+            pendingCount++;
+
+            Release(clock, released);
+        }
 
-            if (!over)
+        // queue due event in its shard (must be called with orderLock,
+        // so each shard gets its events in timestamp order)
+        private void Enqueue(Failure failure, long due, List<Shard> released)
+        {
+            failure.now = due;
+            failure.shard.Released.Enqueue(failure);
+            if (!released.Contains(failure.shard))
             {
-                if (hasLast)
+                released.Add(failure.shard);
+            }
+        }
+
+        // update history of given shards with their released events (each
+        // shard under its own lock) and produce treshold actions
+        private void Apply(List<Shard> released)
+        {
+            List<Failure> ready = new List<Failure>();
+            foreach (Shard shard in released)
+            {
+                lock (shard.Lock)
                 {
-                    treshold.Last.Remove(addr);
+                    shard.Apply(ready);
                 }
-
-                return false;
             }
 
-            // check rules for repeated over treshold notifications
-            long now = DateTime.Now.Ticks;
+            foreach (Failure item in ready)
+            {
+                Notify(item);
+            }
+        }
 
-            if (treshold.Repeat == 0 && last != 0)
+        // Without new events for whole cleanup interval watermark advances
+        // with current time since the newest event arrived, so buffered
+        // events are released and history expires also on idle input
+        // (log replay has new events all the time and it is not affected)
+        private void AdvanceIdle()
+        {
+            List<Shard> released = new List<Shard>();
+            lock (orderLock)
             {
-                return false;
+                if (!aligned)
+                    return;
+
+                long idle = DateTime.Now.Ticks - newestArrival;
+                long watermark = newest + idle - time_lateness * TimeSpan.TicksPerSecond;
+                if (idle < cleanup * TimeSpan.TicksPerSecond || watermark <= clock)
+                    return;
+
+                System.Threading.Interlocked.Exchange(ref clock, watermark);
+                Release(clock, released);
             }
-            else if (treshold.Repeat > 0 && last + treshold.Repeat * TimeSpan.TicksPerSecond > now)
+
+            Apply(released);
+        }
+
+        // queue buffered events up to given time in their shards
+        private void Release(long watermark, List<Shard> released)
+        {
+            while (pendingCount > 0)
             {
-                return false;
+                KeyValuePair<long, List<Failure>> first = pending.First();
+                if (first.Key > watermark)
+                    break;
+
+                pending.Remove(first.Key);
+                pendingCount -= first.Value.Count;
+                foreach (Failure item in first.Value)
+                {
+                    Enqueue(item, first.Key, released);
+                }
             }
-            else
+        }
+
+        // produce actions for tresholds reached by failed login
+        private void Notify(Failure failure)
+        {
+            EventEntry evtlog = failure.evtlog;
+
+            // evaluate all defined tresholds
+            for (int i = 0; i < tresholds.Count; i++)
             {
-                treshold.Last[addr] = now;
-                return true;
+                if (!failure.check[i])
+                    continue;
+
+                Treshold treshold = tresholds[i];
+                int tmpPrefix = FailTable.IsIPv4(failure.hi, failure.lo) ? treshold.IPv4Prefix : treshold.IPv6Prefix;
+                IPAddress tmpAddr = failure.network[treshold.Level];
+                int tmpFailcnt = failure.failcnt[treshold.Level];
+                long expiration = failure.now + TimeSpan.FromSeconds(treshold.Bantime).Ticks;
+
+                if (FailTable.IsIPv4(failure.hi, failure.lo))
+                {
+                    // workaround for buggy MapToIPv4 implementation
+                    tmpAddr = Fixes.MapToIPv4(tmpAddr);
+                    tmpPrefix = tmpPrefix - 96;
+                }
+
+                Log.Info("Fail2ban[" + Name + "]: reached treshold "
+                        + treshold.Name + " (" + treshold.MaxRetry + "&"
+                        + tmpFailcnt + ") for " + tmpAddr + "/" + tmpPrefix);
+
+                if (evtlog.HasProcData("Fail2ban.All"))
+                {
+                    string all = evtlog.GetProcData<string>("Fail2ban.All");
+                    evtlog.SetProcData("Fail2ban.All", all + "," + Name);
+                }
+                else
+                {
+                    evtlog.SetProcData("Fail2ban.All", Name);
+                }
+                evtlog.SetProcData("Fail2ban.Last", Name);
+
+                evtlog.SetProcData(Name + ".Address", tmpAddr);
+                evtlog.SetProcData(Name + ".Prefix", tmpPrefix);
+                evtlog.SetProcData(Name + ".FailCnt", tmpFailcnt);
+                evtlog.SetProcData(Name + ".Bantime", treshold.Bantime);
+                evtlog.SetProcData(Name + ".Expiration", expiration);
+                evtlog.SetProcData(Name + ".Treshold", treshold.Name);
+
+                // Add to "action" queue
+                Produce(new EventEntry(evtlog), treshold.Action, EventQueue.Priority.High);
             }
         }
-        private void ReadState(string filename)
+
+        // returns journal sequence number of last event in snapshot
+        private long ReadState(Shard shard)
         {
-            using (Stream stream = File.Open(filename, FileMode.Open))
+            long sequence = 0;
+
+            using (Stream stream = new FileStream(shard.StateFile, FileMode.Open, FileAccess.Read, FileShare.Read, 1 << 20))
             using (BinaryReader reader = new BinaryReader(stream))
             {
-                lock (thisLock)
+                // snapshot written with enabled journal ends with sequence
+                // number of last journaled event and magic number
+                long length = stream.Length;
+                if (length >= 4 + 8 + 4)
                 {
-                    int nhistory = reader.ReadInt32();
-                    for (int i = 0; i < nhistory; i++)
+                    stream.Seek(-(8 + 4), SeekOrigin.End);
+                    long tmpSequence = reader.ReadInt64();
+                    if (reader.ReadInt32() == STATE_MAGIC)
                     {
-                        IPAddress addr = new IPAddress(reader.ReadBytes(16));
-                        IFail fail = null;
+                        sequence = tmpSequence;
+                        length -= 8 + 4;
+                    }
+                    stream.Seek(0, SeekOrigin.Begin);
+                }
 
-                        switch (history)
-                        {
-                            case HistoryType.ALL: fail = new FailAll(reader, findtime * TimeSpan.TicksPerSecond); break;
-                            case HistoryType.ONE: fail = new FailOne(reader, findtime * TimeSpan.TicksPerSecond); break;
-                            case HistoryType.FIXED: fail = new FailFixed(reader, findtime * TimeSpan.TicksPerSecond, history_fixed_count, history_fixed_decay); break;
-                            case HistoryType.RRD: fail = new FailRRD(reader, findtime * TimeSpan.TicksPerSecond, history_rrd_count, history_rrd_repeat); break;
-                        }
+                lock (shard.Lock)
+                {
+                    // first level has same format as state file without
+                    // additional levels
+                    if (!ReadLevel(reader, shard.Levels[0], length))
+                    {
+                        return sequence;
+                    }
+
+                    while (stream.Position + 3 * 4 <= length)
+                    {
+                        if (reader.ReadInt32() != LEVEL_MAGIC)
+                            break;
 
-                        if (fail.Count > 0)
+                        int ipv4Prefix = reader.ReadInt32();
+                        int ipv6Prefix = reader.ReadInt32();
+                        Level level = shard.Levels.Find(l => l.IPv4Prefix == ipv4Prefix && l.IPv6Prefix == ipv6Prefix);
+                        if (level == null)
                         {
-                            data[addr] = fail;
+                            // level is no longer used by any treshold
+                            level = CreateLevel(ipv4Prefix, ipv6Prefix);
                         }
+
+                        if (!ReadLevel(reader, level, length))
+                            break;
                     }
                 }
             }
+
+            return sequence;
         }
 
-        private void WriteState(string filename)
+        // returns false if following data can't be parsed
+        private bool ReadLevel(BinaryReader reader, Level level, long length)
+        {
+            int nhistory = reader.ReadInt32();
+            if (level.Sketch != null)
+            {
+                // approximate history follows empty list of addresses
+                if (nhistory == 0 && reader.BaseStream.Position < length)
+                {
+                    level.Sketch.Load(reader);
+                    return true;
+                }
+                return false;
+            }
+
+            level.Data.Load(reader, nhistory);
+            return true;
+        }
+
+        private void WriteLevel(BinaryWriter writer, Level level)
+        {
+            writer.Write(level.Data.Count);
+            level.Data.Save(writer);
+            if (level.Sketch != null)
+            {
+                level.Sketch.Save(writer);
+            }
+        }
+
+        // write state snapshot of all shards
+        private void WriteState()
         {
             Cleanup();
 
-            using (Stream stream = File.Open(filename, FileMode.Create))
+            lock (stateLock)
+            {
+                foreach (Shard shard in data)
+                {
+                    WriteState(shard);
+                }
+            }
+        }
+
+        // Write shard state snapshot. Shard lock is held only to copy
+        // failed login history, serialization and file operations are
+        // done without blocking event processing. Snapshot is written
+        // in temporary file that replaces state file when complete and
+        // after that journal with events included in snapshot is removed.
+        private void WriteState(Shard shard)
+        {
+            Stopwatch sw = Stopwatch.StartNew();
+
+            List<Level> copies = new List<Level>();
+            FailJournal.Block pending = null;
+            long sequence = 0;
+            double copyTime;
+
+            lock (shard.Lock)
+            {
+                foreach (Level level in shard.Levels)
+                {
+                    copies.Add(level.Snapshot());
+                }
+                if (shard.Journal != null)
+                {
+                    pending = shard.Journal.Swap();
+                    sequence = shard.Journal.Sequence;
+                }
+                copyTime = sw.Elapsed.TotalMilliseconds;
+            }
+
+            // journal must contain all events in case we fail to
+            // write complete snapshot
+            if (shard.Journal != null)
+            {
+                shard.Journal.Write(pending);
+            }
+
+            string filename = shard.StateFile;
+            string tmpFilename = filename + ".tmp";
+            using (Stream stream = new FileStream(tmpFilename, FileMode.Create, FileAccess.Write, FileShare.None, 1 << 20))
             using (BinaryWriter writer = new BinaryWriter(stream))
             {
-                lock (thisLock)
+                for (int i = 0; i < copies.Count; i++)
                 {
-                    writer.Write(data.Count);
-                    foreach (var item in data)
+                    if (i > 0)
                     {
-                        IPAddress addr = item.Key;
-                        IFail fail = item.Value;
+                        writer.Write(LEVEL_MAGIC);
+                        writer.Write(copies[i].IPv4Prefix);
+                        writer.Write(copies[i].IPv6Prefix);
+                    }
+                    WriteLevel(writer, copies[i]);
+                }
+                if (shard.Journal != null)
+                {
+                    writer.Write(sequence);
+                    writer.Write(STATE_MAGIC);
+                }
+            }
+
+            if (File.Exists(filename))
+            {
+                File.Replace(tmpFilename, filename, null);
+            }
+            else
+            {
+                File.Move(tmpFilename, filename);
+            }
 
-                        writer.Write(addr.GetAddressBytes());
-                        fail.Save(writer);
+            // all events from journal are in snapshot (also remove
+            // journal from previous run with enabled journal)
+            if (shard.Journal != null)
+            {
+                shard.Journal.Truncate();
+            }
+            else if (File.Exists(filename + ".journal"))
+            {
+                File.Delete(filename + ".journal");
+            }
+
+            Log.Info("Fail2ban[" + Name + "]: state snapshot \"" + filename
+                + "\" with " + copies.Sum(l => l.Data.Count) + " addresses written in "
+                + sw.Elapsed.TotalMilliseconds + "ms (locked "
+                + copyTime + "ms)");
+        }
+
+        // append events buffered in memory to the journal files
+        private void FlushJournal(object sender, ElapsedEventArgs e)
+        {
+            if (!journal_timer.Enabled)
+            {
+                return;
+            }
+
+            lock (stateLock)
+            {
+                foreach (Shard shard in data)
+                {
+                    FailJournal.Block pending;
+                    lock (shard.Lock)
+                    {
+                        pending = shard.Journal.Swap();
+                    }
+
+                    try
+                    {
+                        shard.Journal.Write(pending);
+                    }
+                    catch (Exception ex)
+                    {
+                        Log.Warn("Fail2ban[" + Name + "]: Unable to write journal \""
+                            + shard.Journal.Filename + "\" (lost " + pending.count
+                            + " events): " + ex.Message);
                     }
                 }
             }
         }
-        #endregion
 
-        #region Override
-        public override void Start()
+        private void WriteSnapshot(object sender, ElapsedEventArgs e)
         {
-            if (stateFile == null)
+            if (!snapshot_timer.Enabled)
+            {
                 return;
+            }
 
-            if (File.Exists(stateFile))
+            try
+            {
+                WriteState();
+            }
+            catch (Exception ex)
+            {
+                Log.Warn("Fail2ban[" + Name + "]: Unable to write state file \""
+                    + stateFile + "\": " + ex.Message);
+            }
+        }
+
+        // apply events from journal that are not included in snapshot,
+        // returns processor clock of last applied event
+        private long ReplayJournal(Shard shard, long sequence)
+        {
+            Stopwatch sw = Stopwatch.StartNew();
+            long applied = 0;
+            long last = 0;
+
+            shard.Journal.Restore(sequence);
+            long replayed = shard.Journal.Replay(block =>
+            {
+                lock (shard.Lock)
+                {
+                    for (int i = 0; i < block.count; i++)
+                    {
+                        if (block.first + i <= sequence)
+                            continue;
+
+                        foreach (Level level in shard.Levels)
+                        {
+                            level.Add(block.hi[i], block.lo[i], block.timestamp[i], block.now[i]);
+                        }
+                        last = Math.Max(last, block.now[i]);
+                        applied++;
+                    }
+                }
+            });
+
+            Log.Info("Fail2ban[" + Name + "]: replayed " + applied + "/"
+                + replayed + " events from journal \"" + shard.Journal.Filename
+                + "\" in " + sw.Elapsed.TotalMilliseconds + "ms");
+
+            return last;
+        }
+
+        // load shard state and journal, returns processor clock of last
+        // event from journal
+        private long Load(Shard shard)
+        {
+            long sequence = 0;
+            if (File.Exists(shard.StateFile))
             {
                 Log.Info("Fail2ban[" + Name + "]: Load processor state from \""
-                    + stateFile + "\"");
+                    + shard.StateFile + "\"");
 
                 try
                 {
-                    ReadState(stateFile);
+                    sequence = ReadState(shard);
                 }
                 catch (Exception ex)
                 {
                     Log.Warn("Fail2ban[" + Name + "]: Unable to read state file \""
-                        + stateFile + "\": " + ex.Message);
+                        + shard.StateFile + "\": " + ex.Message);
                 }
             }
+
+            if (shard.Journal == null)
+                return 0;
+
+            try
+            {
+                return ReplayJournal(shard, sequence);
+            }
+            catch (Exception ex)
+            {
+                Log.Warn("Fail2ban[" + Name + "]: Unable to replay journal \""
+                    + shard.Journal.Filename + "\": " + ex.Message);
+            }
+
+            return 0;
+        }
+        #endregion
+
+        #region Override
+        public override void Start()
+        {
+            if (stateFile == null)
+                return;
+
+            // shards are independent, load them in parallel
+            long[] last = new long[data.Length];
+            Parallel.For(0, data.Length, i =>
+            {
+                last[i] = Load(data[i]);
+            });
+
+            if (time == TimeType.EVENT)
+            {
+                // continue with event time clock from journal
+                clock = Math.Max(clock, last.Max());
+                newest = Math.Max(newest, clock);
+            }
+
+            if (state_journal <= 0)
+                return;
+
+            journal_timer = new Timer(state_journal * 1000);
+            journal_timer.Elapsed += FlushJournal;
+            journal_timer.Enabled = true;
+
+            if (state_snapshot > 0)
+            {
+                snapshot_timer = new Timer(state_snapshot * 1000);
+                snapshot_timer.Elapsed += WriteSnapshot;
+                snapshot_timer.Enabled = true;
+            }
         }
 
         public override void Stop()
         {
+            // history must contain also events waiting for watermark
+            List<Shard> released = new List<Shard>();
+            lock (orderLock)
+            {
+                Release(long.MaxValue, released);
+            }
+            Apply(released);
+
             if (stateFile == null)
                 return;
 
+            if (journal_timer != null)
+            {
+                journal_timer.Enabled = false;
+            }
+            if (snapshot_timer != null)
+            {
+                snapshot_timer.Enabled = false;
+            }
+
             Log.Info("Fail2ban[" + Name + "]: Save processor state to \""
                 + stateFile + "\"");
 
             try
             {
-                WriteState(stateFile);
+                WriteState();
             }
             catch (Exception ex)
             {
@@ -1014,75 +1559,38 @@ namespace F2B.processors
                 logtime = now;
             }
 
-            int failcnt = 0;
-            bool[] tresholdCheck = new bool[tresholds.Count];
+            ulong hi, lo;
+            FailTable.Key(addr, out hi, out lo);
+
+            Shard shard = data[ShardIndex(hi, lo, shardIPv4Prefix, shardIPv6Prefix, data.Length)];
+            Failure failure = new Failure(evtlog, shard, hi, lo, logtime, shard.Levels.Count, tresholds.Count);
+            failure.network[0] = addr;
 
-            lock (thisLock)
+            if (time == TimeType.EVENT)
             {
-                // update failed login fail2ban data
-                IFail fail;
-                if (!data.TryGetValue(addr, out fail))
+                // orderLock is held only to buffer event and move the
+                // watermark, history is updated with shard lock
+                List<Shard> released = new List<Shard>(1);
+                lock (orderLock)
                 {
-                    switch (history)
-                    {
-                        case HistoryType.ALL: fail = new FailAll(findtime * TimeSpan.TicksPerSecond); break;
-                        case HistoryType.ONE: fail = new FailOne(findtime * TimeSpan.TicksPerSecond); break;
-                        case HistoryType.FIXED: fail = new FailFixed(findtime * TimeSpan.TicksPerSecond, history_fixed_count, history_fixed_decay); break;
-                        case HistoryType.RRD: fail = new FailRRD(findtime * TimeSpan.TicksPerSecond, history_rrd_count, history_rrd_repeat); break;
-                    }
-
-                    data[addr] = fail;
+                    Reorder(failure, released);
                 }
-                failcnt = fail.Add(logtime);
+                Apply(released);
 
-                for (int i = 0; i < tresholds.Count; i++)
+                // event that was not buffered is applied by this or
+                // concurrent Apply (its shard queue was drained)
+                if (failure.direct)
                 {
-                    tresholdCheck[i] = Check(addr, tresholds[i], failcnt);
+                    Notify(failure);
                 }
             }
-
-            // evaluate all defined tresholds
-            for (int i = 0; i < tresholds.Count; i++)
+            else
             {
-                if (!tresholdCheck[i])
-                    continue;
-
-                Treshold treshold = tresholds[i];
-                int tmpPrefix = prefix;
-                IPAddress tmpAddr = addr;
-                long expiration = now + TimeSpan.FromSeconds(treshold.Bantime).Ticks;
-
-                if (addr.IsIPv4MappedToIPv6)
+                lock (shard.Lock)
                 {
-                    // workaround for buggy MapToIPv4 implementation
-                    tmpAddr = Fixes.MapToIPv4(addr);
-                    tmpPrefix = prefix - 96;
+                    shard.Update(failure, DateTime.Now.Ticks);
                 }
-
-                Log.Info("Fail2ban[" + Name + "]: reached treshold "
-                        + treshold.Name + " (" + treshold.MaxRetry + "&"
-                        + failcnt + ") for " + tmpAddr + "/" + tmpPrefix);
-
-                if (evtlog.HasProcData("Fail2ban.All"))
-                {
-                    string all = evtlog.GetProcData<string>("Fail2ban.All");
-                    evtlog.SetProcData("Fail2ban.All", all + "," + Name);
-                }
-                else
-                {
-                    evtlog.SetProcData("Fail2ban.All", Name);
-                }
-                evtlog.SetProcData("Fail2ban.Last", Name);
-
-                evtlog.SetProcData(Name + ".Address", tmpAddr);
-                evtlog.SetProcData(Name + ".Prefix", tmpPrefix);
-                evtlog.SetProcData(Name + ".FailCnt", failcnt);
-                evtlog.SetProcData(Name + ".Bantime", treshold.Bantime);
-                evtlog.SetProcData(Name + ".Expiration", expiration);
-                evtlog.SetProcData(Name + ".Treshold", treshold.Name);
-
-                // Add to "action" queue
-                Produce(new EventEntry(evtlog), treshold.Action, EventQueue.Priority.High);
+                Notify(failure);
             }
 
             return goto_next;
@@ -1094,15 +1602,25 @@ namespace F2B.processors
             base.Debug(output);
 
             output.WriteLine("config address: " + address);
+            output.WriteLine("config state: " + stateFile);
+            output.WriteLine("config state_journal: " + state_journal);
+            output.WriteLine("config state_snapshot: " + state_snapshot);
             output.WriteLine("config findtime: " + findtime);
             output.WriteLine("config ipv4_prefix: " + ipv4_prefix);
             output.WriteLine("config ipv6_prefix: " + ipv6_prefix);
+            output.WriteLine("config shards: " + shards);
+            output.WriteLine("config time: " + time);
+            output.WriteLine("config time_lateness: " + time_lateness);
             output.WriteLine("config cleanup: " + cleanup);
             output.WriteLine("config history: " + history);
             output.WriteLine("config history_fixed_count: " + history_fixed_count);
             output.WriteLine("config history_fixed_decay: " + history_fixed_decay);
             output.WriteLine("config history_rrd_count: " + history_rrd_count);
             output.WriteLine("config history_rrd_repeat: " + history_rrd_repeat);
+            output.WriteLine("config history_sketch_count: " + history_sketch_count);
+            output.WriteLine("config history_sketch_epsilon: " + history_sketch_epsilon);
+            output.WriteLine("config history_sketch_delta: " + history_sketch_delta);
+            output.WriteLine("config history_sketch_heavy: " + history_sketch_heavy);
             foreach (Treshold treshold in tresholds)
             {
                 output.WriteLine("config treshold " + treshold.Name + " function: " + treshold.Function);
@@ -1110,24 +1628,259 @@ namespace F2B.processors
                 output.WriteLine("config treshold " + treshold.Name + " maxretry: " + treshold.MaxRetry);
                 output.WriteLine("config treshold " + treshold.Name + " bantime: " + treshold.Bantime);
                 output.WriteLine("config treshold " + treshold.Name + " action: " + treshold.Action);
-                output.Write("config treshold " + treshold.Name + " last(" + treshold.Last.Count + "): ");
-                foreach (var kvs in treshold.Last)
+                output.WriteLine("config treshold " + treshold.Name + " ipv4_prefix: " + treshold.IPv4Prefix);
+                output.WriteLine("config treshold " + treshold.Name + " ipv6_prefix: " + treshold.IPv6Prefix);
+            }
+
+            long now = Now();
+            if (time == TimeType.EVENT)
+            {
+                lock (orderLock)
+                {
+                    output.WriteLine("status time clock: " + clock + ", newest: "
+                        + newest + ", pending: " + pendingCount + ", late: "
+                        + lateEvents);
+                }
+            }
+
+            for (int i = 0; i < data.Length; i++)
+            {
+                Shard shard = data[i];
+                lock (shard.Lock)
+                {
+                    output.WriteLine("status shard " + i + " state: " + shard.StateFile);
+                    foreach (Treshold treshold in shard.Tresholds)
+                    {
+                        output.Write("status treshold " + treshold.Name + " last(" + treshold.Last.Count + "): ");
+                        foreach (var kvs in treshold.Last)
+                        {
+                            output.Write(kvs.Key + "(" + kvs.Value + "),");
+                        }
+                        output.WriteLine();
+                    }
+                    foreach (Level level in shard.Levels)
+                    {
+                        output.WriteLine("status level ipv4_prefix: " + level.IPv4Prefix
+                            + ", ipv6_prefix: " + level.IPv6Prefix);
+                        level.Data.Debug(output, now);
+                        if (level.Sketch != null)
+                        {
+                            level.Sketch.Debug(output, now);
+                        }
+                    }
+                    if (shard.Journal != null)
+                    {
+                        output.WriteLine("status journal " + shard.Journal.Filename
+                            + " sequence: " + shard.Journal.Sequence + ", pending: "
+                            + shard.Journal.Pending + ", size: " + shard.Journal.Length);
+                    }
+                }
+            }
+        }
+
+
+        // Time to update history for one, two and three prefix levels
+        // (IPv4 /32, /24, /16) compared with single level used by default
+        // configuration (address key, table update and network address)
+        public static void BenchmarkLevels(int events)
+        {
+            long findtime = 600 * TimeSpan.TicksPerSecond;
+            int[][] configs = { new int[] { 128 }, new int[] { 128, 120 }, new int[] { 128, 120, 112 } };
+
+            Console.WriteLine("{0} events: levels, update [ms], per event [ns]", events);
+            foreach (int[] prefixes in configs)
+            {
+                List<Level> levels = new List<Level>();
+                foreach (int prefix in prefixes)
+                {
+                    levels.Add(new Level(prefix, 64, new FailTable(HistoryType.ALL, findtime, 10, 1.0), null));
+                }
+
+                Random rnd = new Random(1);
+                byte[] bytes = new byte[16];
+                bytes[10] = 0xff;
+                bytes[11] = 0xff;
+                long now = DateTime.Now.Ticks;
+                int[] failcnt = new int[levels.Count];
+
+                Stopwatch sw = Stopwatch.StartNew();
+                for (int i = 0; i < events; i++)
                 {
-                    output.Write(kvs.Key + "(" + kvs.Value + "),");
+                    // slow attack from many addresses in few networks
+                    int a = rnd.Next(1 << 20);
+                    bytes[12] = 10;
+                    bytes[13] = (byte)(a >> 12);
+                    bytes[14] = (byte)(a >> 4);
+                    bytes[15] = (byte)a;
+                    IPAddress addr = new IPAddress(bytes);
+
+                    ulong hi, lo;
+                    FailTable.Key(addr, out hi, out lo);
+                    for (int l = 0; l < levels.Count; l++)
+                    {
+                        failcnt[l] = levels[l].Add(hi, lo, now, now);
+                    }
+                }
+                long updateTime = sw.ElapsedMilliseconds;
+
+                Console.WriteLine("  {0,-6} {1,8} {2,8:F1}", levels.Count, updateTime,
+                    1000000.0 * updateTime / events);
+            }
+        }
+
+
+        // Throughput of history updates from multiple consumer threads
+        // (EventQueue consumers) with different number of shards, each
+        // event updates two prefix levels (/32 and /24) and one treshold
+        public static void BenchmarkShards(int events)
+        {
+            long findtime = 600 * TimeSpan.TicksPerSecond;
+            int[] shardCounts = { 1, 4, 16 };
+            int[] threadCounts = { 1, 2, 4, 8 };
+
+            Console.WriteLine("{0} events, {1} processors: shards, threads, time [ms], events/s",
+                events, Environment.ProcessorCount);
+            foreach (int shardCount in shardCounts)
+            {
+                foreach (int threadCount in threadCounts)
+                {
+                    Shard[] shards = new Shard[shardCount];
+                    for (int i = 0; i < shardCount; i++)
+                    {
+                        List<Level> levels = new List<Level>();
+                        levels.Add(new Level(128, 64, new FailTable(HistoryType.ALL, findtime, 10, 1.0), null));
+                        levels.Add(new Level(120, 48, new FailTable(HistoryType.ALL, findtime, 10, 1.0), null));
+                        List<Treshold> tresholds = new List<Treshold>();
+                        tresholds.Add(new Treshold("benchmark", TresholdFunction.SIMPLE, 10, 0, 600, null));
+                        shards[i] = new Shard(levels, tresholds, null, null);
+                    }
+
+                    long now = DateTime.Now.Ticks;
+                    System.Threading.Thread[] threads = new System.Threading.Thread[threadCount];
+                    for (int t = 0; t < threadCount; t++)
+                    {
+                        int seed = t;
+                        threads[t] = new System.Threading.Thread(() =>
+                        {
+                            Random rnd = new Random(seed);
+                            byte[] bytes = new byte[16];
+                            bytes[10] = 0xff;
+                            bytes[11] = 0xff;
+
+                            for (int i = 0; i < events / threadCount; i++)
+                            {
+                                // failed logins from many addresses
+                                int a = rnd.Next(1 << 22);
+                                bytes[12] = 10;
+                                bytes[13] = (byte)(a >> 14);
+                                bytes[14] = (byte)(a >> 6);
+                                bytes[15] = (byte)a;
+
+                                ulong hi, lo;
+                                FailTable.Key(new IPAddress(bytes), out hi, out lo);
+                                Shard shard = shards[ShardIndex(hi, lo, 120, 48, shardCount)];
+                                Failure failure = new Failure(null, shard, hi, lo, now, 2, 1);
+                                lock (shard.Lock)
+                                {
+                                    shard.Update(failure, now);
+                                }
+                            }
+                        });
+                    }
+
+                    Stopwatch sw = Stopwatch.StartNew();
+                    foreach (System.Threading.Thread thread in threads)
+                    {
+                        thread.Start();
+                    }
+                    foreach (System.Threading.Thread thread in threads)
+                    {
+                        thread.Join();
+                    }
+                    long updateTime = Math.Max(1, sw.ElapsedMilliseconds);
+
+                    Console.WriteLine("  {0,-6} {1,-7} {2,8} {3,12:F0}", shardCount, threadCount,
+                        updateTime, 1000.0 * events / updateTime);
                 }
-                output.WriteLine();
             }
+        }
+
+
+        // Time to save and load history of many addresses: snapshot copy
+        // (time with shard lock held), state file write and full read
+        // (start without journal) compared with journal append and replay
+        // of one event per address (start after crash)
+        public static void BenchmarkState(int addresses)
+        {
+            long findtime = 600 * TimeSpan.TicksPerSecond;
+            string tmpFilename = Path.Combine(Path.GetTempPath(), "F2BBenchmarkState." + Process.GetCurrentProcess().Id);
+            HistoryType[] types = { HistoryType.ALL, HistoryType.FIXED };
 
-            lock (thisLock)
+            Console.WriteLine("{0} addresses: history, snapshot (locked) [ms], state write [ms], state read [ms], journal write [ms], journal replay [ms]", addresses);
+            foreach (HistoryType type in types)
             {
-                foreach (var item in data)
+                Level level = new Level(128, 64, new FailTable(type, findtime, 10, 1.0), null);
+                FailJournal journal = new FailJournal(tmpFilename + ".journal");
+                journal.Truncate();
+                Stopwatch journalWrite = new Stopwatch();
+                long now = DateTime.Now.Ticks;
+
+                for (int i = 0; i < addresses; i++)
                 {
-                    IPAddress addr = item.Key;
-                    IFail fail = item.Value;
+                    // IPv4 addresses 10.x.x.x mapped to IPv6
+                    ulong lo = 0xffff0a000000UL + (ulong)i;
+                    level.Add(0, lo, now, now);
+                    journal.Append(0, lo, now, now);
+                    if (journal.Pending == 65536 || i == addresses - 1)
+                    {
+                        journalWrite.Start();
+                        journal.Write(journal.Swap());
+                        journalWrite.Stop();
+                    }
+                }
+
+                Stopwatch sw = Stopwatch.StartNew();
+                Level copy = level.Snapshot();
+                double snapshotTime = sw.Elapsed.TotalMilliseconds;
 
-                    output.WriteLine("status address " + addr);
-                    fail.Debug(output);
+                sw.Restart();
+                using (Stream stream = new FileStream(tmpFilename, FileMode.Create, FileAccess.Write, FileShare.None, 1 << 20))
+                using (BinaryWriter writer = new BinaryWriter(stream))
+                {
+                    writer.Write(copy.Data.Count);
+                    copy.Data.Save(writer);
+                }
+                double writeTime = sw.Elapsed.TotalMilliseconds;
+
+                sw.Restart();
+                Level loaded = new Level(128, 64, new FailTable(type, findtime, 10, 1.0), null);
+                using (Stream stream = new FileStream(tmpFilename, FileMode.Open, FileAccess.Read, FileShare.Read, 1 << 20))
+                using (BinaryReader reader = new BinaryReader(stream))
+                {
+                    loaded.Data.Load(reader, reader.ReadInt32());
+                }
+                double readTime = sw.Elapsed.TotalMilliseconds;
+
+                sw.Restart();
+                Level replayed = new Level(128, 64, new FailTable(type, findtime, 10, 1.0), null);
+                new FailJournal(tmpFilename + ".journal").Replay(block =>
+                {
+                    for (int i = 0; i < block.count; i++)
+                    {
+                        replayed.Add(block.hi[i], block.lo[i], block.timestamp[i], block.now[i]);
+                    }
+                });
+                double replayTime = sw.Elapsed.TotalMilliseconds;
+
+                if (loaded.Data.Count != addresses || replayed.Data.Count != addresses)
+                {
+                    Console.WriteLine("  {0,-6} loaded {1}, replayed {2} addresses", type, loaded.Data.Count, replayed.Data.Count);
                 }
+                Console.WriteLine("  {0,-6} {1,8:F1} {2,8:F1} {3,8:F1} {4,8:F1} {5,8:F1}", type, snapshotTime,
+                    writeTime, readTime, journalWrite.Elapsed.TotalMilliseconds, replayTime);
+
+                File.Delete(tmpFilename);
+                journal.Truncate();
             }
         }
 #endif
@@ -1,6 +1,6 @@
-﻿using NetFwTypeLib; // Add reference %SystemRoot%\System32\FirewallAPI.dll
-using System;
+﻿using System;
 using System.Collections.Generic;
+using System.Diagnostics;
 using System.IO;
 using System.Net;
 using System.Timers;
@@ -13,8 +13,7 @@ namespace F2B.processors
         private static volatile FwManager instance;
         private static object syncRoot = new Object();
         // firewall
-        private static Type typeFWPolicy2 = Type.GetTypeFromCLSID(new Guid("{E2B3C97F-6AE1-41AC-817A-F6F92166D7DD}"));
-        private static Type typeFWRule = Type.GetTypeFromCLSID(new Guid("{2C5BC43E-3369-4C33-AB0C-BE9469677AF4}"));
+        private IFwRuleStore store = new ComFwRuleStore();
 
         System.Timers.Timer tCleanupExpired = null;
         private object dataLock = new Object();
@@ -27,6 +26,16 @@ namespace F2B.processors
         IDictionary<byte[], long> expire; // ruleHash -> expiration
         SortedDictionary<long, string> cleanup; // expiration -> name
 
+        // fcnt is authoritative inventory of F2B rules updated with
+        // each add/remove, full enumeration of firewall rules (slow
+        // with large GPO rule sets) is done only by Refresh when number
+        // of all firewall rules doesn't match expected value
+        int fwCount = -1; // expected number of all firewall rules
+        int fwPending = 0; // removals not yet reflected in fwCount
+        long resyncCount = 0;
+        long resyncTime = 0; // duration of last resync (ms)
+        int resyncRules = 0; // F2B rules found by last resync
+
         private FwManager()
         {
             tCleanupExpired = new System.Timers.Timer(10000);
@@ -113,9 +122,8 @@ namespace F2B.processors
         private IDictionary<string, int> List()
         {
             IDictionary<string, int> ret = new Dictionary<string, int>();
-            INetFwPolicy2 fwPolicy2 = (INetFwPolicy2)Activator.CreateInstance(typeFWPolicy2);
 
-            foreach (INetFwRule rule in fwPolicy2.Rules)
+            foreach (FwRule rule in store.List())
             {
                 if (rule.Name.IndexOf("F2B B64 ") < 0)
                     continue;
@@ -153,13 +161,18 @@ namespace F2B.processors
                 }
             }
 
-            INetFwPolicy2 fwPolicy2 = (INetFwPolicy2)Activator.CreateInstance(typeFWPolicy2);
+            lock (dataLock)
+            {
+                fwPending++;
+            }
 
+            int removed = 0;
             for (int i = 0; i < filterCnt; i++)
             {
                 try
                 {
-                    fwPolicy2.Rules.Remove(filterName);
+                    store.Remove(filterName);
+                    removed++;
 
                     if (fwName == null)
                     {
@@ -192,6 +205,63 @@ namespace F2B.processors
                     break;
                 }
             }
+
+            lock (dataLock)
+            {
+                int cnt;
+                if (fcnt.TryGetValue(filterName, out cnt))
+                {
+                    if (cnt > removed)
+                        fcnt[filterName] = cnt - removed;
+                    else
+                        fcnt.Remove(filterName);
+                }
+                if (fwCount >= 0)
+                {
+                    fwCount -= removed;
+                }
+                fwPending--;
+            }
+        }
+
+
+        // Cheap check that firewall rules were not modified by someone
+        // else, resync inventory with full enumeration of firewall rules
+        // when number of rules doesn't match
+        public void Verify()
+        {
+            lock (dataLock)
+            {
+                // both counts are taken under dataLock, so rules added
+                // (always under dataLock) can't change one of them
+                int count;
+                try
+                {
+                    count = store.Count();
+                }
+                catch (Exception ex)
+                {
+                    Log.Warn("Verify: Unable to get number of firewall rules: " + ex.Message);
+                    return;
+                }
+
+                if (count == fwCount)
+                {
+                    return;
+                }
+
+                if (fwPending > 0)
+                {
+                    // removal outside dataLock already changed firewall
+                    // but not yet fwCount, check again next time
+                    Log.Info("Verify: Number of firewall rules changed (expected " + fwCount + ", found " + count + ") while removing " + fwPending + " F2B rules, skipping resync");
+                    return;
+                }
+
+                Log.Info("Verify: Number of firewall rules changed (expected " + fwCount + ", found " + count + "), resync F2B rules");
+            }
+
+            Refresh();
         }
 
 
@@ -207,18 +277,29 @@ namespace F2B.processors
 
                 long currtime = DateTime.UtcNow.Ticks;
 
+                Stopwatch sw = Stopwatch.StartNew();
                 try
                 {
+                    fwCount = store.Count();
                     fcnt = List();
                 }
                 catch (Exception ex)
                 {
                     Log.Error("Refresh: Unable to list F2B firewall filters: " + ex.Message);
+                    fcnt = new Dictionary<string, int>();
+                    fwCount = -1;
                     return;
                 }
+                sw.Stop();
+
+                resyncCount++;
+                resyncTime = sw.ElapsedMilliseconds;
+                resyncRules = fcnt.Count;
+                Log.Info("Refresh: Enumeration of firewall rules found " + fcnt.Count + " F2B rules (" + fwCount + " rules, " + resyncTime + " ms)");
 
                 // get current F2B firewall rules from WFP configuration
-                foreach (var item in fcnt)
+                // (Remove modifies fcnt inventory)
+                foreach (var item in new List<KeyValuePair<string, int>>(fcnt))
                 {
                     string filterName = item.Key;
                     int filterCnt = item.Value;
@@ -332,6 +413,8 @@ namespace F2B.processors
 
             Log.Info("CleanupExpired: Started");
 
+            Verify();
+
             lock (dataLock)
             {
                 sizeBefore = data.Count;
@@ -403,26 +486,24 @@ namespace F2B.processors
             {
             }
 
-            INetFwPolicy2 fwPolicy2 = (INetFwPolicy2)Activator.CreateInstance(typeFWPolicy2);
-            INetFwRule newRule = (INetFwRule)Activator.CreateInstance(typeFWRule);
-
+            FwRule newRule = new FwRule();
             newRule.Name = name;
             newRule.Description = "Fail2ban " + (permit ? "allow" : "block") + " client address " + address + " till " + expstr;
             newRule.RemoteAddresses = address;
-            newRule.Direction = NET_FW_RULE_DIRECTION_.NET_FW_RULE_DIR_IN;
-            newRule.Enabled = true;
-            newRule.Grouping = "@firewallapi.dll,-23255";
-            newRule.Profiles = fwPolicy2.CurrentProfileTypes;
-            if (permit)
-            {
-                newRule.Action = NET_FW_ACTION_.NET_FW_ACTION_ALLOW;
-            }
-            else
+            newRule.Permit = permit;
+
+            store.Add(newRule);
+
+            lock (dataLock)
             {
-                newRule.Action = NET_FW_ACTION_.NET_FW_ACTION_BLOCK;
+                int cnt;
+                fcnt.TryGetValue(name, out cnt);
+                fcnt[name] = cnt + 1;
+                if (fwCount >= 0)
+                {
+                    fwCount++;
+                }
             }
-
-            fwPolicy2.Rules.Add(newRule);
         }
 
 
@@ -539,7 +620,6 @@ namespace F2B.processors
 
                 if (filterName != null)
                 {
-                    fcnt[filterName] = 1; // ???
                     data[filterName] = hash;
                     expire[hash] = expiration;
                     cleanup[expiration] = filterName;
@@ -590,14 +670,14 @@ namespace F2B.processors
                 }
             }
 
-            output.WriteLine("  FwPolicy:");
-            INetFwPolicy2 fwPolicy2 = (INetFwPolicy2)Activator.CreateInstance(typeFWPolicy2);
-            foreach (INetFwRule rule in fwPolicy2.Rules)
+            lock (dataLock)
             {
-                if (rule.Name.IndexOf("F2B B64 ") < 0)
-                    continue;
-
-                output.WriteLine("    {0}", rule.Description);
+                output.WriteLine("  inventory: {0} F2B rules, {1} firewall rules expected", fcnt.Count, fwCount);
+                output.WriteLine("  resync: {0} times, last {1} ms for {2} F2B rules", resyncCount, resyncTime, resyncRules);
+                foreach (var item in fcnt)
+                {
+                    output.WriteLine("  fcnt: {0} {1}", item.Key, item.Value);
+                }
             }
         }
 #endif
@@ -611,6 +691,10 @@ namespace F2B.processors
         private int cleanup;
         private int max_filter_rules;
         private bool permit;
+        private bool packed;
+        private int packed_granularity;
+        private int packed_rule_size;
+        private int packed_flush;
         #endregion
 
         #region Constructors
@@ -637,24 +721,100 @@ namespace F2B.processors
                 max_filter_rules = int.Parse(config.Options["max_filter_rules"].Value);
             }
 
-            if (F2B.processors.FwManager.Instance.Interval > 1000 * cleanup)
-            {
-                F2B.processors.FwManager.Instance.Interval = 1000 * cleanup;
-            }
-            F2B.processors.FwManager.Instance.MaxSize = max_filter_rules;
-
             permit = false;
             if (config.Options["permit"] != null)
             {
                 permit = bool.Parse(config.Options["permit"].Value);
             }
+
+            // packed mode must be used consistently by all Fail2banFw
+            // processors, because it migrates separate F2B rules
+            packed = false;
+            if (config.Options["packed"] != null)
+            {
+                packed = bool.Parse(config.Options["packed"].Value);
+            }
+
+            packed_granularity = 300;
+            if (config.Options["packed_granularity"] != null)
+            {
+                int tmp = int.Parse(config.Options["packed_granularity"].Value);
+                if (tmp > 0)
+                {
+                    packed_granularity = tmp;
+                }
+                else
+                {
+                    Log.Error("Ignoring invalid packed granularity " + tmp);
+                }
+            }
+
+            packed_rule_size = 1000;
+            if (config.Options["packed_rule_size"] != null)
+            {
+                int tmp = int.Parse(config.Options["packed_rule_size"].Value);
+                if (tmp > 0)
+                {
+                    packed_rule_size = tmp;
+                }
+                else
+                {
+                    Log.Error("Ignoring invalid packed rule size " + tmp);
+                }
+            }
+
+            packed_flush = 5;
+            if (config.Options["packed_flush"] != null)
+            {
+                int tmp = int.Parse(config.Options["packed_flush"].Value);
+                if (tmp > 0)
+                {
+                    packed_flush = tmp;
+                }
+                else
+                {
+                    Log.Error("Ignoring invalid packed flush interval " + tmp);
+                }
+            }
+
+            if (packed)
+            {
+                FwPackedManager.Instance.Granularity = packed_granularity * TimeSpan.TicksPerSecond;
+                FwPackedManager.Instance.RuleSize = packed_rule_size;
+                FwPackedManager.Instance.Interval = 1000 * packed_flush;
+                FwPackedManager.Instance.MaxSize = max_filter_rules;
+            }
+            else
+            {
+                if (F2B.processors.FwManager.Instance.Interval > 1000 * cleanup)
+                {
+                    F2B.processors.FwManager.Instance.Interval = 1000 * cleanup;
+                }
+                F2B.processors.FwManager.Instance.MaxSize = max_filter_rules;
+            }
         }
         #endregion
 
         #region Override
+        public override void Stop()
+        {
+            // pending changes of packed rules must be written before shutdown
+            if (packed)
+            {
+                FwPackedManager.Instance.Flush();
+            }
+        }
+
         protected override void ExecuteFail2banAction(EventEntry evtlog, IPAddress addr, int prefix, long expiration)
         {
-            F2B.processors.FwManager.Instance.Add(expiration, addr, prefix, permit);
+            if (packed)
+            {
+                FwPackedManager.Instance.Add(expiration, addr, prefix, permit);
+            }
+            else
+            {
+                F2B.processors.FwManager.Instance.Add(expiration, addr, prefix, permit);
+            }
         }
 
 
@@ -663,9 +823,22 @@ namespace F2B.processors
         {
             output.WriteLine("config cleanup: " + cleanup);
             output.WriteLine("config max_filter_rules: " + max_filter_rules);
+            output.WriteLine("config permit: " + permit);
+            output.WriteLine("config packed: " + packed);
+            output.WriteLine("config packed_granularity: " + packed_granularity);
+            output.WriteLine("config packed_rule_size: " + packed_rule_size);
+            output.WriteLine("config packed_flush: " + packed_flush);
             base.Debug(output);
-            output.WriteLine("FwManager:");
-            F2B.processors.FwManager.Instance.Debug(output);
+            if (packed)
+            {
+                output.WriteLine("FwPackedManager:");
+                FwPackedManager.Instance.Debug(output);
+            }
+            else
+            {
+                output.WriteLine("FwManager:");
+                F2B.processors.FwManager.Instance.Debug(output);
+            }
         }
 #endif
         #endregion
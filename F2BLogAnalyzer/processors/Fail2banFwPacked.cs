@@ -0,0 +1,748 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Net;
+using System.Net.Sockets;
+using System.Text;
+using System.Timers;
+
+namespace F2B.processors
+{
+    // Packed mode keeps banned addresses in small set of Windows firewall
+    // rules. Addresses are grouped by expiration (rounded up to
+    // granularity) and each group uses one or more rules with up to
+    // RuleSize addresses in RemoteAddresses. Changes are recorded only in
+    // memory and written once per flush interval, so firewall COM API
+    // is called once per modified rule and not once per address.
+    public sealed class FwPackedManager
+    {
+        public const string PackedPrefix = "F2B P64 ";
+
+        private class PackedRule
+        {
+            public string name;
+            public long expiration; // expiration of all members
+            public bool permit;
+            public bool installed = false;
+            public HashSet<string> members = new HashSet<string>();
+        }
+
+        // singleton
+        private static volatile FwPackedManager instance;
+        private static object syncRoot = new Object();
+
+        private IFwRuleStore store;
+        System.Timers.Timer tFlush = null;
+        private object dataLock = new Object();
+        private object flushLock = new Object();
+
+        IDictionary<string, PackedRule> members = new Dictionary<string, PackedRule>(); // address/prefix -> rule
+        SortedDictionary<long, List<PackedRule>> rules = new SortedDictionary<long, List<PackedRule>>(); // expiration -> rules
+        HashSet<PackedRule> dirty = new HashSet<PackedRule>(); // rules modified since last flush
+        IDictionary<string, List<PackedRule>> migrated = new Dictionary<string, List<PackedRule>>(); // separate rule name -> packed rules with its addresses
+        long ruleSeq = 0;
+
+
+        // Rule store can be replaced (e.g. by MemoryFwRuleStore) to
+        // use packing logic without Windows firewall
+        public FwPackedManager(IFwRuleStore store)
+        {
+            this.store = store;
+
+            tFlush = new System.Timers.Timer(5000);
+            tFlush.Elapsed += (s, e) => Flush();
+
+            Refresh();
+        }
+
+
+        ~FwPackedManager()
+        {
+            if (tFlush != null)
+            {
+                if (tFlush.Enabled)
+                {
+                    tFlush.Enabled = false;
+                }
+                tFlush.Dispose();
+            }
+        }
+
+
+        public static FwPackedManager Instance
+        {
+            get
+            {
+                if (instance == null)
+                {
+                    lock (syncRoot)
+                    {
+                        if (instance == null)
+                            instance = new FwPackedManager(new ComFwRuleStore());
+                    }
+                }
+
+                return instance;
+            }
+        }
+
+
+        // Addresses with expiration within same interval (in ticks)
+        // share firewall rule
+        public long Granularity { get; set; } = 300 * TimeSpan.TicksPerSecond;
+
+        // Maximum number of addresses in one firewall rule
+        public int RuleSize { get; set; } = 1000;
+
+        // Maximum number of banned addresses (0 .. no limit)
+        public int MaxSize { get; set; } = 0;
+
+        // Interval for writing modified rules in firewall (ms)
+        public double Interval
+        {
+            get { return tFlush.Interval; }
+            set
+            {
+                if (value > 0)
+                {
+                    tFlush.Interval = value;
+                }
+            }
+        }
+
+        public int Count
+        {
+            get
+            {
+                lock (dataLock)
+                {
+                    return members.Count;
+                }
+            }
+        }
+
+
+        private static string Key(IPAddress addr, int prefix)
+        {
+            return addr + "/" + prefix;
+        }
+
+
+        // Parse RemoteAddresses of existing rule (Windows firewall
+        // returns IPv4 prefix as network mask)
+        private static IList<string> ParseAddresses(string remoteAddresses)
+        {
+            List<string> ret = new List<string>();
+
+            if (string.IsNullOrEmpty(remoteAddresses))
+            {
+                return ret;
+            }
+
+            foreach (string item in remoteAddresses.Split(','))
+            {
+                string[] parts = item.Trim().Split('/');
+                IPAddress addr;
+                if (!IPAddress.TryParse(parts[0], out addr))
+                {
+                    Log.Info("FwPacked: Ignoring unsupported remote address " + item);
+                    continue;
+                }
+
+                int prefix = (addr.AddressFamily == AddressFamily.InterNetworkV6 ? 128 : 32);
+                if (parts.Length > 1)
+                {
+                    IPAddress mask;
+                    if (!int.TryParse(parts[1], out prefix))
+                    {
+                        if (!IPAddress.TryParse(parts[1], out mask))
+                        {
+                            Log.Info("FwPacked: Ignoring unsupported remote address " + item);
+                            continue;
+                        }
+
+                        prefix = 0;
+                        foreach (byte b in mask.GetAddressBytes())
+                        {
+                            for (int i = 7; i >= 0 && (b & (1 << i)) != 0; i--)
+                            {
+                                prefix++;
+                            }
+                        }
+                    }
+                }
+
+                ret.Add(Key(addr, prefix));
+            }
+
+            return ret;
+        }
+
+
+        private string RuleName(long expiration, bool permit)
+        {
+            // rule names must be unique also with rules created before restart
+            string key = expiration + "/" + permit + "/" + DateTime.UtcNow.Ticks + "/" + (ruleSeq++);
+            byte[] hash = FwData.ComputeHash(Encoding.ASCII.GetBytes(key));
+            return PackedPrefix + Convert.ToBase64String(FwData.EncodeMetadata(expiration, hash));
+        }
+
+
+        private static Tuple<long, byte[]> DecodeName(string name)
+        {
+            try
+            {
+                if (name.StartsWith(PackedPrefix))
+                {
+                    return FwData.DecodeName("F2B B64 " + name.Substring(PackedPrefix.Length));
+                }
+
+                int pos = name.IndexOf("F2B B64 ");
+                if (pos >= 0)
+                {
+                    return FwData.DecodeName(name.Substring(pos));
+                }
+            }
+            catch (ArgumentException)
+            {
+            }
+
+            return null;
+        }
+
+
+        // Rule for new member (must be called with dataLock)
+        private PackedRule RuleFor(long expiration, bool permit)
+        {
+            List<PackedRule> expirationRules;
+            if (!rules.TryGetValue(expiration, out expirationRules))
+            {
+                expirationRules = new List<PackedRule>();
+                rules[expiration] = expirationRules;
+            }
+
+            PackedRule rule = expirationRules.Find(r => r.permit == permit && r.members.Count < RuleSize);
+            if (rule == null)
+            {
+                rule = new PackedRule();
+                rule.name = RuleName(expiration, permit);
+                rule.expiration = expiration;
+                rule.permit = permit;
+                expirationRules.Add(rule);
+            }
+
+            return rule;
+        }
+
+
+        private void Attach(string address, PackedRule rule)
+        {
+            rule.members.Add(address);
+            members[address] = rule;
+            dirty.Add(rule);
+        }
+
+
+        private void Detach(string address)
+        {
+            PackedRule rule;
+            if (members.TryGetValue(address, out rule))
+            {
+                rule.members.Remove(address);
+                members.Remove(address);
+                dirty.Add(rule);
+            }
+        }
+
+
+        // Load packed rules from firewall, separate rules created by
+        // FwManager are migrated in packed rules
+        public void Refresh()
+        {
+            Log.Info("FwPacked: Refresh list of F2B rules using Firewall COM object");
+
+            IList<FwRule> fwRules;
+            try
+            {
+                fwRules = store.List();
+            }
+            catch (Exception ex)
+            {
+                Log.Error("FwPacked: Unable to list F2B firewall rules: " + ex.Message);
+                return;
+            }
+
+            List<string> remove = new List<string>();
+
+            lock (dataLock)
+            {
+                long currtime = DateTime.UtcNow.Ticks;
+
+                members.Clear();
+                rules.Clear();
+                dirty.Clear();
+                migrated.Clear();
+
+                foreach (FwRule fwRule in fwRules)
+                {
+                    Tuple<long, byte[]> fwName = DecodeName(fwRule.Name);
+                    if (fwName == null)
+                    {
+                        Log.Info("FwPacked: Unable to parse F2B data from rule name: " + fwRule.Name);
+                        continue;
+                    }
+
+                    long expiration = fwName.Item1;
+                    bool packed = fwRule.Name.StartsWith(PackedPrefix);
+
+                    if (expiration <= currtime)
+                    {
+                        Log.Info("FwPacked: Remove expired rule \"" + fwRule.Name + "\"");
+                        remove.Add(fwRule.Name);
+                        continue;
+                    }
+
+                    PackedRule rule = null;
+                    List<PackedRule> targets = null;
+                    if (packed)
+                    {
+                        rule = new PackedRule();
+                        rule.name = fwRule.Name;
+                        rule.expiration = expiration;
+                        rule.permit = fwRule.Permit;
+                        rule.installed = true;
+
+                        List<PackedRule> expirationRules;
+                        if (!rules.TryGetValue(expiration, out expirationRules))
+                        {
+                            expirationRules = new List<PackedRule>();
+                            rules[expiration] = expirationRules;
+                        }
+                        expirationRules.Add(rule);
+                    }
+                    else
+                    {
+                        Log.Info("FwPacked: Migrate separate rule \"" + fwRule.Name + "\" in packed rule");
+                        targets = new List<PackedRule>();
+                        migrated[fwRule.Name] = targets;
+                    }
+
+                    foreach (string address in ParseAddresses(fwRule.RemoteAddresses))
+                    {
+                        PackedRule ruleOld;
+                        if (members.TryGetValue(address, out ruleOld))
+                        {
+                            if (ruleOld.expiration >= expiration)
+                            {
+                                // duplicate address is removed from this rule
+                                if (rule != null)
+                                    dirty.Add(rule);
+                                if (targets != null)
+                                    targets.Add(ruleOld);
+                                continue;
+                            }
+                            Detach(address);
+                        }
+
+                        if (rule != null)
+                        {
+                            rule.members.Add(address);
+                            members[address] = rule;
+                        }
+                        else
+                        {
+                            PackedRule target = RuleFor(Bucket(expiration), fwRule.Permit);
+                            Attach(address, target);
+                            targets.Add(target);
+                        }
+                    }
+
+                    if (rule != null && rule.members.Count == 0)
+                    {
+                        dirty.Add(rule);
+                    }
+                }
+
+                Log.Info("FwPacked: Found " + fwRules.Count + " F2B rules with " + members.Count + " addresses");
+            }
+
+            foreach (string name in remove)
+            {
+                try
+                {
+                    store.Remove(name);
+                }
+                catch (Exception ex)
+                {
+                    Log.Warn("FwPacked: Unable to remove rule \"" + name + "\": " + ex.Message);
+                }
+            }
+
+            // separate rules are removed by Flush only after packed rules
+            // with their addresses are installed
+            Flush();
+
+            lock (dataLock)
+            {
+                if (migrated.Count > 0 && !tFlush.Enabled)
+                {
+                    Log.Info("FwPacked: Enabling flush timer to finish migration of " + migrated.Count + " rules");
+                    tFlush.Enabled = true;
+                }
+            }
+        }
+
+
+        // Separate rules with all addresses in installed packed rules
+        // (must be called with dataLock)
+        private IList<string> MigratedRules()
+        {
+            List<string> ret = new List<string>();
+
+            foreach (var item in migrated)
+            {
+                bool installed = true;
+                foreach (PackedRule rule in item.Value)
+                {
+                    // expired rule no longer needs its addresses
+                    if (dirty.Contains(rule) || (!rule.installed && rule.members.Count > 0))
+                    {
+                        installed = false;
+                        break;
+                    }
+                }
+
+                if (installed)
+                {
+                    ret.Add(item.Key);
+                }
+            }
+
+            return ret;
+        }
+
+
+        private long Bucket(long expiration)
+        {
+            return (expiration / Granularity + (expiration % Granularity > 0 ? 1 : 0)) * Granularity;
+        }
+
+
+        public void Add(long expiration, IPAddress addr, int prefix, bool permit = false)
+        {
+            long currtime = DateTime.UtcNow.Ticks;
+
+            if (currtime >= expiration)
+            {
+                Log.Info("FwPacked: Skipping expired rule (expired on " + expiration + ")");
+                return;
+            }
+
+            // mapped prefix shorter than 96 stays IPv6 (see FwData.Add)
+            if (addr.IsIPv4MappedToIPv6 && prefix >= 96)
+            {
+                // workaround for buggy MapToIPv4 implementation
+                addr = Fixes.MapToIPv4(addr);
+                prefix -= 96;
+            }
+
+            string address = Key(addr, prefix);
+            long bucket = Bucket(expiration);
+
+            lock (dataLock)
+            {
+                PackedRule ruleOld;
+                if (members.TryGetValue(address, out ruleOld))
+                {
+                    if (ruleOld.permit == permit && bucket <= ruleOld.expiration)
+                    {
+                        Log.Info("FwPacked: Skipping request for " + address + ", already in rule with expiration " + ruleOld.expiration);
+                        return;
+                    }
+
+                    Detach(address);
+                }
+                else if (MaxSize != 0 && members.Count >= MaxSize)
+                {
+                    Log.Warn("FwPacked: Reached limit for number of banned addresses, skipping new additions");
+                    return;
+                }
+
+                PackedRule rule = RuleFor(bucket, permit);
+                Attach(address, rule);
+                Log.Info("FwPacked: Add " + address + " in rule \"" + rule.name + "\" (" + rule.members.Count + " addresses, expiration " + bucket + ")");
+
+                if (!tFlush.Enabled)
+                {
+                    Log.Info("FwPacked: Enabling flush timer (interval " + tFlush.Interval + " ms)");
+                    tFlush.Enabled = true;
+                }
+            }
+        }
+
+
+        // Remove expired rules and write all modified rules in firewall
+        public void Flush()
+        {
+            lock (flushLock)
+            {
+                List<Tuple<PackedRule, FwRule>> changes = new List<Tuple<PackedRule, FwRule>>();
+                int expired = 0;
+
+                lock (dataLock)
+                {
+                    long currtime = DateTime.UtcNow.Ticks;
+
+                    List<long> remove = new List<long>();
+                    foreach (var item in rules)
+                    {
+                        // sorted by expiration
+                        if (item.Key > currtime)
+                            break;
+
+                        remove.Add(item.Key);
+                        foreach (PackedRule rule in item.Value)
+                        {
+                            foreach (string address in rule.members)
+                            {
+                                members.Remove(address);
+                            }
+                            expired += rule.members.Count;
+                            rule.members.Clear();
+                            dirty.Add(rule);
+                        }
+                    }
+                    foreach (long expiration in remove)
+                    {
+                        rules.Remove(expiration);
+                    }
+
+                    foreach (PackedRule rule in dirty)
+                    {
+                        FwRule fwRule = null;
+                        if (rule.members.Count > 0)
+                        {
+                            fwRule = new FwRule();
+                            fwRule.Name = rule.name;
+                            fwRule.Description = Description(rule);
+                            fwRule.RemoteAddresses = string.Join(",", rule.members);
+                            fwRule.Permit = rule.permit;
+                        }
+                        changes.Add(new Tuple<PackedRule, FwRule>(rule, fwRule));
+                    }
+                    dirty.Clear();
+                }
+
+                // firewall is modified without dataLock, rules changed
+                // in the meantime are marked dirty again
+                int fail = 0;
+                foreach (var item in changes)
+                {
+                    PackedRule rule = item.Item1;
+                    FwRule fwRule = item.Item2;
+
+                    try
+                    {
+                        if (fwRule != null)
+                        {
+                            if (rule.installed)
+                            {
+                                store.Update(fwRule);
+                            }
+                            else
+                            {
+                                store.Add(fwRule);
+                                rule.installed = true;
+                            }
+                        }
+                        else if (rule.installed)
+                        {
+                            store.Remove(rule.name);
+                            rule.installed = false;
+                        }
+                    }
+                    catch (Exception ex)
+                    {
+                        Log.Warn("FwPacked: Unable to write rule \"" + rule.name + "\": " + ex.Message);
+                        fail++;
+
+                        lock (dataLock)
+                        {
+                            dirty.Add(rule);
+                        }
+                    }
+                }
+
+                // original separate rules of migrated addresses
+                IList<string> confirmed;
+                lock (dataLock)
+                {
+                    confirmed = MigratedRules();
+                }
+
+                foreach (string name in confirmed)
+                {
+                    try
+                    {
+                        store.Remove(name);
+                        Log.Info("FwPacked: Removed migrated rule \"" + name + "\"");
+                    }
+                    catch (Exception ex)
+                    {
+                        Log.Warn("FwPacked: Unable to remove migrated rule \"" + name + "\": " + ex.Message);
+                        fail++;
+                        continue;
+                    }
+
+                    lock (dataLock)
+                    {
+                        migrated.Remove(name);
+                    }
+                }
+
+                lock (dataLock)
+                {
+                    // forget empty rules that are no longer in firewall
+                    foreach (var item in changes)
+                    {
+                        PackedRule rule = item.Item1;
+                        List<PackedRule> expirationRules;
+                        if (rule.members.Count == 0 && !rule.installed && rules.TryGetValue(rule.expiration, out expirationRules))
+                        {
+                            expirationRules.Remove(rule);
+                            if (expirationRules.Count == 0)
+                            {
+                                rules.Remove(rule.expiration);
+                            }
+                        }
+                    }
+
+                    if (members.Count == 0 && dirty.Count == 0 && migrated.Count == 0 && tFlush.Enabled)
+                    {
+                        Log.Info("FwPacked: No banned addresses, disabling flush timer");
+                        tFlush.Enabled = false;
+                    }
+                }
+
+                if (changes.Count > 0)
+                {
+                    Log.Info("FwPacked: Flushed " + changes.Count + " modified rules, " + expired + " addresses expired"
+                        + (fail > 0 ? " (failed to write " + fail + " rules)" : ""));
+                }
+            }
+        }
+
+
+        private static string Description(PackedRule rule)
+        {
+            string expstr = Convert.ToString(rule.expiration);
+            try
+            {
+                DateTime tmpExp = new DateTime(rule.expiration, DateTimeKind.Utc);
+                expstr = tmpExp.ToLocalTime().ToString();
+            }
+            catch (Exception)
+            {
+            }
+
+            return "Fail2ban " + (rule.permit ? "allow" : "block") + " " + rule.members.Count + " client addresses till " + expstr;
+        }
+
+
+#if DEBUG
+        // Packing, reload and migration of separate rules verified with
+        // in-memory rule store (including failed installation)
+        public static bool SelfTest()
+        {
+            int failures = 0;
+            Action<bool, string> check = (condition, message) =>
+            {
+                if (!condition)
+                {
+                    Console.WriteLine("FAILED: " + message);
+                    failures++;
+                }
+            };
+
+            long expiration = DateTime.UtcNow.Ticks + 3600 * TimeSpan.TicksPerSecond;
+
+            // addresses with same expiration share rules with RuleSize members
+            MemoryFwRuleStore store = new MemoryFwRuleStore();
+            FwPackedManager packed = new FwPackedManager(store);
+            packed.RuleSize = 3;
+            for (int i = 1; i <= 7; i++)
+            {
+                packed.Add(expiration, IPAddress.Parse("192.0.2." + i), 32);
+            }
+            packed.Flush();
+            check(store.Count() == 3 && store.Added == 3, "packed rules for 7 addresses: " + store.Count() + " (added " + store.Added + ")");
+            check(packed.Count == 7, "packed addresses: " + packed.Count);
+
+            packed.Add(expiration, IPAddress.Parse("192.0.2.1"), 32);
+            packed.Flush();
+            check(store.Updated == 0, "duplicate address updated " + store.Updated + " rules");
+
+            // packed rules are loaded without modification after restart
+            FwPackedManager reloaded = new FwPackedManager(store);
+            check(reloaded.Count == 7, "reloaded addresses: " + reloaded.Count);
+            check(store.Added == 3 && store.Updated == 0 && store.Removed == 0, "reload modified rules (added " + store.Added + ", updated " + store.Updated + ", removed " + store.Removed + ")");
+
+            // separate rules are replaced by packed rule
+            store = new MemoryFwRuleStore();
+            for (int i = 1; i <= 2; i++)
+            {
+                store.Add(SeparateRule(expiration, "198.51.100." + i));
+            }
+            packed = new FwPackedManager(store);
+            IList<FwRule> fwRules = store.List();
+            check(fwRules.Count == 1 && fwRules[0].Name.StartsWith(PackedPrefix), "rules after migration: " + fwRules.Count);
+            check(packed.Count == 2, "migrated addresses: " + packed.Count);
+
+            // separate rule stays till its packed rule is installed
+            store = new MemoryFwRuleStore();
+            FwRule separate = SeparateRule(expiration, "203.0.113.1");
+            store.Add(separate);
+            store.FailAdd = 1;
+            packed = new FwPackedManager(store);
+            fwRules = store.List();
+            check(fwRules.Count == 1 && fwRules[0].Name == separate.Name, "separate rule removed without installed packed rule");
+
+            packed.Flush();
+            fwRules = store.List();
+            check(fwRules.Count == 1 && fwRules[0].Name.StartsWith(PackedPrefix), "separate rule not replaced after retry");
+
+            Console.WriteLine(failures == 0 ? "FwPacked selftest passed" : ("FwPacked selftest failed (" + failures + " checks)"));
+            return failures == 0;
+        }
+
+
+        private static FwRule SeparateRule(long expiration, string address)
+        {
+            FwData fwdata = new FwData(expiration, IPAddress.Parse(address), 32);
+
+            FwRule rule = new FwRule();
+            rule.Name = FwData.EncodeName(expiration, fwdata.Hash);
+            rule.Description = "F2B separate rule";
+            rule.RemoteAddresses = address + "/255.255.255.255";
+            return rule;
+        }
+
+
+        public void Debug(StreamWriter output)
+        {
+            lock (dataLock)
+            {
+                output.WriteLine("  packed: {0} addresses (granularity {1}, rule size {2}, dirty {3})", members.Count, Granularity, RuleSize, dirty.Count);
+                foreach (var item in rules)
+                {
+                    foreach (PackedRule rule in item.Value)
+                    {
+                        output.WriteLine("  rule: {0} {1} ({2} addresses, {3}{4})", item.Key, rule.name, rule.members.Count,
+                            rule.permit ? "permit" : "block", rule.installed ? "" : ", not installed");
+                    }
+                }
+            }
+        }
+#endif
+    }
+}
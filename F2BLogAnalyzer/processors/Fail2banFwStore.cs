@@ -0,0 +1,201 @@
+﻿using NetFwTypeLib; // Add reference %SystemRoot%\System32\FirewallAPI.dll
+using System;
+using System.Collections.Generic;
+
+namespace F2B.processors
+{
+    // Windows firewall rule as seen by F2B
+    public class FwRule
+    {
+        public string Name { get; set; }
+        public string Description { get; set; }
+        public string RemoteAddresses { get; set; }
+        public bool Permit { get; set; }
+    }
+
+
+    // Access to Windows firewall rules created by F2B (separate rules
+    // use "F2B B64 " and packed rules "F2B P64 " in rule name)
+    public interface IFwRuleStore
+    {
+        IList<FwRule> List();
+        // number of all firewall rules (cheap check for external changes)
+        int Count();
+        void Add(FwRule rule);
+        // change description and remote addresses of existing rule
+        void Update(FwRule rule);
+        // remove one rule with given name
+        void Remove(string name);
+    }
+
+
+    // Rules managed using Firewall COM object (each call takes tens of
+    // milliseconds and gets slower with number of rules)
+    public class ComFwRuleStore : IFwRuleStore
+    {
+        private static Type typeFWPolicy2 = Type.GetTypeFromCLSID(new Guid("{E2B3C97F-6AE1-41AC-817A-F6F92166D7DD}"));
+        private static Type typeFWRule = Type.GetTypeFromCLSID(new Guid("{2C5BC43E-3369-4C33-AB0C-BE9469677AF4}"));
+
+        public static bool IsF2BRule(string name)
+        {
+            return name != null && (name.IndexOf("F2B B64 ") >= 0 || name.StartsWith("F2B P64 "));
+        }
+
+        public IList<FwRule> List()
+        {
+            IList<FwRule> ret = new List<FwRule>();
+            INetFwPolicy2 fwPolicy2 = (INetFwPolicy2)Activator.CreateInstance(typeFWPolicy2);
+
+            foreach (INetFwRule rule in fwPolicy2.Rules)
+            {
+                if (!IsF2BRule(rule.Name))
+                    continue;
+
+                FwRule tmp = new FwRule();
+                tmp.Name = rule.Name;
+                tmp.Description = rule.Description;
+                tmp.RemoteAddresses = rule.RemoteAddresses;
+                tmp.Permit = (rule.Action == NET_FW_ACTION_.NET_FW_ACTION_ALLOW);
+                ret.Add(tmp);
+            }
+
+            return ret;
+        }
+
+        public int Count()
+        {
+            INetFwPolicy2 fwPolicy2 = (INetFwPolicy2)Activator.CreateInstance(typeFWPolicy2);
+            return fwPolicy2.Rules.Count;
+        }
+
+        public void Add(FwRule rule)
+        {
+            INetFwPolicy2 fwPolicy2 = (INetFwPolicy2)Activator.CreateInstance(typeFWPolicy2);
+            INetFwRule newRule = (INetFwRule)Activator.CreateInstance(typeFWRule);
+
+            newRule.Name = rule.Name;
+            newRule.Description = rule.Description;
+            newRule.RemoteAddresses = rule.RemoteAddresses;
+            newRule.Direction = NET_FW_RULE_DIRECTION_.NET_FW_RULE_DIR_IN;
+            newRule.Enabled = true;
+            newRule.Grouping = "@firewallapi.dll,-23255";
+            newRule.Profiles = fwPolicy2.CurrentProfileTypes;
+            if (rule.Permit)
+            {
+                newRule.Action = NET_FW_ACTION_.NET_FW_ACTION_ALLOW;
+            }
+            else
+            {
+                newRule.Action = NET_FW_ACTION_.NET_FW_ACTION_BLOCK;
+            }
+
+            fwPolicy2.Rules.Add(newRule);
+        }
+
+        public void Update(FwRule rule)
+        {
+            INetFwPolicy2 fwPolicy2 = (INetFwPolicy2)Activator.CreateInstance(typeFWPolicy2);
+            INetFwRule oldRule = fwPolicy2.Rules.Item(rule.Name);
+
+            oldRule.RemoteAddresses = rule.RemoteAddresses;
+            oldRule.Description = rule.Description;
+        }
+
+        public void Remove(string name)
+        {
+            INetFwPolicy2 fwPolicy2 = (INetFwPolicy2)Activator.CreateInstance(typeFWPolicy2);
+            fwPolicy2.Rules.Remove(name);
+        }
+    }
+
+
+    // In-memory rules (used to verify rule packing without touching
+    // Windows firewall), counts each operation
+    public class MemoryFwRuleStore : IFwRuleStore
+    {
+        private object sync = new Object();
+        private List<FwRule> rules = new List<FwRule>();
+
+        public int Added { get; private set; } = 0;
+        public int Updated { get; private set; } = 0;
+        public int Removed { get; private set; } = 0;
+
+        // Number of following Add calls that fail (simulates firewall
+        // that refuses new rules)
+        public int FailAdd { get; set; } = 0;
+
+        public IList<FwRule> List()
+        {
+            lock (sync)
+            {
+                IList<FwRule> ret = new List<FwRule>();
+                foreach (FwRule rule in rules)
+                {
+                    ret.Add(Copy(rule));
+                }
+                return ret;
+            }
+        }
+
+        public int Count()
+        {
+            lock (sync)
+            {
+                return rules.Count;
+            }
+        }
+
+        public void Add(FwRule rule)
+        {
+            lock (sync)
+            {
+                if (FailAdd > 0)
+                {
+                    FailAdd--;
+                    throw new InvalidOperationException("Unable to add rule " + rule.Name);
+                }
+                rules.Add(Copy(rule));
+                Added++;
+            }
+        }
+
+        public void Update(FwRule rule)
+        {
+            lock (sync)
+            {
+                FwRule tmp = rules.Find(r => r.Name == rule.Name);
+                if (tmp == null)
+                {
+                    throw new ArgumentException("Rule " + rule.Name + " doesn't exist");
+                }
+                tmp.Description = rule.Description;
+                tmp.RemoteAddresses = rule.RemoteAddresses;
+                Updated++;
+            }
+        }
+
+        public void Remove(string name)
+        {
+            lock (sync)
+            {
+                int idx = rules.FindIndex(r => r.Name == name);
+                if (idx < 0)
+                {
+                    throw new ArgumentException("Rule " + name + " doesn't exist");
+                }
+                rules.RemoveAt(idx);
+                Removed++;
+            }
+        }
+
+        private static FwRule Copy(FwRule rule)
+        {
+            FwRule ret = new FwRule();
+            ret.Name = rule.Name;
+            ret.Description = rule.Description;
+            ret.RemoteAddresses = rule.RemoteAddresses;
+            ret.Permit = rule.Permit;
+            return ret;
+        }
+    }
+}
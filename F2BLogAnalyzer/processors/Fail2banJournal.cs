@@ -0,0 +1,271 @@
+﻿#region Imports
+using System;
+using System.Collections.Concurrent;
+using System.IO;
+using System.Threading;
+#endregion
+
+namespace F2B.processors
+{
+    public partial class Fail2banProcessor
+    {
+        // Append-only journal of failed logins added since last state
+        // snapshot. Events are collected in memory (under processor lock)
+        // and periodically appended to the journal file in one block, so
+        // crash loses only events from last flush interval. Each event
+        // has sequence number (implicit, first + position in block) and
+        // snapshot stores sequence number of last event it contains, so
+        // events already included in snapshot are skipped by replay.
+        //
+        // Block format: first sequence number (long), number of events
+        // (int) and events (address hi, address lo, log timestamp and
+        // time when the event was processed; all ulong/long).
+        private class FailJournal
+        {
+            private const int BLOCK_HEADER = 8 + 4;
+            private const int RECORD_SIZE = 8 + 8 + 8 + 8;
+            private const int REPLAY_QUEUE = 4;
+
+            public class Block
+            {
+                public long first; // sequence number of first event
+                public int count;
+                public ulong[] hi;
+                public ulong[] lo;
+                public long[] timestamp;
+                public long[] now;
+
+                public Block(long first, int capacity)
+                {
+                    this.first = first;
+                    this.count = 0;
+                    this.hi = new ulong[capacity];
+                    this.lo = new ulong[capacity];
+                    this.timestamp = new long[capacity];
+                    this.now = new long[capacity];
+                }
+            }
+
+            private string filename;
+            private Block pending;
+            private long sequence; // last journaled event
+
+            public FailJournal(string filename)
+            {
+                this.filename = filename;
+                this.sequence = 0;
+                this.pending = new Block(1, 64);
+            }
+
+            public string Filename
+            {
+                get { return filename; }
+            }
+
+            // sequence number of last event
+            public long Sequence
+            {
+                get { return sequence; }
+            }
+
+            // continue after last event stored in state snapshot
+            public void Restore(long sequence)
+            {
+                this.sequence = sequence;
+                this.pending = new Block(sequence + 1, 64);
+            }
+
+            // number of events not yet written in journal file
+            public int Pending
+            {
+                get { return pending.count; }
+            }
+
+            // journal file size (bytes)
+            public long Length
+            {
+                get
+                {
+                    FileInfo fi = new FileInfo(filename);
+                    return fi.Exists ? fi.Length : 0;
+                }
+            }
+
+            // add event in memory buffer (must be called with processor lock)
+            public void Append(ulong hi, ulong lo, long timestamp, long now)
+            {
+                if (pending.count == pending.hi.Length)
+                {
+                    int capacity = 2 * pending.hi.Length;
+                    Array.Resize(ref pending.hi, capacity);
+                    Array.Resize(ref pending.lo, capacity);
+                    Array.Resize(ref pending.timestamp, capacity);
+                    Array.Resize(ref pending.now, capacity);
+                }
+
+                int i = pending.count++;
+                pending.hi[i] = hi;
+                pending.lo[i] = lo;
+                pending.timestamp[i] = timestamp;
+                pending.now[i] = now;
+                sequence++;
+            }
+
+            // take buffered events (must be called with processor lock),
+            // returned block can be written without holding the lock
+            public Block Swap()
+            {
+                Block ret = pending;
+                pending = new Block(sequence + 1, Math.Max(64, ret.count));
+                return ret;
+            }
+
+            // append block of events in journal file
+            public void Write(Block block)
+            {
+                if (block.count == 0)
+                    return;
+
+                byte[] buf = new byte[BLOCK_HEADER + RECORD_SIZE * block.count];
+                using (MemoryStream ms = new MemoryStream(buf))
+                using (BinaryWriter writer = new BinaryWriter(ms))
+                {
+                    writer.Write(block.first);
+                    writer.Write(block.count);
+                    for (int i = 0; i < block.count; i++)
+                    {
+                        writer.Write(block.hi[i]);
+                        writer.Write(block.lo[i]);
+                        writer.Write(block.timestamp[i]);
+                        writer.Write(block.now[i]);
+                    }
+                }
+
+                using (FileStream stream = new FileStream(filename, FileMode.Append, FileAccess.Write, FileShare.Read))
+                {
+                    stream.Write(buf, 0, buf.Length);
+                    stream.Flush(true);
+                }
+            }
+
+            // remove journal file (all events are in snapshot)
+            public void Truncate()
+            {
+                if (File.Exists(filename))
+                {
+                    File.Delete(filename);
+                }
+            }
+
+            // Read journal blocks and pass them to given function. Blocks
+            // are read and decoded by separate thread, so reading next
+            // block overlaps with processing of current block. Incomplete
+            // block at the end of journal (crash while writing) is removed.
+            // Returns number of replayed events.
+            public long Replay(Action<Block> apply)
+            {
+                if (!File.Exists(filename))
+                    return 0;
+
+                long replayed = 0;
+                long valid = 0; // size of journal with complete blocks
+                Exception readerException = null;
+
+                using (BlockingCollection<Block> queue = new BlockingCollection<Block>(REPLAY_QUEUE))
+                using (CancellationTokenSource canceled = new CancellationTokenSource())
+                {
+                    Thread reader = new Thread(() =>
+                    {
+                        try
+                        {
+                            valid = Read(queue, canceled.Token);
+                        }
+                        catch (OperationCanceledException)
+                        {
+                        }
+                        catch (Exception ex)
+                        {
+                            readerException = ex;
+                        }
+                        finally
+                        {
+                            queue.CompleteAdding();
+                        }
+                    });
+                    reader.IsBackground = true;
+                    reader.Start();
+
+                    try
+                    {
+                        foreach (Block block in queue.GetConsumingEnumerable())
+                        {
+                            apply(block);
+                            replayed += block.count;
+                            sequence = Math.Max(sequence, block.first + block.count - 1);
+                        }
+                    }
+                    finally
+                    {
+                        canceled.Cancel();
+                        reader.Join();
+                    }
+                }
+
+                if (readerException != null)
+                {
+                    throw readerException;
+                }
+
+                using (FileStream stream = new FileStream(filename, FileMode.Open, FileAccess.Write, FileShare.Read))
+                {
+                    if (stream.Length > valid)
+                    {
+                        Log.Warn("Fail2ban::FailJournal: removing incomplete data at the end of \""
+                            + filename + "\" (" + (stream.Length - valid) + " bytes)");
+                        stream.SetLength(valid);
+                    }
+                }
+
+                pending = new Block(sequence + 1, 64);
+
+                return replayed;
+            }
+
+            // read complete blocks, returns position after last one
+            private long Read(BlockingCollection<Block> queue, CancellationToken token)
+            {
+                using (Stream stream = new FileStream(filename, FileMode.Open, FileAccess.Read, FileShare.Read, 1 << 20))
+                using (BinaryReader reader = new BinaryReader(stream))
+                {
+                    long valid = 0;
+                    long length = stream.Length;
+
+                    while (length - valid >= BLOCK_HEADER)
+                    {
+                        long first = reader.ReadInt64();
+                        int count = reader.ReadInt32();
+                        if (first <= 0 || count <= 0 || (length - valid - BLOCK_HEADER) / RECORD_SIZE < count)
+                        {
+                            break;
+                        }
+
+                        Block block = new Block(first, count);
+                        for (int i = 0; i < count; i++)
+                        {
+                            block.hi[i] = reader.ReadUInt64();
+                            block.lo[i] = reader.ReadUInt64();
+                            block.timestamp[i] = reader.ReadInt64();
+                            block.now[i] = reader.ReadInt64();
+                        }
+                        block.count = count;
+
+                        queue.Add(block, token);
+                        valid += BLOCK_HEADER + (long)RECORD_SIZE * count;
+                    }
+
+                    return valid;
+                }
+            }
+        }
+    }
+}
@@ -92,12 +92,11 @@ namespace F2B.processors
             //stream.Write(memStream.ToArray());
 
             F2B.FwData fwData = new F2B.FwData(expiration, addr, prefix);
-            byte[] data = fwData.ToArray();
-            int dataLengthNO = IPAddress.HostToNetworkOrder(data.Length);
+            int dataLengthNO = IPAddress.HostToNetworkOrder(fwData.Length);
             byte[] dataLenght = BitConverter.GetBytes(dataLengthNO);
 
             msg.BodyStream.Write(dataLenght, 0, dataLenght.Length);
-            msg.BodyStream.Write(data, 0, data.Length);
+            fwData.WriteTo(msg.BodyStream);
 
             msg.BodyStream.WriteByte((byte)'F');
             msg.BodyStream.WriteByte((byte)'2');
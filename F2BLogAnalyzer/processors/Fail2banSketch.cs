@@ -0,0 +1,430 @@
+﻿#region Imports
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Net;
+#endregion
+
+namespace F2B.processors
+{
+    public partial class Fail2banProcessor
+    {
+        // Approximate failed login history with fixed memory size (count-min
+        // sketch split in time buckets). Each address is counted in "depth"
+        // rows of "width" counters and its estimate is the minimum of these
+        // counters, so number of failed logins is never underestimated.
+        // With probability 1 - delta the estimate exceeds real value at most
+        // by epsilon * (all failed logins within findtime). Memory and cost
+        // per event don't depend on number of distinct addresses.
+        private class FailSketch
+        {
+            private long findtime;
+            private int count; // number of time buckets
+            private double epsilon;
+            private double delta;
+            private int width;
+            private int depth;
+            private ulong[] seeds;
+
+            private long current; // current time bucket (time / bucket length)
+            private int[][] buckets; // time bucket -> depth * width counters
+            private int[] sum; // counters for all time buckets
+            private long[] bucketTotal; // failed logins in time bucket
+            private long total; // failed logins in all time buckets
+
+            // optional tracking of addresses with highest estimates
+            private int heavySize;
+            private Dictionary<Tuple<ulong, ulong>, int> heavy;
+            private int heavyMin = 0;
+
+            public FailSketch(long findtime, int count, double epsilon, double delta, int heavySize)
+            {
+                if (count < 1)
+                {
+                    throw new ArgumentException("Invalid history.sketch.count: " + count);
+                }
+                if (epsilon <= 0 || epsilon >= 1)
+                {
+                    throw new ArgumentException("Invalid history.sketch.epsilon: " + epsilon);
+                }
+                if (delta <= 0 || delta >= 1)
+                {
+                    throw new ArgumentException("Invalid history.sketch.delta: " + delta);
+                }
+
+                this.findtime = findtime;
+                this.count = count;
+                this.epsilon = epsilon;
+                this.delta = delta;
+                this.width = (int)Math.Ceiling(Math.E / epsilon);
+                this.depth = (int)Math.Ceiling(Math.Log(1 / delta));
+                this.heavySize = heavySize;
+
+                // seeds must not change between restarts (state file)
+                seeds = new ulong[depth];
+                ulong seed = 0;
+                for (int r = 0; r < depth; r++)
+                {
+                    unchecked
+                    {
+                        seed += 0x9E3779B97F4A7C15UL;
+                        seeds[r] = Mix(seed);
+                    }
+                }
+
+                current = DateTime.Now.Ticks / BucketLength;
+                buckets = new int[count][];
+                for (int i = 0; i < count; i++)
+                {
+                    buckets[i] = new int[depth * width];
+                }
+                sum = new int[depth * width];
+                bucketTotal = new long[count];
+                total = 0;
+
+                heavy = new Dictionary<Tuple<ulong, ulong>, int>();
+            }
+
+            private long BucketLength
+            {
+                get { return Math.Max(1, findtime / count); }
+            }
+
+            // approximate memory used by counters (bytes)
+            public long Bytes
+            {
+                get { return 4L * (count + 1) * depth * width; }
+            }
+
+            // maximum overestimate (with probability 1 - delta)
+            public double Error(long now)
+            {
+                Advance(now);
+
+                return epsilon * total;
+            }
+
+            // start time buckets at given processor clock (event time
+            // processing can start far from current time), loaded buckets
+            // keep their age relative to the new clock
+            public void Align(long now)
+            {
+                long bucket = now / BucketLength;
+                if (total == 0 || bucket == current)
+                {
+                    current = bucket;
+                    return;
+                }
+                if (bucket > current)
+                {
+                    Advance(now);
+                    return;
+                }
+
+                // clock behind loaded buckets (e.g. replay of older logs),
+                // otherwise all new events would be dropped as too old
+                int[][] tmpBuckets = new int[count][];
+                long[] tmpBucketTotal = new long[count];
+                for (int age = 0; age < count; age++)
+                {
+                    int from = (int)((current - age) % count);
+                    int to = (int)((bucket - age) % count);
+                    tmpBuckets[to] = buckets[from];
+                    tmpBucketTotal[to] = bucketTotal[from];
+                }
+                buckets = tmpBuckets;
+                bucketTotal = tmpBucketTotal;
+                current = bucket;
+            }
+
+            private static ulong Mix(ulong h)
+            {
+                unchecked
+                {
+                    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9UL;
+                    h = (h ^ (h >> 27)) * 0x94D049BB133111EBUL;
+                    return h ^ (h >> 31);
+                }
+            }
+
+            private int Index(int row, ulong hi, ulong lo)
+            {
+                unchecked
+                {
+                    ulong h = Mix(((hi ^ seeds[row]) * 0x9E3779B97F4A7C15UL) ^ lo);
+                    return row * width + (int)(h % (ulong)width);
+                }
+            }
+
+            // forget time buckets older than findtime
+            private void Advance(long now)
+            {
+                long bucket = now / BucketLength;
+                if (bucket <= current)
+                {
+                    return;
+                }
+
+                long steps = Math.Min(bucket - current, count);
+                for (long i = 1; i <= steps; i++)
+                {
+                    int pos = (int)((current + i) % count);
+                    if (bucketTotal[pos] == 0)
+                        continue;
+
+                    int[] counters = buckets[pos];
+                    for (int j = 0; j < counters.Length; j++)
+                    {
+                        sum[j] -= counters[j];
+                    }
+                    Array.Clear(counters, 0, counters.Length);
+                    total -= bucketTotal[pos];
+                    bucketTotal[pos] = 0;
+                }
+                current = bucket;
+
+                if (total == 0)
+                {
+                    heavy.Clear();
+                    heavyMin = 0;
+                }
+            }
+
+            private int Estimate(ulong hi, ulong lo)
+            {
+                int ret = int.MaxValue;
+                for (int r = 0; r < depth; r++)
+                {
+                    ret = Math.Min(ret, sum[Index(r, hi, lo)]);
+                }
+                return ret;
+            }
+
+            // add failed login for address, returns estimated fail count
+            public int Add(IPAddress addr, long timestamp)
+            {
+                ulong hi, lo;
+                FailTable.Key(addr, out hi, out lo);
+
+                return Add(hi, lo, timestamp, DateTime.Now.Ticks);
+            }
+
+            // add failed login processed at given time (journal replay
+            // can add events older than current time bucket)
+            public int Add(ulong hi, ulong lo, long timestamp, long now)
+            {
+                Advance(now);
+
+                // skip old log data
+                long bucket = Math.Min(now / BucketLength, current);
+                if (timestamp + findtime < now || bucket + count <= current)
+                {
+                    return Estimate(hi, lo);
+                }
+
+                // NOTE: same as with fixed history we use "now"
+                // instead of "timestamp"
+                int[] counters = buckets[(int)(bucket % count)];
+                int ret = int.MaxValue;
+                for (int r = 0; r < depth; r++)
+                {
+                    int i = Index(r, hi, lo);
+                    counters[i]++;
+                    sum[i]++;
+                    ret = Math.Min(ret, sum[i]);
+                }
+                bucketTotal[bucket % count]++;
+                total++;
+
+                if (heavySize > 0)
+                {
+                    UpdateHeavy(new Tuple<ulong, ulong>(hi, lo), ret);
+                }
+
+                return ret;
+            }
+
+            private void UpdateHeavy(Tuple<ulong, ulong> key, int estimate)
+            {
+                if (heavy.ContainsKey(key) || heavy.Count < heavySize)
+                {
+                    heavy[key] = estimate;
+                    heavyMin = (heavy.Count == 1 ? estimate : Math.Min(heavyMin, estimate));
+                    return;
+                }
+
+                if (estimate <= heavyMin)
+                {
+                    return;
+                }
+
+                // replace address with lowest estimate
+                Tuple<ulong, ulong> minKey = null;
+                int minValue = int.MaxValue;
+                foreach (var item in heavy)
+                {
+                    if (item.Value < minValue)
+                    {
+                        minKey = item.Key;
+                        minValue = item.Value;
+                    }
+                }
+
+                if (estimate <= minValue)
+                {
+                    heavyMin = minValue;
+                    return;
+                }
+
+                heavy.Remove(minKey);
+                heavy[key] = estimate;
+
+                heavyMin = int.MaxValue;
+                foreach (int value in heavy.Values)
+                {
+                    heavyMin = Math.Min(heavyMin, value);
+                }
+            }
+
+            // addresses with highest estimated fail count
+            public IList<KeyValuePair<IPAddress, int>> Heavy(long now)
+            {
+                Advance(now);
+
+                List<KeyValuePair<IPAddress, int>> ret = new List<KeyValuePair<IPAddress, int>>();
+                foreach (var key in heavy.Keys)
+                {
+                    int estimate = Estimate(key.Item1, key.Item2);
+                    if (estimate > 0)
+                    {
+                        ret.Add(new KeyValuePair<IPAddress, int>(FailTable.Address(key.Item1, key.Item2), estimate));
+                    }
+                }
+                ret.Sort((a, b) => b.Value.CompareTo(a.Value));
+
+                return ret;
+            }
+
+            // read-only copy used to save state without holding
+            // processor lock
+            public FailSketch Snapshot()
+            {
+                FailSketch ret = (FailSketch)MemberwiseClone();
+                ret.buckets = new int[count][];
+                for (int i = 0; i < count; i++)
+                {
+                    ret.buckets[i] = (int[])buckets[i].Clone();
+                }
+                ret.sum = null;
+                ret.bucketTotal = (long[])bucketTotal.Clone();
+                ret.heavy = new Dictionary<Tuple<ulong, ulong>, int>(heavy);
+                return ret;
+            }
+
+            public void Load(BinaryReader reader)
+            {
+                long tmpFindtime = reader.ReadInt64();
+                int tmpCount = reader.ReadInt32();
+                int tmpWidth = reader.ReadInt32();
+                int tmpDepth = reader.ReadInt32();
+
+                if (tmpFindtime != findtime || tmpCount != count || tmpWidth != width || tmpDepth != depth)
+                {
+                    // different configuration
+                    Log.Info("Fail2ban::FailSketch: ignoring state with different configuration");
+                    return;
+                }
+
+                long tmpCurrent = reader.ReadInt64();
+                long[] tmpBucketTotal = new long[count];
+                int[][] tmpBuckets = new int[count][];
+                for (int i = 0; i < count; i++)
+                {
+                    tmpBucketTotal[i] = reader.ReadInt64();
+                    tmpBuckets[i] = new int[depth * width];
+                    for (int j = 0; j < tmpBuckets[i].Length; j++)
+                    {
+                        tmpBuckets[i][j] = reader.ReadInt32();
+                    }
+                }
+
+                int tmpHeavy = reader.ReadInt32();
+                if (tmpHeavy < 0 || tmpHeavy > Fail2banProcessor.MAX_COUNT)
+                {
+                    throw new InvalidDataException("invalid state file heavy hitters count = " + tmpHeavy);
+                }
+                heavy.Clear();
+                for (int i = 0; i < tmpHeavy; i++)
+                {
+                    Tuple<ulong, ulong> key = new Tuple<ulong, ulong>(reader.ReadUInt64(), reader.ReadUInt64());
+                    int value = reader.ReadInt32();
+                    if (heavy.Count < heavySize)
+                    {
+                        heavy[key] = value;
+                    }
+                }
+
+                current = tmpCurrent;
+                buckets = tmpBuckets;
+                bucketTotal = tmpBucketTotal;
+                total = 0;
+                Array.Clear(sum, 0, sum.Length);
+                for (int i = 0; i < count; i++)
+                {
+                    total += bucketTotal[i];
+                    for (int j = 0; j < sum.Length; j++)
+                    {
+                        sum[j] += buckets[i][j];
+                    }
+                }
+                heavyMin = int.MaxValue;
+                foreach (int value in heavy.Values)
+                {
+                    heavyMin = Math.Min(heavyMin, value);
+                }
+
+                // expired buckets are dropped by next update with
+                // processor clock (it could be event time)
+            }
+
+            public void Save(BinaryWriter writer)
+            {
+                writer.Write(findtime);
+                writer.Write(count);
+                writer.Write(width);
+                writer.Write(depth);
+                writer.Write(current);
+                for (int i = 0; i < count; i++)
+                {
+                    writer.Write(bucketTotal[i]);
+                    foreach (int item in buckets[i])
+                    {
+                        writer.Write(item);
+                    }
+                }
+                writer.Write(heavy.Count);
+                foreach (var item in heavy)
+                {
+                    writer.Write(item.Key.Item1);
+                    writer.Write(item.Key.Item2);
+                    writer.Write(item.Value);
+                }
+            }
+
+#if DEBUG
+            public void Debug(StreamWriter output, long now)
+            {
+                Advance(now);
+
+                output.WriteLine("status sketch width: " + width + ", depth: " + depth + ", buckets: " + count + ", bytes: " + Bytes);
+                output.WriteLine("status sketch total: " + total + ", error: " + (epsilon * total) + " (probability " + (1 - delta) + ")");
+                output.WriteLine("status sketch buckets: " + string.Join<long>(",", bucketTotal));
+                foreach (var item in Heavy(now))
+                {
+                    output.WriteLine("status sketch heavy " + item.Key + ": " + item.Value);
+                }
+            }
+#endif
+        }
+    }
+}
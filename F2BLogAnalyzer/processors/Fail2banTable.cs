@@ -0,0 +1,1503 @@
+﻿#region Imports
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Net;
+#endregion
+
+namespace F2B.processors
+{
+    public partial class Fail2banProcessor
+    {
+        // Failed login history of all tracked addresses. Addresses are
+        // kept in dense parallel arrays (entry index) and located using
+        // open addressing table (linear probing) keyed by 128-bit address,
+        // so there are no objects per address (IPAddress, dictionary
+        // entry, history object with its own array/queue). FailFixed
+        // counters are stored inline ("count" counters per entry), FailAll
+        // timestamps and FailRRD counters in blocks of pooled slabs shared
+        // by all addresses. History semantics and
+        // state file records are same as for former per address
+        // FailAll/FailOne/FailFixed objects.
+        //
+        // Entries are never moved (removed entries are reused from free
+        // list) and each entry is linked in one slot of expiry wheel
+        // according to time when its history becomes empty without new
+        // failed logins ("last" + findtime). Expire visits only entries
+        // in already passed wheel slots, entries with new activity are
+        // just moved to later slot.
+        private class FailTable
+        {
+            private const long FREE = long.MinValue; // "last" of unused entry
+            private const int WHEEL_SIZE = 4096;
+
+            private HistoryType history;
+            private long findtime;
+            private int count; // FIXED: number of time slots, RRD: buckets in each level
+            private double[] decay; // FIXED: weight of time slots
+            private long[] length; // RRD: bucket length of each level (finest first)
+
+            private int[] index; // slot -> entry + 1 (0 .. empty slot)
+            private int size; // number of tracked addresses
+            private int top; // number of used and free entries
+            private int free; // first free entry (next free entry is in "data")
+
+            // expiry wheel (singly linked lists of entries)
+            private long resolution;
+            private long tick; // next wheel slot to process
+            private int[] wheel; // wheel slot -> first entry (-1 .. empty)
+            private int[] wheelNext; // entry -> next entry in same wheel slot
+
+            // entry data
+            private ulong[] keyHi;
+            private ulong[] keyLo;
+            private long[] last; // ALL: last add, ONE: last cleanup, FIXED, RRD: last add
+            private int[] data; // ALL: number of timestamps, ONE: fail counter, FIXED, RRD: sum of slots
+            private int[] block; // ALL, RRD: slab block handle (-1 .. no block)
+            private long[] start; // RRD: last ring update
+            private ushort[] slots; // FIXED: entry * count -> time slot (saturating counters)
+
+            private Slab<long> timestamps; // ALL (single timestamp is stored only in "last")
+            private Slab<ushort> buckets; // RRD (saturating counters)
+
+            public FailTable(HistoryType history, long findtime, int count, double decay)
+                : this(history, findtime, count, decay, 1)
+            {
+            }
+
+            public FailTable(HistoryType history, long findtime, int count, double decay, int repeat)
+            {
+                this.history = history;
+                this.findtime = findtime;
+                this.count = count;
+                this.decay = null;
+                this.length = null;
+
+                if (history == HistoryType.RRD)
+                {
+                    // coarsest level covers findtime with one more bucket
+                    // (partly outside findtime), finest level buckets
+                    // are not shorter than one second
+                    this.count = Math.Max(2, count);
+                    long tmpLength = Math.Max(1, findtime / (this.count - 1));
+                    int levels = 1;
+                    while (levels < repeat && tmpLength / this.count >= TimeSpan.TicksPerSecond)
+                    {
+                        tmpLength /= this.count;
+                        levels++;
+                    }
+
+                    this.length = new long[levels];
+                    for (int i = 0; i < levels; i++)
+                    {
+                        this.length[i] = tmpLength;
+                        tmpLength *= this.count;
+                    }
+                }
+
+                if (history == HistoryType.FIXED && decay != 1.0)
+                {
+                    this.decay = new double[count];
+                    this.decay[0] = 1.0;
+                    for (int i = 1; i < count; i++)
+                    {
+                        this.decay[i] = this.decay[i - 1] * decay;
+                    }
+                }
+
+                Clear();
+            }
+
+            public int Count
+            {
+                get { return size; }
+            }
+
+            public void Clear()
+            {
+                index = new int[16];
+                size = 0;
+                top = 0;
+                free = -1;
+
+                keyHi = new ulong[8];
+                keyLo = new ulong[8];
+                last = new long[8];
+                data = new int[8];
+
+                resolution = Math.Max(TimeSpan.TicksPerSecond, (findtime + WHEEL_SIZE - 1) / WHEEL_SIZE);
+                tick = DateTime.Now.Ticks / resolution;
+                wheel = new int[WHEEL_SIZE];
+                for (int i = 0; i < WHEEL_SIZE; i++)
+                {
+                    wheel[i] = -1;
+                }
+                wheelNext = new int[8];
+                block = null;
+                start = null;
+                slots = null;
+                timestamps = null;
+                buckets = null;
+
+                if (history == HistoryType.ALL)
+                {
+                    block = new int[8];
+                    timestamps = new Slab<long>(2);
+                }
+                else if (history == HistoryType.FIXED)
+                {
+                    slots = new ushort[8 * count];
+                }
+                else if (history == HistoryType.RRD)
+                {
+                    block = new int[8];
+                    start = new long[8];
+                    buckets = new Slab<ushort>(count * length.Length);
+                }
+            }
+
+            // start expiry wheel at given processor clock (event time
+            // processing can start far from current time), loaded entries
+            // are scheduled again from their stored last failed login time
+            public void Align(long now)
+            {
+                tick = now / resolution;
+                if (size == 0)
+                    return;
+
+                for (int i = 0; i < WHEEL_SIZE; i++)
+                {
+                    wheel[i] = -1;
+                }
+                for (int e = 0; e < top; e++)
+                {
+                    if (last[e] != FREE)
+                    {
+                        Schedule(e);
+                    }
+                }
+            }
+
+            // approximate memory used by table (bytes)
+            public long Bytes
+            {
+                get
+                {
+                    long ret = 4L * index.Length + 4L * wheel.Length + (8 + 8 + 8 + 4 + 4) * (long)keyHi.Length;
+                    if (block != null) ret += 4L * block.Length;
+                    if (start != null) ret += 8L * start.Length;
+                    if (slots != null) ret += 2L * slots.Length;
+                    if (timestamps != null) ret += 8L * timestamps.Capacity;
+                    if (buckets != null) ret += 2L * buckets.Capacity;
+                    return ret;
+                }
+            }
+
+            #region Keys
+            public static void Key(IPAddress addr, out ulong hi, out ulong lo)
+            {
+                byte[] bytes = addr.GetAddressBytes();
+
+                if (bytes.Length == 4)
+                {
+                    // IPv4 mapped to IPv6 (::ffff:a.b.c.d)
+                    hi = 0;
+                    lo = 0xffff00000000UL | ((ulong)bytes[0] << 24) | ((ulong)bytes[1] << 16) | ((ulong)bytes[2] << 8) | bytes[3];
+                    return;
+                }
+
+                hi = 0;
+                lo = 0;
+                for (int i = 0; i < 8; i++)
+                {
+                    hi = (hi << 8) | bytes[i];
+                    lo = (lo << 8) | bytes[8 + i];
+                }
+            }
+
+            public static IPAddress Address(ulong hi, ulong lo)
+            {
+                byte[] bytes = new byte[16];
+                for (int i = 7; i >= 0; i--)
+                {
+                    bytes[i] = (byte)hi;
+                    bytes[8 + i] = (byte)lo;
+                    hi >>= 8;
+                    lo >>= 8;
+                }
+                return new IPAddress(bytes);
+            }
+
+            public static bool IsIPv4(ulong hi, ulong lo)
+            {
+                return hi == 0 && (lo >> 32) == 0xffffUL;
+            }
+
+            // clear address bits after prefix
+            public static void Network(int prefix, ref ulong hi, ref ulong lo)
+            {
+                if (prefix <= 0)
+                {
+                    hi = 0;
+                    lo = 0;
+                }
+                else if (prefix <= 64)
+                {
+                    hi &= ~0UL << (64 - prefix);
+                    lo = 0;
+                }
+                else if (prefix < 128)
+                {
+                    lo &= ~0UL << (128 - prefix);
+                }
+            }
+
+            private int Slot(ulong hi, ulong lo)
+            {
+                unchecked
+                {
+                    ulong h = hi ^ (lo * 0x9E3779B97F4A7C15UL);
+                    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9UL;
+                    h = (h ^ (h >> 27)) * 0x94D049BB133111EBUL;
+                    return (int)(h ^ (h >> 31)) & (index.Length - 1);
+                }
+            }
+
+            private int Find(ulong hi, ulong lo)
+            {
+                int mask = index.Length - 1;
+                for (int s = Slot(hi, lo); index[s] != 0; s = (s + 1) & mask)
+                {
+                    int e = index[s] - 1;
+                    if (keyHi[e] == hi && keyLo[e] == lo)
+                    {
+                        return e;
+                    }
+                }
+
+                return -1;
+            }
+
+            // slot that points to existing entry
+            private int SlotOf(int e)
+            {
+                int mask = index.Length - 1;
+                int s = Slot(keyHi[e], keyLo[e]);
+                while (index[s] != e + 1)
+                {
+                    s = (s + 1) & mask;
+                }
+                return s;
+            }
+
+            // add entry for address that is not in table
+            private int Insert(ulong hi, ulong lo)
+            {
+                // keep load factor of index below 3/4
+                if (4 * (size + 1) > 3 * index.Length)
+                {
+                    index = new int[2 * index.Length];
+                    for (int i = 0; i < top; i++)
+                    {
+                        if (last[i] != FREE)
+                            Place(i);
+                    }
+                }
+
+                int e;
+                if (free >= 0)
+                {
+                    e = free;
+                    free = data[e];
+                }
+                else
+                {
+                    if (top == keyHi.Length)
+                    {
+                        int capacity = 2 * keyHi.Length;
+                        Array.Resize(ref keyHi, capacity);
+                        Array.Resize(ref keyLo, capacity);
+                        Array.Resize(ref last, capacity);
+                        Array.Resize(ref data, capacity);
+                        Array.Resize(ref wheelNext, capacity);
+                        if (block != null) Array.Resize(ref block, capacity);
+                        if (start != null) Array.Resize(ref start, capacity);
+                        if (slots != null) Array.Resize(ref slots, capacity * count);
+                    }
+                    e = top++;
+                }
+
+                size++;
+                keyHi[e] = hi;
+                keyLo[e] = lo;
+                last[e] = 0;
+                data[e] = 0;
+                if (block != null) block[e] = -1;
+                if (start != null) start[e] = 0;
+                Place(e);
+
+                return e;
+            }
+
+            // resize entry arrays and index for given number of entries
+            private void Reserve(int capacity)
+            {
+                if (capacity <= keyHi.Length)
+                    return;
+
+                Array.Resize(ref keyHi, capacity);
+                Array.Resize(ref keyLo, capacity);
+                Array.Resize(ref last, capacity);
+                Array.Resize(ref data, capacity);
+                Array.Resize(ref wheelNext, capacity);
+                if (block != null) Array.Resize(ref block, capacity);
+                if (start != null) Array.Resize(ref start, capacity);
+                if (slots != null) Array.Resize(ref slots, capacity * count);
+
+                int indexSize = index.Length;
+                while (4 * capacity > 3 * indexSize)
+                {
+                    indexSize *= 2;
+                }
+                if (indexSize != index.Length)
+                {
+                    index = new int[indexSize];
+                    for (int i = 0; i < top; i++)
+                    {
+                        if (last[i] != FREE)
+                            Place(i);
+                    }
+                }
+            }
+
+            private void Place(int e)
+            {
+                int mask = index.Length - 1;
+                int s = Slot(keyHi[e], keyLo[e]);
+                while (index[s] != 0)
+                {
+                    s = (s + 1) & mask;
+                }
+                index[s] = e + 1;
+            }
+
+            // remove entry (must not be linked in expiry wheel)
+            private void Remove(int e)
+            {
+                FreeBlock(e);
+
+                // backward shift deletion (no tombstones with linear probing)
+                int mask = index.Length - 1;
+                int hole = SlotOf(e);
+                for (int s = (hole + 1) & mask; index[s] != 0; s = (s + 1) & mask)
+                {
+                    int i = index[s] - 1;
+                    int home = Slot(keyHi[i], keyLo[i]);
+                    // entry can move to hole if its home slot is not
+                    // cyclically within (hole, s]
+                    if (((s - home) & mask) >= ((s - hole) & mask))
+                    {
+                        index[hole] = index[s];
+                        hole = s;
+                    }
+                }
+                index[hole] = 0;
+
+                last[e] = FREE;
+                data[e] = free;
+                free = e;
+                size--;
+            }
+
+            // link entry in wheel slot for time when its history
+            // becomes empty
+            private void Schedule(int e)
+            {
+                long due;
+                try
+                {
+                    due = checked(last[e] + findtime);
+                }
+                catch (OverflowException)
+                {
+                    due = long.MaxValue - resolution;
+                }
+
+                // round up, entry must not be visited before due time
+                // (entries with timestamps in future are visited sooner
+                // and linked again, wheel covers at most WHEEL_SIZE slots)
+                long t = Math.Max(tick, due / resolution + (due % resolution > 0 ? 1 : 0));
+                t = Math.Min(t, tick + WHEEL_SIZE - 1);
+                int pos = (int)(t % WHEEL_SIZE);
+                wheelNext[e] = wheel[pos];
+                wheel[pos] = e;
+            }
+
+            private void FreeBlock(int e)
+            {
+                if (block == null || block[e] < 0)
+                    return;
+
+                if (history == HistoryType.ALL)
+                    timestamps.Free(block[e]);
+                else
+                    buckets.Free(block[e]);
+
+                block[e] = -1;
+            }
+            #endregion
+
+            #region Public
+            // add failed login for address, returns fail count
+            public int Add(IPAddress addr, long timestamp)
+            {
+                ulong hi, lo;
+                Key(addr, out hi, out lo);
+
+                return Add(hi, lo, timestamp, DateTime.Now.Ticks);
+            }
+
+            // add failed login processed at given time (journal replay)
+            public int Add(ulong hi, ulong lo, long timestamp, long now)
+            {
+                int e = Find(hi, lo);
+                bool created = (e < 0);
+                if (created)
+                {
+                    e = Insert(hi, lo);
+                    Init(e, now);
+                }
+
+                int ret;
+                switch (history)
+                {
+                    case HistoryType.ALL: ret = AddAll(e, timestamp, now); break;
+                    case HistoryType.ONE: ret = AddOne(e, timestamp, now); break;
+                    case HistoryType.FIXED: ret = AddFixed(e, timestamp, now); break;
+                    case HistoryType.RRD: ret = AddRRD(e, timestamp, now); break;
+                    default: throw new NotImplementedException();
+                }
+
+                // existing entries are rescheduled lazily by Expire
+                if (created)
+                {
+                    Schedule(e);
+                }
+
+                return ret;
+            }
+
+            // remove addresses with empty history from wheel slots up to
+            // current time, removed addresses are added in given collection
+            // (can be null); returns false when processing stopped because
+            // it took more than given time budget (ticks)
+            public bool Expire(long now, long budget, ICollection<IPAddress> removed)
+            {
+                Stopwatch sw = Stopwatch.StartNew();
+                int visited = 0;
+
+                long end = now / resolution;
+                if (end - tick >= WHEEL_SIZE)
+                {
+                    // all wheel slots are visited at most once
+                    tick = end - WHEEL_SIZE + 1;
+                }
+
+                for (; tick <= end; tick++)
+                {
+                    int pos = (int)(tick % WHEEL_SIZE);
+                    while (wheel[pos] >= 0)
+                    {
+                        if ((++visited & 0x3f) == 0 && sw.Elapsed.Ticks > budget)
+                        {
+                            return false;
+                        }
+
+                        int e = wheel[pos];
+                        wheel[pos] = wheelNext[e];
+
+                        if (Fails(e, now) > 0)
+                        {
+                            // new failed logins since entry was scheduled
+                            Schedule(e);
+                            continue;
+                        }
+
+                        if (removed != null)
+                        {
+                            removed.Add(Address(keyHi[e], keyLo[e]));
+                        }
+                        Remove(e);
+                    }
+                }
+
+                return true;
+            }
+
+            // load given number of state file records (address and
+            // its history) written by Save
+            public void Load(BinaryReader reader, int records)
+            {
+                // don't trust number from (possibly corrupted) state file
+                Reserve(Math.Min(records, 1 << 20));
+
+                for (int i = 0; i < records; i++)
+                {
+                    ulong hi = 0, lo = 0;
+                    for (int j = 0; j < 8; j++)
+                    {
+                        hi = (hi << 8) | reader.ReadByte();
+                    }
+                    for (int j = 0; j < 8; j++)
+                    {
+                        lo = (lo << 8) | reader.ReadByte();
+                    }
+                    Load(reader, hi, lo);
+                }
+            }
+
+            // load history of one address (state file record)
+            public void Load(BinaryReader reader, IPAddress addr)
+            {
+                ulong hi, lo;
+                Key(addr, out hi, out lo);
+
+                Load(reader, hi, lo);
+            }
+
+            private void Load(BinaryReader reader, ulong hi, ulong lo)
+            {
+                // duplicate address replaces existing history, entry
+                // stays linked in expiry wheel
+                int e = Find(hi, lo);
+                bool created = (e < 0);
+                if (created)
+                {
+                    e = Insert(hi, lo);
+                }
+                else
+                {
+                    FreeBlock(e);
+                }
+
+                try
+                {
+                    switch (history)
+                    {
+                        case HistoryType.ALL: LoadAll(e, reader); break;
+                        case HistoryType.ONE: LoadOne(e, reader); break;
+                        case HistoryType.FIXED: LoadFixed(e, reader); break;
+                        case HistoryType.RRD: LoadRRD(e, reader); break;
+                    }
+                }
+                catch (Exception)
+                {
+                    // empty history is removed by next Expire (entry
+                    // must have valid block until then)
+                    Init(e, DateTime.Now.Ticks);
+                    if (created)
+                    {
+                        Schedule(e);
+                    }
+                    throw;
+                }
+
+                if (created)
+                {
+                    Schedule(e);
+                }
+            }
+
+            // read-only copy of table data used to save state without
+            // holding processor lock (copy of dense arrays is much faster
+            // than serialization of all entries)
+            public FailTable Snapshot()
+            {
+                FailTable ret = (FailTable)MemberwiseClone();
+
+                // index and expiry wheel are not used by Save
+                ret.index = null;
+                ret.wheel = null;
+                ret.wheelNext = null;
+
+                ret.keyHi = Copy(keyHi, top);
+                ret.keyLo = Copy(keyLo, top);
+                ret.last = Copy(last, top);
+                ret.data = Copy(data, top);
+                if (block != null) ret.block = Copy(block, top);
+                if (start != null) ret.start = Copy(start, top);
+                if (slots != null) ret.slots = Copy(slots, top * count);
+                if (timestamps != null) ret.timestamps = timestamps.Snapshot();
+                if (buckets != null) ret.buckets = buckets.Snapshot();
+
+                return ret;
+            }
+
+            private static T[] Copy<T>(T[] arr, int length)
+            {
+                T[] ret = new T[length];
+                Array.Copy(arr, ret, length);
+                return ret;
+            }
+
+            // save address and history for all entries
+            public void Save(BinaryWriter writer)
+            {
+                byte[] bytes = new byte[16];
+                for (int e = 0; e < top; e++)
+                {
+                    if (last[e] == FREE)
+                        continue;
+
+                    ulong hi = keyHi[e], lo = keyLo[e];
+                    for (int i = 7; i >= 0; i--)
+                    {
+                        bytes[i] = (byte)hi;
+                        bytes[8 + i] = (byte)lo;
+                        hi >>= 8;
+                        lo >>= 8;
+                    }
+                    writer.Write(bytes);
+
+                    switch (history)
+                    {
+                        case HistoryType.ALL: SaveAll(e, writer); break;
+                        case HistoryType.ONE: SaveOne(e, writer); break;
+                        case HistoryType.FIXED: SaveFixed(e, writer); break;
+                        case HistoryType.RRD: SaveRRD(e, writer); break;
+                    }
+                }
+            }
+            #endregion
+
+            private void Init(int e, long now)
+            {
+                FreeBlock(e);
+
+                data[e] = 0;
+                last[e] = now - findtime;
+
+                if (history == HistoryType.FIXED)
+                {
+                    Array.Clear(slots, e * count, count);
+                }
+                else if (history == HistoryType.RRD)
+                {
+                    block[e] = buckets.Alloc(count * length.Length);
+                    start[e] = now;
+                }
+            }
+
+            private int Fails(int e, long now)
+            {
+                switch (history)
+                {
+                    case HistoryType.ALL:
+                        CleanupAll(e, now);
+                        return data[e];
+                    case HistoryType.ONE:
+                        CleanupOne(e, now);
+                        return data[e];
+                    case HistoryType.FIXED:
+                        CleanupFixed(e, now);
+                        if (decay == null)
+                        {
+                            return data[e];
+                        }
+                        else
+                        {
+                            int off = e * count;
+                            double tmp = 0;
+                            for (int i = 0; i < count; i++)
+                            {
+                                tmp += slots[off + i] * decay[i];
+                            }
+                            return (int)tmp;
+                        }
+                    case HistoryType.RRD:
+                        return FailsRRD(e, now);
+                }
+
+                throw new NotImplementedException();
+            }
+
+            #region FailAll
+            // clear expired entries
+            private void CleanupAll(int e, long now)
+            {
+                if (last[e] + findtime <= now)
+                {
+                    data[e] = 0;
+                    FreeBlock(e);
+                }
+                else if (block[e] >= 0)
+                {
+                    long[] arr = timestamps.Data(block[e]);
+                    int off = timestamps.Offset(block[e]);
+                    int n = data[e];
+                    int k = 0;
+                    while (k < n && arr[off + k] + findtime < now)
+                    {
+                        k++;
+                    }
+                    if (k > 0)
+                    {
+                        Array.Copy(arr, off + k, arr, off, n - k);
+                        data[e] = n - k;
+                    }
+                }
+            }
+
+            private int AddAll(int e, long timestamp, long now)
+            {
+                CleanupAll(e, now);
+
+                // skip old log data
+                if (timestamp + findtime < now)
+                {
+                    return data[e];
+                }
+
+                // NOTE: history stores "now" because cleanup needs
+                // sorted timestamps, with event time processing "now"
+                // is log timestamp of events reordered by processor
+                int n = data[e];
+                if (block[e] >= 0 || n > 0)
+                {
+                    if (block[e] < 0)
+                    {
+                        // move single timestamp from "last" in slab block
+                        block[e] = timestamps.Alloc(2);
+                        timestamps.Data(block[e])[timestamps.Offset(block[e])] = last[e];
+                    }
+                    else if (n == timestamps.Size(block[e]))
+                    {
+                        int handle = timestamps.Alloc(2 * n);
+                        Array.Copy(timestamps.Data(block[e]), timestamps.Offset(block[e]), timestamps.Data(handle), timestamps.Offset(handle), n);
+                        timestamps.Free(block[e]);
+                        block[e] = handle;
+                    }
+                    timestamps.Data(block[e])[timestamps.Offset(block[e]) + n] = now;
+                }
+                data[e] = n + 1;
+                last[e] = now;
+
+                return data[e];
+            }
+
+            private void LoadAll(int e, BinaryReader reader)
+            {
+                long tmpFindtime = reader.ReadInt64();
+                int tmpCount = reader.ReadInt32();
+                if (tmpCount < 0)
+                {
+                    throw new InvalidDataException("invalid state file data count = " + tmpCount);
+                }
+
+                long first = 0;
+                if (tmpCount == 1)
+                {
+                    first = reader.ReadInt64();
+                }
+                else if (tmpCount > 1)
+                {
+                    block[e] = timestamps.Alloc(tmpCount);
+                    long[] arr = timestamps.Data(block[e]);
+                    int off = timestamps.Offset(block[e]);
+                    for (int i = 0; i < tmpCount; i++)
+                    {
+                        arr[off + i] = reader.ReadInt64();
+                    }
+                }
+
+                data[e] = tmpCount;
+                last[e] = reader.ReadInt64();
+
+                if (tmpCount == 1 && first != last[e])
+                {
+                    block[e] = timestamps.Alloc(1);
+                    timestamps.Data(block[e])[timestamps.Offset(block[e])] = first;
+                }
+
+                if (tmpFindtime != findtime)
+                {
+                    // different configuration
+                    Init(e, DateTime.Now.Ticks);
+                }
+            }
+
+            private void SaveAll(int e, BinaryWriter writer)
+            {
+                int n = data[e];
+                writer.Write(findtime);
+                writer.Write(n);
+                if (block[e] < 0)
+                {
+                    if (n == 1)
+                    {
+                        writer.Write(last[e]);
+                    }
+                }
+                else
+                {
+                    long[] arr = timestamps.Data(block[e]);
+                    int off = timestamps.Offset(block[e]);
+                    for (int i = 0; i < n; i++)
+                    {
+                        writer.Write(arr[off + i]);
+                    }
+                }
+                writer.Write(last[e]);
+            }
+            #endregion
+
+            #region FailOne
+            private void CleanupOne(int e, long now)
+            {
+                // no or empty history (reset last cleanup time)
+                if (data[e] == 0)
+                {
+                    last[e] = now;
+                    return;
+                }
+
+                // history data too old (older than findtime, reset last cleanup time)
+                if (last[e] + findtime <= now)
+                {
+                    data[e] = 0;
+                    last[e] = now;
+                    return;
+                }
+
+                // substract from treshold data number that corresponds
+                // data fraction from last call to cleanup
+                double findtime_fraction = (double)(now - last[e]) / findtime;
+                int substract = (int)(findtime_fraction * data[e]);
+
+                if (substract == 0)
+                {
+                    return;
+                }
+
+                if (substract > data[e])
+                {
+                    data[e] = 0;
+                }
+                else
+                {
+                    data[e] -= substract;
+                }
+                last[e] = now;
+            }
+
+            private int AddOne(int e, long timestamp, long now)
+            {
+                CleanupOne(e, now);
+
+                // skip old log data
+                if (timestamp + findtime < now)
+                {
+                    return data[e];
+                }
+
+                data[e]++;
+
+                return data[e];
+            }
+
+            private void LoadOne(int e, BinaryReader reader)
+            {
+                long tmpFindtime = reader.ReadInt64();
+                data[e] = reader.ReadInt32();
+                last[e] = reader.ReadInt64();
+
+                if (tmpFindtime != findtime)
+                {
+                    // different configuration
+                    Init(e, DateTime.Now.Ticks);
+                }
+            }
+
+            private void SaveOne(int e, BinaryWriter writer)
+            {
+                writer.Write(findtime);
+                writer.Write(data[e]);
+                writer.Write(last[e]);
+            }
+            #endregion
+
+            #region FailFixed
+            // Time slots are aligned to multiples of findtime / count (same
+            // as slots of former FailFixed with start time 0), so entry
+            // doesn't need its own start timestamp
+            private long SlotFixed(long time)
+            {
+                long pos = (long)(((double)time / findtime) * count) % count;
+                return pos < 0 ? pos + count : pos;
+            }
+
+            private void CleanupFixed(int e, long now)
+            {
+                if (data[e] == 0)
+                {
+                    return;
+                }
+
+                int off = e * count;
+
+                if (last[e] + findtime <= now || last[e] > now)
+                {
+                    if (last[e] > now)
+                    {
+                        Log.Warn("Fail2ban::FailFixed: last(" + last[e] + ") > now(" + now + ")");
+                    }
+
+                    Array.Clear(slots, off, count);
+                    data[e] = 0;
+                }
+                else
+                {
+                    long pos = SlotFixed(now);
+                    long lastpos = SlotFixed(last[e]);
+
+                    if (lastpos != pos)
+                    {
+                        long endpos = (pos > lastpos) ? pos : pos + count;
+                        for (long i = lastpos + 1; i <= endpos; i++)
+                        {
+                            long currpos = off + i % count;
+                            data[e] -= slots[currpos];
+                            slots[currpos] = 0;
+                        }
+                    }
+                }
+            }
+
+            private int AddFixed(int e, long timestamp, long now)
+            {
+                CleanupFixed(e, now);
+
+                // skip old log data
+                if (timestamp + findtime < now)
+                {
+                    return data[e];
+                }
+
+                // NOTE: we should use "timestamp" instead of "now"
+                // but that requires also changes in Cleanup function
+                long pos = e * count + SlotFixed(now);
+                if (slots[pos] < ushort.MaxValue)
+                {
+                    slots[pos]++;
+                    data[e]++;
+                }
+                last[e] = now;
+
+                return data[e];
+            }
+
+            private void LoadFixed(int e, BinaryReader reader)
+            {
+                long tmpFindtime = reader.ReadInt64();
+                int tmpCount = reader.ReadInt32();
+                if (tmpCount < 0 || tmpCount > Fail2banProcessor.MAX_COUNT)
+                {
+                    throw new InvalidDataException("invalid state file data count = " + tmpCount);
+                }
+
+                int off = e * count;
+                Array.Clear(slots, off, count);
+                data[e] = 0;
+                for (int i = 0; i < tmpCount; i++)
+                {
+                    int value = reader.ReadInt32();
+                    if (i < count)
+                    {
+                        slots[off + i] = (ushort)Math.Min(Math.Max(value, 0), ushort.MaxValue);
+                        data[e] += slots[off + i];
+                    }
+                }
+
+                long tmpStart = reader.ReadInt64();
+                last[e] = reader.ReadInt64();
+                reader.ReadInt32(); // sum of slots (computed from counters)
+
+                if (tmpFindtime != findtime || tmpCount != count)
+                {
+                    // different configuration
+                    Init(e, DateTime.Now.Ticks);
+                    return;
+                }
+
+                // slots of history with different start time are rotated
+                // to slots aligned to time 0
+                long shift = SlotFixed(tmpStart);
+                if (shift != 0)
+                {
+                    ushort[] tmp = new ushort[count];
+                    Array.Copy(slots, off, tmp, 0, count);
+                    for (int i = 0; i < count; i++)
+                    {
+                        slots[off + (i + shift) % count] = tmp[i];
+                    }
+                }
+            }
+
+            private void SaveFixed(int e, BinaryWriter writer)
+            {
+                int off = e * count;
+                writer.Write(findtime);
+                writer.Write(count);
+                for (int i = 0; i < count; i++)
+                {
+                    writer.Write((int)slots[off + i]);
+                }
+                writer.Write(0L); // start of first time slot
+                writer.Write(last[e]);
+                writer.Write(data[e]);
+            }
+            #endregion
+
+            #region FailRRD
+            // Round-robin rings of saturating counters with growing bucket
+            // length (bucket of level i + 1 is "count" times longer than
+            // bucket of level i). Failed logins are counted in the finest
+            // bucket and buckets that leave their ring are merged into the
+            // bucket of the coarsest ring that still contains them (bucket
+            // boundaries are aligned to multiples of bucket length), so
+            // recent failed logins keep fine resolution and memory per
+            // address doesn't depend on findtime. Oldest bucket of coarsest
+            // level is only partly within findtime and its counter is
+            // interpolated.
+            private void CleanupRRD(int e, long now)
+            {
+                if (now <= start[e])
+                {
+                    return;
+                }
+
+                int levels = length.Length;
+                ushort[] arr = buckets.Data(block[e]);
+                int off = buckets.Offset(block[e]);
+
+                if (data[e] == 0 || last[e] + findtime <= now)
+                {
+                    if (data[e] != 0)
+                    {
+                        Array.Clear(arr, off, count * levels);
+                        data[e] = 0;
+                    }
+                    start[e] = now;
+                    return;
+                }
+
+                // coarse levels first, buckets from finer level are
+                // merged into ring that was already moved to current time
+                for (int i = levels - 1; i >= 0; i--)
+                {
+                    long from = start[e] / length[i];
+                    long to = now / length[i];
+                    if (from == to)
+                    {
+                        continue;
+                    }
+
+                    // buckets (from - count, min(from, to - count)] leave the ring
+                    long end = Math.Min(from, to - count);
+                    for (long b = from - count + 1; b <= end; b++)
+                    {
+                        int pos = off + i * count + (int)(b % count);
+                        int value = arr[pos];
+                        if (value == 0)
+                        {
+                            continue;
+                        }
+                        arr[pos] = 0;
+
+                        long tb = b;
+                        int j = i + 1;
+                        for (; j < levels; j++)
+                        {
+                            tb /= count;
+                            if (tb > now / length[j] - count)
+                                break;
+                        }
+
+                        if (j < levels)
+                        {
+                            int tpos = off + j * count + (int)(tb % count);
+                            int sum = arr[tpos] + value;
+                            arr[tpos] = (ushort)Math.Min(sum, ushort.MaxValue);
+                            data[e] -= sum - arr[tpos];
+                        }
+                        else
+                        {
+                            data[e] -= value;
+                        }
+                    }
+                }
+
+                start[e] = now;
+            }
+
+            private int FailsRRD(int e, long now)
+            {
+                CleanupRRD(e, now);
+
+                if (data[e] == 0)
+                {
+                    return 0;
+                }
+
+                // part of the oldest bucket in coarsest ring before findtime
+                int top = length.Length - 1;
+                long tmpNow = Math.Max(now, start[e]);
+                long oldest = tmpNow / length[top] - count + 1;
+                long outside = tmpNow - findtime - oldest * length[top];
+                if (outside <= 0)
+                {
+                    return data[e];
+                }
+
+                int value = buckets.Data(block[e])[buckets.Offset(block[e]) + top * count + (int)(oldest % count)];
+                double fraction = Math.Min(1.0, (double)outside / length[top]);
+                return data[e] - (int)Math.Round(value * fraction);
+            }
+
+            private int AddRRD(int e, long timestamp, long now)
+            {
+                CleanupRRD(e, now);
+
+                // skip old log data
+                if (timestamp + findtime < now)
+                {
+                    return FailsRRD(e, now);
+                }
+
+                // NOTE: same as for FailFixed bucket is selected by "now"
+                int pos = buckets.Offset(block[e]) + (int)(Math.Max(now, start[e]) / length[0] % count);
+                ushort[] arr = buckets.Data(block[e]);
+                if (arr[pos] < ushort.MaxValue)
+                {
+                    arr[pos]++;
+                    data[e]++;
+                }
+                last[e] = now;
+
+                return FailsRRD(e, now);
+            }
+
+            private void LoadRRD(int e, BinaryReader reader)
+            {
+                long tmpFindtime = reader.ReadInt64();
+                int tmpCount = reader.ReadInt32();
+                int tmpLevels = reader.ReadInt32();
+                if (tmpCount < 0 || tmpLevels < 0 || (long)tmpCount * tmpLevels > Fail2banProcessor.MAX_COUNT)
+                {
+                    throw new InvalidDataException("invalid state file data count = " + tmpCount + "x" + tmpLevels);
+                }
+
+                block[e] = buckets.Alloc(count * length.Length);
+                ushort[] arr = buckets.Data(block[e]);
+                int off = buckets.Offset(block[e]);
+                int sum = 0;
+                for (int i = 0; i < tmpCount * tmpLevels; i++)
+                {
+                    ushort value = reader.ReadUInt16();
+                    if (i < count * length.Length)
+                    {
+                        arr[off + i] = value;
+                        sum += value;
+                    }
+                }
+
+                start[e] = reader.ReadInt64();
+                last[e] = reader.ReadInt64();
+                data[e] = sum;
+
+                if (tmpFindtime != findtime || tmpCount != count || tmpLevels != length.Length)
+                {
+                    // different configuration
+                    Init(e, DateTime.Now.Ticks);
+                }
+            }
+
+            private void SaveRRD(int e, BinaryWriter writer)
+            {
+                ushort[] arr = buckets.Data(block[e]);
+                int off = buckets.Offset(block[e]);
+                writer.Write(findtime);
+                writer.Write(count);
+                writer.Write(length.Length);
+                for (int i = 0; i < count * length.Length; i++)
+                {
+                    writer.Write(arr[off + i]);
+                }
+                writer.Write(start[e]);
+                writer.Write(last[e]);
+            }
+            #endregion
+
+#if DEBUG
+            public void Debug(StreamWriter output, long now)
+            {
+                output.WriteLine("status table addresses: " + size + ", index slots: " + index.Length + ", bytes: " + Bytes);
+                output.WriteLine("status table expiry resolution: " + resolution + ", next tick: " + tick);
+                for (int e = 0; e < top; e++)
+                {
+                    if (last[e] == FREE)
+                        continue;
+
+                    output.WriteLine("status address " + Address(keyHi[e], keyLo[e]));
+                    output.WriteLine("status " + history + " count: " + Fails(e, now));
+                    output.WriteLine("status " + history + " last: " + last[e]);
+                    if (start != null)
+                    {
+                        output.WriteLine("status " + history + " start: " + start[e]);
+                    }
+                    if (slots != null)
+                    {
+                        output.WriteLine("status " + history + " data(" + count
+                            + "): " + string.Join<ushort>(",", new ArraySegment<ushort>(slots, e * count, count)));
+                    }
+                    if (block != null && block[e] >= 0)
+                    {
+                        if (history == HistoryType.ALL)
+                        {
+                            long[] arr = timestamps.Data(block[e]);
+                            int off = timestamps.Offset(block[e]);
+                            output.WriteLine("status " + history + " data(" + data[e]
+                                + "): " + string.Join<long>(",", new ArraySegment<long>(arr, off, data[e])));
+                        }
+                        else
+                        {
+                            ushort[] arr = buckets.Data(block[e]);
+                            int off = buckets.Offset(block[e]);
+                            for (int i = 0; i < length.Length; i++)
+                            {
+                                output.WriteLine("status " + history + " data(" + count + "x" + length[i]
+                                    + "): " + string.Join<ushort>(",", new ArraySegment<ushort>(arr, off + i * count, count)));
+                            }
+                        }
+                    }
+                }
+            }
+#endif
+        }
+
+
+        // Pool of blocks for per address arrays, block size for size
+        // class c is minSize << c and freed blocks are reused
+        private class Slab<T>
+        {
+            private const int CLASS_SHIFT = 24;
+            private const int INDEX_MASK = (1 << CLASS_SHIFT) - 1;
+            private const int MAX_CLASS = 24;
+
+            private int minSize;
+            private T[][] arena = new T[MAX_CLASS][];
+            private int[] allocated = new int[MAX_CLASS]; // blocks taken from arena
+            private Stack<int>[] free = new Stack<int>[MAX_CLASS];
+
+            public Slab(int minSize)
+            {
+                this.minSize = Math.Max(1, minSize);
+            }
+
+            // number of elements in all arenas
+            public long Capacity
+            {
+                get
+                {
+                    long ret = 0;
+                    foreach (T[] item in arena)
+                    {
+                        if (item != null)
+                            ret += item.Length;
+                    }
+                    return ret;
+                }
+            }
+
+            public int Size(int handle)
+            {
+                return minSize << (handle >> CLASS_SHIFT);
+            }
+
+            public T[] Data(int handle)
+            {
+                return arena[handle >> CLASS_SHIFT];
+            }
+
+            public int Offset(int handle)
+            {
+                return (handle & INDEX_MASK) * Size(handle);
+            }
+
+            // allocate cleared block with at least given number of elements
+            public int Alloc(int size)
+            {
+                int cls = 0;
+                while ((minSize << cls) < size)
+                {
+                    cls++;
+                    if (cls >= MAX_CLASS)
+                    {
+                        throw new ArgumentOutOfRangeException("size", "slab block too big (" + size + ")");
+                    }
+                }
+
+                int blockSize = minSize << cls;
+                int index;
+                if (free[cls] != null && free[cls].Count > 0)
+                {
+                    index = free[cls].Pop();
+                    Array.Clear(arena[cls], index * blockSize, blockSize);
+                }
+                else
+                {
+                    index = allocated[cls]++;
+                    if (index > INDEX_MASK)
+                    {
+                        throw new OutOfMemoryException("slab size class " + cls + " is full");
+                    }
+                    if (arena[cls] == null || arena[cls].Length < (index + 1) * blockSize)
+                    {
+                        int blocks = (arena[cls] == null ? 16 : 2 * arena[cls].Length / blockSize);
+                        Array.Resize(ref arena[cls], blocks * blockSize);
+                    }
+                }
+
+                return (cls << CLASS_SHIFT) | index;
+            }
+
+            public void Free(int handle)
+            {
+                int cls = handle >> CLASS_SHIFT;
+                if (free[cls] == null)
+                {
+                    free[cls] = new Stack<int>();
+                }
+                free[cls].Push(handle & INDEX_MASK);
+            }
+
+            // read-only copy of allocated blocks (free lists are not copied)
+            public Slab<T> Snapshot()
+            {
+                Slab<T> ret = new Slab<T>(minSize);
+                for (int cls = 0; cls < MAX_CLASS; cls++)
+                {
+                    if (arena[cls] == null)
+                        continue;
+
+                    int length = Math.Min(arena[cls].Length, allocated[cls] * (minSize << cls));
+                    ret.arena[cls] = new T[length];
+                    Array.Copy(arena[cls], ret.arena[cls], length);
+                    ret.allocated[cls] = allocated[cls];
+                }
+                return ret;
+            }
+        }
+
+
+#if DEBUG
+        // Memory and time used to track failed logins for many distinct
+        // addresses (e.g. password spraying from large botnet)
+        public static void Benchmark(int addresses)
+        {
+            long findtime = 600 * TimeSpan.TicksPerSecond;
+            HistoryType[] types = { HistoryType.ALL, HistoryType.ONE, HistoryType.FIXED, HistoryType.RRD };
+
+            Console.WriteLine("{0} addresses: add [ms], cleanup [ms], table [bytes/address], heap [bytes/address]", addresses);
+            foreach (HistoryType type in types)
+            {
+                long before = GC.GetTotalMemory(true);
+
+                FailTable table = new FailTable(type, findtime, 10, 1.0, 3);
+                long now = DateTime.Now.Ticks;
+                byte[] bytes = new byte[16];
+                bytes[10] = 0xff;
+                bytes[11] = 0xff;
+
+                Stopwatch sw = Stopwatch.StartNew();
+                for (int i = 0; i < addresses; i++)
+                {
+                    // distinct IPv4 addresses mapped to IPv6 (few
+                    // addresses with repeated failed logins)
+                    int a = (i % 1000 == 0 ? i / 2 : i);
+                    bytes[12] = (byte)(10 + (a >> 24));
+                    bytes[13] = (byte)(a >> 16);
+                    bytes[14] = (byte)(a >> 8);
+                    bytes[15] = (byte)a;
+                    table.Add(new IPAddress(bytes), now);
+                }
+                long addTime = sw.ElapsedMilliseconds;
+
+                sw.Restart();
+                table.Expire(now, long.MaxValue, null);
+                long cleanupTime = sw.ElapsedMilliseconds;
+
+                long after = GC.GetTotalMemory(true);
+                Console.WriteLine("  {0,-6} {1,8} {2,8} {3,8:F1} {4,8:F1}", type, addTime, cleanupTime,
+                    (double)table.Bytes / table.Count, (double)(after - before) / table.Count);
+                GC.KeepAlive(table);
+            }
+        }
+
+        // Memory, time and precision of history with long findtime and
+        // many failed logins per address (slow brute force spread over
+        // days), fail counter is compared with exact FailAll history
+        public static void BenchmarkFindtime(int addresses, int failures)
+        {
+            long findtime = 7 * TimeSpan.TicksPerDay;
+            long step = (2 * findtime) / failures;
+            HistoryType[] types = { HistoryType.ALL, HistoryType.FIXED, HistoryType.RRD };
+            int[] exact = new int[addresses];
+
+            Console.WriteLine("{0} addresses, {1} failures in {2} days: add [ns/failure], table [bytes/address], heap [bytes/address], error [%]",
+                addresses, failures, 2 * findtime / TimeSpan.TicksPerDay);
+            foreach (HistoryType type in types)
+            {
+                long before = GC.GetTotalMemory(true);
+
+                // hourly slots for FailFixed, RRD with minutes, hours and days
+                FailTable table = new FailTable(type, findtime, type == HistoryType.RRD ? 7 : 168, 1.0, 3);
+                long now = DateTime.Now.Ticks;
+                long events = 0, error = 0, total = 0;
+
+                Stopwatch sw = Stopwatch.StartNew();
+                for (int f = 0; f < failures; f++)
+                {
+                    now += step;
+                    for (int i = 0; i < addresses; i++)
+                    {
+                        // address with more failed logins in second half
+                        if (i % 2 == 1 && f < failures / 2 && f % 4 != 0)
+                            continue;
+
+                        // IPv4 addresses 10.x.x.x mapped to IPv6
+                        int ret = table.Add(0, 0xffff0a000000UL + (ulong)i, now, now + i);
+                        events++;
+                        if (f == failures - 1)
+                        {
+                            if (type == HistoryType.ALL)
+                                exact[i] = ret;
+                            error += Math.Abs(ret - exact[i]);
+                            total += exact[i];
+                        }
+                    }
+                }
+                long addTime = sw.ElapsedTicks;
+
+                long after = GC.GetTotalMemory(true);
+                Console.WriteLine("  {0,-6} {1,8:F1} {2,8:F1} {3,8:F1} {4,8:F2}", type,
+                    addTime * (1e9 / Stopwatch.Frequency) / events,
+                    (double)table.Bytes / table.Count, (double)(after - before) / table.Count,
+                    100.0 * error / Math.Max(1, total));
+                GC.KeepAlive(table);
+            }
+        }
+#endif
+    }
+}
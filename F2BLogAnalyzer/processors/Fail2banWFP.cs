@@ -11,9 +11,18 @@ namespace F2B.processors
         #region Fields
         private int cleanup;
         private int max_filter_rules;
+        private FwEvictionPolicy eviction;
+        private int eviction_prefix_ipv4;
+        private int eviction_prefix_ipv6;
         private ulong weight;
         private bool permit;
         private bool persistent;
+        private int bucket_size;
+        private int bucket_granularity;
+        private string coalesce_ipv4;
+        private string coalesce_ipv6;
+        private int queue_size;
+        private string state_file;
         #endregion
 
         #region Constructors
@@ -40,12 +49,42 @@ namespace F2B.processors
                 max_filter_rules = int.Parse(config.Options["max_filter_rules"].Value);
             }
 
+            // state file is used when FwManager is created
+            state_file = null;
+            if (config.Options["state_file"] != null && !string.IsNullOrEmpty(config.Options["state_file"].Value))
+            {
+                state_file = config.Options["state_file"].Value;
+                FwManager.StateFile = state_file;
+            }
+
             if (FwManager.Instance.Interval > 1000 * cleanup)
             {
                 FwManager.Instance.Interval = 1000 * cleanup;
             }
             FwManager.Instance.MaxSize = max_filter_rules;
 
+            eviction = FwEvictionPolicy.None;
+            if (config.Options["eviction"] != null && !string.IsNullOrEmpty(config.Options["eviction"].Value))
+            {
+                eviction = (FwEvictionPolicy)Enum.Parse(typeof(FwEvictionPolicy), config.Options["eviction"].Value, true);
+            }
+
+            eviction_prefix_ipv4 = 24;
+            if (config.Options["eviction_prefix_ipv4"] != null)
+            {
+                eviction_prefix_ipv4 = int.Parse(config.Options["eviction_prefix_ipv4"].Value);
+            }
+
+            eviction_prefix_ipv6 = 64;
+            if (config.Options["eviction_prefix_ipv6"] != null)
+            {
+                eviction_prefix_ipv6 = int.Parse(config.Options["eviction_prefix_ipv6"].Value);
+            }
+
+            FwManager.Instance.EvictionPolicy = eviction;
+            FwManager.Instance.EvictionPrefixIPv4 = eviction_prefix_ipv4;
+            FwManager.Instance.EvictionPrefixIPv6 = eviction_prefix_ipv6;
+
             weight = 0;
             if (config.Options["weight"] != null)
             {
@@ -63,10 +102,63 @@ namespace F2B.processors
             {
                 persistent = bool.Parse(config.Options["persistent"].Value);
             }
+
+            bucket_size = 0;
+            if (config.Options["bucket_size"] != null)
+            {
+                bucket_size = int.Parse(config.Options["bucket_size"].Value);
+            }
+
+            bucket_granularity = 300;
+            if (config.Options["bucket_granularity"] != null)
+            {
+                int tmp = int.Parse(config.Options["bucket_granularity"].Value);
+                if (tmp > 0)
+                {
+                    bucket_granularity = tmp;
+                }
+                else
+                {
+                    Log.Error("Ignoring invalid bucket granularity " + tmp);
+                }
+            }
+
+            coalesce_ipv4 = null;
+            if (config.Options["coalesce_ipv4"] != null)
+            {
+                coalesce_ipv4 = config.Options["coalesce_ipv4"].Value;
+            }
+
+            coalesce_ipv6 = null;
+            if (config.Options["coalesce_ipv6"] != null)
+            {
+                coalesce_ipv6 = config.Options["coalesce_ipv6"].Value;
+            }
+
+            queue_size = 0;
+            if (config.Options["queue_size"] != null)
+            {
+                queue_size = int.Parse(config.Options["queue_size"].Value);
+            }
+
+            FwManager.Instance.BucketSize = bucket_size;
+            FwManager.Instance.BucketGranularity = bucket_granularity * TimeSpan.TicksPerSecond;
+            FwManager.Instance.CoalesceIPv4 = coalesce_ipv4;
+            FwManager.Instance.CoalesceIPv6 = coalesce_ipv6;
+            FwManager.Instance.QueueSize = queue_size;
         }
         #endregion
 
         #region Override
+        public override void Stop()
+        {
+            // queued filter rules must be installed before shutdown
+            if (!FwManager.Instance.Flush(30000))
+            {
+                Log.Warn("Fail2banWFP[" + Name + "]: Unable to process all queued WFP operations");
+            }
+        }
+
         protected override void ExecuteFail2banAction(EventEntry evtlog, IPAddress addr, int prefix, long expiration)
         {
             F2B.FwData fwData = new F2B.FwData(expiration, addr, prefix);
@@ -79,9 +171,18 @@ namespace F2B.processors
         {
             output.WriteLine("config cleanup: " + cleanup);
             output.WriteLine("config max_filter_rules: " + max_filter_rules);
+            output.WriteLine("config eviction: " + eviction);
+            output.WriteLine("config eviction_prefix_ipv4: " + eviction_prefix_ipv4);
+            output.WriteLine("config eviction_prefix_ipv6: " + eviction_prefix_ipv6);
             output.WriteLine("config weight: " + weight);
             output.WriteLine("config permit: " + permit);
             output.WriteLine("config persistent: " + persistent);
+            output.WriteLine("config bucket_size: " + bucket_size);
+            output.WriteLine("config bucket_granularity: " + bucket_granularity);
+            output.WriteLine("config coalesce_ipv4: " + coalesce_ipv4);
+            output.WriteLine("config coalesce_ipv6: " + coalesce_ipv6);
+            output.WriteLine("config queue_size: " + queue_size);
+            output.WriteLine("config state_file: " + state_file);
             base.Debug(output);
             output.WriteLine("FwManager:");
             F2B.FwManager.Instance.Debug(output);
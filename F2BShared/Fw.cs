@@ -4,7 +4,6 @@ using System.IO;
 using System.Linq;
 using System.Net;
 using System.Net.Sockets;
-using System.Security.Cryptography;
 using System.Text;
 using System.Timers;
 
@@ -44,7 +43,17 @@ namespace F2B
             {
                 throw new ArgumentNullException("key");
             }
-            return key.Sum(b => b);
+            // FNV-1a (sum of bytes puts all 16 byte rule hashes
+            // in few thousand buckets)
+            unchecked
+            {
+                int hash = (int)2166136261;
+                for (int i = 0; i < key.Length; i++)
+                {
+                    hash = (hash ^ key[i]) * 16777619;
+                }
+                return hash;
+            }
         }
     }
 
@@ -65,11 +74,32 @@ namespace F2B
             { F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_PROTOCOL, 1 + 1 },
         };
 
+        // record size indexed by F2B_FWDATA_TYPE0_ENUM (0 .. unknown type)
+        private static readonly int[] RecordSize;
+
+        static FwData()
+        {
+            RecordSize = new int[256];
+            foreach (var item in DataSize)
+            {
+                RecordSize[(byte)item.Key] = item.Value;
+            }
+        }
+
         public long Expire { get; set; }
 
-        private MemoryStream stream;
-        private BinaryReader reader;
-        private BinaryWriter writer;
+        // records are written directly in byte buffer with fixed layout
+        // (big endian, same as type-0 wire format), buffer grows only
+        // when it is not big enough for new record
+        private byte[] buffer;
+        private int length;
+        private bool shared; // buffer is owned by caller (decoded data)
+        private byte[] owned; // own buffer kept while decoded data is used
+
+        // MD5 of records is updated while they are written, full blocks
+        // are hashed directly from buffer up to this position
+        private Md5 md5;
+        private int hashed;
 
         private byte[] cachedHash = null;
 
@@ -100,13 +130,27 @@ namespace F2B
                 throw new InvalidDataException("No expiration record at the beginning of FwData data");
             }
 
-            int expSize = DataSize[F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION];
+            return GetHash(data, data.Length);
+        }
 
-            MD5 md5 = MD5.Create();
-            return md5.ComputeHash(data, expSize, data.Length - expSize);
+        // Hash of records (without expiration) in first length bytes
+        private static byte[] GetHash(byte[] data, int length)
+        {
+            int expSize = RecordSize[(byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION];
+
+            return Md5.Compute(data, expSize, length - expSize);
         }
 
-        public static string EncodeName(long expiration, byte[] hash)
+        // MD5 hash of arbitrary data (used for names of filters that
+        // are not created from one FwData)
+        public static byte[] ComputeHash(byte[] data)
+        {
+            return Md5.Compute(data, 0, data.Length);
+        }
+
+        // Binary metadata stored in WFP filter providerData (layout must
+        // be kept in sync with F2B_FILTER_METADATA0 in F2BWFP/F2BWFP.h)
+        public static byte[] EncodeMetadata(long expiration, byte[] hash)
         {
             byte[] tmp = new byte[4 + 8 + hash.Length];
             byte[] exp = BitConverter.GetBytes(expiration);
@@ -121,7 +165,12 @@ namespace F2B
             Array.Copy(exp, 0, tmp, 4, exp.Length);
             Array.Copy(hash, 0, tmp, 4 + 8, hash.Length);
 
-            return "F2B B64 " + Convert.ToBase64String(tmp);
+            return tmp;
+        }
+
+        public static string EncodeName(long expiration, byte[] hash)
+        {
+            return "F2B B64 " + Convert.ToBase64String(EncodeMetadata(expiration, hash));
         }
 
         public static Tuple<long, byte[]> DecodeName(string name)
@@ -177,14 +226,9 @@ namespace F2B
 
         public FwData(long expiration)
         {
-            this.cachedHash = null;
-            this.Expire = expiration;
-            this.stream = new MemoryStream();
-            this.reader = new BinaryReader(this.stream);
-            this.writer = new BinaryWriter(this.stream);
-
-            writer.Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION);
-            writer.Write(IPAddress.HostToNetworkOrder(expiration));
+            // expiration and one address with prefix fits without resize
+            this.buffer = new byte[RecordSize[(byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION] + RecordSize[(byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6_AND_PREFIX]];
+            Reset(expiration);
         }
 
         public FwData(long expiration, IPAddress addr) : this(expiration)
@@ -220,25 +264,31 @@ namespace F2B
                         + DataSize[item.Item1] + ") for data type " + item.Item1);
                 }
 
-                writer.Write((byte)item.Item1);
-                writer.Write(item.Item2);
+                Write((byte)item.Item1);
+                Write(item.Item2);
             }
+
+            Update();
         }
 
+        // Decode type-0 data, data array is used directly (not copied)
+        // and must not be modified by caller
         public FwData(byte[] data)
         {
-            this.cachedHash = null;
-            this.Expire = Expiration(data);
-            this.stream = new MemoryStream(data);
-            this.reader = new BinaryReader(this.stream);
-            this.writer = new BinaryWriter(this.stream);
+            Load(data);
+        }
+
+        // Reuse this object for decoded type-0 data (same as decoding
+        // constructor, own buffer is kept for next Reset)
+        public void Load(byte[] data)
+        {
+            long expiration = Expiration(data);
 
             // validate input data
-            int pos = DataSize[F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION];
+            int pos = RecordSize[(byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION];
             while (pos < data.Length)
             {
-                int size = 0;
-                DataSize.TryGetValue((F2B_FWDATA_TYPE0_ENUM)data[pos], out size);
+                int size = RecordSize[data[pos]];
 
                 if (size == 0)
                 {
@@ -254,6 +304,110 @@ namespace F2B
 
                 pos += size;
             }
+
+            if (!shared)
+            {
+                owned = buffer;
+            }
+
+            this.cachedHash = null;
+            this.Expire = expiration;
+            this.buffer = data;
+            this.length = data.Length;
+            this.shared = true;
+
+            md5.Initialize();
+            hashed = RecordSize[(byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION];
+            Update();
+        }
+
+        // Reuse this object for new data with given expiration
+        // (existing buffer is kept, so encoding doesn't allocate)
+        public void Reset(long expiration)
+        {
+            this.cachedHash = null;
+            this.Expire = expiration;
+            this.length = 0;
+
+            if (shared)
+            {
+                buffer = owned ?? new byte[RecordSize[(byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION] + RecordSize[(byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6_AND_PREFIX]];
+                owned = null;
+                shared = false;
+            }
+
+            Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION);
+            Write(expiration);
+
+            md5.Initialize();
+            hashed = length;
+        }
+
+        // Hash all full blocks of written records
+        private void Update()
+        {
+            while (length - hashed >= Md5.BlockSize)
+            {
+                md5.Transform(buffer, hashed);
+                hashed += Md5.BlockSize;
+            }
+        }
+
+        private void Reserve(int size)
+        {
+            if (length + size <= buffer.Length)
+            {
+                return;
+            }
+
+            byte[] tmp = new byte[Math.Max(2 * buffer.Length, length + size)];
+            Array.Copy(buffer, tmp, length);
+            buffer = tmp;
+            owned = null;
+            shared = false;
+        }
+
+        private void Write(byte value)
+        {
+            Reserve(1);
+            buffer[length++] = value;
+        }
+
+        private void Write(byte[] value)
+        {
+            Reserve(value.Length);
+            Array.Copy(value, 0, buffer, length, value.Length);
+            length += value.Length;
+        }
+
+        // IPv4 address without GetAddressBytes() copy
+        private void WriteIPv4(IPAddress addr)
+        {
+#pragma warning disable 618
+            long value = addr.Address; // first address byte is lowest byte
+#pragma warning restore 618
+            Reserve(4);
+            for (int shift = 0; shift < 32; shift += 8)
+            {
+                buffer[length++] = (byte)(value >> shift);
+            }
+        }
+
+        // integers are stored in network byte order
+        private void Write(short value)
+        {
+            Reserve(2);
+            buffer[length++] = (byte)(value >> 8);
+            buffer[length++] = (byte)value;
+        }
+
+        private void Write(long value)
+        {
+            Reserve(8);
+            for (int shift = 56; shift >= 0; shift -= 8)
+            {
+                buffer[length++] = (byte)(value >> shift);
+            }
         }
 
         public void Add(byte[] data)
@@ -273,7 +427,8 @@ namespace F2B
 
             cachedHash = null;
 
-            writer.Write(data);
+            Write(data);
+            Update();
         }
 
         public void Add(F2B_FWDATA_TYPE0_ENUM type, byte[] data)
@@ -286,8 +441,9 @@ namespace F2B
 
             cachedHash = null;
 
-            writer.Write((byte)type);
-            writer.Write(data);
+            Write((byte)type);
+            Write(data);
+            Update();
         }
 
         public void Add(IPAddress addr)
@@ -302,39 +458,42 @@ namespace F2B
 
             if (addr.AddressFamily == AddressFamily.InterNetwork)
             {
-                writer.Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv4);
+                Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv4);
+                WriteIPv4(addr);
             }
             else
             {
-                writer.Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6);
+                Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6);
+                Write(addr.GetAddressBytes());
             }
-            writer.Write(addr.GetAddressBytes());
+            Update();
         }
 
         public void Add(IPAddress addr, int prefix)
         {
             cachedHash = null;
 
-            if (addr.IsIPv4MappedToIPv6)
+            // mapped IPv4 address with prefix shorter than 96 covers also
+            // addresses outside ::ffff:0:0/96 and it must stay IPv6 prefix
+            if (addr.IsIPv4MappedToIPv6 && prefix >= 96)
             {
                 // workaround for buggy MapToIPv4 implementation
                 addr = Fixes.MapToIPv4(addr);
-                if (prefix >= 96)
-                {
-                    prefix -= 96;
-                }
+                prefix -= 96;
             }
 
             if (addr.AddressFamily == AddressFamily.InterNetwork)
             {
-                writer.Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv4_AND_PREFIX);
+                Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv4_AND_PREFIX);
+                WriteIPv4(addr);
             }
             else
             {
-                writer.Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6_AND_PREFIX);
+                Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6_AND_PREFIX);
+                Write(addr.GetAddressBytes());
             }
-            writer.Write(addr.GetAddressBytes());
-            writer.Write((byte)prefix);
+            Write((byte)prefix);
+            Update();
         }
 
         public void Add(IPAddress addrLow, IPAddress addrHigh)
@@ -359,44 +518,126 @@ namespace F2B
 
             if (addrLow.AddressFamily == AddressFamily.InterNetwork)
             {
-                writer.Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv4_RANGE);
+                Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv4_RANGE);
+                WriteIPv4(addrLow);
+                WriteIPv4(addrHigh);
             }
             else
             {
-                writer.Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6_RANGE);
+                Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6_RANGE);
+                Write(addrLow.GetAddressBytes());
+                Write(addrHigh.GetAddressBytes());
             }
-            writer.Write(addrLow.GetAddressBytes());
-            writer.Write(addrHigh.GetAddressBytes());
+            Update();
         }
 
         public void Add(short port)
         {
             cachedHash = null;
 
-            writer.Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_PORT);
-            writer.Write(IPAddress.HostToNetworkOrder(port));
+            Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_PORT);
+            Write(port);
+            Update();
         }
 
         public void Add(short portLow, short portHigh)
         {
             cachedHash = null;
 
-            writer.Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_PORT_RANGE);
-            writer.Write(IPAddress.HostToNetworkOrder(portLow));
-            writer.Write(IPAddress.HostToNetworkOrder(portHigh));
+            Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_PORT_RANGE);
+            Write(portLow);
+            Write(portHigh);
+            Update();
         }
 
         public void Add(ProtocolType protocol)
         {
             cachedHash = null;
 
-            writer.Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_PROTOCOL);
-            writer.Write((byte)protocol);
+            Write((byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_PROTOCOL);
+            Write((byte)protocol);
+            Update();
         }
 
         public byte[] ToArray()
         {
-            return stream.ToArray();
+            byte[] ret = new byte[length];
+            Array.Copy(buffer, ret, length);
+            return ret;
+        }
+
+        // Size of encoded data
+        public int Length
+        {
+            get { return length; }
+        }
+
+        // Write encoded data without creating temporary copy
+        public void WriteTo(Stream output)
+        {
+            output.Write(buffer, 0, length);
+        }
+
+        // Encoded data in array with exact size (internal buffer is
+        // trimmed, so later calls doesn't allocate)
+        private byte[] Data()
+        {
+            if (buffer.Length != length)
+            {
+                Array.Resize(ref buffer, length);
+                owned = null;
+                shared = false;
+            }
+            return buffer;
+        }
+
+        // Get address for data with just one IPv4/IPv6 address (or prefix)
+        // record, returns false for all other (more complex) rules
+        public bool SingleAddress(out IPAddress addr, out int prefix)
+        {
+            addr = null;
+            prefix = 0;
+
+            byte[] data = buffer;
+
+            int pos = RecordSize[(byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION];
+            if (pos >= length)
+            {
+                return false;
+            }
+
+            F2B_FWDATA_TYPE0_ENUM type = (F2B_FWDATA_TYPE0_ENUM)data[pos];
+            int size = RecordSize[data[pos]];
+            if (size == 0 || pos + size != length)
+            {
+                return false;
+            }
+
+            switch (type)
+            {
+                case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv4:
+                case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv4_AND_PREFIX:
+                    addr = new IPAddress((uint)(data[pos + 1] | data[pos + 2] << 8 | data[pos + 3] << 16 | data[pos + 4] << 24));
+                    prefix = (type == F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv4 ? 32 : Math.Min((int)data[pos + 1 + 4], 32));
+                    break;
+                case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6:
+                case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6_AND_PREFIX:
+                    byte[] baddr6 = new byte[16];
+                    Array.Copy(data, pos + 1, baddr6, 0, 16);
+                    addr = new IPAddress(baddr6);
+                    prefix = (type == F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6 ? 128 : Math.Min((int)data[pos + 1 + 16], 128));
+                    if (addr.IsIPv4MappedToIPv6 && prefix >= 96)
+                    {
+                        // workaround for buggy MapToIPv4 implementation
+                        addr = Fixes.MapToIPv4(addr);
+                        prefix = Math.Min(prefix - 96, 32);
+                    }
+                    break;
+                default:
+                    return false;
+            }
+
+            return true;
         }
 
         public byte[] Hash
@@ -405,19 +646,32 @@ namespace F2B
             {
                 if (cachedHash == null)
                 {
-                    byte[] data = this.ToArray();
-                    cachedHash = GetHash(data);
+                    byte[] hash = new byte[Md5.HashSize];
+                    WriteHash(hash, 0);
+                    cachedHash = hash;
                 }
 
                 return cachedHash;
             }
         }
 
-        public string Name()
+        // Write hash in caller's array without allocation (Hash returns
+        // new array for every data, because callers keep it as a key)
+        public void WriteHash(byte[] hash, int offset)
         {
-            byte[] data = this.ToArray();
+            if (cachedHash != null)
+            {
+                Array.Copy(cachedHash, 0, hash, offset, cachedHash.Length);
+                return;
+            }
 
-            return EncodeName(Expire, GetHash(data));
+            int expSize = RecordSize[(byte)F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION];
+            md5.Final(buffer, hashed, length - hashed, length - expSize, hash, offset);
+        }
+
+        public string Name()
+        {
+            return EncodeName(Expire, Hash);
         }
 
         public override string ToString()
@@ -426,7 +680,7 @@ namespace F2B
 
             ret.Append("FwData[expiration=" + Expire + ",md5=" + BitConverter.ToString(this.Hash).Replace("-", ":") + "](");
 
-            byte[] data = stream.ToArray();
+            byte[] data = Data();
 
             int pos = DataSize[F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION];
             while (pos < data.Length)
@@ -530,7 +784,7 @@ namespace F2B
 
             output.WriteLine("  FwData[expiration=" + Expire + " (" + tmp + "), md5=" + BitConverter.ToString(this.Hash).Replace("-", ":") + "]");
 
-            byte[] data = stream.ToArray();
+            byte[] data = Data();
 
             int pos = DataSize[F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION];
             while (pos < data.Length)
@@ -0,0 +1,152 @@
+﻿using System;
+
+namespace F2B
+{
+    // MD5 with caller owned state and output buffer. HashAlgorithm in
+    // .Net 4.5 allocates result array for every hash and can't copy its
+    // incremental state, FwData needs both to hash records while they
+    // are encoded without allocations.
+    public struct Md5
+    {
+        private static readonly int[] Shift =
+        {
+            7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+            5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+            4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+            6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+        };
+
+        private static readonly uint[] K;
+
+        // padding of last block (per thread, final block is built there)
+        [ThreadStatic]
+        private static byte[] tail;
+
+        public const int BlockSize = 64;
+        public const int HashSize = 16;
+
+        private uint a, b, c, d;
+
+        static Md5()
+        {
+            K = new uint[64];
+            for (int i = 0; i < K.Length; i++)
+            {
+                K[i] = (uint)(long)Math.Floor(Math.Abs(Math.Sin(i + 1)) * 4294967296.0);
+            }
+        }
+
+        public void Initialize()
+        {
+            a = 0x67452301;
+            b = 0xefcdab89;
+            c = 0x98badcfe;
+            d = 0x10325476;
+        }
+
+        // Process one full block starting at given offset
+        public void Transform(byte[] data, int offset)
+        {
+            uint aa = a, bb = b, cc = c, dd = d;
+
+            for (int i = 0; i < 64; i++)
+            {
+                uint f;
+                int g;
+                if (i < 16)
+                {
+                    f = (bb & cc) | (~bb & dd);
+                    g = i;
+                }
+                else if (i < 32)
+                {
+                    f = (dd & bb) | (~dd & cc);
+                    g = (5 * i + 1) & 15;
+                }
+                else if (i < 48)
+                {
+                    f = bb ^ cc ^ dd;
+                    g = (3 * i + 5) & 15;
+                }
+                else
+                {
+                    f = cc ^ (bb | ~dd);
+                    g = (7 * i) & 15;
+                }
+
+                int pos = offset + 4 * g;
+                uint m = (uint)(data[pos] | data[pos + 1] << 8 | data[pos + 2] << 16 | data[pos + 3] << 24);
+                uint x = aa + f + K[i] + m;
+
+                aa = dd;
+                dd = cc;
+                cc = bb;
+                bb = bb + (x << Shift[i] | x >> (32 - Shift[i]));
+            }
+
+            a += aa;
+            b += bb;
+            c += cc;
+            d += dd;
+        }
+
+        // Finish hash with remaining data (less than one block) and write
+        // result in hash array, total is number of all hashed bytes (state
+        // of this instance is not modified, so more blocks can follow)
+        public void Final(byte[] data, int offset, int count, long total, byte[] hash, int hashOffset)
+        {
+            if (tail == null)
+            {
+                tail = new byte[2 * BlockSize];
+            }
+
+            Md5 tmp = this;
+
+            Array.Copy(data, offset, tail, 0, count);
+            tail[count] = 0x80;
+            int size = (count + 1 + 8 <= BlockSize ? BlockSize : 2 * BlockSize);
+            Array.Clear(tail, count + 1, size - count - 1);
+
+            long bits = total << 3;
+            for (int i = 0; i < 8; i++)
+            {
+                tail[size - 8 + i] = (byte)(bits >> (8 * i));
+            }
+
+            for (int pos = 0; pos < size; pos += BlockSize)
+            {
+                tmp.Transform(tail, pos);
+            }
+
+            Write(tmp.a, hash, hashOffset);
+            Write(tmp.b, hash, hashOffset + 4);
+            Write(tmp.c, hash, hashOffset + 8);
+            Write(tmp.d, hash, hashOffset + 12);
+        }
+
+        private static void Write(uint value, byte[] hash, int offset)
+        {
+            hash[offset] = (byte)value;
+            hash[offset + 1] = (byte)(value >> 8);
+            hash[offset + 2] = (byte)(value >> 16);
+            hash[offset + 3] = (byte)(value >> 24);
+        }
+
+        public static byte[] Compute(byte[] data, int offset, int count)
+        {
+            Md5 md5 = new Md5();
+            md5.Initialize();
+
+            int pos = offset;
+            for (; pos + BlockSize <= offset + count; pos += BlockSize)
+            {
+                md5.Transform(data, pos);
+            }
+
+            byte[] hash = new byte[HashSize];
+            md5.Final(data, pos, offset + count - pos, count, hash, 0);
+
+            return hash;
+        }
+    }
+}
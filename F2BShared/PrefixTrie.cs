@@ -0,0 +1,228 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Net;
+using System.Net.Sockets;
+
+namespace F2B
+{
+    // Binary trie for IPv4 and IPv6 prefixes. Each node keeps number
+    // of prefixes stored in its subtree, so it is cheap to find out how
+    // many active entries are covered by any shorter prefix.
+    public class PrefixTrie<T>
+    {
+        private class Node
+        {
+            public Node[] child = new Node[2];
+            public int count = 0; // number of entries in this subtree
+            public bool used = false;
+            public T value;
+        }
+
+        private Node root4 = new Node();
+        private Node root6 = new Node();
+
+        public int Count
+        {
+            get { return root4.count + root6.count; }
+        }
+
+
+        // Address bytes (IPv4 mapped to IPv6 with prefix >= 96 is used as IPv4 address)
+        // with prefix length limited by address size
+        private static byte[] Normalize(ref IPAddress addr, ref int prefix)
+        {
+            if (addr.IsIPv4MappedToIPv6 && prefix >= 96)
+            {
+                addr = Fixes.MapToIPv4(addr);
+                prefix -= 96;
+            }
+
+            byte[] bytes = addr.GetAddressBytes();
+            prefix = Math.Max(0, Math.Min(prefix, 8 * bytes.Length));
+
+            return bytes;
+        }
+
+        private static int Bit(byte[] bytes, int pos)
+        {
+            return (bytes[pos >> 3] >> (7 - (pos & 7))) & 1;
+        }
+
+        private Node Root(IPAddress addr)
+        {
+            return (addr.AddressFamily == AddressFamily.InterNetwork ? root4 : root6);
+        }
+
+        // Find node for given prefix (null if it doesn't exist)
+        private Node Find(IPAddress addr, int prefix)
+        {
+            byte[] bytes = Normalize(ref addr, ref prefix);
+
+            Node node = Root(addr);
+            for (int i = 0; i < prefix && node != null; i++)
+            {
+                node = node.child[Bit(bytes, i)];
+            }
+
+            return node;
+        }
+
+
+        // Network address for given address and prefix length
+        public static IPAddress Network(IPAddress addr, int prefix)
+        {
+            byte[] bytes = Normalize(ref addr, ref prefix);
+
+            for (int i = prefix; i < 8 * bytes.Length; i++)
+            {
+                bytes[i >> 3] &= (byte)~(1 << (7 - (i & 7)));
+            }
+
+            return new IPAddress(bytes);
+        }
+
+
+        // Add new entry or update value of existing entry, returns
+        // true for new entries
+        public bool Add(IPAddress addr, int prefix, T value)
+        {
+            Node node = Find(addr, prefix);
+            if (node != null && node.used)
+            {
+                node.value = value;
+                return false;
+            }
+
+            byte[] bytes = Normalize(ref addr, ref prefix);
+
+            node = Root(addr);
+            node.count++;
+            for (int i = 0; i < prefix; i++)
+            {
+                int bit = Bit(bytes, i);
+                if (node.child[bit] == null)
+                {
+                    node.child[bit] = new Node();
+                }
+                node = node.child[bit];
+                node.count++;
+            }
+
+            node.used = true;
+            node.value = value;
+
+            return true;
+        }
+
+
+        public bool Remove(IPAddress addr, int prefix)
+        {
+            Node node = Find(addr, prefix);
+            if (node == null || !node.used)
+            {
+                return false;
+            }
+
+            byte[] bytes = Normalize(ref addr, ref prefix);
+
+            // decrement counters and release subtrees without entries
+            node = Root(addr);
+            node.count--;
+            for (int i = 0; i < prefix; i++)
+            {
+                int bit = Bit(bytes, i);
+                Node next = node.child[bit];
+                next.count--;
+                if (next.count == 0)
+                {
+                    node.child[bit] = null;
+                }
+                node = next;
+            }
+
+            node.used = false;
+            node.value = default(T);
+
+            return true;
+        }
+
+
+        public bool TryGetValue(IPAddress addr, int prefix, out T value)
+        {
+            Node node = Find(addr, prefix);
+            if (node == null || !node.used)
+            {
+                value = default(T);
+                return false;
+            }
+
+            value = node.value;
+            return true;
+        }
+
+
+        // Number of entries equal or more specific than given prefix
+        public int CountWithin(IPAddress addr, int prefix)
+        {
+            Node node = Find(addr, prefix);
+
+            return (node != null ? node.count : 0);
+        }
+
+
+        // All entries equal or more specific than given prefix
+        public IList<Tuple<IPAddress, int, T>> Within(IPAddress addr, int prefix)
+        {
+            List<Tuple<IPAddress, int, T>> ret = new List<Tuple<IPAddress, int, T>>();
+
+            Normalize(ref addr, ref prefix);
+
+            Node node = Find(addr, prefix);
+            if (node != null)
+            {
+                Collect(node, Network(addr, prefix).GetAddressBytes(), prefix, ret);
+            }
+
+            return ret;
+        }
+
+
+        // All entries stored in this trie
+        public IList<Tuple<IPAddress, int, T>> Entries()
+        {
+            List<Tuple<IPAddress, int, T>> ret = new List<Tuple<IPAddress, int, T>>();
+
+            Collect(root4, new byte[4], 0, ret);
+            Collect(root6, new byte[16], 0, ret);
+
+            return ret;
+        }
+
+
+        private static void Collect(Node node, byte[] bytes, int depth, List<Tuple<IPAddress, int, T>> ret)
+        {
+            if (node.used)
+            {
+                ret.Add(new Tuple<IPAddress, int, T>(new IPAddress((byte[])bytes.Clone()), depth, node.value));
+            }
+
+            for (int bit = 0; bit < 2; bit++)
+            {
+                if (node.child[bit] == null)
+                {
+                    continue;
+                }
+
+                if (bit == 1)
+                {
+                    bytes[depth >> 3] |= (byte)(1 << (7 - (depth & 7)));
+                }
+                Collect(node.child[bit], bytes, depth + 1, ret);
+                if (bit == 1)
+                {
+                    bytes[depth >> 3] &= (byte)~(1 << (7 - (depth & 7)));
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,388 @@
+﻿using System;
+using System.Collections.Generic;
+
+namespace F2B
+{
+    // Hierarchical timing wheel for entries with expiration time. Entries
+    // can share same expiration, insert / reschedule / remove are O(1)
+    // and Expire returns all entries that expired since previous call.
+    // Expiration is rounded up to wheel resolution, so entries are
+    // returned at most one resolution after their expiration.
+    public class TimingWheel<K, V>
+    {
+        private const int SlotBits = 8;
+        private const int Slots = 1 << SlotBits;
+        private const int SlotMask = Slots - 1;
+        private const int Levels = 4;
+        private const int Due = Levels; // list of already expired entries
+        private const int Overflow = Levels + 1; // too far in future
+
+        private class Entry
+        {
+            public K key;
+            public V value;
+            public long expiration;
+            public long tick;
+            public int list; // level (or Due / Overflow)
+            public int slot;
+            public Entry prev;
+            public Entry next;
+        }
+
+        private readonly long resolution;
+        private long current; // last processed tick
+        private long overflowTick = long.MaxValue; // first tick in Overflow list
+        private Entry[] heads = new Entry[Levels * Slots + 2];
+        private int[] counts = new int[Levels + 2];
+        private Dictionary<K, Entry> index;
+
+        public int Count
+        {
+            get { return index.Count; }
+        }
+
+        public long Resolution
+        {
+            get { return resolution; }
+        }
+
+
+        public TimingWheel(long resolution, long currtime, IEqualityComparer<K> comparer = null)
+        {
+            if (resolution <= 0)
+            {
+                throw new ArgumentOutOfRangeException("resolution");
+            }
+
+            this.resolution = resolution;
+            this.current = currtime / resolution;
+            this.index = new Dictionary<K, Entry>(comparer ?? EqualityComparer<K>.Default);
+        }
+
+
+        private static int Head(int list, int slot)
+        {
+            return (list >= Levels ? Levels * Slots + (list - Levels) : list * Slots + slot);
+        }
+
+        private void Link(Entry entry, int list, int slot)
+        {
+            int head = Head(list, slot);
+            entry.list = list;
+            entry.slot = slot;
+            entry.prev = null;
+            entry.next = heads[head];
+            if (entry.next != null)
+            {
+                entry.next.prev = entry;
+            }
+            heads[head] = entry;
+            counts[list]++;
+        }
+
+        private void Unlink(Entry entry)
+        {
+            if (entry.prev != null)
+            {
+                entry.prev.next = entry.next;
+            }
+            else
+            {
+                heads[Head(entry.list, entry.slot)] = entry.next;
+            }
+            if (entry.next != null)
+            {
+                entry.next.prev = entry.prev;
+            }
+            entry.prev = null;
+            entry.next = null;
+            counts[entry.list]--;
+        }
+
+        // Put entry in the lowest level that covers its tick (level L
+        // contains ticks less than 2^(SlotBits*(L+1)) after current tick)
+        private void Place(Entry entry)
+        {
+            long delta = entry.tick - current;
+            if (delta < 0)
+            {
+                Link(entry, Due, 0);
+                return;
+            }
+
+            for (int level = 0; level < Levels; level++)
+            {
+                if (delta < (1L << (SlotBits * (level + 1))))
+                {
+                    Link(entry, level, (int)((entry.tick >> (SlotBits * level)) & SlotMask));
+                    return;
+                }
+            }
+
+            Link(entry, Overflow, 0);
+            overflowTick = Math.Min(overflowTick, entry.tick);
+        }
+
+
+        // Add new entry or reschedule existing entry with same key
+        public void Add(K key, long expiration, V value)
+        {
+            Entry entry;
+            if (index.TryGetValue(key, out entry))
+            {
+                Unlink(entry);
+            }
+            else
+            {
+                entry = new Entry();
+                entry.key = key;
+                index[key] = entry;
+            }
+
+            entry.value = value;
+            entry.expiration = expiration;
+            // round up (entry must not expire before its expiration time)
+            entry.tick = expiration / resolution + (expiration % resolution > 0 ? 1 : 0);
+
+            // slot of current tick was already processed
+            if (entry.tick <= current)
+            {
+                Link(entry, Due, 0);
+            }
+            else
+            {
+                Place(entry);
+            }
+        }
+
+
+        public bool Remove(K key)
+        {
+            Entry entry;
+            if (!index.TryGetValue(key, out entry))
+            {
+                return false;
+            }
+
+            Unlink(entry);
+            index.Remove(key);
+
+            return true;
+        }
+
+
+        public bool ContainsKey(K key)
+        {
+            return index.ContainsKey(key);
+        }
+
+
+        public bool TryGetValue(K key, out V value)
+        {
+            Entry entry;
+            if (!index.TryGetValue(key, out entry))
+            {
+                value = default(V);
+                return false;
+            }
+
+            value = entry.value;
+            return true;
+        }
+
+
+        public V this[K key]
+        {
+            get { return index[key].value; }
+        }
+
+
+        public bool TryGetExpiration(K key, out long expiration)
+        {
+            Entry entry;
+            if (!index.TryGetValue(key, out entry))
+            {
+                expiration = 0;
+                return false;
+            }
+
+            expiration = entry.expiration;
+            return true;
+        }
+
+
+        // Entry with earliest expiration (without removing it), only
+        // first non-empty slot of each level is scanned
+        public bool TryPeek(out K key, out long expiration, out V value)
+        {
+            Entry best = Earliest(heads[Head(Due, 0)], null);
+
+            for (int level = 0; level < Levels; level++)
+            {
+                if (counts[level] == 0)
+                    continue;
+
+                // slot of current tick was already cascaded (collected),
+                // so it can only contain entries one wheel turn ahead
+                int shift = SlotBits * level;
+                for (long i = 1; i <= Slots; i++)
+                {
+                    Entry head = heads[Head(level, (int)(((current >> shift) + i) & SlotMask))];
+                    if (head != null)
+                    {
+                        best = Earliest(head, best);
+                        break;
+                    }
+                }
+            }
+
+            if (counts[Overflow] > 0 && (best == null || best.tick >= overflowTick))
+            {
+                best = Earliest(heads[Head(Overflow, 0)], best);
+            }
+
+            if (best == null)
+            {
+                key = default(K);
+                expiration = 0;
+                value = default(V);
+                return false;
+            }
+
+            key = best.key;
+            expiration = best.expiration;
+            value = best.value;
+            return true;
+        }
+
+        private static Entry Earliest(Entry entry, Entry best)
+        {
+            for (; entry != null; entry = entry.next)
+            {
+                if (best == null || entry.expiration < best.expiration)
+                {
+                    best = entry;
+                }
+            }
+            return best;
+        }
+
+
+        // Remove and return all entries with expiration up to currtime
+        // (key, expiration, value)
+        public IList<Tuple<K, long, V>> Expire(long currtime)
+        {
+            List<Tuple<K, long, V>> ret = new List<Tuple<K, long, V>>();
+            long target = currtime / resolution;
+
+            Collect(Due, 0, ret);
+
+            while (current < target)
+            {
+                // skip ticks that can't contain entries, lower levels
+                // are empty till next slot of first non-empty level
+                int level = 0;
+                while (level < Levels && counts[level] == 0)
+                {
+                    level++;
+                }
+
+                if (level == Levels)
+                {
+                    current = target;
+                    break;
+                }
+
+                if (level > 0)
+                {
+                    int shift = SlotBits * level;
+                    long next = ((current >> shift) + 1) << shift;
+                    if (next > target)
+                    {
+                        current = target;
+                        break;
+                    }
+                    current = next - 1;
+                }
+
+                current++;
+
+                // move entries from higher levels to lower levels when
+                // current tick reaches their slot
+                for (int l = Levels - 1; l > 0; l--)
+                {
+                    if ((current & ((1L << (SlotBits * l)) - 1)) == 0)
+                    {
+                        Cascade(l, (int)((current >> (SlotBits * l)) & SlotMask));
+                    }
+                }
+
+                Collect(0, (int)(current & SlotMask), ret);
+            }
+
+            // entries far in future are moved in wheel once they fits
+            if (counts[Overflow] > 0 && overflowTick - current < (1L << (SlotBits * Levels)))
+            {
+                overflowTick = long.MaxValue;
+                Cascade(Overflow, 0);
+                Collect(Due, 0, ret);
+            }
+
+            return ret;
+        }
+
+        private void Cascade(int list, int slot)
+        {
+            int head = Head(list, slot);
+            Entry entry = heads[head];
+            heads[head] = null;
+            while (entry != null)
+            {
+                Entry next = entry.next;
+                entry.prev = null;
+                entry.next = null;
+                counts[list]--;
+                Place(entry);
+                entry = next;
+            }
+        }
+
+        private void Collect(int list, int slot, List<Tuple<K, long, V>> ret)
+        {
+            int head = Head(list, slot);
+            Entry entry = heads[head];
+            heads[head] = null;
+            while (entry != null)
+            {
+                Entry next = entry.next;
+                counts[list]--;
+                index.Remove(entry.key);
+                ret.Add(new Tuple<K, long, V>(entry.key, entry.expiration, entry.value));
+                entry = next;
+            }
+        }
+
+
+        // All entries (key, expiration, value) in unspecified order
+        public IList<Tuple<K, long, V>> Entries()
+        {
+            List<Tuple<K, long, V>> ret = new List<Tuple<K, long, V>>(index.Count);
+
+            foreach (Entry entry in index.Values)
+            {
+                ret.Add(new Tuple<K, long, V>(entry.key, entry.expiration, entry.value));
+            }
+
+            return ret;
+        }
+
+
+        public void Clear()
+        {
+            Array.Clear(heads, 0, heads.Length);
+            Array.Clear(counts, 0, counts.Length);
+            overflowTick = long.MaxValue;
+            index.Clear();
+        }
+    }
+}
@@ -12,107 +12,30 @@ namespace F2B
     {
         public F2B.FirewallConditions Conditions()
         {
-            F2B.FirewallConditions conds = new F2B.FirewallConditions();
-
-            byte[] data = stream.ToArray();
-
-            int pos = DataSize[F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION];
-            while (pos < data.Length)
-            {
-                int size = 0;
-                DataSize.TryGetValue((F2B_FWDATA_TYPE0_ENUM)data[pos], out size);
-
-                // this is not necessary because we validate input data
-                //if (size == 0)
-                //{
-                //    // undefined size or unknown type
-                //    throw new InvalidDataException("Unknown FwData type or size: " + data[pos]);
-                //}
-                //
-                //if (!(data.Length >= pos + size))
-                //{
-                //    // Truncated data?!
-                //    throw new InvalidDataException("Truncated FwData data with type: " + data[pos]);
-                //}
-
-                // Create new firewall rule
-                switch ((F2B_FWDATA_TYPE0_ENUM)data[pos])
-                {
-                    case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_EXPIRATION:
-                        throw new InvalidDataException("More expiration records in FwData");
-                    //expiration = IPAddress.NetworkToHostOrder(BitConverter.ToInt64(data, pos + 1));
-                    //break;
-                    case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv4:
-                    case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv4_AND_PREFIX:
-                        byte[] baddr4 = new byte[4];
-                        Array.Copy(data, pos + 1, baddr4, 0, 4);
-                        if ((F2B_FWDATA_TYPE0_ENUM)data[pos] == F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv4)
-                            conds.Add(new IPAddress(baddr4));
-                        else
-                            conds.Add(new IPAddress(baddr4), data[pos + 1 + 4]);
-                        break;
-                    case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv4_RANGE:
-                        byte[] baddrLow4 = new byte[4];
-                        byte[] baddrHigh4 = new byte[4];
-                        Array.Copy(data, pos + 1, baddrLow4, 0, 4);
-                        Array.Copy(data, pos + 1 + 4, baddrHigh4, 0, 4);
-                        conds.Add(new IPAddress(baddrLow4), new IPAddress(baddrHigh4));
-                        break;
-                    case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6:
-                    case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6_AND_PREFIX:
-                        byte[] baddr6 = new byte[16];
-                        Array.Copy(data, pos + 1, baddr6, 0, 16);
-                        if ((F2B_FWDATA_TYPE0_ENUM)data[pos] == F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6)
-                            conds.Add(new IPAddress(baddr6));
-                        else
-                            conds.Add(new IPAddress(baddr6), data[pos + 1 + 16]);
-                        break;
-                    case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_IPv6_RANGE:
-                        byte[] baddrLow6 = new byte[16];
-                        byte[] baddrHigh6 = new byte[16];
-                        Array.Copy(data, pos + 1, baddrLow6, 0, 16);
-                        Array.Copy(data, pos + 1 + 4, baddrHigh6, 0, 16);
-                        conds.Add(new IPAddress(baddrLow6), new IPAddress(baddrHigh6));
-                        break;
-                    case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_PORT:
-                        conds.Add(IPAddress.NetworkToHostOrder(BitConverter.ToInt16(data, pos + 1)));
-                        break;
-                    case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_PORT_RANGE:
-                        conds.Add(IPAddress.NetworkToHostOrder(BitConverter.ToInt16(data, pos + 1)),
-                            IPAddress.NetworkToHostOrder(BitConverter.ToInt16(data, pos + 1 + 2)));
-                        break;
-                    case F2B_FWDATA_TYPE0_ENUM.F2B_FWDATA_PROTOCOL:
-                        conds.Add((ProtocolType)data[pos + 1]);
-                        break;
-                    default:
-                        throw new InvalidDataException("Unknown FwData type: " + data[pos]);
-                        //break;
-                }
-
-                pos += size;
-            }
-
-            return conds;
+            // records are parsed by native code directly into WFP filter
+            // conditions (no managed allocations for individual records)
+            return F2B.FirewallConditions.FromFwData(Data());
+        }
+
+        // Load records in existing (e.g. pooled) conditions object
+        public void Conditions(F2B.FirewallConditions conds)
+        {
+            conds.Load(Data());
         }
     }
 
 
 
-    public sealed class FwManager
+    public sealed partial class FwManager
     {
         private static volatile FwManager instance;
         private static object syncRoot = new Object();
 
         System.Timers.Timer tCleanupExpired = null;
+        // protects bucket, coalesce and queue data structures, state of
+        // separate filter rules is protected by shard locks (FwShards.cs)
         private object dataLock = new Object();
 
-        // data structures that keeps info about applyed firewall rules,
-        // to be able to discard filters with duplicate conditions and
-        // remove filter rules after expiration time
-        IDictionary<UInt64, byte[]> data; // filterId -> ruleHash
-        IDictionary<byte[], long> expire; // ruleHash -> expiration
-        SortedDictionary<long, UInt64> cleanup; // expiration -> filterId
-
         private FwManager()
         {
             tCleanupExpired = new System.Timers.Timer(10000);
@@ -179,7 +102,7 @@ namespace F2B
                 {
                     tCleanupExpired.Interval = value;
 
-                    if (!tCleanupExpired.Enabled && data.Count > 0)
+                    if (!tCleanupExpired.Enabled && Count + bucketCount > 0)
                     {
                         Log.Info("Enabling cleanup timer (interval " + tCleanupExpired.Interval + " ms)");
                         tCleanupExpired.Enabled = true;
@@ -196,60 +119,157 @@ namespace F2B
         public int MaxSize { get; set; } = 0;
 
 
+        // Snapshot file with FwManager state (must be set before first
+        // use of FwManager.Instance, null disables snapshot)
+        public static string StateFile
+        {
+            get { return stateFile; }
+            set
+            {
+                if (instance != null)
+                {
+                    Log.Warn("FwManager state file must be configured before first use, ignoring " + value);
+                    return;
+                }
+                stateFile = value;
+            }
+        }
+        private static string stateFile = null;
+        private FwSnapshot snapshot = null;
+
+
         public void Refresh()
         {
             Log.Info("Refresh list of F2B filter rules from WFP data structures");
 
+            IDictionary<UInt64, Tuple<byte[], long>> loaded = null;
+
             lock (dataLock)
             {
-                data = new Dictionary<UInt64, byte[]>();
-                expire = new Dictionary<byte[], long>(new ByteArrayComparer());
-                cleanup = new SortedDictionary<long, UInt64>();
+                ClearState();
 
-                IDictionary<ulong, string> filters;
-                long currtime = DateTime.UtcNow.Ticks;
+                // existing bucket and coalesced filters are handled as
+                // separate rules that expires together with last member
+                ClearBuckets();
+                ClearCoalesce();
 
-                try
+                // state from snapshot is used immediately and verified
+                // with WFP filters in background, so new rules can be
+                // added while WFP filters are enumerated
+                if (StateFile != null)
                 {
-                    filters = F2B.Firewall.Instance.List();
-                }
-                catch (FirewallException ex)
-                {
-                    Log.Error("Unable to list F2B firewall filters: " + ex.Message);
-                    return;
+                    if (snapshot == null)
+                    {
+                        snapshot = new FwSnapshot(StateFile);
+                    }
+
+                    loaded = snapshot.Load();
+                    foreach (var item in loaded)
+                    {
+                        // duplicate rules are resolved by Reconcile
+                        long expirationOld;
+                        if (expire.TryGetValue(item.Value.Item1, out expirationOld) && expirationOld >= item.Value.Item2)
+                        {
+                            continue;
+                        }
+
+                        Track(item.Key, item.Value.Item1, item.Value.Item2);
+                    }
+                    RewriteSnapshot();
+
+                    Log.Info("Refresh: Loaded " + loaded.Count + " F2B filter rules from " + StateFile);
+                    if (Count > 0)
+                    {
+                        EnableCleanupTimer();
+                    }
                 }
+            }
+
+            if (loaded != null)
+            {
+                System.Threading.ThreadPool.QueueUserWorkItem(o => Reconcile(loaded));
+            }
+            else
+            {
+                Reconcile(null);
+            }
+        }
+
+
+        // Update state with F2B filters that really exists in WFP, only
+        // filters that differs from loaded snapshot are processed
+        private void Reconcile(IDictionary<UInt64, Tuple<byte[], long>> loaded)
+        {
+            IList<FirewallFilter> filters;
+            List<UInt64> remove = new List<UInt64>();
+            int added = 0, dropped = 0;
+
+            try
+            {
+                filters = F2B.Firewall.Instance.ListFilters();
+            }
+            catch (FirewallException ex)
+            {
+                Log.Error("Unable to list F2B firewall filters: " + ex.Message);
+                return;
+            }
+
+            lock (dataLock)
+            {
+                long currtime = DateTime.UtcNow.Ticks;
+                ByteArrayComparer comparer = new ByteArrayComparer();
+                IDictionary<UInt64, bool> existing = new Dictionary<UInt64, bool>(filters.Count);
 
                 // get current F2B firewall rules from WFP configuration
                 foreach (var item in filters)
                 {
-                    Tuple<long, byte[]> fwName = null;
-                    try
-                    {
-                        fwName = FwData.DecodeName(item.Value);
-                    }
-                    catch (ArgumentException)
+                    UInt64 filterId = item.Id;
+                    long expiration;
+                    byte[] hash;
+
+                    existing[filterId] = true;
+
+                    // filter rule known from snapshot (filterId can be
+                    // reused after reboot, so compare also rule hash)
+                    byte[] hashKnown;
+                    if (data.TryGetValue(filterId, out hashKnown) && (!item.HasMetadata || comparer.Equals(item.Hash, hashKnown)))
                     {
-                        Log.Info("Refresh: Unable to parse F2B data from filter rule name: " + item.Value);
                         continue;
                     }
 
-                    UInt64 filterId = item.Key;
-                    long expiration = fwName.Item1;
-                    byte[] hash = fwName.Item2;
-
-                    // cleanup expired rules
-                    if (expiration < currtime)
+                    if (item.HasMetadata)
                     {
+                        expiration = item.Expiration;
+                        hash = item.Hash;
+                    }
+                    else
+                    {
+                        // filter rules installed by older versions
+                        // keeps F2B data only in filter name
                         try
                         {
-                            F2B.Firewall.Instance.Remove(filterId);
-                            Log.Info("Refresh: Removed expired filter rule #" + filterId);
+                            Tuple<long, byte[]> fwName = FwData.DecodeName(item.Name);
+                            expiration = fwName.Item1;
+                            hash = fwName.Item2;
                         }
-                        catch (Exception ex)
+                        catch (ArgumentException)
                         {
-                            Log.Warn("Refresh: Unable to remove expired filter rule #" + filterId + ": " + ex.Message);
-                            //fail++;
+                            Log.Info("Refresh: Unable to parse F2B data from filter rule name: " + item.Name);
+                            continue;
                         }
+                    }
+
+                    if (hashKnown != null)
+                    {
+                        Log.Info("Refresh: Filter rule #" + filterId + " differs from snapshot");
+                        Untrack(filterId);
+                    }
+
+                    // cleanup expired rules
+                    if (expiration < currtime)
+                    {
+                        Log.Info("Refresh: Remove expired filter rule #" + filterId);
+                        remove.Add(filterId);
                         continue;
                     }
 
@@ -257,58 +277,55 @@ namespace F2B
                     long expirationOld;
                     if (expire.TryGetValue(hash, out expirationOld))
                     {
-                        UInt64 filterIdOld = cleanup[expirationOld];
-                        UInt64 filterIdRemove = (expiration < expirationOld ? filterId : filterIdOld);
-                        try
-                        {
-                            F2B.Firewall.Instance.Remove(filterIdRemove);
-                            Log.Info("Refresh: Removed older filter rule #" + filterId);
-                        }
-                        catch (Exception ex)
-                        {
-                            Log.Warn("Refresh: Unable to remove older rule #" + filterIdRemove + ": " + ex.Message);
-                            //fail++;
-                        }
-
+                        UInt64 filterIdOld = FilterId(hash);
                         if (expiration < expirationOld)
                         {
-                            Log.Info("Refresh: Skipping older (removed) filter rule");
+                            Log.Info("Refresh: Remove older filter rule #" + filterId);
+                            remove.Add(filterId);
                             continue;
                         }
-                        else
-                        {
-                            data.Remove(filterIdOld);
-                            expire.Remove(hash); // not necessary
-                            cleanup.Remove(expirationOld);
-                        }
-                    }
 
-                    // we need unique expiration time to keep all required
-                    // data in simple key/value hashmap structure (and we
-                    // really don't care about different expiration time in ns)
-                    while (cleanup.ContainsKey(expiration))
-                    {
-                        expiration++;
+                        Log.Info("Refresh: Remove older filter rule #" + filterIdOld);
+                        remove.Add(filterIdOld);
+                        Untrack(filterIdOld);
                     }
 
                     Log.Info("Refresh: Add filter rule e/f/h: " + expiration + "/" + filterId + "/" + BitConverter.ToString(hash).Replace("-", ":"));
-                    data[filterId] = hash;
-                    expire[hash] = expiration;
-                    cleanup[expiration] = filterId;
+                    Track(filterId, hash, expiration);
+                    added++;
                 }
 
-                if (data.Count > 0)
+                // filters from snapshot that no longer exists in WFP
+                // (filters added while WFP was enumerated are kept)
+                if (loaded != null)
                 {
-                    if (tCleanupExpired.Enabled)
+                    foreach (var item in loaded)
                     {
-                        Log.Info("Found " + data.Count + " F2B existing filter rules, cleanup timer already running (interval " + tCleanupExpired.Interval + " ms)");
-                    }
-                    else
-                    {
-                        Log.Info("Found " + data.Count + " F2B existing filter rules, enabling cleanup timer (interval " + tCleanupExpired.Interval + " ms)");
-                        tCleanupExpired.Enabled = true;
+                        byte[] hash;
+                        if (existing.ContainsKey(item.Key) || !data.TryGetValue(item.Key, out hash) || !comparer.Equals(hash, item.Value.Item1))
+                        {
+                            continue;
+                        }
+
+                        Log.Info("Refresh: Filter rule #" + item.Key + " from snapshot no longer exists");
+                        Untrack(item.Key);
+                        dropped++;
                     }
                 }
+
+                if (snapshot != null)
+                {
+                    snapshot.Flush();
+                }
+
+                Log.Info("Refresh: Found " + filters.Count + " F2B filter rules, " + added + " added to state"
+                    + (loaded != null ? " and " + dropped + " removed from state loaded from " + StateFile : ""));
+
+                if (Count > 0)
+                {
+                    Log.Info("Found " + Count + " F2B existing filter rules");
+                    EnableCleanupTimer();
+                }
                 else
                 {
                     if (tCleanupExpired.Enabled)
@@ -322,6 +339,26 @@ namespace F2B
                     }
                 }
             }
+
+            // expired and duplicate filters are removed in one round trip
+            if (remove.Count > 0)
+            {
+                try
+                {
+                    int[] results = F2B.Firewall.Instance.RemoveMany(remove);
+                    for (int i = 0; i < remove.Count; i++)
+                    {
+                        if (results[i] != (int)WFPErrorCode.Success && results[i] != (int)WFPErrorCode.FilterNotFound)
+                        {
+                            Log.Warn("Refresh: Unable to remove filter rule #" + remove[i] + ": error " + results[i].ToString("X8"));
+                        }
+                    }
+                }
+                catch (FirewallException ex)
+                {
+                    Log.Warn("Refresh: Unable to remove " + remove.Count + " filter rules: " + ex.Message);
+                }
+            }
         }
 
 
@@ -334,60 +371,99 @@ namespace F2B
                 return;
             }
 
-            int sizeBefore, sizeAfter;
-            long currtime = DateTime.UtcNow.Ticks;
-            IList<KeyValuePair<long, UInt64>> remove = new List<KeyValuePair<long, UInt64>>();
+            CleanupExpired(DateTime.UtcNow.Ticks);
+        }
+
+
+        // Remove rules expired at given time (selftest uses time in
+        // future to expire rules without waiting)
+        internal void CleanupExpired(long currtime)
+        {
+            int sizeBefore, sizeAfter, bucketsRemoved;
+            IList<Tuple<byte[], long, UInt64>> remove;
 
             Log.Info("CleanupExpired: Started");
 
+            sizeBefore = Count;
+
+            // all rules expired since last run are collected at once
+            // (each shard is locked only while its rules are expired)
+            remove = ExpireRules(currtime);
+
+            sizeAfter = Count;
+
             lock (dataLock)
             {
-                sizeBefore = data.Count;
+                bucketsRemoved = CleanupExpiredBuckets(currtime);
+                CleanupExpiredCoalesce(currtime);
+            }
 
-                foreach (var item in cleanup)
+            // journal records are written in batches and compacted
+            // when they are much bigger than current state
+            if (snapshot != null)
+            {
+                if (snapshot.Records > 2 * Count + 1024)
                 {
-                    // this assume sorted container!
-                    if (item.Key > currtime)
-                        break;
-
-                    remove.Add(item);
+                    RewriteSnapshot();
                 }
-
-                foreach (var item in remove)
+                else
                 {
-                    long expiration = item.Key;
-                    UInt64 filterId = item.Value;
-                    byte[] hash = data[filterId];
-
-                    cleanup.Remove(expiration);
-                    expire.Remove(hash);
-                    data.Remove(filterId);
+                    snapshot.Flush();
                 }
-
-                sizeAfter = data.Count;
             }
 
-            Log.Info("CleanupExpired: Removed " + remove.Count + " F2B filter rules (data size " + sizeBefore + " -> " + sizeAfter + ")");
+            Log.Info("CleanupExpired: Removed " + remove.Count + " F2B filter rules (data size " + sizeBefore + " -> " + sizeAfter + ")"
+                + (bucketsRemoved > 0 ? " and " + bucketsRemoved + " addresses from bucket filters" : ""));
 
             int fail = 0;
+            List<UInt64> filterIds = new List<UInt64>(remove.Count);
             foreach (var item in remove)
             {
-                UInt64 filterId = item.Value;
+                UInt64 filterId = item.Item3;
+
+                // asynchronous mode removes expired filters in batches
+                FirewallQueue q = queue;
+                if (q != null && q.TryEnqueue(new FirewallQueueItem(filterId, RemoveCompleted)))
+                {
+                    continue;
+                }
+
+                filterIds.Add(filterId);
+            }
+
+            // remaining expired filters are removed in one round trip
+            if (filterIds.Count > 0)
+            {
                 try
                 {
-                    F2B.Firewall.Instance.Remove(filterId);
-                    Log.Info("CleanupExpired: Removed filter rule #" + filterId);
+                    int[] results = F2B.Firewall.Instance.RemoveMany(filterIds);
+                    for (int i = 0; i < filterIds.Count; i++)
+                    {
+                        if (results[i] == (int)WFPErrorCode.Success)
+                        {
+                            Log.Info("CleanupExpired: Removed filter rule #" + filterIds[i]);
+                        }
+                        else if (results[i] == (int)WFPErrorCode.FilterNotFound)
+                        {
+                            Log.Info("CleanupExpired: Filter rule #" + filterIds[i] + " no longer exists");
+                        }
+                        else
+                        {
+                            Log.Warn("CleanupExpired: Unable to remove filter rule #" + filterIds[i] + ": error " + results[i].ToString("X8"));
+                            fail++;
+                        }
+                    }
                 }
                 catch (FirewallException ex)
                 {
-                    Log.Warn("CleanupExpired: Unable to remove filter rule #" + filterId + ": " + ex.Message);
-                    fail++;
+                    Log.Warn("CleanupExpired: Unable to remove " + filterIds.Count + " filter rules: " + ex.Message);
+                    fail += filterIds.Count;
                 }
             }
 
-            lock (dataLock)
+            lock (timerLock)
             {
-                if (data.Count == 0)
+                if (Count == 0 && bucketCount == 0)
                 {
                     Log.Info("CleanupExpired: List of F2B filters is empty, disabling cleanup timer");
                     tCleanupExpired.Enabled = false;
@@ -398,99 +474,91 @@ namespace F2B
         }
 
 
-        private void Add(string filter, long expiration, byte[] hash, FirewallConditions conds, UInt64 weight, bool permit, bool persistent, Func<string, FirewallConditions, UInt64, bool, bool, ulong> AddFilter)
+        private void Add(string filter, long expiration, byte[] hash, FirewallConditions conds, UInt64 weight, bool permit, bool persistent, Func<string, byte[], FirewallConditions, UInt64, bool, bool, ulong> AddFilter)
         {
             long currtime = DateTime.UtcNow.Ticks;
             string filterName = FwData.EncodeName(expiration, hash);
-
-            lock (dataLock)
+            byte[] filterMetadata = FwData.EncodeMetadata(expiration, hash);
+
+            // filter out requests with expiration within 10% time
+            // range and treat them as duplicate requests (lock-free read,
+            // concurrent Add calls for different rules doesn't block)
+            long expirationOld;
+            bool replace = expire.TryGetValue(hash, out expirationOld);
+            if (replace)
             {
-                // we need unique expiration time to keep all required
-                // data in simple key/value hashmap structure (and we
-                // really don't care about different expiration time in ns)
-                while (cleanup.ContainsKey(expiration))
+                Triggered(hash);
+
+                if (currtime > Math.Max(expirationOld, expiration))
+                {
+                    Log.Info("Skipping request with expiration in past");
+                    return;
+                }
+                else if (expiration < expirationOld)
                 {
-                    expiration++;
+                    Log.Info("Skipping request with new expiration " + expiration + " < existing exipration " + expirationOld);
+                    return;
                 }
-
-                // filter out requests with expiration within 10% time
-                // range and treat them as duplicate requests
-                UInt64 filterId = 0;
-                long expirationOld;
-                if (expire.TryGetValue(hash, out expirationOld))
+                else if (expiration - expirationOld < (expiration - currtime) / 10)
                 {
-                    if (currtime > Math.Max(expirationOld, expiration))
-                    {
-                        Log.Info("Skipping request with expiration in past");
-                    }
-                    else if (expiration < expirationOld)
-                    {
-                        Log.Info("Skipping request with new expiration " + expiration + " < existing exipration " + expirationOld);
-                    }
-                    else if (expiration - expirationOld < (expiration - currtime) / 10)
-                    {
-                        Log.Info("Skipping request with expiration of new records within 10% of expiration of existing rule (c/o/e=" + currtime + "/" + expirationOld + "/" + expiration + ")");
-                    }
-                    else
-                    {
-                        UInt64 filterIdOld = cleanup[expirationOld];
+                    Log.Info("Skipping request with expiration of new records within 10% of expiration of existing rule (c/o/e=" + currtime + "/" + expirationOld + "/" + expiration + ")");
+                    return;
+                }
+            }
+            else if (Full && !Evict(expiration))
+            {
+                return;
+            }
 
-                        Log.Info("Replace old filter #" + filterIdOld + " with increased expiration time (c/o/e=" + currtime + "/" + expirationOld + "/" + expiration + ")");
-                        try
-                        {
-                            filterId = AddFilter(filterName, conds, weight, permit, persistent);
-                            Log.Info("Added filter rule #" + filterId + ": " + filter);
-                            F2B.Firewall.Instance.Remove(filterIdOld);
-                            Log.Info("Removed filter rule #" + filterIdOld);
-                        }
-                        catch (FirewallException ex)
-                        {
-                            Log.Warn("Unable to replace filter rule #" + filterId + ": " + ex.Message);
-                            //fail++;
-                        }
+            // firewall is called without holding any lock, in-flight
+            // marker prevents concurrent installation of same rule
+            if (!installing.TryAdd(hash, expiration))
+            {
+                Log.Info("Skipping request, filter rule with same hash is just being installed");
+                return;
+            }
 
-                        if (filterId != 0) // no exception during rule addition
-                        {
-                            data.Remove(filterIdOld);
-                            expire.Remove(hash); // not necessary
-                            cleanup.Remove(expirationOld);
-                        }
-                    }
+            UInt64 filterId = 0;
+            UInt64 filterIdOld = 0;
+            try
+            {
+                try
+                {
+                    filterId = AddFilter(filterName, filterMetadata, conds, weight, permit, persistent);
                 }
-                else
+                catch (FirewallException ex)
                 {
-                    if (MaxSize == 0 || MaxSize > data.Count)
-                    {
-                        try
-                        {
-                            filterId = AddFilter(filterName, conds, weight, permit, persistent);
-                            Log.Info("Added new filter #" + filterId + ": " + filter);
-                        }
-                        catch (FirewallException ex)
-                        {
-                            Log.Warn("Unable to add filter " + filter + ": " + ex.Message);
-                            //fail++;
-                        }
-                    }
-                    else
-                    {
-                        Log.Warn("Reached limit for number of active F2B filter rules, skipping new additions");
-                    }
+                    Log.Warn("Unable to " + (replace ? "replace" : "add") + " filter " + filter + ": " + ex.Message);
+                    return;
                 }
 
-                if (filterId != 0)
-                {
-                    data[filterId] = hash;
-                    expire[hash] = expiration;
-                    cleanup[expiration] = filterId;
+                filterIdOld = Track(filterId, hash, expiration);
+            }
+            finally
+            {
+                long tmp;
+                installing.TryRemove(hash, out tmp);
+            }
 
-                    if (!tCleanupExpired.Enabled)
-                    {
-                        Log.Info("Enabling cleanup timer (interval " + tCleanupExpired.Interval + " ms)");
-                        tCleanupExpired.Enabled = true;
-                    }
+            if (filterIdOld == 0)
+            {
+                Log.Info("Added new filter #" + filterId + ": " + filter);
+            }
+            else
+            {
+                Log.Info("Replace old filter #" + filterIdOld + " with #" + filterId + " with increased expiration time (c/o/e=" + currtime + "/" + expirationOld + "/" + expiration + ")");
+                try
+                {
+                    F2B.Firewall.Instance.Remove(filterIdOld);
+                    Log.Info("Removed filter rule #" + filterIdOld);
                 }
-            } // dataLock
+                catch (FirewallException ex)
+                {
+                    Log.Warn("Unable to remove replaced filter rule #" + filterIdOld + ": " + ex.Message);
+                }
+            }
+
+            EnableCleanupTimer();
         }
 
 
@@ -516,32 +584,362 @@ namespace F2B
                 return;
             }
 
+            fwdata = EvictionPrefix(fwdata);
+
+            // rules with addresses are first aggregated by coalescing stage
+            if (CoalesceEnabled)
+            {
+                Add(new FwData[] { fwdata }, weight, permit, persistent);
+                return;
+            }
+
+            // simple rules are added in shared bucket filters
+            if (BucketSize > 1)
+            {
+                lock (dataLock)
+                {
+                    if (AddBucketed(new FwData[] { fwdata }, weight, permit, persistent).Count == 0)
+                        return;
+                }
+            }
+
+            // caller doesn't wait for WFP in asynchronous mode
+            if (queue != null)
+            {
+                AddAsync(fwdata, weight, permit, persistent);
+                return;
+            }
+
             byte[] hash = fwdata.Hash;
-            FirewallConditions conds = fwdata.Conditions();
 
-            // IPv4 filter layer
-            if (conds.HasIPv4() || (!conds.HasIPv4() && !conds.HasIPv6()))
+            // conditions are used only while filters are added synchronously,
+            // so pooled object can be reused for next request
+            FirewallConditions conds = FirewallConditions.Acquire();
+            try
+            {
+                fwdata.Conditions(conds);
+
+                // IPv4 filter layer
+                if (conds.HasIPv4() || (!conds.HasIPv4() && !conds.HasIPv6()))
+                {
+                    byte[] hash4 = new byte[hash.Length];
+                    hash.CopyTo(hash4, 0);
+                    hash4[hash4.Length - 1] &= 0xfe;
+                    Add(fwdata.ToString(), expiration, hash4, conds, weight, permit, persistent, F2B.Firewall.Instance.AddIPv4);
+                }
+
+                // IPv6 filter layer
+                if (conds.HasIPv6() || (!conds.HasIPv4() && !conds.HasIPv6()))
+                {
+                    byte[] hash6 = new byte[hash.Length];
+                    hash.CopyTo(hash6, 0);
+                    hash6[hash6.Length - 1] |= 0x01;
+                    Add(fwdata.ToString(), expiration, hash6, conds, weight, permit, persistent, F2B.Firewall.Instance.AddIPv6);
+                }
+            }
+            finally
+            {
+                FirewallConditions.Release(conds);
+            }
+        }
+
+
+        // Remove installed rules (separate filters or bucket members)
+        // identified by their hash (must be called with dataLock)
+        private int RemoveRules(IEnumerable<byte[]> hashes)
+        {
+            int removed = 0;
+            IDictionary<Bucket, IList<KeyValuePair<byte[], BucketMember>>> rebuild = new Dictionary<Bucket, IList<KeyValuePair<byte[], BucketMember>>>();
+
+            foreach (byte[] hash in hashes)
+            {
+                long expiration;
+                Bucket bucket;
+                if (expire.TryGetValue(hash, out expiration))
+                {
+                    UInt64 filterId = FilterId(hash);
+                    if (filterId == 0)
+                    {
+                        // expired concurrently
+                        continue;
+                    }
+
+                    try
+                    {
+                        F2B.Firewall.Instance.Remove(filterId);
+                        Log.Info("Removed filter rule #" + filterId);
+                    }
+                    catch (FirewallException ex)
+                    {
+                        Log.Warn("Unable to remove filter rule #" + filterId + ": " + ex.Message);
+                        continue;
+                    }
+
+                    Untrack(filterId);
+                    removed++;
+                }
+                else if (bucketMembers.TryGetValue(hash, out bucket))
+                {
+                    IList<KeyValuePair<byte[], BucketMember>> members;
+                    if (!rebuild.TryGetValue(bucket, out members))
+                    {
+                        members = new List<KeyValuePair<byte[], BucketMember>>();
+                        rebuild[bucket] = members;
+                    }
+                    members.Add(new KeyValuePair<byte[], BucketMember>(hash, bucket.members[hash]));
+                    bucket.members.Remove(hash);
+                }
+            }
+
+            // each bucket is rebuilt just once
+            foreach (var item in rebuild)
+            {
+                if (RebuildBucket(item.Key))
+                {
+                    foreach (var member in item.Value)
+                    {
+                        bucketMembers.Remove(member.Key);
+                    }
+                    removed += item.Value.Count;
+                }
+                else
+                {
+                    foreach (var member in item.Value)
+                    {
+                        item.Key.members[member.Key] = member.Value;
+                    }
+                }
+            }
+
+            return removed;
+        }
+
+
+        // Rule with given hash is installed (as separate filter or
+        // in bucket filter)
+        private bool IsInstalled(byte[] hash)
+        {
+            return expire.ContainsKey(hash) || bucketMembers.ContainsKey(hash);
+        }
+
+
+        // Filter rule requested by batch Add that passed all checks
+        // and should be installed in one WFP transaction
+        private class BatchFilter
+        {
+            public string filter;
+            public long expiration;
+            public byte[] hash;
+            public UInt64 filterIdOld;
+            public FirewallBatchItem item;
+        }
+
+
+        public void Add(IList<FwData> fwdatas, UInt64 weight = 0, bool permit = false, bool persistent = false)
+        {
+            if (!CoalesceEnabled)
+            {
+                AddInternal(fwdatas, weight, permit, persistent);
+                return;
+            }
+
+            lock (dataLock)
+            {
+                IList<CoalesceCover> covers = new List<CoalesceCover>();
+                IList<Tuple<IPAddress, int, CoalesceMember, long>> members = new List<Tuple<IPAddress, int, CoalesceMember, long>>();
+                IList<FwData> coalesced = Coalesce(fwdatas, weight, permit, persistent, covers, members);
+                AddInternal(coalesced, weight, permit, persistent);
+                AddCovers(covers);
+                CoalesceFinish(covers, members);
+            }
+        }
+
+
+        private void AddInternal(IList<FwData> fwdatas, UInt64 weight, bool permit, bool persistent)
+        {
+            long currtime = DateTime.UtcNow.Ticks;
+
+            // duplicate requests within one batch are reduced to the one
+            // with longest expiration time
+            IDictionary<byte[], BatchFilter> requests = new Dictionary<byte[], BatchFilter>(new ByteArrayComparer());
+            IList<BatchFilter> filters = new List<BatchFilter>();
+
+            // simple rules are added in shared bucket filters
+            if (BucketSize > 1)
             {
-                byte[] hash4 = new byte[hash.Length];
-                hash.CopyTo(hash4, 0);
-                hash4[hash4.Length - 1] &= 0xfe;
-                Add(fwdata.ToString(), expiration, hash4, conds, weight, permit, persistent, F2B.Firewall.Instance.AddIPv4);
+                lock (dataLock)
+                {
+                    fwdatas = AddBucketed(fwdatas, weight, permit, persistent);
+                }
             }
 
-            // IPv6 filter layer
-            if (conds.HasIPv6() || (!conds.HasIPv4() && !conds.HasIPv6()))
+            foreach (FwData fwdata in fwdatas)
             {
-                byte[] hash6 = new byte[hash.Length];
-                hash.CopyTo(hash6, 0);
-                hash6[hash6.Length - 1] |= 0x01;
-                Add(fwdata.ToString(), expiration, hash6, conds, weight, permit, persistent, F2B.Firewall.Instance.AddIPv6);
+                long expiration = fwdata.Expire;
+
+                if (currtime >= expiration)
+                {
+                    Log.Info("Skipping expired firewall rule (expired on " + expiration + ")");
+                    continue;
+                }
+
+                byte[] hash = fwdata.Hash;
+                FirewallConditions conds = fwdata.Conditions();
+
+                for (int i = 0; i < 2; i++)
+                {
+                    bool ipv6 = (i == 1);
+                    bool noAddr = !conds.HasIPv4() && !conds.HasIPv6();
+                    if (!(ipv6 ? conds.HasIPv6() : conds.HasIPv4()) && !noAddr)
+                        continue;
+
+                    byte[] hashLayer = new byte[hash.Length];
+                    hash.CopyTo(hashLayer, 0);
+                    if (ipv6)
+                        hashLayer[hashLayer.Length - 1] |= 0x01;
+                    else
+                        hashLayer[hashLayer.Length - 1] &= 0xfe;
+
+                    BatchFilter bf;
+                    if (requests.TryGetValue(hashLayer, out bf))
+                    {
+                        if (bf.expiration >= expiration)
+                            continue;
+                    }
+                    else
+                    {
+                        bf = new BatchFilter();
+                        requests[hashLayer] = bf;
+                    }
+
+                    bf.filter = fwdata.ToString();
+                    bf.expiration = expiration;
+                    bf.hash = hashLayer;
+                    bf.item = new FirewallBatchItem(FwData.EncodeName(expiration, hashLayer), conds, ipv6);
+                    bf.item.Metadata = FwData.EncodeMetadata(expiration, hashLayer);
+                }
             }
+
+            if (requests.Count == 0)
+                return;
+
+            lock (dataLock)
+            {
+                int added = 0;
+
+                foreach (BatchFilter bf in requests.Values)
+                {
+                    // filter out requests with expiration within 10% time
+                    // range and treat them as duplicate requests
+                    long expirationOld;
+                    if (expire.TryGetValue(bf.hash, out expirationOld))
+                    {
+                        Triggered(bf.hash);
+
+                        if (currtime > Math.Max(expirationOld, bf.expiration))
+                        {
+                            Log.Info("Skipping request with expiration in past");
+                            continue;
+                        }
+                        else if (bf.expiration < expirationOld)
+                        {
+                            Log.Info("Skipping request with new expiration " + bf.expiration + " < existing exipration " + expirationOld);
+                            continue;
+                        }
+                        else if (bf.expiration - expirationOld < (bf.expiration - currtime) / 10)
+                        {
+                            Log.Info("Skipping request with expiration of new records within 10% of expiration of existing rule (c/o/e=" + currtime + "/" + expirationOld + "/" + bf.expiration + ")");
+                            continue;
+                        }
+
+                        bf.filterIdOld = FilterId(bf.hash);
+                    }
+                    else
+                    {
+                        if (MaxSize != 0 && MaxSize <= Count + bucketCount + added && !Evict(bf.expiration))
+                        {
+                            continue;
+                        }
+
+                        added++;
+                    }
+
+                    filters.Add(bf);
+                }
+
+                if (filters.Count == 0)
+                    return;
+
+                IList<FirewallBatchItem> items = new List<FirewallBatchItem>(filters.Count);
+                foreach (BatchFilter bf in filters)
+                {
+                    items.Add(bf.item);
+                }
+
+                try
+                {
+                    F2B.Firewall.Instance.AddBatch(items, weight, permit, persistent);
+                }
+                catch (FirewallException ex)
+                {
+                    Log.Warn("Unable to add batch of " + items.Count + " filter rules: " + ex.Message);
+                    return;
+                }
+
+                int fail = 0;
+                foreach (BatchFilter bf in filters)
+                {
+                    UInt64 filterId = bf.item.FilterId;
+
+                    if (bf.item.Error != 0)
+                    {
+                        Log.Warn("Unable to add filter " + bf.filter + ": error 0x" + bf.item.Error.ToString("X8"));
+                        fail++;
+                        continue;
+                    }
+
+                    if (bf.filterIdOld != 0)
+                    {
+                        Log.Info("Replace old filter #" + bf.filterIdOld + " with #" + filterId + ": " + bf.filter);
+                        try
+                        {
+                            F2B.Firewall.Instance.Remove(bf.filterIdOld);
+                            Log.Info("Removed filter rule #" + bf.filterIdOld);
+                        }
+                        catch (FirewallException ex)
+                        {
+                            Log.Warn("Unable to remove replaced filter rule #" + bf.filterIdOld + ": " + ex.Message);
+                        }
+
+                        Untrack(bf.filterIdOld);
+                    }
+                    else
+                    {
+                        Log.Info("Added new filter #" + filterId + ": " + bf.filter);
+                    }
+
+                    Track(filterId, bf.hash, bf.expiration);
+                }
+
+                Log.Info("Added batch of " + (filters.Count - fail) + " filter rules" + (fail > 0 ? " (failed to add " + fail + " filter rules)" : ""));
+
+                if (Count > 0)
+                {
+                    EnableCleanupTimer();
+                }
+            } // dataLock
         }
 
 
 #if DEBUG
         public void Debug(StreamWriter output)
         {
+            output.WriteLine("  enumeration: scanned {0} matched {1}", F2B.Firewall.Instance.EnumScanned, F2B.Firewall.Instance.EnumMatched);
+            foreach (string line in F2B.Firewall.Instance.Stats.ToString().Split(new char[] { '\r', '\n' }, StringSplitOptions.RemoveEmptyEntries))
+            {
+                output.WriteLine("  stats: {0}", line);
+            }
+
             lock (dataLock)
             {
                 foreach (var item in data)
@@ -561,18 +959,11 @@ namespace F2B
                     }
                     output.WriteLine("  expire: {0} {1} ({2})", BitConverter.ToString(item.Key).Replace("-", ":"), item.Value, tmp);
                 }
-                foreach (var item in cleanup)
-                {
-                    output.WriteLine("  cleanup: {0} {1}", item.Key, item.Value);
-                }
-                foreach (var item in cleanup)
-                {
-                    long expiration = item.Key;
-                    UInt64 filterId = item.Value;
-                    byte[] hash = data[filterId];
-
-                    output.WriteLine("  e/f/h: {0}/{1}/{2}", expiration, filterId, BitConverter.ToString(hash).Replace("-", ":"));
-                }
+                DebugBuckets(output);
+                DebugCoalesce(output);
+                DebugAsync(output);
+                DebugEviction(output);
+                DebugShards(output);
             }
         }
 #endif
@@ -0,0 +1,264 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Threading;
+
+namespace F2B
+{
+    // Asynchronous mode submits filter rules in FirewallQueue processed
+    // by F2BWFP worker thread, so caller doesn't wait for WFP. Rules
+    // waiting in the queue are tracked in inflight map (duplicate
+    // requests are discarded) and they are added in FwManager data
+    // structures by completion callback executed by worker thread.
+    public sealed partial class FwManager
+    {
+        private class AsyncRule
+        {
+            public string filter;
+            public byte[] hash;
+            public long expiration;
+        }
+
+
+        // Maximum time (milliseconds) to wait for free space in full queue
+        private const int QueueTimeout = 5000;
+
+        // data structures for asynchronous mode
+        FirewallQueue queue = null;
+        IDictionary<byte[], long> inflight = new Dictionary<byte[], long>(new ByteArrayComparer()); // ruleHash -> expiration
+
+
+        // Maximum number of WFP operations waiting in asynchronous queue
+        // (0 disables asynchronous mode)
+        public int QueueSize
+        {
+            get
+            {
+                FirewallQueue q = queue;
+                return (q != null ? q.Capacity : 0);
+            }
+            set
+            {
+                FirewallQueue old;
+
+                lock (dataLock)
+                {
+                    old = queue;
+                    queue = (value > 0 ? new FirewallQueue(value) : null);
+                }
+
+                // completion callbacks of remaining operations needs dataLock
+                if (old != null)
+                {
+                    old.Stop();
+                    old.Dispose();
+                }
+            }
+        }
+
+
+        // Wait until all queued WFP operations are processed and write
+        // pending state snapshot records
+        public bool Flush(int millisecondsTimeout = Timeout.Infinite)
+        {
+            bool ret = true;
+
+            FirewallQueue q = queue;
+            if (q != null)
+            {
+                Log.Info("Waiting for " + q.Count + " queued WFP operations");
+                ret = q.Flush(millisecondsTimeout);
+            }
+
+            lock (dataLock)
+            {
+                if (snapshot != null)
+                {
+                    snapshot.Flush();
+                }
+            }
+
+            return ret;
+        }
+
+
+        private void AddAsync(FwData fwdata, UInt64 weight, bool permit, bool persistent)
+        {
+            FirewallConditions conds = fwdata.Conditions();
+
+            // IPv4 filter layer
+            if (conds.HasIPv4() || (!conds.HasIPv4() && !conds.HasIPv6()))
+            {
+                AddAsync(fwdata.ToString(), fwdata.Expire, LayerHash(fwdata, false), conds, false, weight, permit, persistent);
+            }
+
+            // IPv6 filter layer
+            if (conds.HasIPv6() || (!conds.HasIPv4() && !conds.HasIPv6()))
+            {
+                AddAsync(fwdata.ToString(), fwdata.Expire, LayerHash(fwdata, true), conds, true, weight, permit, persistent);
+            }
+        }
+
+
+        private void AddAsync(string filter, long expiration, byte[] hash, FirewallConditions conds, bool ipv6, UInt64 weight, bool permit, bool persistent)
+        {
+            long currtime = DateTime.UtcNow.Ticks;
+            FirewallQueue q;
+
+            lock (dataLock)
+            {
+                q = queue;
+
+                long expirationOld;
+                if (inflight.TryGetValue(hash, out expirationOld) && expiration <= expirationOld)
+                {
+                    Log.Info("Skipping request with new expiration " + expiration + " <= expiration of queued request " + expirationOld);
+                    return;
+                }
+
+                if (expire.TryGetValue(hash, out expirationOld))
+                {
+                    Triggered(hash);
+
+                    if (expiration < expirationOld)
+                    {
+                        Log.Info("Skipping request with new expiration " + expiration + " < existing exipration " + expirationOld);
+                        return;
+                    }
+                    else if (expiration - expirationOld < (expiration - currtime) / 10)
+                    {
+                        Log.Info("Skipping request with expiration of new records within 10% of expiration of existing rule (c/o/e=" + currtime + "/" + expirationOld + "/" + expiration + ")");
+                        return;
+                    }
+                }
+                else if (!inflight.ContainsKey(hash) && MaxSize != 0 && MaxSize <= Count + bucketCount + inflight.Count && !Evict(expiration))
+                {
+                    return;
+                }
+
+                inflight[hash] = expiration;
+            }
+
+            AsyncRule rule = new AsyncRule();
+            rule.filter = filter;
+            rule.hash = hash;
+            rule.expiration = expiration;
+
+            FirewallBatchItem item = new FirewallBatchItem(FwData.EncodeName(expiration, hash), conds, ipv6);
+            item.Metadata = FwData.EncodeMetadata(expiration, hash);
+            FirewallQueueItem qitem = new FirewallQueueItem(item, weight, permit, persistent, AddCompleted);
+            qitem.State = rule;
+
+            if (!q.Enqueue(qitem, QueueTimeout))
+            {
+                Log.Warn("Unable to queue filter rule " + filter + " (queue full for " + QueueTimeout + "ms)");
+
+                lock (dataLock)
+                {
+                    long expirationOld;
+                    if (inflight.TryGetValue(hash, out expirationOld) && expirationOld == expiration)
+                    {
+                        inflight.Remove(hash);
+                    }
+                }
+            }
+        }
+
+
+        // Completion of asynchronous filter rule installation (executed
+        // by FirewallQueue worker thread)
+        private void AddCompleted(FirewallQueueItem qitem)
+        {
+            AsyncRule rule = (AsyncRule)qitem.State;
+            FirewallBatchItem item = qitem.Item;
+
+            lock (dataLock)
+            {
+                long expiration;
+                if (inflight.TryGetValue(rule.hash, out expiration) && expiration == rule.expiration)
+                {
+                    inflight.Remove(rule.hash);
+                }
+
+                if (item.Error != 0)
+                {
+                    Log.Warn("Unable to add filter " + rule.filter + " (error 0x" + item.Error.ToString("x") + ")");
+                    return;
+                }
+
+                Log.Info("Added filter rule #" + item.FilterId + ": " + rule.filter);
+
+                // rule with same hash installed while this one was queued
+                long expirationOld;
+                if (expire.TryGetValue(rule.hash, out expirationOld))
+                {
+                    if (expirationOld >= rule.expiration)
+                    {
+                        RemoveQueued(item.FilterId);
+                        return;
+                    }
+                }
+
+                UInt64 filterIdOld = Track(item.FilterId, rule.hash, rule.expiration);
+                if (filterIdOld != 0)
+                {
+                    Log.Info("Replace old filter #" + filterIdOld + " with #" + item.FilterId + " with increased expiration time");
+                    RemoveQueued(filterIdOld);
+                }
+            }
+
+            EnableCleanupTimer();
+        }
+
+
+        // Remove filter rule using asynchronous queue, filter rule is
+        // removed synchronously when queue is disabled or full (this
+        // method never blocks worker thread that drains the queue)
+        private void RemoveQueued(UInt64 filterId)
+        {
+            FirewallQueue q = queue;
+            if (q != null && q.TryEnqueue(new FirewallQueueItem(filterId, RemoveCompleted)))
+            {
+                return;
+            }
+
+            try
+            {
+                F2B.Firewall.Instance.Remove(filterId);
+                Log.Info("Removed filter rule #" + filterId);
+            }
+            catch (FirewallException ex)
+            {
+                Log.Warn("Unable to remove filter rule #" + filterId + ": " + ex.Message);
+            }
+        }
+
+
+        private void RemoveCompleted(FirewallQueueItem qitem)
+        {
+            if (qitem.Item.Error != 0)
+            {
+                Log.Warn("Unable to remove filter rule #" + qitem.Item.FilterId + " (error 0x" + qitem.Item.Error.ToString("x") + ")");
+                return;
+            }
+
+            Log.Info("Removed filter rule #" + qitem.Item.FilterId);
+        }
+
+
+#if DEBUG
+        private void DebugAsync(StreamWriter output)
+        {
+            FirewallQueue q = queue;
+            if (q == null)
+            {
+                output.WriteLine("  queue: disabled");
+                return;
+            }
+
+            output.WriteLine("  queue: {0}/{1} (submitted {2}, completed {3}, batches {4}, inflight {5})",
+                q.Count, q.Capacity, q.Submitted, q.Completed, q.Batches, inflight.Count);
+        }
+#endif
+    }
+}
@@ -0,0 +1,390 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Net;
+using System.Net.Sockets;
+using System.Text;
+
+namespace F2B
+{
+    // Bucketed mode packs filter rules with just one address and similar
+    // expiration time in shared WFP filters. WFP evaluates conditions
+    // for same field with logical OR, so one filter with N remote address
+    // conditions blocks all these addresses. Each member keeps its own
+    // expiration time and bucket filter is rebuilt (new filter added
+    // and old filter removed in one WFP transaction) when its members
+    // change.
+    public sealed partial class FwManager
+    {
+        private class BucketMember
+        {
+            public IPAddress addr;
+            public int prefix;
+            public long expiration;
+        }
+
+
+        private class Bucket
+        {
+            public string key;
+            public bool ipv6;
+            public UInt64 weight;
+            public bool permit;
+            public bool persistent;
+            public byte[] hash;
+            public UInt64 filterId = 0;
+            public long expiration = long.MaxValue; // first member expiration
+            public long expirationMax = 0; // expiration in filter name and metadata
+            public IDictionary<byte[], BucketMember> members = new Dictionary<byte[], BucketMember>(new ByteArrayComparer());
+        }
+
+
+        // data structures for bucketed filter rules
+        IDictionary<string, List<Bucket>> buckets = new Dictionary<string, List<Bucket>>(); // bucketKey -> buckets
+        IDictionary<byte[], Bucket> bucketMembers = new Dictionary<byte[], Bucket>(new ByteArrayComparer()); // ruleHash -> bucket
+        int bucketCount = 0;
+        long bucketSeq = 0;
+
+
+        // Maximum number of addresses in one bucket filter rule
+        // (values smaller than 2 disable bucketed mode)
+        public int BucketSize { get; set; } = 0;
+
+        // Addresses with expiration time within same interval (in ticks)
+        // share bucket filter rule
+        public long BucketGranularity { get; set; } = 5 * 60 * TimeSpan.TicksPerSecond;
+
+
+        private void ClearBuckets()
+        {
+            buckets.Clear();
+            bucketMembers.Clear();
+            bucketCount = 0;
+        }
+
+
+        // Add simple rules in bucket filters (must be called with dataLock),
+        // returns rules that has to be installed as separate filters
+        private IList<FwData> AddBucketed(IList<FwData> fwdatas, UInt64 weight, bool permit, bool persistent)
+        {
+            if (BucketSize < 2)
+            {
+                return fwdatas;
+            }
+
+            long currtime = DateTime.UtcNow.Ticks;
+            List<FwData> ret = new List<FwData>();
+
+            // modified buckets with their new members (used to revert
+            // changes in case bucket filter can't be replaced)
+            IDictionary<Bucket, IList<byte[]>> changes = new Dictionary<Bucket, IList<byte[]>>();
+            // members with extended expiration and their original expiration
+            IDictionary<BucketMember, long> extended = new Dictionary<BucketMember, long>();
+
+            foreach (FwData fwdata in fwdatas)
+            {
+                IPAddress addr;
+                int prefix;
+
+                if (!fwdata.SingleAddress(out addr, out prefix))
+                {
+                    ret.Add(fwdata);
+                    continue;
+                }
+
+                long expiration = fwdata.Expire;
+                if (currtime >= expiration)
+                {
+                    Log.Info("Skipping expired firewall rule (expired on " + expiration + ")");
+                    continue;
+                }
+
+                bool ipv6 = (addr.AddressFamily == AddressFamily.InterNetworkV6);
+                byte[] hash = new byte[fwdata.Hash.Length];
+                fwdata.Hash.CopyTo(hash, 0);
+                if (ipv6)
+                    hash[hash.Length - 1] |= 0x01;
+                else
+                    hash[hash.Length - 1] &= 0xfe;
+
+                // rule already installed as separate filter
+                if (expire.ContainsKey(hash))
+                {
+                    ret.Add(fwdata);
+                    continue;
+                }
+
+                Bucket bucket;
+                BucketMember member;
+                if (bucketMembers.TryGetValue(hash, out bucket))
+                {
+                    member = bucket.members[hash];
+                    if (expiration <= member.expiration)
+                    {
+                        Log.Info("Skipping request with new expiration " + expiration + " <= existing exipration " + member.expiration + " in bucket #" + bucket.filterId);
+                        continue;
+                    }
+
+                    // bucket filter conditions doesn't change, but filter name
+                    // and metadata contains expiration of last member and they
+                    // must be updated when this expiration grows
+                    Log.Info("Extend expiration of " + addr + "/" + prefix + " in bucket #" + bucket.filterId + " to " + expiration);
+                    if (expiration > bucket.expirationMax)
+                    {
+                        if (!extended.ContainsKey(member))
+                        {
+                            extended[member] = member.expiration;
+                        }
+                        if (!changes.ContainsKey(bucket))
+                        {
+                            changes[bucket] = new List<byte[]>();
+                        }
+                    }
+                    member.expiration = expiration;
+                    continue;
+                }
+
+                string key = (ipv6 ? "IPv6" : "IPv4") + "/" + (expiration / BucketGranularity) + "/" + weight + "/" + permit + "/" + persistent;
+
+                List<Bucket> keyBuckets;
+                if (!buckets.TryGetValue(key, out keyBuckets))
+                {
+                    keyBuckets = new List<Bucket>();
+                    buckets[key] = keyBuckets;
+                }
+
+                bucket = keyBuckets.Find(b => b.members.Count < BucketSize);
+                if (bucket == null)
+                {
+                    if (Full && !Evict(expiration))
+                    {
+                        continue;
+                    }
+
+                    bucket = new Bucket();
+                    bucket.key = key;
+                    bucket.ipv6 = ipv6;
+                    bucket.weight = weight;
+                    bucket.permit = permit;
+                    bucket.persistent = persistent;
+                    bucket.hash = FwData.ComputeHash(Encoding.ASCII.GetBytes(key + "/" + (bucketSeq++)));
+                    if (ipv6)
+                        bucket.hash[bucket.hash.Length - 1] |= 0x01;
+                    else
+                        bucket.hash[bucket.hash.Length - 1] &= 0xfe;
+
+                    keyBuckets.Add(bucket);
+                    bucketCount++;
+                }
+
+                member = new BucketMember();
+                member.addr = addr;
+                member.prefix = prefix;
+                member.expiration = expiration;
+
+                IList<byte[]> bucketChanges;
+                if (!changes.TryGetValue(bucket, out bucketChanges))
+                {
+                    bucketChanges = new List<byte[]>();
+                    changes[bucket] = bucketChanges;
+                }
+                bucketChanges.Add(hash);
+
+                bucket.members[hash] = member;
+                bucketMembers[hash] = bucket;
+            }
+
+            // install each modified bucket filter just once
+            foreach (var item in changes)
+            {
+                Bucket bucket = item.Key;
+
+                if (RebuildBucket(bucket))
+                {
+                    continue;
+                }
+
+                foreach (byte[] hash in item.Value)
+                {
+                    bucket.members.Remove(hash);
+                    bucketMembers.Remove(hash);
+                }
+
+                // installed filter still expires with original expiration
+                foreach (BucketMember member in bucket.members.Values)
+                {
+                    long origExpiration;
+                    if (extended.TryGetValue(member, out origExpiration))
+                    {
+                        member.expiration = origExpiration;
+                    }
+                }
+
+                if (bucket.members.Count == 0 && bucket.filterId == 0)
+                {
+                    RemoveBucket(bucket);
+                }
+            }
+
+            if (bucketCount > 0)
+            {
+                EnableCleanupTimer();
+            }
+
+            return ret;
+        }
+
+
+        // Replace bucket filter with filter for current members (must
+        // be called with dataLock)
+        private bool RebuildBucket(Bucket bucket)
+        {
+            long expirationMin = long.MaxValue;
+            long expirationMax = 0;
+
+            FirewallConditions conds = FirewallConditions.Acquire();
+            foreach (BucketMember member in bucket.members.Values)
+            {
+                conds.Add(member.addr, member.prefix);
+                expirationMin = Math.Min(expirationMin, member.expiration);
+                expirationMax = Math.Max(expirationMax, member.expiration);
+            }
+
+            // bucket filter name contains expiration of last member, this
+            // expiration is used for whole bucket filter after Refresh
+            string filterName = FwData.EncodeName(expirationMax, bucket.hash);
+            byte[] filterMetadata = FwData.EncodeMetadata(expirationMax, bucket.hash);
+
+            try
+            {
+                UInt64 filterId = F2B.Firewall.Instance.Replace(filterName, filterMetadata, conds, bucket.ipv6, bucket.weight, bucket.permit, bucket.persistent, bucket.filterId);
+                Log.Info("Replaced bucket filter #" + bucket.filterId + " with #" + filterId + " (" + bucket.members.Count + " addresses)");
+                bucket.filterId = filterId;
+                bucket.expiration = expirationMin;
+                bucket.expirationMax = expirationMax;
+            }
+            catch (FirewallException ex)
+            {
+                Log.Warn("Unable to replace bucket filter #" + bucket.filterId + ": " + ex.Message);
+                return false;
+            }
+            finally
+            {
+                FirewallConditions.Release(conds);
+            }
+
+            if (bucket.members.Count == 0)
+            {
+                RemoveBucket(bucket);
+            }
+
+            return true;
+        }
+
+
+        private void RemoveBucket(Bucket bucket)
+        {
+            List<Bucket> keyBuckets;
+            if (buckets.TryGetValue(bucket.key, out keyBuckets))
+            {
+                if (keyBuckets.Remove(bucket))
+                {
+                    bucketCount--;
+                }
+                if (keyBuckets.Count == 0)
+                {
+                    buckets.Remove(bucket.key);
+                }
+            }
+        }
+
+
+        // Remove expired members from bucket filters (must be called
+        // with dataLock), returns number of removed members
+        private int CleanupExpiredBuckets(long currtime)
+        {
+            int removed = 0;
+
+            List<Bucket> expired = new List<Bucket>();
+            foreach (var keyBuckets in buckets.Values)
+            {
+                foreach (Bucket bucket in keyBuckets)
+                {
+                    if (bucket.expiration <= currtime)
+                    {
+                        expired.Add(bucket);
+                    }
+                }
+            }
+
+            foreach (Bucket bucket in expired)
+            {
+                IList<KeyValuePair<byte[], BucketMember>> remove = new List<KeyValuePair<byte[], BucketMember>>();
+                foreach (var item in bucket.members)
+                {
+                    if (item.Value.expiration <= currtime)
+                    {
+                        remove.Add(item);
+                    }
+                }
+
+                if (remove.Count == 0)
+                {
+                    // expiration of first member was extended
+                    long expirationMin = long.MaxValue;
+                    foreach (BucketMember member in bucket.members.Values)
+                    {
+                        expirationMin = Math.Min(expirationMin, member.expiration);
+                    }
+                    bucket.expiration = expirationMin;
+                    continue;
+                }
+
+                foreach (var item in remove)
+                {
+                    bucket.members.Remove(item.Key);
+                }
+
+                if (RebuildBucket(bucket))
+                {
+                    foreach (var item in remove)
+                    {
+                        bucketMembers.Remove(item.Key);
+                    }
+                    removed += remove.Count;
+                }
+                else
+                {
+                    // keep expired members and try again next time
+                    foreach (var item in remove)
+                    {
+                        bucket.members[item.Key] = item.Value;
+                    }
+                }
+            }
+
+            return removed;
+        }
+
+
+#if DEBUG
+        private void DebugBuckets(StreamWriter output)
+        {
+            output.WriteLine("  buckets: {0} (size {1}, granularity {2})", bucketCount, BucketSize, BucketGranularity);
+            foreach (var keyBuckets in buckets)
+            {
+                foreach (Bucket bucket in keyBuckets.Value)
+                {
+                    output.WriteLine("  bucket: {0} #{1} {2} ({3} addresses, first expiration {4})",
+                        keyBuckets.Key, bucket.filterId, BitConverter.ToString(bucket.hash).Replace("-", ":"),
+                        bucket.members.Count, bucket.expiration);
+                    foreach (var member in bucket.members.Values)
+                    {
+                        output.WriteLine("    member: {0}/{1} {2}", member.addr, member.prefix, member.expiration);
+                    }
+                }
+            }
+        }
+#endif
+    }
+}
@@ -0,0 +1,518 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Net;
+using System.Net.Sockets;
+
+namespace F2B
+{
+    // Coalescing stage aggregates rules with just one address. Installed
+    // addresses are stored in prefix trie and when number of addresses
+    // within shorter prefix reach configured threshold all of them are
+    // replaced by one filter rule for covering prefix. Covering rule uses
+    // latest expiration and highest weight of its members (members must
+    // agree on permit and persistent flags) and it is split again to
+    // separate rules when number of active members drop below threshold.
+    public sealed partial class FwManager
+    {
+        private class CoalesceMember
+        {
+            public long expiration;
+            public byte[] hash; // hash of separate filter rule
+            public byte[] data; // serialized FwData of separate filter rule
+            public UInt64 weight;
+            public bool permit;
+            public bool persistent;
+        }
+
+
+        private class CoalesceCover
+        {
+            public IPAddress addr;
+            public int prefix;
+            public int minCount;
+            public long expiration;
+            public byte[] hash;
+            public UInt64 weight;
+            public bool permit;
+            public bool persistent;
+        }
+
+
+        // data structures for coalesced filter rules
+        PrefixTrie<CoalesceMember> coalesceMembers = new PrefixTrie<CoalesceMember>();
+        IDictionary<string, CoalesceCover> coalesceCovers = new Dictionary<string, CoalesceCover>(); // network/prefix -> cover
+        IList<Tuple<int, int>> coalesceThresholds4 = new List<Tuple<int, int>>();
+        IList<Tuple<int, int>> coalesceThresholds6 = new List<Tuple<int, int>>();
+
+
+        // Coalescing thresholds for IPv4 addresses in format
+        // "prefix:count[,prefix:count...]", e.g. "24:32,16:1024"
+        // (empty value disables coalescing for IPv4)
+        public string CoalesceIPv4
+        {
+            get { return FormatThresholds(coalesceThresholds4); }
+            set { coalesceThresholds4 = ParseThresholds(value, 32); }
+        }
+
+        // Coalescing thresholds for IPv6 addresses (same format as IPv4)
+        public string CoalesceIPv6
+        {
+            get { return FormatThresholds(coalesceThresholds6); }
+            set { coalesceThresholds6 = ParseThresholds(value, 128); }
+        }
+
+        private bool CoalesceEnabled
+        {
+            get { return coalesceThresholds4.Count > 0 || coalesceThresholds6.Count > 0; }
+        }
+
+
+        // Parse thresholds sorted from shortest (widest) prefix
+        private static IList<Tuple<int, int>> ParseThresholds(string value, int maxPrefix)
+        {
+            List<Tuple<int, int>> ret = new List<Tuple<int, int>>();
+
+            if (string.IsNullOrWhiteSpace(value))
+            {
+                return ret;
+            }
+
+            foreach (string item in value.Split(','))
+            {
+                string[] parts = item.Split(':');
+                int prefix, count;
+                if (parts.Length != 2
+                    || !int.TryParse(parts[0].Trim(), out prefix)
+                    || !int.TryParse(parts[1].Trim(), out count))
+                {
+                    throw new ArgumentException("Invalid coalescing threshold \"" + item + "\", expected prefix:count");
+                }
+                if (prefix < 1 || prefix >= maxPrefix)
+                {
+                    throw new ArgumentException("Invalid coalescing prefix length " + prefix + " (allowed range 1-" + (maxPrefix - 1) + ")");
+                }
+                if (count < 2)
+                {
+                    throw new ArgumentException("Invalid coalescing count " + count + " (must be at least 2)");
+                }
+                ret.Add(new Tuple<int, int>(prefix, count));
+            }
+
+            ret.Sort((a, b) => a.Item1.CompareTo(b.Item1));
+
+            return ret;
+        }
+
+        private static string FormatThresholds(IList<Tuple<int, int>> thresholds)
+        {
+            List<string> ret = new List<string>();
+            foreach (var threshold in thresholds)
+            {
+                ret.Add(threshold.Item1 + ":" + threshold.Item2);
+            }
+            return string.Join(",", ret);
+        }
+
+
+        private void ClearCoalesce()
+        {
+            coalesceMembers = new PrefixTrie<CoalesceMember>();
+            coalesceCovers.Clear();
+        }
+
+
+        private static string CoverKey(IPAddress addr, int prefix)
+        {
+            return PrefixTrie<CoalesceMember>.Network(addr, prefix) + "/" + prefix;
+        }
+
+
+        private static byte[] LayerHash(FwData fwdata, bool ipv6)
+        {
+            byte[] hash = new byte[fwdata.Hash.Length];
+            fwdata.Hash.CopyTo(hash, 0);
+            if (ipv6)
+                hash[hash.Length - 1] |= 0x01;
+            else
+                hash[hash.Length - 1] &= 0xfe;
+            return hash;
+        }
+
+
+        // Existing cover for given address (null if there is no cover)
+        private CoalesceCover FindCover(IPAddress addr, int prefix, IList<Tuple<int, int>> thresholds)
+        {
+            foreach (var threshold in thresholds)
+            {
+                if (threshold.Item1 >= prefix)
+                {
+                    break;
+                }
+
+                CoalesceCover cover;
+                if (coalesceCovers.TryGetValue(CoverKey(addr, threshold.Item1), out cover))
+                {
+                    return cover;
+                }
+            }
+
+            return null;
+        }
+
+
+        // Member can be replaced by cover without changing filtering
+        // (member with higher weight must stay separate rule)
+        private static bool Compatible(CoalesceCover cover, CoalesceMember member)
+        {
+            return cover.permit == member.permit && cover.persistent == member.persistent && cover.weight >= member.weight;
+        }
+
+
+        // Create cover for widest prefix that reached its threshold
+        // (null if address is not dense enough or members within prefix
+        // doesn't share permit and persistent flags)
+        private CoalesceCover NewCover(IPAddress addr, int prefix, IList<Tuple<int, int>> thresholds)
+        {
+            foreach (var threshold in thresholds)
+            {
+                if (threshold.Item1 >= prefix)
+                {
+                    break;
+                }
+
+                if (coalesceMembers.CountWithin(addr, threshold.Item1) < threshold.Item2)
+                {
+                    continue;
+                }
+
+                CoalesceCover cover = new CoalesceCover();
+                cover.addr = PrefixTrie<CoalesceMember>.Network(addr, threshold.Item1);
+                cover.prefix = threshold.Item1;
+                cover.minCount = threshold.Item2;
+                cover.expiration = 0;
+                cover.weight = 0;
+
+                bool uniform = true;
+                IList<Tuple<IPAddress, int, CoalesceMember>> members = coalesceMembers.Within(cover.addr, cover.prefix);
+                cover.permit = members[0].Item3.permit;
+                cover.persistent = members[0].Item3.persistent;
+                foreach (var item in members)
+                {
+                    uniform &= (item.Item3.permit == cover.permit && item.Item3.persistent == cover.persistent);
+                    cover.expiration = Math.Max(cover.expiration, item.Item3.expiration);
+                    cover.weight = Math.Max(cover.weight, item.Item3.weight);
+                }
+                if (!uniform)
+                {
+                    continue;
+                }
+
+                cover.hash = LayerHash(new FwData(0, cover.addr, cover.prefix), cover.addr.AddressFamily == AddressFamily.InterNetworkV6);
+
+                coalesceCovers[CoverKey(cover.addr, cover.prefix)] = cover;
+
+                return cover;
+            }
+
+            return null;
+        }
+
+
+        private FwData CoverRule(CoalesceCover cover)
+        {
+            return new FwData(cover.expiration, cover.addr, cover.prefix);
+        }
+
+
+        // Replace rules with addresses covered by dense prefix with one
+        // covering rule (must be called with dataLock), returns rules
+        // that should be installed, new or modified covers that must be
+        // installed with their own attributes and members added to prefix
+        // trie by this call (with original expiration, -1 for new member)
+        private IList<FwData> Coalesce(IList<FwData> fwdatas, UInt64 weight, bool permit, bool persistent, IList<CoalesceCover> covers, IList<Tuple<IPAddress, int, CoalesceMember, long>> members)
+        {
+            long currtime = DateTime.UtcNow.Ticks;
+            List<FwData> ret = new List<FwData>();
+            List<Tuple<FwData, IPAddress, int, CoalesceMember>> pending = new List<Tuple<FwData, IPAddress, int, CoalesceMember>>();
+            IDictionary<CoalesceCover, bool> modified = new Dictionary<CoalesceCover, bool>();
+
+            foreach (FwData fwdata in fwdatas)
+            {
+                IPAddress addr;
+                int prefix;
+
+                if (!fwdata.SingleAddress(out addr, out prefix) || currtime >= fwdata.Expire)
+                {
+                    ret.Add(fwdata);
+                    continue;
+                }
+
+                bool ipv6 = (addr.AddressFamily == AddressFamily.InterNetworkV6);
+                IList<Tuple<int, int>> thresholds = (ipv6 ? coalesceThresholds6 : coalesceThresholds4);
+                if (thresholds.Count == 0)
+                {
+                    ret.Add(fwdata);
+                    continue;
+                }
+
+                // member is kept in trie only if its rule (or cover)
+                // is installed, see CoalesceFinish
+                CoalesceMember member;
+                if (!coalesceMembers.TryGetValue(addr, prefix, out member))
+                {
+                    member = new CoalesceMember();
+                    member.hash = LayerHash(fwdata, ipv6);
+                    member.data = fwdata.ToArray();
+                    member.weight = weight;
+                    member.permit = permit;
+                    member.persistent = persistent;
+                    coalesceMembers.Add(addr, prefix, member);
+                    members.Add(new Tuple<IPAddress, int, CoalesceMember, long>(addr, prefix, member, -1));
+                }
+                else
+                {
+                    members.Add(new Tuple<IPAddress, int, CoalesceMember, long>(addr, prefix, member, member.expiration));
+                }
+                member.expiration = Math.Max(member.expiration, fwdata.Expire);
+
+                // member that can't be covered by existing cover
+                CoalesceCover cover = FindCover(addr, prefix, thresholds);
+                if (cover != null && !Compatible(cover, member))
+                {
+                    ret.Add(fwdata);
+                    continue;
+                }
+
+                // existing cover can be replaced by wider prefix
+                CoalesceCover wider = NewCover(addr, (cover != null ? cover.prefix : prefix), thresholds);
+                if (wider != null)
+                {
+                    Log.Info("Coalescing " + coalesceMembers.CountWithin(wider.addr, wider.prefix) + " addresses in " + wider.addr + "/" + wider.prefix);
+                    modified[wider] = true;
+                    cover = wider;
+                }
+
+                if (cover == null)
+                {
+                    pending.Add(new Tuple<FwData, IPAddress, int, CoalesceMember>(fwdata, addr, prefix, member));
+                    continue;
+                }
+
+                if (member.expiration > cover.expiration)
+                {
+                    cover.expiration = member.expiration;
+                    modified[cover] = true;
+                }
+            }
+
+            // rules from this request could be covered by prefix created
+            // later while processing same request
+            foreach (var item in pending)
+            {
+                IList<Tuple<int, int>> thresholds = (item.Item2.AddressFamily == AddressFamily.InterNetworkV6 ? coalesceThresholds6 : coalesceThresholds4);
+                CoalesceCover cover = FindCover(item.Item2, item.Item3, thresholds);
+                if (cover == null || !Compatible(cover, item.Item4))
+                {
+                    ret.Add(item.Item1);
+                }
+            }
+
+            foreach (CoalesceCover cover in modified.Keys)
+            {
+                covers.Add(cover);
+            }
+
+            return ret;
+        }
+
+
+        // Install cover rules with attributes derived from their members
+        private void AddCovers(IList<CoalesceCover> covers)
+        {
+            foreach (CoalesceCover cover in covers)
+            {
+                AddInternal(new FwData[] { CoverRule(cover) }, cover.weight, cover.permit, cover.persistent);
+            }
+        }
+
+
+        // Install members as separate rules with their own attributes
+        private void AddMembers(IList<CoalesceMember> members)
+        {
+            IDictionary<Tuple<UInt64, bool, bool>, List<FwData>> groups = new Dictionary<Tuple<UInt64, bool, bool>, List<FwData>>();
+            foreach (CoalesceMember member in members)
+            {
+                Tuple<UInt64, bool, bool> key = new Tuple<UInt64, bool, bool>(member.weight, member.permit, member.persistent);
+                List<FwData> group;
+                if (!groups.TryGetValue(key, out group))
+                {
+                    group = new List<FwData>();
+                    groups[key] = group;
+                }
+
+                FwData fwdata = new FwData(member.data);
+                fwdata.Expire = member.expiration;
+                group.Add(fwdata);
+            }
+
+            foreach (var group in groups)
+            {
+                AddInternal(group.Value, group.Key.Item1, group.Key.Item2, group.Key.Item3);
+            }
+        }
+
+
+        // Remove rules replaced by new covers or revert covers that could
+        // not be installed and remove members that were not installed
+        // from prefix trie (must be called with dataLock)
+        private void CoalesceFinish(IList<CoalesceCover> covers, IList<Tuple<IPAddress, int, CoalesceMember, long>> members)
+        {
+            foreach (CoalesceCover cover in covers)
+            {
+                List<byte[]> covered = new List<byte[]>();
+                List<CoalesceMember> uncovered = new List<CoalesceMember>();
+                foreach (var item in coalesceMembers.Within(cover.addr, cover.prefix))
+                {
+                    if (!Compatible(cover, item.Item3))
+                    {
+                        continue; // installed as separate rule
+                    }
+
+                    if (IsInstalled(item.Item3.hash))
+                    {
+                        covered.Add(item.Item3.hash);
+                    }
+                    else
+                    {
+                        uncovered.Add(item.Item3);
+                    }
+                }
+
+                // nested covers for more specific prefixes are replaced too
+                foreach (var nested in new List<CoalesceCover>(coalesceCovers.Values))
+                {
+                    if (nested.prefix > cover.prefix && nested.addr.AddressFamily == cover.addr.AddressFamily
+                        && PrefixTrie<CoalesceMember>.Network(nested.addr, cover.prefix).Equals(cover.addr))
+                    {
+                        if (IsInstalled(cover.hash))
+                        {
+                            coalesceCovers.Remove(CoverKey(nested.addr, nested.prefix));
+                        }
+                        covered.Add(nested.hash);
+                    }
+                }
+
+                if (IsInstalled(cover.hash))
+                {
+                    int removed = RemoveRules(covered);
+                    Log.Info("Coalesced filter rule for " + cover.addr + "/" + cover.prefix + " replaced " + removed + " filter rules");
+                }
+                else
+                {
+                    Log.Warn("Unable to install coalesced filter rule for " + cover.addr + "/" + cover.prefix + ", using separate filter rules");
+                    coalesceCovers.Remove(CoverKey(cover.addr, cover.prefix));
+                    AddMembers(uncovered);
+                }
+            }
+
+            // counts in prefix trie must reflect only installed rules,
+            // otherwise failed requests could create covering rule
+            for (int i = members.Count - 1; i >= 0; i--)
+            {
+                var item = members[i];
+                if (IsInstalled(item.Item3.hash))
+                {
+                    continue;
+                }
+
+                IList<Tuple<int, int>> thresholds = (item.Item1.AddressFamily == AddressFamily.InterNetworkV6 ? coalesceThresholds6 : coalesceThresholds4);
+                CoalesceCover cover = FindCover(item.Item1, item.Item2, thresholds);
+                if (cover != null && Compatible(cover, item.Item3) && IsInstalled(cover.hash))
+                {
+                    continue;
+                }
+
+                if (item.Item4 < 0)
+                {
+                    coalesceMembers.Remove(item.Item1, item.Item2);
+                }
+                else
+                {
+                    item.Item3.expiration = item.Item4;
+                }
+            }
+        }
+
+
+        // Remove expired members and split covers with not enough active
+        // members back to separate rules (must be called with dataLock),
+        // returns number of split covers
+        private int CleanupExpiredCoalesce(long currtime)
+        {
+            if (coalesceMembers.Count == 0 && coalesceCovers.Count == 0)
+            {
+                return 0;
+            }
+
+            foreach (var item in coalesceMembers.Entries())
+            {
+                if (item.Item3.expiration <= currtime)
+                {
+                    coalesceMembers.Remove(item.Item1, item.Item2);
+                }
+            }
+
+            int split = 0;
+            foreach (CoalesceCover cover in new List<CoalesceCover>(coalesceCovers.Values))
+            {
+                if (cover.expiration <= currtime)
+                {
+                    // filter rule itself is removed by standard cleanup
+                    coalesceCovers.Remove(CoverKey(cover.addr, cover.prefix));
+                    continue;
+                }
+
+                if (coalesceMembers.CountWithin(cover.addr, cover.prefix) >= cover.minCount)
+                {
+                    continue;
+                }
+
+                // remaining members are installed before covering
+                // rule is removed to keep all addresses blocked
+                Log.Info("Splitting coalesced filter rule for " + cover.addr + "/" + cover.prefix);
+                coalesceCovers.Remove(CoverKey(cover.addr, cover.prefix));
+
+                List<CoalesceMember> members = new List<CoalesceMember>();
+                foreach (var item in coalesceMembers.Within(cover.addr, cover.prefix))
+                {
+                    if (Compatible(cover, item.Item3))
+                    {
+                        members.Add(item.Item3);
+                    }
+                }
+                AddMembers(members);
+
+                RemoveRules(new byte[][] { cover.hash });
+                split++;
+            }
+
+            return split;
+        }
+
+
+#if DEBUG
+        private void DebugCoalesce(StreamWriter output)
+        {
+            output.WriteLine("  coalesce: {0} addresses, {1} covers (IPv4 {2}, IPv6 {3})",
+                coalesceMembers.Count, coalesceCovers.Count, CoalesceIPv4, CoalesceIPv6);
+            foreach (CoalesceCover cover in coalesceCovers.Values)
+            {
+                output.WriteLine("  cover: {0}/{1} {2} ({3} addresses, min {4}, expiration {5})",
+                    cover.addr, cover.prefix, BitConverter.ToString(cover.hash).Replace("-", ":"),
+                    coalesceMembers.CountWithin(cover.addr, cover.prefix), cover.minCount, cover.expiration);
+            }
+        }
+#endif
+    }
+}
@@ -0,0 +1,187 @@
+﻿using System;
+using System.IO;
+using System.Net;
+using System.Net.Sockets;
+using System.Threading;
+
+namespace F2B
+{
+    // What to do with new rule when number of filter rules reach MaxSize
+    public enum FwEvictionPolicy
+    {
+        None,                   // drop new rule
+        SoonestExpiring,        // remove installed rule with earliest expiration
+        LeastRecentlyTriggered, // remove installed rule requested least recently
+        CoalescePrefix,         // ban whole prefix of new address (existing rule
+                                // for prefix is extended, otherwise rule with
+                                // earliest expiration is removed)
+    }
+
+
+    // Eviction keeps most valuable rules when MaxSize is reached. Victim
+    // is found using expiration timing wheel (or list of last requests)
+    // of each shard, so eviction never scans all installed rules. Only
+    // separate filter rules are evicted (not buckets or coalesced rules).
+    public sealed partial class FwManager
+    {
+        private long evicted = 0;
+        private long dropped = 0;
+        private long coalescedPrefix = 0;
+
+
+        public FwEvictionPolicy EvictionPolicy { get; set; } = FwEvictionPolicy.None;
+
+        // Prefix length used by CoalescePrefix eviction policy
+        public int EvictionPrefixIPv4 { get; set; } = 24;
+        public int EvictionPrefixIPv6 { get; set; } = 64;
+
+        // Number of rules removed to make space for new rule
+        public long Evicted
+        {
+            get { return Interlocked.Read(ref evicted); }
+        }
+
+        // Number of new rules dropped because of MaxSize
+        public long Dropped
+        {
+            get { return Interlocked.Read(ref dropped); }
+        }
+
+        // Number of addresses replaced by prefix (CoalescePrefix policy)
+        public long CoalescedPrefix
+        {
+            get { return Interlocked.Read(ref coalescedPrefix); }
+        }
+
+
+        private bool Full
+        {
+            get { return MaxSize != 0 && MaxSize <= Count + bucketCount; }
+        }
+
+
+        // Request for already installed rule (updates order used by
+        // LeastRecentlyTriggered policy)
+        private void Triggered(byte[] hash)
+        {
+            if (EvictionPolicy == FwEvictionPolicy.LeastRecentlyTriggered)
+            {
+                Touch(hash);
+            }
+        }
+
+
+        // Replace single address with prefix when there is no space for
+        // new filter rules (CoalescePrefix policy)
+        private FwData EvictionPrefix(FwData fwdata)
+        {
+            if (EvictionPolicy != FwEvictionPolicy.CoalescePrefix || !Full)
+            {
+                return fwdata;
+            }
+
+            IPAddress addr;
+            int prefix;
+            if (!fwdata.SingleAddress(out addr, out prefix))
+            {
+                return fwdata;
+            }
+
+            int evictionPrefix = (addr.AddressFamily == AddressFamily.InterNetworkV6 ? EvictionPrefixIPv6 : EvictionPrefixIPv4);
+            if (prefix <= evictionPrefix)
+            {
+                return fwdata;
+            }
+
+            IPAddress network = PrefixTrie<CoalesceMember>.Network(addr, evictionPrefix);
+            Log.Info("Reached limit for number of active F2B filter rules, using " + network + "/" + evictionPrefix + " for " + addr + "/" + prefix);
+            Interlocked.Increment(ref coalescedPrefix);
+
+            return new FwData(fwdata.Expire, network, evictionPrefix);
+        }
+
+
+        // Remove least valuable separate filter rule to get space for new
+        // rule with given expiration, returns false if new rule must be
+        // dropped (must not be called with shard lock)
+        private bool Evict(long expiration)
+        {
+            FwEvictionPolicy policy = EvictionPolicy;
+
+            byte[] hash = null;
+            UInt64 filterId = 0;
+            long victimExpiration = 0;
+            if (policy != FwEvictionPolicy.None)
+            {
+                long best = long.MaxValue;
+                foreach (Shard shard in shards)
+                {
+                    lock (shard)
+                    {
+                        byte[] shardHash;
+                        UInt64 shardFilterId;
+                        long shardExpiration;
+                        long order;
+
+                        if (policy == FwEvictionPolicy.LeastRecentlyTriggered)
+                        {
+                            if (shard.triggers.Count == 0)
+                                continue;
+                            shardHash = shard.triggers.First.Value.Key;
+                            order = shard.triggers.First.Value.Value;
+                            if (!shard.cleanup.TryGetValue(shardHash, out shardFilterId) || !shard.cleanup.TryGetExpiration(shardHash, out shardExpiration))
+                                continue;
+                        }
+                        else
+                        {
+                            if (!shard.cleanup.TryPeek(out shardHash, out shardExpiration, out shardFilterId))
+                                continue;
+                            order = shardExpiration;
+                        }
+
+                        if (order < best)
+                        {
+                            best = order;
+                            hash = shardHash;
+                            filterId = shardFilterId;
+                            victimExpiration = shardExpiration;
+                        }
+                    }
+                }
+
+                // new rule is less valuable than any installed rule
+                if (hash != null && policy != FwEvictionPolicy.LeastRecentlyTriggered && expiration <= victimExpiration)
+                {
+                    hash = null;
+                }
+            }
+
+            if (hash == null)
+            {
+                Interlocked.Increment(ref dropped);
+                Log.Warn("Reached limit for number of active F2B filter rules, skipping new additions");
+                return false;
+            }
+
+            // rule could be removed concurrently (e.g. expired), but then
+            // there is space for new rule anyway
+            if (Untrack(filterId))
+            {
+                Interlocked.Increment(ref evicted);
+                Log.Info("Reached limit for number of active F2B filter rules, evicting filter rule #" + filterId + " (" + policy + ", expiration " + victimExpiration + ")");
+                RemoveQueued(filterId);
+            }
+
+            return true;
+        }
+
+
+#if DEBUG
+        private void DebugEviction(StreamWriter output)
+        {
+            output.WriteLine("  eviction: {0} (max size {1}, evicted {2}, dropped {3}, coalesced prefix {4})",
+                EvictionPolicy, MaxSize, Evicted, Dropped, CoalescedPrefix);
+        }
+#endif
+    }
+}
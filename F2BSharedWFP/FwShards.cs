@@ -0,0 +1,312 @@
+﻿using System;
+using System.Collections.Concurrent;
+using System.Collections.Generic;
+using System.IO;
+using System.Threading;
+
+namespace F2B
+{
+    // State of installed filter rules is split in shards by rule hash.
+    // Rule hash and expiration maps are concurrent dictionaries with
+    // lock-free reads (used for duplicate and 10% expiration checks),
+    // expiration timing wheel and all modifications of one rule are
+    // protected by lock of its shard. Firewall is never called while
+    // holding shard lock.
+    public sealed partial class FwManager
+    {
+        private const int ShardCount = 16; // must be power of two
+
+        private class Shard
+        {
+            public TimingWheel<byte[], UInt64> cleanup; // ruleHash -> filterId (scheduled by expiration)
+            public LinkedList<KeyValuePair<byte[], long>> triggers; // (ruleHash, last trigger time), least recent first
+            public Dictionary<byte[], LinkedListNode<KeyValuePair<byte[], long>>> triggerNodes;
+        }
+
+
+        ByteArrayComparer hashComparer = new ByteArrayComparer();
+        ConcurrentDictionary<UInt64, byte[]> data; // filterId -> ruleHash
+        ConcurrentDictionary<byte[], long> expire; // ruleHash -> expiration
+        Shard[] shards;
+        int dataCount = 0; // number of entries in data (without locking all ConcurrentDictionary locks)
+
+        // rules installed by synchronous Add without holding any lock
+        // (prevents duplicate installation of rule with same hash)
+        ConcurrentDictionary<byte[], long> installing; // ruleHash -> expiration
+
+        // serialize enabling and disabling cleanup timer
+        private object timerLock = new Object();
+
+
+        private void ClearState()
+        {
+            long currtime = DateTime.UtcNow.Ticks;
+
+            data = new ConcurrentDictionary<UInt64, byte[]>();
+            expire = new ConcurrentDictionary<byte[], long>(hashComparer);
+            installing = new ConcurrentDictionary<byte[], long>(hashComparer);
+            shards = new Shard[ShardCount];
+            for (int i = 0; i < ShardCount; i++)
+            {
+                shards[i] = new Shard();
+                shards[i].cleanup = new TimingWheel<byte[], UInt64>(TimeSpan.TicksPerSecond, currtime, hashComparer);
+                shards[i].triggers = new LinkedList<KeyValuePair<byte[], long>>();
+                shards[i].triggerNodes = new Dictionary<byte[], LinkedListNode<KeyValuePair<byte[], long>>>(hashComparer);
+            }
+            dataCount = 0;
+        }
+
+
+        private Shard ShardFor(byte[] hash)
+        {
+            return shards[hashComparer.GetHashCode(hash) & (ShardCount - 1)];
+        }
+
+
+        // Number of installed separate filter rules
+        private int Count
+        {
+            get { return Volatile.Read(ref dataCount); }
+        }
+
+
+        // FilterId of installed rule with given hash (0 if unknown)
+        private UInt64 FilterId(byte[] hash)
+        {
+            Shard shard = ShardFor(hash);
+            lock (shard)
+            {
+                UInt64 filterId;
+                return shard.cleanup.TryGetValue(hash, out filterId) ? filterId : 0;
+            }
+        }
+
+
+        // Register installed filter rule, returns filterId of replaced
+        // rule with same hash (0 if there was no such rule)
+        private UInt64 Track(UInt64 filterId, byte[] hash, long expiration)
+        {
+            UInt64 filterIdOld = 0;
+
+            Shard shard = ShardFor(hash);
+            lock (shard)
+            {
+                byte[] tmp;
+                if (shard.cleanup.TryGetValue(hash, out filterIdOld) && data.TryRemove(filterIdOld, out tmp))
+                {
+                    Interlocked.Decrement(ref dataCount);
+                    if (snapshot != null)
+                    {
+                        snapshot.Remove(filterIdOld);
+                    }
+                }
+
+                if (data.TryAdd(filterId, hash))
+                {
+                    Interlocked.Increment(ref dataCount);
+                }
+                else
+                {
+                    data[filterId] = hash;
+                }
+                expire[hash] = expiration;
+                shard.cleanup.Add(hash, expiration, filterId);
+                Touch(shard, hash, DateTime.UtcNow.Ticks);
+
+                if (snapshot != null)
+                {
+                    snapshot.Add(filterId, hash, expiration);
+                }
+            }
+
+            return (filterIdOld != filterId ? filterIdOld : 0);
+        }
+
+
+        // Record request for installed rule (must be called with shard lock)
+        private static void Touch(Shard shard, byte[] hash, long currtime)
+        {
+            LinkedListNode<KeyValuePair<byte[], long>> node;
+            if (shard.triggerNodes.TryGetValue(hash, out node))
+            {
+                shard.triggers.Remove(node);
+                node.Value = new KeyValuePair<byte[], long>(hash, currtime);
+            }
+            else
+            {
+                node = new LinkedListNode<KeyValuePair<byte[], long>>(new KeyValuePair<byte[], long>(hash, currtime));
+                shard.triggerNodes[hash] = node;
+            }
+            shard.triggers.AddLast(node);
+        }
+
+
+        private static void Forget(Shard shard, byte[] hash)
+        {
+            LinkedListNode<KeyValuePair<byte[], long>> node;
+            if (shard.triggerNodes.TryGetValue(hash, out node))
+            {
+                shard.triggers.Remove(node);
+                shard.triggerNodes.Remove(hash);
+            }
+        }
+
+
+        // Record repeated request for already installed rule
+        private void Touch(byte[] hash)
+        {
+            Shard shard = ShardFor(hash);
+            lock (shard)
+            {
+                if (shard.cleanup.ContainsKey(hash))
+                {
+                    Touch(shard, hash, DateTime.UtcNow.Ticks);
+                }
+            }
+        }
+
+
+        // Forget removed filter rule
+        private bool Untrack(UInt64 filterId)
+        {
+            byte[] hash;
+            if (!data.TryGetValue(filterId, out hash))
+            {
+                return false;
+            }
+
+            Shard shard = ShardFor(hash);
+            lock (shard)
+            {
+                if (!data.TryRemove(filterId, out hash))
+                {
+                    return false;
+                }
+                Interlocked.Decrement(ref dataCount);
+
+                UInt64 filterIdHash;
+                if (!shard.cleanup.TryGetValue(hash, out filterIdHash) || filterIdHash == filterId)
+                {
+                    long tmp;
+                    expire.TryRemove(hash, out tmp);
+                    shard.cleanup.Remove(hash);
+                    Forget(shard, hash);
+                }
+
+                if (snapshot != null)
+                {
+                    snapshot.Remove(filterId);
+                }
+            }
+
+            return true;
+        }
+
+
+        // Forget all rules expired till currtime, returns them as
+        // (ruleHash, expiration, filterId)
+        private IList<Tuple<byte[], long, UInt64>> ExpireRules(long currtime)
+        {
+            List<Tuple<byte[], long, UInt64>> ret = new List<Tuple<byte[], long, UInt64>>();
+
+            foreach (Shard shard in shards)
+            {
+                lock (shard)
+                {
+                    foreach (var item in shard.cleanup.Expire(currtime))
+                    {
+                        byte[] tmpHash;
+                        long tmpExpiration;
+                        if (data.TryRemove(item.Item3, out tmpHash))
+                        {
+                            Interlocked.Decrement(ref dataCount);
+                        }
+                        expire.TryRemove(item.Item1, out tmpExpiration);
+                        Forget(shard, item.Item1);
+
+                        if (snapshot != null)
+                        {
+                            snapshot.Remove(item.Item3);
+                        }
+
+                        ret.Add(item);
+                    }
+                }
+            }
+
+            return ret;
+        }
+
+
+        // All tracked filter rules (filterId, rule hash, expiration)
+        private IEnumerable<Tuple<UInt64, byte[], long>> Entries()
+        {
+            foreach (var item in data)
+            {
+                long expiration;
+                if (expire.TryGetValue(item.Value, out expiration))
+                {
+                    yield return new Tuple<UInt64, byte[], long>(item.Key, item.Value, expiration);
+                }
+            }
+        }
+
+
+        // Compact snapshot journal, all shards are locked (in fixed order)
+        // so no change can be journaled in replaced file
+        private void RewriteSnapshot()
+        {
+            if (snapshot == null)
+                return;
+
+            int locked = 0;
+            try
+            {
+                for (; locked < ShardCount; locked++)
+                {
+                    Monitor.Enter(shards[locked]);
+                }
+
+                snapshot.Rewrite(Entries());
+            }
+            finally
+            {
+                while (locked > 0)
+                {
+                    Monitor.Exit(shards[--locked]);
+                }
+            }
+        }
+
+
+        private void EnableCleanupTimer()
+        {
+            lock (timerLock)
+            {
+                if (!tCleanupExpired.Enabled)
+                {
+                    Log.Info("Enabling cleanup timer (interval " + tCleanupExpired.Interval + " ms)");
+                    tCleanupExpired.Enabled = true;
+                }
+            }
+        }
+
+
+#if DEBUG
+        private void DebugShards(StreamWriter output)
+        {
+            output.WriteLine("  shards: {0} (rules {1}, installing {2})", ShardCount, Count, installing.Count);
+            for (int i = 0; i < ShardCount; i++)
+            {
+                lock (shards[i])
+                {
+                    foreach (var item in shards[i].cleanup.Entries())
+                    {
+                        output.WriteLine("  e/f/h: {0}/{1}/{2} (shard {3})", item.Item2, item.Item3, BitConverter.ToString(item.Item1).Replace("-", ":"), i);
+                    }
+                }
+            }
+        }
+#endif
+    }
+}
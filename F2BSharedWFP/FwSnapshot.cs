@@ -0,0 +1,243 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+
+namespace F2B
+{
+    // On-disk state of FwManager (filterId, rule hash, expiration). File
+    // starts with full snapshot of installed rules followed by journal
+    // of later additions and removals, so each change costs just one
+    // small append. Journal is compacted by rewriting whole snapshot.
+    // Data in this file are only a hint, FwManager always reconciles
+    // them with filter rules that really exists in WFP.
+    public class FwSnapshot : IDisposable
+    {
+        private static readonly byte[] Magic = { (byte)'F', (byte)'2', (byte)'B', (byte)'S' };
+        private const byte Version = 1;
+        private const byte RecordAdd = 1;
+        private const byte RecordRemove = 2;
+
+        private string filename;
+        private BinaryWriter writer = null;
+        private object sync = new Object(); // journal is written from all FwManager shards
+
+        // Number of records written since last rewrite
+        public long Records { get; private set; } = 0;
+
+
+        public FwSnapshot(string filename)
+        {
+            this.filename = filename;
+        }
+
+
+        public void Dispose()
+        {
+            lock (sync)
+            {
+                if (writer != null)
+                {
+                    try
+                    {
+                        writer.Close();
+                    }
+                    catch (IOException)
+                    {
+                    }
+                    writer = null;
+                }
+            }
+        }
+
+
+        // Read snapshot with all journal records, returns
+        // filterId -> (rule hash, expiration)
+        public IDictionary<UInt64, Tuple<byte[], long>> Load()
+        {
+            IDictionary<UInt64, Tuple<byte[], long>> ret = new Dictionary<UInt64, Tuple<byte[], long>>();
+
+            if (!File.Exists(filename))
+            {
+                return ret;
+            }
+
+            try
+            {
+                using (BinaryReader reader = new BinaryReader(new FileStream(filename, FileMode.Open, FileAccess.Read, FileShare.Read, 65536)))
+                {
+                    byte[] magic = reader.ReadBytes(Magic.Length);
+                    if (magic.Length != Magic.Length || magic[0] != Magic[0] || magic[1] != Magic[1] || magic[2] != Magic[2] || magic[3] != Magic[3])
+                    {
+                        Log.Warn("FwSnapshot: Ignoring " + filename + " (invalid header)");
+                        return ret;
+                    }
+
+                    byte version = reader.ReadByte();
+                    if (version != Version)
+                    {
+                        Log.Warn("FwSnapshot: Ignoring " + filename + " (unsupported version " + version + ")");
+                        return ret;
+                    }
+
+                    while (reader.BaseStream.Position < reader.BaseStream.Length)
+                    {
+                        byte type = reader.ReadByte();
+                        UInt64 filterId = reader.ReadUInt64();
+
+                        if (type == RecordAdd)
+                        {
+                            long expiration = reader.ReadInt64();
+                            byte[] hash = reader.ReadBytes(reader.ReadByte());
+                            ret[filterId] = new Tuple<byte[], long>(hash, expiration);
+                        }
+                        else if (type == RecordRemove)
+                        {
+                            ret.Remove(filterId);
+                        }
+                        else
+                        {
+                            Log.Warn("FwSnapshot: Unknown record type " + type + " in " + filename + ", ignoring rest of file");
+                            break;
+                        }
+                    }
+                }
+            }
+            catch (EndOfStreamException)
+            {
+                // last record was not completely written
+                Log.Info("FwSnapshot: Ignoring truncated record at the end of " + filename);
+            }
+            catch (IOException ex)
+            {
+                Log.Warn("FwSnapshot: Unable to read " + filename + ": " + ex.Message);
+            }
+            catch (UnauthorizedAccessException ex)
+            {
+                Log.Warn("FwSnapshot: Unable to read " + filename + ": " + ex.Message);
+            }
+
+            return ret;
+        }
+
+
+        // Replace file content with snapshot of given entries
+        // (filterId, rule hash, expiration) and continue with journal
+        public void Rewrite(IEnumerable<Tuple<UInt64, byte[], long>> entries)
+        {
+            lock (sync)
+            {
+                Dispose();
+
+                string tmpname = filename + ".tmp";
+                try
+                {
+                    long records = 0;
+                    using (BinaryWriter tmp = new BinaryWriter(new FileStream(tmpname, FileMode.Create, FileAccess.Write, FileShare.None, 65536)))
+                    {
+                        tmp.Write(Magic);
+                        tmp.Write(Version);
+                        foreach (var entry in entries)
+                        {
+                            WriteAdd(tmp, entry.Item1, entry.Item2, entry.Item3);
+                            records++;
+                        }
+                    }
+
+                    if (File.Exists(filename))
+                    {
+                        File.Replace(tmpname, filename, null);
+                    }
+                    else
+                    {
+                        File.Move(tmpname, filename);
+                    }
+
+                    writer = new BinaryWriter(new FileStream(filename, FileMode.Append, FileAccess.Write, FileShare.Read, 65536));
+                    Records = records;
+                }
+                catch (IOException ex)
+                {
+                    Log.Warn("FwSnapshot: Unable to write " + filename + ": " + ex.Message);
+                }
+                catch (UnauthorizedAccessException ex)
+                {
+                    Log.Warn("FwSnapshot: Unable to write " + filename + ": " + ex.Message);
+                }
+            }
+        }
+
+
+        public void Add(UInt64 filterId, byte[] hash, long expiration)
+        {
+            lock (sync)
+            {
+                if (writer == null)
+                    return;
+
+                try
+                {
+                    WriteAdd(writer, filterId, hash, expiration);
+                    Records++;
+                }
+                catch (IOException ex)
+                {
+                    Log.Warn("FwSnapshot: Unable to write " + filename + ", disabling snapshot: " + ex.Message);
+                    Dispose();
+                }
+            }
+        }
+
+
+        public void Remove(UInt64 filterId)
+        {
+            lock (sync)
+            {
+                if (writer == null)
+                    return;
+
+                try
+                {
+                    writer.Write(RecordRemove);
+                    writer.Write(filterId);
+                    Records++;
+                }
+                catch (IOException ex)
+                {
+                    Log.Warn("FwSnapshot: Unable to write " + filename + ", disabling snapshot: " + ex.Message);
+                    Dispose();
+                }
+            }
+        }
+
+
+        // Write buffered journal records in file
+        public void Flush()
+        {
+            lock (sync)
+            {
+                if (writer == null)
+                    return;
+
+                try
+                {
+                    writer.Flush();
+                }
+                catch (IOException ex)
+                {
+                    Log.Warn("FwSnapshot: Unable to write " + filename + ", disabling snapshot: " + ex.Message);
+                    Dispose();
+                }
+            }
+        }
+
+
+        private static void WriteAdd(BinaryWriter output, UInt64 filterId, byte[] hash, long expiration)
+        {
+            output.Write(RecordAdd);
+            output.Write(filterId);
+            output.Write(expiration);
+            output.Write((byte)hash.Length);
+            output.Write(hash);
+        }
+    }
+}
@@ -1,8 +1,15 @@
 // This is the main DLL file.
 #include "stdafx.h"
 #include "F2BWFP.h"
+#include "FirewallBatch.h"
 #include "Utils.h"
 
+#include <msclr/lock.h>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <string>
+
 #pragma comment (lib, "fwpuclnt.lib")
 #pragma comment (lib, "advapi32.lib")
 #pragma comment (lib, "Ws2_32.lib")
@@ -10,6 +17,9 @@
 using namespace F2B;
 
 
+static FirewallSessionPool *NewMemorySessionPool();
+
+
 // Singleton constructor
 Firewall::Firewall()
 {
@@ -29,6 +39,14 @@ Firewall::Firewall()
 	m_Session->flags = 0; // non-dynamic session
 	//m_Session->flags = FWPM_SESSION_FLAG_DYNAMIC;
 
+	// Filter operations use in-memory engine (tests without WFP)
+	if (m_memoryEngine)
+	{
+		m_sessions = NewMemorySessionPool();
+		OutputDebugString(L"Firewall::Firewall OK (memory engine)");
+		return;
+	}
+
 	// Create packet filter engine
 	//pin_ptr<HANDLE> p_hEngineHandle = &p_hEngineHandle; // prevent GC moving managed class pointer
 	rc = FwpmEngineOpen(NULL, RPC_C_AUTHN_WINNT, NULL, m_Session, p_hEngineHandle);
@@ -37,6 +55,9 @@ Firewall::Firewall()
 		throw gcnew FirewallException(rc, "Firewall::Firewall(): FwpmEngineOpen failed (" + GetErrorText(rc) + ")");
 	}
 
+	// Filter operations open their own sessions on demand
+	m_sessions = new FirewallSessionPool(m_Session);
+
 	OutputDebugString(L"Firewall::Firewall OK");
 }
 
@@ -60,13 +81,23 @@ Firewall::!Firewall()
 
 	DWORD rc = ERROR_SUCCESS;
 
+	if (m_sessions != NULL)
+	{
+		// Close engine sessions used by filter operations
+		delete m_sessions;
+		m_sessions = NULL;
+	}
+
 	if (p_hEngineHandle != NULL)
 	{
-		// Close packet filter engine
-		rc = FwpmEngineClose(*p_hEngineHandle);
-		if (rc != ERROR_SUCCESS)
+		// Close packet filter engine (not opened with memory engine)
+		if (*p_hEngineHandle != NULL)
 		{
-			OutputDebugString(FormatErrorText(L"Firewall::!Firewall: Unable to close packet filter engine", rc));
+			rc = FwpmEngineClose(*p_hEngineHandle);
+			if (rc != ERROR_SUCCESS)
+			{
+				OutputDebugString(FormatErrorText(L"Firewall::!Firewall: Unable to close packet filter engine", rc));
+			}
 		}
 
 		*p_hEngineHandle = NULL;
@@ -84,11 +115,32 @@ Firewall::!Firewall()
 }
 
 
+void Firewall::UseMemoryEngine()
+{
+	Monitor::Enter(sync);
+	try
+	{
+		if (m_instance != nullptr && !m_memoryEngine)
+		{
+			throw gcnew System::InvalidOperationException("Firewall::UseMemoryEngine: WFP engine already in use");
+		}
+
+		m_memoryEngine = true;
+	}
+	finally
+	{
+		Monitor::Exit(sync);
+	}
+}
+
+
 // Create required WFP provider and sublayer for this module
 void Firewall::Install()
 {
 	OutputDebugString(L"Firewall::Install");
 
+	FirewallOperationTimer timer((int)FirewallOperation::Install);
+
 	DWORD rc = ERROR_SUCCESS;
 	FWPM_PROVIDER provider;
 	FWPM_SUBLAYER subLayer;
@@ -120,6 +172,7 @@ void Firewall::Install()
 	}
 	else
 	{
+		timer.rc = rc;
 		throw gcnew FirewallException(rc, "Firewall::Install: FwpmProviderAdd failed (" + GetErrorText(rc) + ")");
 	}
 
@@ -146,6 +199,7 @@ void Firewall::Install()
 	}
 	else
 	{
+		timer.rc = rc;
 		throw gcnew FirewallException(rc, "Firewall::Install: FwpmSubLayerAdd failed (" + GetErrorText(rc) + ")");
 	}
 }
@@ -1217,6 +1271,56 @@ void Firewall::DumpPrivileges()
 #endif
 
 
+// Add filter rule without throwing exception (it can be used inside
+// already opened WFP transaction)
+static DWORD AddFilter(FirewallEngine *engine, String^ name, array<Byte>^ metadata, const GUID &layerKey, FWPM_FILTER_CONDITION *fwpFilterCondition, UInt32 iFilterCondition, UInt64 weight, bool permit, bool persistent, UINT64 *filterId)
+{
+	FWPM_FILTER fwpFilter;
+
+	::ZeroMemory(&fwpFilter, sizeof(FWPM_FILTER));
+
+	pin_ptr<const wchar_t> pName = PtrToStringChars(name);
+
+	fwpFilter.layerKey = layerKey;
+	fwpFilter.subLayerKey = F2BFW_SUBLAYER_KEY;
+	fwpFilter.providerKey = (GUID*)&F2BFW_PROVIDER_KEY;
+	fwpFilter.flags = FWPM_FILTER_FLAG_NONE;
+	if (persistent)
+		fwpFilter.flags |= FWPM_FILTER_FLAG_PERSISTENT;
+	if (permit)
+		fwpFilter.action.type = FWP_ACTION_PERMIT;
+	else
+		fwpFilter.action.type = FWP_ACTION_BLOCK;
+	if (weight == 0)
+		fwpFilter.weight.type = FWP_EMPTY; // auto-weight.
+	else if (weight < 16)
+	{
+		fwpFilter.weight.type = FWP_UINT8;
+		fwpFilter.weight.uint8 = (UINT8)weight;
+	}
+	else
+	{
+		fwpFilter.weight.type = FWP_UINT64;
+		fwpFilter.weight.uint64 = &weight;
+	}
+	fwpFilter.displayData.name = (wchar_t *)pName;
+	fwpFilter.numFilterConditions = iFilterCondition;
+	fwpFilter.filterCondition = fwpFilterCondition;
+
+	// binary F2B metadata (see F2B_FILTER_METADATA0)
+	pin_ptr<Byte> pMetadata = nullptr;
+	if (metadata != nullptr && metadata->Length > 0)
+	{
+		pMetadata = &metadata[0];
+		fwpFilter.providerData.size = metadata->Length;
+		fwpFilter.providerData.data = (UINT8 *)pMetadata;
+	}
+
+	*filterId = 0;
+	return engine->FilterAdd(&fwpFilter, filterId);
+}
+
+
 // Add new filtering rule
 UInt64 Firewall::Add(String^ name, IPAddress^ addr, int prefix, UInt64 weight, bool permit, bool persistent)
 {
@@ -1226,13 +1330,12 @@ UInt64 Firewall::Add(String^ name, IPAddress^ addr, int prefix, UInt64 weight, b
 
 	::ZeroMemory(&fwpFilterCondition, sizeof(FWPM_FILTER_CONDITION));
 
-	if (addr->IsIPv4MappedToIPv6)
+	// IPv4 address mapped to IPv6 with prefix shorter than 96 covers
+	// also addresses outside ::ffff:0:0/96 and it must stay IPv6 prefix
+	if (addr->IsIPv4MappedToIPv6 && prefix >= 96)
 	{
 		addr = addr->MapToIPv4();
-		if (prefix >= 96)
-		{
-			prefix -= 96;
-		}
+		prefix -= 96;
 	}
 
 	fwpFilterCondition.fieldKey = FWPM_CONDITION_IP_REMOTE_ADDRESS;
@@ -1248,7 +1351,7 @@ UInt64 Firewall::Add(String^ name, IPAddress^ addr, int prefix, UInt64 weight, b
 		array<unsigned char>^ addrBytes = addr->GetAddressBytes();
 		pin_ptr<unsigned char> pAddrBytes = &addrBytes[0];
 		fwpAddr4AndMask.addr = htonl(*((u_long *)&pAddrBytes[0]));
-		fwpAddr4AndMask.mask = 0xffffffff << (32 - prefix);
+		fwpAddr4AndMask.mask = (prefix <= 0 ? 0 : (prefix >= 32 ? 0xffffffff : 0xffffffff << (32 - prefix)));
 
 		return this->Add(name, FWPM_LAYER_INBOUND_IPPACKET_V4, fwpFilterCondition, 1, weight, permit, persistent);
 	}
@@ -1263,7 +1366,7 @@ UInt64 Firewall::Add(String^ name, IPAddress^ addr, int prefix, UInt64 weight, b
 		array<unsigned char>^ addrBytes = addr->GetAddressBytes();
 		pin_ptr<unsigned char> pAddrBytes = &addrBytes[0];
 		CopyMemory(&fwpAddr6AndMask.addr, pAddrBytes, 16);
-		fwpAddr6AndMask.prefixLength = prefix;
+		fwpAddr6AndMask.prefixLength = (UINT8)(prefix > 128 ? 128 : prefix);
 
 		return this->Add(name, FWPM_LAYER_INBOUND_IPPACKET_V6, fwpFilterCondition, 1, weight, permit, persistent);
 	}
@@ -1329,7 +1432,7 @@ UInt64 Firewall::Add(String^ name, IPAddress^ addrLow, IPAddress^ addrHigh, UInt
 
 //UInt64 Firewall::Add(String^ name, List<Object^>^ rules) { return 0; }
 //UInt64 Add(String^ name, char *data, UInt32 size);
-UInt64 Firewall::AddIPv4(String^ name, FirewallConditions^ conditions, UInt64 weight, bool permit, bool persistent)
+UInt64 Firewall::AddIPv4(String^ name, array<Byte>^ metadata, FirewallConditions^ conditions, UInt64 weight, bool permit, bool persistent)
 {
 	OutputDebugString(L"Firewall::AddIPv4(String, FirewallConditions)");
 
@@ -1339,9 +1442,9 @@ UInt64 Firewall::AddIPv4(String^ name, FirewallConditions^ conditions, UInt64 we
 		throw gcnew System::ArgumentException("Firewall::AddIPv4: no conditions");
 	}
 
-	return this->Add(name, conditions->LayerIPv4(), *conditions->GetIPv4(), (UInt32) conditions->CountIPv4(), weight, permit, persistent);
+	return this->Add(name, metadata, conditions->LayerIPv4(), *conditions->GetIPv4(), (UInt32) conditions->CountIPv4(), weight, permit, persistent);
 }
-UInt64 Firewall::AddIPv6(String^ name, FirewallConditions^ conditions, UInt64 weight, bool permit, bool persistent)
+UInt64 Firewall::AddIPv6(String^ name, array<Byte>^ metadata, FirewallConditions^ conditions, UInt64 weight, bool permit, bool persistent)
 {
 	OutputDebugString(L"Firewall::AddIPv6(String, FirewallConditions)");
 
@@ -1351,751 +1454,3075 @@ UInt64 Firewall::AddIPv6(String^ name, FirewallConditions^ conditions, UInt64 we
 		throw gcnew System::ArgumentException("Firewall::AddIPv6: no conditions");
 	}
 
-	return this->Add(name, conditions->LayerIPv6(), *conditions->GetIPv6(), (UInt32) conditions->CountIPv6(), weight, permit, persistent);
+	return this->Add(name, metadata, conditions->LayerIPv6(), *conditions->GetIPv6(), (UInt32) conditions->CountIPv6(), weight, permit, persistent);
 }
 
-UInt64 Firewall::Add(String^ name, const GUID &layerKey, FWPM_FILTER_CONDITION &fwpFilterCondition, UInt32 iFilterCondition, UInt64 weight, bool permit, bool persistent)
+UInt64 Firewall::Add(String^ name, array<Byte>^ metadata, const GUID &layerKey, FWPM_FILTER_CONDITION &fwpFilterCondition, UInt32 iFilterCondition, UInt64 weight, bool permit, bool persistent)
 {
 	OutputDebugString(L"Firewall::Add(String, &FWPM_FILTER_CONDITION)");
 
 	// Add filter to block traffic from IP address
 	DWORD rc = ERROR_SUCCESS;
 
-	FWPM_FILTER fwpFilter;
-
-	::ZeroMemory(&fwpFilter, sizeof(FWPM_FILTER));
-
-	pin_ptr<const wchar_t> pName = PtrToStringChars(name);
-
-	fwpFilter.layerKey = layerKey;
-	fwpFilter.subLayerKey = F2BFW_SUBLAYER_KEY;
-	fwpFilter.providerKey = (GUID*)&F2BFW_PROVIDER_KEY;
-	fwpFilter.flags = FWPM_FILTER_FLAG_NONE;
-	if (persistent)
-		fwpFilter.flags |= FWPM_FILTER_FLAG_PERSISTENT;
-	if (permit)
-		fwpFilter.action.type = FWP_ACTION_PERMIT;
-	else
-		fwpFilter.action.type = FWP_ACTION_BLOCK;
-	if (weight == 0)
-		fwpFilter.weight.type = FWP_EMPTY; // auto-weight.
-	else if (weight < 16)
-	{
-		fwpFilter.weight.type = FWP_UINT8;
-		fwpFilter.weight.uint8 = (UINT8)weight;
+	FirewallOperationTimer timer((int)FirewallOperation::Add);
+	FirewallSession session(m_sessions);
+	if (session.rc != ERROR_SUCCESS) {
+		timer.rc = session.rc;
+		throw gcnew FirewallException(session.rc, "Firewall::Add: FwpmEngineOpen failed (" + GetErrorText(session.rc) + ")");
 	}
-	else
-	{
-		fwpFilter.weight.type = FWP_UINT64;
-		fwpFilter.weight.uint64 = &weight;
-	}
-	fwpFilter.displayData.name = (wchar_t *)pName;
-	fwpFilter.numFilterConditions = iFilterCondition;
-	fwpFilter.filterCondition = &fwpFilterCondition;
+	FirewallEngine *engine = session.Engine();
 
 	UINT64 filterId = 0;
-	rc = FwpmFilterAdd(*p_hEngineHandle, &fwpFilter, NULL, &filterId);
+	rc = AddFilter(engine, name, metadata, layerKey, &fwpFilterCondition, iFilterCondition, weight, permit, persistent, &filterId);
 	if (rc != ERROR_SUCCESS) {
+		timer.rc = rc;
 		throw gcnew FirewallException(rc, "Firewall::Add: FwpmFilterAdd failed (" + GetErrorText(rc) + ")");
 	}
 	else
 	{
 		OutputDebugString(L"Firewall::Add: FwpmFilterAdd OK");
+		SetOwned(filterId, true);
+		FirewallStats::AddFilters(1);
 	}
 
 	return filterId;
 }
 
 
-// Remove filter with defined Id
-void Firewall::Remove(UInt64 id)
+// Filter rules from FirewallBatchItem list added in WFP transactions,
+// result of each rule is stored in its item (FilterId and Error)
+class FirewallAddBatch : public FirewallBatch
 {
-	// Remove filter blocking traffic from IP address
-	DWORD rc = ERROR_SUCCESS;
-	FWPM_FILTER *pFilter = NULL;
-
-	rc = FwpmFilterGetById(*p_hEngineHandle, id, &pFilter);
-	if (rc != ERROR_SUCCESS) {
-		throw gcnew FirewallException(rc, "Firewall::Remove: FwpmFilterGetById failed (" + GetErrorText(rc) + ")");
+public:
+	FirewallAddBatch(FirewallEngine *engine, IList<FirewallBatchItem^>^ items, UInt64 weight, bool permit, bool persistent)
+	{
+		this->engine = engine;
+		this->items = items;
+		this->weight = weight;
+		this->permit = permit;
+		this->persistent = persistent;
 	}
 
-	BOOL f2bGUIDs = ((pFilter->providerKey != NULL && IsEqualGUID(*pFilter->providerKey, F2BFW_PROVIDER_KEY)) || IsEqualGUID(pFilter->subLayerKey, F2BFW_SUBLAYER_KEY));
-	if (pFilter != NULL)
+	virtual bool Pending(size_t i)
 	{
-		FwpmFreeMemory((void **)&pFilter);
+		FirewallBatchItem^ item = Item(i);
+		return item != nullptr && item->Error == ERROR_IO_PENDING;
 	}
 
-	if (!f2bGUIDs)
+	virtual DWORD Begin()
 	{
-		OutputDebugString(L"Firewall::Remove:provider key and sublayer key doesn't match F2B GUIDs");
-		return;
+		DWORD rc = engine->TransactionBegin();
+		if (rc != ERROR_SUCCESS)
+			OutputDebugString(FormatErrorText(L"Firewall::AddBatch: FwpmTransactionBegin failed: ", rc));
+		return rc;
 	}
 
-	rc = FwpmFilterDeleteById(*p_hEngineHandle, id);
-	if (rc != ERROR_SUCCESS) {
-		throw gcnew FirewallException(rc, "Firewall::Remove: FwpmFilterDeleteById failed (" + GetErrorText(rc) + ")");
-	}
+	virtual DWORD Apply(size_t i, UINT64 *id)
+	{
+		FirewallBatchItem^ item = Item(i);
+		FirewallConditions^ conditions = item->Conditions;
+		DWORD rc;
 
-	OutputDebugString(L"Firewall::Remove: FwpmFilterDeleteById OK");
-}
+		if (item->IPv6)
+			rc = AddFilter(engine, item->Name, item->Metadata, conditions->LayerIPv6(), conditions->GetIPv6(), (UInt32)conditions->CountIPv6(), weight, permit, persistent, id);
+		else
+			rc = AddFilter(engine, item->Name, item->Metadata, conditions->LayerIPv4(), conditions->GetIPv4(), (UInt32)conditions->CountIPv4(), weight, permit, persistent, id);
 
+		if (rc != ERROR_SUCCESS)
+			OutputDebugString(FormatErrorText(L"Firewall::AddBatch: FwpmFilterAdd failed: ", rc));
+		return rc;
+	}
 
-// Remove all filter rules added by this module
-void Firewall::Cleanup()
-{
-	OutputDebugString(L"Firewall::Cleanup");
+	virtual DWORD Commit()
+	{
+		DWORD rc = engine->TransactionCommit();
+		if (rc != ERROR_SUCCESS)
+			OutputDebugString(FormatErrorText(L"Firewall::AddBatch: FwpmTransactionCommit failed: ", rc));
+		return rc;
+	}
 
-	DWORD rc = ERROR_SUCCESS;
+	virtual DWORD Abort()
+	{
+		DWORD rc = engine->TransactionAbort();
+		if (rc != ERROR_SUCCESS)
+			OutputDebugString(FormatErrorText(L"Firewall::AddBatch: FwpmTransactionAbort failed: ", rc));
+		return rc;
+	}
 
-	// Use transaction to remove filters
-	//rc = FwpmTransactionBegin(*p_hEngineHandle, 0);
+	virtual void Result(size_t i, DWORD rc, UINT64 id)
+	{
+		FirewallBatchItem^ item = Item(i);
+		item->FilterId = id;
+		item->Error = rc;
+	}
 
-	// Remove WFP filters related to our provider and sublayer
-	HANDLE m_hFilterEnumHandle = NULL;
-	//FWPM_FILTER_ENUM_TEMPLATE enumTemplate;
-	FWPM_FILTER** pFilter = NULL;
-	UINT32 nFilter;
+	virtual bool Fatal(DWORD rc)
+	{
+		return rc == FWP_E_TXN_ABORTED || rc == FWP_E_SESSION_ABORTED || rc == FWP_E_TIMEOUT;
+	}
 
-	// template
-	//ZeroMemory(&enumTemplate, sizeof(FWPM_FILTER_ENUM_TEMPLATE));
-	//enumTemplate.providerKey = (GUID *)&F2BFW_PROVIDER_KEY;
-	//enumTemplate.numFilterConditions = 0;
-	//enumTemplate.actionMask = 0xFFFFFFFF;
+private:
+	FirewallEngine *engine;
+	gcroot<IList<FirewallBatchItem^>^> items;
+	UInt64 weight;
+	bool permit;
+	bool persistent;
 
-	// filter
-	rc = FwpmFilterCreateEnumHandle(*p_hEngineHandle, NULL, &m_hFilterEnumHandle);
-	if (rc != ERROR_SUCCESS) {
-		throw gcnew FirewallException(rc, "Firewall::Cleanup: FwpmFilterCreateEnumHandle failed (" + GetErrorText(rc) + ")");
+	FirewallBatchItem^ Item(size_t i)
+	{
+		IList<FirewallBatchItem^>^ list = items;
+		return list[(int)i];
 	}
+};
 
-	rc = FwpmFilterEnum(*p_hEngineHandle, m_hFilterEnumHandle, INFINITE, &pFilter, &nFilter);
-	if (rc != ERROR_SUCCESS) {
-		FwpmFilterDestroyEnumHandle(*p_hEngineHandle, m_hFilterEnumHandle);
-		throw gcnew FirewallException(rc, "Firewall::Cleanup: FwpmFilterEnum failed (" + GetErrorText(rc) + ")");
+
+// Filters with ids from FirewallBatchItem list removed in WFP transactions,
+// filter that no longer exists doesn't abort transaction for other filters
+class FirewallRemoveBatch : public FirewallBatch
+{
+public:
+	FirewallRemoveBatch(FirewallEngine *engine, IList<FirewallBatchItem^>^ items)
+	{
+		this->engine = engine;
+		this->items = items;
 	}
 
-	for (UINT32 i = 0; i < nFilter; i++)
+	virtual bool Pending(size_t i)
 	{
-		FWPM_FILTER *f = pFilter[i];
-		if (!((f->providerKey != NULL && IsEqualGUID(*f->providerKey, F2BFW_PROVIDER_KEY)) || IsEqualGUID(f->subLayerKey, F2BFW_SUBLAYER_KEY)))
-			continue;
+		FirewallBatchItem^ item = Item(i);
+		return item != nullptr && item->Error == ERROR_IO_PENDING;
+	}
 
-		//{ /// REMOVE
-		//	PACL pDacl;
-		//	PSECURITY_DESCRIPTOR securityDescriptor;
-		//	rc = FwpmFilterGetSecurityInfoByKey(*p_hEngineHandle, NULL, DACL_SECURITY_INFORMATION, NULL, NULL, &pDacl, NULL, &securityDescriptor);
-		//	PrintSD(securityDescriptor);
-		//	FwpmFreeMemory((void **)&securityDescriptor);
-		//}
-		rc = FwpmFilterDeleteById(*p_hEngineHandle, f->filterId);
-		if (rc != ERROR_SUCCESS) {
-			OutputDebugString(FormatErrorText(L"Firewall::Cleanup: FwpmFilterDeleteById failed: ", rc));
-			//throw new std::exception("FwpmFilterDeleteById failed");
-		}
+	virtual DWORD Begin()
+	{
+		DWORD rc = engine->TransactionBegin();
+		if (rc != ERROR_SUCCESS)
+			OutputDebugString(FormatErrorText(L"Firewall::RemoveBatch: FwpmTransactionBegin failed: ", rc));
+		return rc;
 	}
 
-	if (pFilter != NULL)
+	virtual DWORD Apply(size_t i, UINT64 *id)
 	{
-		FwpmFreeMemory((void**)&pFilter);
+		*id = 0;
+		DWORD rc = engine->FilterDeleteById(Item(i)->FilterId);
+		if (rc != ERROR_SUCCESS && rc != FWP_E_FILTER_NOT_FOUND)
+			OutputDebugString(FormatErrorText(L"Firewall::RemoveBatch: FwpmFilterDeleteById failed: ", rc));
+		return rc;
 	}
 
-	rc = FwpmFilterDestroyEnumHandle(*p_hEngineHandle, m_hFilterEnumHandle);
-	if (rc != ERROR_SUCCESS) {
-		OutputDebugString(FormatErrorText(L"Firewall::Cleanup: FwpmFilterDestroyEnumHandle failed: ", rc));
-		//throw gcnew FirewallException(rc, "Firewall::Cleanup: FwpmFilterDestroyEnumHandle failed (" + GetErrorText(rc) + ")");
+	virtual DWORD Commit()
+	{
+		DWORD rc = engine->TransactionCommit();
+		if (rc != ERROR_SUCCESS)
+			OutputDebugString(FormatErrorText(L"Firewall::RemoveBatch: FwpmTransactionCommit failed: ", rc));
+		return rc;
 	}
 
-	// Use transaction to remove filters
-	// rc = FwpmTransactionCommit0(engine);
-}
+	virtual DWORD Abort()
+	{
+		DWORD rc = engine->TransactionAbort();
+		if (rc != ERROR_SUCCESS)
+			OutputDebugString(FormatErrorText(L"Firewall::RemoveBatch: FwpmTransactionAbort failed: ", rc));
+		return rc;
+	}
 
+	virtual void Result(size_t i, DWORD rc, UINT64 id)
+	{
+		Item(i)->Error = rc;
+	}
 
-// List all filter rules added by this module
-Dictionary<UInt64, String^>^ Firewall::List(bool details)
-{
-	Dictionary<UInt64, String^>^ ret = gcnew Dictionary<UInt64, String^>();
-	List(details, FWPM_LAYER_INBOUND_IPPACKET_V4, ret);
-	List(details, FWPM_LAYER_INBOUND_IPPACKET_V6, ret);
-	return ret;
-}
+	virtual bool Tolerated(DWORD rc)
+	{
+		return rc == FWP_E_FILTER_NOT_FOUND;
+	}
 
+	virtual bool Fatal(DWORD rc)
+	{
+		return rc == FWP_E_TXN_ABORTED || rc == FWP_E_SESSION_ABORTED || rc == FWP_E_TIMEOUT;
+	}
 
-void Firewall::List(bool details, GUID layer, Dictionary<UInt64, String^>^ list)
-{
-	OutputDebugString(L"Firewall::List");
+private:
+	FirewallEngine *engine;
+	gcroot<IList<FirewallBatchItem^>^> items;
 
-	DWORD rc = ERROR_SUCCESS;
+	FirewallBatchItem^ Item(size_t i)
+	{
+		IList<FirewallBatchItem^>^ list = items;
+		return list[(int)i];
+	}
+};
 
-	HANDLE m_hFilterEnumHandle = NULL;
-	FWPM_FILTER** pFilter = NULL;
-	UINT32 nFilter;
 
-	// return only subset of filter rules
-	FWPM_FILTER_ENUM_TEMPLATE enumTemplate;
-	ZeroMemory(&enumTemplate, sizeof(FWPM_FILTER_ENUM_TEMPLATE));
-	enumTemplate.layerKey = layer;
-	enumTemplate.providerKey = (GUID *)&F2BFW_PROVIDER_KEY;
-	enumTemplate.actionMask = 0xFFFFFFFF;
+// Add new filtering rules in (size capped) WFP transactions
+void Firewall::AddBatch(IList<FirewallBatchItem^>^ items, UInt64 weight, bool permit, bool persistent)
+{
+	OutputDebugString(L"Firewall::AddBatch");
 
-	// filter
-	rc = FwpmFilterCreateEnumHandle(*p_hEngineHandle, &enumTemplate, &m_hFilterEnumHandle);
-	if (rc != ERROR_SUCCESS) {
-		throw gcnew FirewallException(rc, "Firewall::List: FwpmFilterCreateEnumHandle failed (" + GetErrorText(rc) + ")");
+	if (items == nullptr)
+	{
+		throw gcnew System::ArgumentNullException("items", "Firewall::AddBatch: no filter rules");
 	}
 
-	rc = FwpmFilterEnum(*p_hEngineHandle, m_hFilterEnumHandle, INFINITE, &pFilter, &nFilter);
-	if (rc != ERROR_SUCCESS) {
-		FwpmFilterDestroyEnumHandle(*p_hEngineHandle, m_hFilterEnumHandle);
-		throw gcnew FirewallException(rc, "Firewall::List: FwpmFilterEnum failed (" + GetErrorText(rc) + ")");
+	FirewallOperationTimer timer((int)FirewallOperation::AddBatch);
+	FirewallSession session(m_sessions);
+	if (session.rc != ERROR_SUCCESS) {
+		timer.rc = session.rc;
+		throw gcnew FirewallException(session.rc, "Firewall::AddBatch: FwpmEngineOpen failed (" + GetErrorText(session.rc) + ")");
 	}
+	FirewallEngine *engine = session.Engine();
 
-	for (UINT32 i = 0; i < nFilter; i++)
+	// Rules without conditions can't be installed and they are excluded
+	// from transactions to prevent abort of other rules in same batch
+	for (int i = 0; i < items->Count; i++)
 	{
-		FWPM_FILTER *f = pFilter[i];
-		//if (f->providerKey == NULL)
-		//	continue;
-		//if (!IsEqualGUID(*f->providerKey, F2BFW_PROVIDER_KEY))
-		//	continue;
-		if (!IsEqualGUID(f->subLayerKey, F2BFW_SUBLAYER_KEY))
+		FirewallBatchItem^ item = items[i];
+		if (item == nullptr)
 			continue;
 
-		if (!details)
+		item->FilterId = 0;
+		item->Error = ERROR_IO_PENDING;
+
+		FirewallConditions^ conditions = item->Conditions;
+		if (conditions == nullptr || (item->IPv6 ? conditions->CountIPv6() : conditions->CountIPv4()) == 0)
 		{
-			list[f->filterId] = gcnew String(f->displayData.name);
-			continue;
+			item->Error = ERROR_INVALID_PARAMETER;
 		}
+	}
+
+	FirewallAddBatch batch(engine, items, weight, permit, persistent);
+	for (int start = 0; start < items->Count; start += m_batchSize)
+	{
+		int end = start + m_batchSize;
+		if (end > items->Count)
+			end = items->Count;
+
+		batch.Run(start, end);
+	}
+
+	// failed rules doesn't fail whole batch operation
+	int added = 0;
+	for (int i = 0; i < items->Count; i++)
+	{
+		FirewallBatchItem^ item = items[i];
+		if (item == nullptr)
+			continue;
 
-		StringBuilder^ detail = gcnew StringBuilder();
-		detail->Append("name[");
-		detail->Append(gcnew String(f->displayData.name));
-		detail->Append("]");
-		detail->Append("/");
-		// description
-		if (f->displayData.description)
+		if (item->Error == ERROR_SUCCESS)
 		{
-			detail->Append("desc[");
-			detail->Append(gcnew String(f->displayData.description));
-			detail->Append("]");
-			detail->Append("/");
-		}
-		// GUID
-		detail->Append("GUID[");
-		detail->Append(String::Format("{0:X08}-{1:X04}-{2:X04}-{3:X02}{4:X02}-{5:X02}{6:X02}{7:X02}{8:X02}{9:X02}{10:X02}",
-			f->filterKey.Data1, f->filterKey.Data2, f->filterKey.Data3,
-			f->filterKey.Data4[0], f->filterKey.Data4[1], f->filterKey.Data4[2], f->filterKey.Data4[3],
-			f->filterKey.Data4[4], f->filterKey.Data4[5], f->filterKey.Data4[6], f->filterKey.Data4[7]));
-		detail->Append("]");
-		detail->Append("/");
-		// action
-		detail->Append("action[");
-		switch (f->action.type)
-		{
-		case FWP_ACTION_BLOCK:
-			detail->Append("block");
-			break;
-		case FWP_ACTION_PERMIT:
-			detail->Append("permit");
-			break;
-		default:
-			detail->Append("unknown");
-			break;
+			SetOwned(item->FilterId, true);
+			added++;
 		}
-		detail->Append("]");
-		detail->Append("/");
-		// flags
-		detail->Append("flags[");
-		detail->Append(f->flags);
-		detail->Append("]");
-		detail->Append("/");
-		// weight
-		detail->Append("weight[");
-		switch (f->weight.type)
-		{
-		case FWP_UINT8:
-			detail->Append("range_index_");
-			detail->Append(f->weight.uint8);
-			break;
-		case FWP_UINT64:
-			detail->Append(*f->weight.uint64);
-			break;
-		case FWP_EMPTY:
-			detail->Append("empty");
-			break;
-		default:
-			detail->Append("unknown");
-			break;
-		}
-		detail->Append("]");
-		detail->Append("/");
-        // effectiveWeight
-		detail->Append("effectiveWeight[");
-		switch (f->effectiveWeight.type)
+		else
 		{
-		case FWP_UINT8:
-			detail->Append("range_index_");
-			detail->Append(f->effectiveWeight.uint8);
-			break;
-		case FWP_UINT64:
-			detail->Append(*f->effectiveWeight.uint64);
-			break;
-		case FWP_EMPTY:
-			detail->Append("empty");
-			break;
-		default:
-			detail->Append("unknown");
-			break;
+			FirewallStats::RecordError(FirewallOperation::AddBatch, item->Error);
 		}
-		detail->Append("]");
-		detail->Append("/");
-		// conditions
-		detail->Append("conditions[");
-		for (UINT32 j = 0; j < f->numFilterConditions; j++)
-		{
-			FWPM_FILTER_CONDITION *c = &f->filterCondition[j];
-			if (j != 0)
-				detail->Append(",");
-			detail->Append("(");
-			detail->Append("fieldKey[");
-			detail->Append(String::Format("{0:X08}-{1:X04}-{2:X04}-{3:X02}{4:X02}-{5:X02}{6:X02}{7:X02}{8:X02}{9:X02}{10:X02}",
-				c->fieldKey.Data1, c->fieldKey.Data2, c->fieldKey.Data3,
-				c->fieldKey.Data4[0], c->fieldKey.Data4[1], c->fieldKey.Data4[2], c->fieldKey.Data4[3],
-				c->fieldKey.Data4[4], c->fieldKey.Data4[5], c->fieldKey.Data4[6], c->fieldKey.Data4[7]));
-			detail->Append("],match[");
-			switch (c->matchType)
-			{
-			case FWP_MATCH_EQUAL: detail->Append("equal"); break;
-			case FWP_MATCH_GREATER: detail->Append("greater"); break;
-			case FWP_MATCH_LESS: detail->Append("less"); break;
-			case FWP_MATCH_GREATER_OR_EQUAL: detail->Append("greater_or_equal"); break;
-			case FWP_MATCH_LESS_OR_EQUAL: detail->Append("less_or_equal"); break;
-			case FWP_MATCH_RANGE: detail->Append("range"); break;
-			case FWP_MATCH_FLAGS_ALL_SET: detail->Append("flags_all_set"); break;
-			case FWP_MATCH_FLAGS_ANY_SET: detail->Append("flags_any_set"); break;
-			case FWP_MATCH_FLAGS_NONE_SET: detail->Append("flags_none_set"); break;
-			case FWP_MATCH_EQUAL_CASE_INSENSITIVE: detail->Append("equal_case_insensitive"); break;
-			case FWP_MATCH_NOT_EQUAL: detail->Append("not_equal"); break;
-			default: detail->Append("unknown"); break;
-			}
-			detail->Append("],value[");
-			switch (c->conditionValue.type)
-			{
-			case FWP_EMPTY: detail->Append("empty"); break;
-			case FWP_UINT8: detail->Append("uint8="); detail->Append(c->conditionValue.uint8); break;
-			case FWP_UINT16: detail->Append("uint16="); detail->Append(c->conditionValue.uint16); break;
-			case FWP_UINT32: detail->Append("uint32="); detail->Append(c->conditionValue.uint32); break;
-			case FWP_UINT64: detail->Append("uint64="); detail->Append(*c->conditionValue.uint64); break;
-			case FWP_INT8: detail->Append("int8="); detail->Append(c->conditionValue.int8); break;
-			case FWP_INT16: detail->Append("int16="); detail->Append(c->conditionValue.int16); break;
-			case FWP_INT32: detail->Append("int32="); detail->Append(c->conditionValue.int32); break;
-			case FWP_INT64: detail->Append("int64="); detail->Append(*c->conditionValue.int64); break;
-			case FWP_FLOAT: detail->Append("float="); detail->Append(c->conditionValue.float32); break;
-			case FWP_DOUBLE: detail->Append("double="); detail->Append(*c->conditionValue.double64); break;
-			case FWP_BYTE_ARRAY16_TYPE: detail->Append("byte16"); break;
-			case FWP_BYTE_BLOB_TYPE: detail->Append("blob"); break;
-			case FWP_SID: detail->Append("sid"); break;
-			case FWP_SECURITY_DESCRIPTOR_TYPE: detail->Append("sd"); break;
-			case FWP_TOKEN_INFORMATION_TYPE: detail->Append("token_info"); break;
-			case FWP_TOKEN_ACCESS_INFORMATION_TYPE: detail->Append("token_access"); break;
-			case FWP_UNICODE_STRING_TYPE: detail->Append("string"); break;
-			case FWP_BYTE_ARRAY6_TYPE: detail->Append("byte6"); break;
-			case FWP_V4_ADDR_MASK:
-			{
-				detail->Append("IPv4=");
-				IPAddress^ addr = gcnew IPAddress(ntohl(c->conditionValue.v4AddrMask->addr));
-				UINT8 prefix = 0;
-				while (prefix < 32)
-				{
-					if ((c->conditionValue.v4AddrMask->mask & ((UINT32)1 << (31 - prefix))) == 0)
-					{
-						break;
-					}
-					prefix++;
-				}
-				detail->Append(addr->ToString());
-				detail->Append("/");
-				detail->Append(prefix);
-				break;
-			}
-			case FWP_V6_ADDR_MASK:
-			{
-				detail->Append("IPv6=");
-				array<Byte>^ buf = gcnew array<Byte>(16);
-				Marshal::Copy((IntPtr)c->conditionValue.v6AddrMask->addr, buf, 0, 16);
-				IPAddress^ addr = gcnew IPAddress(buf);
-				UINT8 prefix = c->conditionValue.v6AddrMask->prefixLength;
-				detail->Append(addr->ToString());
-				detail->Append("/");
-				detail->Append(prefix);
-				break;
-			}
-			case FWP_RANGE_TYPE:
-			{
-				detail->Append("range=(");
-#define XXXXXXXXXX(CV) \
-				switch (CV.type) \
-				{ \
-				case FWP_EMPTY: detail->Append("empty"); break; \
-				case FWP_UINT8: detail->Append("uint8="); detail->Append(CV.uint8); break; \
-				case FWP_UINT16: detail->Append("uint16="); detail->Append(CV.uint16); break; \
-				case FWP_UINT32: detail->Append("uint32="); detail->Append(CV.uint32); break; \
-				case FWP_UINT64: detail->Append("uint64="); detail->Append(*CV.uint64); break; \
-				case FWP_INT8: detail->Append("int8="); detail->Append(CV.int8); break; \
-				case FWP_INT16: detail->Append("int16="); detail->Append(CV.int16); break; \
-				case FWP_INT32: detail->Append("int32="); detail->Append(CV.int32); break; \
-				case FWP_INT64: detail->Append("int64="); detail->Append(*CV.int64); break; \
-				case FWP_FLOAT: detail->Append("float="); detail->Append(CV.float32); break; \
-				case FWP_DOUBLE: detail->Append("double="); detail->Append(*CV.double64); break; \
-				case FWP_BYTE_ARRAY16_TYPE: detail->Append("byte16"); break; \
-				case FWP_BYTE_BLOB_TYPE: detail->Append("blob"); break; \
-				case FWP_SID: detail->Append("sid"); break; \
-				case FWP_SECURITY_DESCRIPTOR_TYPE: detail->Append("sd"); break; \
-				case FWP_TOKEN_INFORMATION_TYPE: detail->Append("token_info"); break; \
-				case FWP_TOKEN_ACCESS_INFORMATION_TYPE: detail->Append("token_access"); break; \
-				case FWP_UNICODE_STRING_TYPE: detail->Append("string"); break; \
-				case FWP_BYTE_ARRAY6_TYPE: detail->Append("byte6"); break; \
-				case FWP_V4_ADDR_MASK: \
-				{ \
-					detail->Append("IPv4="); \
-					IPAddress^ addr = gcnew IPAddress(ntohl(CV.uint32)); \
-					detail->Append(addr->ToString()); \
-					break; \
-				} \
-				case FWP_V6_ADDR_MASK: \
-				{ \
-					detail->Append("IPv6="); \
-					array<Byte>^ buf = gcnew array<Byte>(16); \
-					Marshal::Copy((IntPtr)CV.byteArray16, buf, 0, 16); \
-					IPAddress^ addr = gcnew IPAddress(buf); \
-					detail->Append(addr->ToString()); \
-					break; \
-				} \
-				default: detail->Append("unknown"); break; \
-				}
+	}
+	FirewallStats::AddFilters(added);
 
-				XXXXXXXXXX(c->conditionValue.rangeValue->valueLow)
-				detail->Append(",");
-				XXXXXXXXXX(c->conditionValue.rangeValue->valueHigh)
-				detail->Append(")");
-				break;
-			}
-			default: detail->Append("unknown"); break;
-			}
-			detail->Append("])");
-		}
-		detail->Append("]");
+	OutputDebugString(L"Firewall::AddBatch OK");
+}
 
-		list[f->filterId] = detail->ToString();
-	}
 
-	if (pFilter != NULL)
+// Add new filter rule and remove existing filter rule in one transaction
+UInt64 Firewall::Replace(String^ name, array<Byte>^ metadata, FirewallConditions^ conditions, bool ipv6, UInt64 weight, bool permit, bool persistent, UInt64 id)
+{
+	OutputDebugString(L"Firewall::Replace");
+
+	DWORD rc = ERROR_SUCCESS;
+	UINT64 filterId = 0;
+
+	FirewallOperationTimer timer((int)FirewallOperation::Replace);
+	FirewallSession session(m_sessions);
+	if (session.rc != ERROR_SUCCESS) {
+		timer.rc = session.rc;
+		throw gcnew FirewallException(session.rc, "Firewall::Replace: FwpmEngineOpen failed (" + GetErrorText(session.rc) + ")");
+	}
+	FirewallEngine *engine = session.Engine();
+
+	rc = engine->TransactionBegin();
+	if (rc != ERROR_SUCCESS) {
+		timer.rc = rc;
+		throw gcnew FirewallException(rc, "Firewall::Replace: FwpmTransactionBegin failed (" + GetErrorText(rc) + ")");
+	}
+
+	if (conditions != nullptr && (ipv6 ? conditions->CountIPv6() : conditions->CountIPv4()) > 0)
 	{
-		FwpmFreeMemory((void**)&pFilter);
+		if (ipv6)
+			rc = AddFilter(engine, name, metadata, conditions->LayerIPv6(), conditions->GetIPv6(), (UInt32)conditions->CountIPv6(), weight, permit, persistent, &filterId);
+		else
+			rc = AddFilter(engine, name, metadata, conditions->LayerIPv4(), conditions->GetIPv4(), (UInt32)conditions->CountIPv4(), weight, permit, persistent, &filterId);
+
+		if (rc != ERROR_SUCCESS) {
+			engine->TransactionAbort();
+			timer.rc = rc;
+			throw gcnew FirewallException(rc, "Firewall::Replace: FwpmFilterAdd failed (" + GetErrorText(rc) + ")");
+		}
 	}
 
-	rc = FwpmFilterDestroyEnumHandle(*p_hEngineHandle, m_hFilterEnumHandle);
+	bool removed = false;
+	if (id != 0)
+	{
+		// filter that no longer exists doesn't need to be replaced
+		rc = engine->FilterDeleteById(id);
+		removed = (rc == ERROR_SUCCESS);
+		if (rc != ERROR_SUCCESS && rc != FWP_E_FILTER_NOT_FOUND) {
+			engine->TransactionAbort();
+			timer.rc = rc;
+			throw gcnew FirewallException(rc, "Firewall::Replace: FwpmFilterDeleteById failed (" + GetErrorText(rc) + ")");
+		}
+	}
+
+	rc = engine->TransactionCommit();
 	if (rc != ERROR_SUCCESS) {
-		OutputDebugString(FormatErrorText(L"Firewall::List: FwpmFilterDestroyEnumHandle failed: ", rc));
-		//throw gcnew FirewallException(rc, "Firewall::List: FwpmFilterDestroyEnumHandle failed (" + GetErrorText(rc) + ")");
+		timer.rc = rc;
+		throw gcnew FirewallException(rc, "Firewall::Replace: FwpmTransactionCommit failed (" + GetErrorText(rc) + ")");
+	}
+
+	if (filterId != 0)
+		SetOwned(filterId, true);
+	if (id != 0)
+		SetOwned(id, false);
+	FirewallStats::AddFilters((filterId != 0 ? 1 : 0) - (removed ? 1 : 0));
+
+	OutputDebugString(L"Firewall::Replace OK");
+
+	return filterId;
+}
+
+
+// Remove filter with defined Id
+void Firewall::Remove(UInt64 id)
+{
+	// Remove filter blocking traffic from IP address
+	DWORD rc = ERROR_SUCCESS;
+
+	FirewallOperationTimer timer((int)FirewallOperation::Remove);
+	FirewallSession session(m_sessions);
+	if (session.rc != ERROR_SUCCESS) {
+		timer.rc = session.rc;
+		throw gcnew FirewallException(session.rc, "Firewall::Remove: FwpmEngineOpen failed (" + GetErrorText(session.rc) + ")");
+	}
+	FirewallEngine *engine = session.Engine();
+
+	rc = CheckOwner(engine, id);
+	if (rc == ERROR_ACCESS_DENIED)
+	{
+		OutputDebugString(L"Firewall::Remove:provider key and sublayer key doesn't match F2B GUIDs");
+		return;
+	}
+	else if (rc != ERROR_SUCCESS) {
+		timer.rc = rc;
+		throw gcnew FirewallException(rc, "Firewall::Remove: FwpmFilterGetById failed (" + GetErrorText(rc) + ")");
+	}
+
+	rc = engine->FilterDeleteById(id);
+	if (rc == FWP_E_FILTER_NOT_FOUND)
+	{
+		SetOwned(id, false);
+	}
+	if (rc != ERROR_SUCCESS) {
+		timer.rc = rc;
+		throw gcnew FirewallException(rc, "Firewall::Remove: FwpmFilterDeleteById failed (" + GetErrorText(rc) + ")");
+	}
+
+	SetOwned(id, false);
+	FirewallStats::AddFilters(-1);
+
+	OutputDebugString(L"Firewall::Remove: FwpmFilterDeleteById OK");
+}
+
+
+// Remove filter rules in (size capped) WFP transactions
+void Firewall::RemoveBatch(IList<FirewallBatchItem^>^ items)
+{
+	OutputDebugString(L"Firewall::RemoveBatch");
+
+	if (items == nullptr)
+	{
+		throw gcnew System::ArgumentNullException("items", "Firewall::RemoveBatch: no filter rules");
+	}
+
+	for (int i = 0; i < items->Count; i++)
+	{
+		FirewallBatchItem^ item = items[i];
+		if (item == nullptr)
+			continue;
+
+		item->Error = (item->FilterId == 0 ? ERROR_INVALID_PARAMETER : ERROR_IO_PENDING);
+	}
+
+	FirewallOperationTimer timer((int)FirewallOperation::RemoveBatch);
+	FirewallSession session(m_sessions);
+	if (session.rc != ERROR_SUCCESS) {
+		timer.rc = session.rc;
+		throw gcnew FirewallException(session.rc, "Firewall::RemoveBatch: FwpmEngineOpen failed (" + GetErrorText(session.rc) + ")");
+	}
+	FirewallEngine *engine = session.Engine();
+
+	FirewallRemoveBatch batch(engine, items);
+	for (int start = 0; start < items->Count; start += m_batchSize)
+	{
+		int end = start + m_batchSize;
+		if (end > items->Count)
+			end = items->Count;
+
+		batch.Run(start, end);
+	}
+
+	// filter that no longer exists is treated as removed
+	int removed = 0;
+	for (int i = 0; i < items->Count; i++)
+	{
+		FirewallBatchItem^ item = items[i];
+		if (item == nullptr)
+			continue;
+
+		if (item->Error == ERROR_SUCCESS)
+		{
+			SetOwned(item->FilterId, false);
+			removed++;
+		}
+		else if (item->Error == FWP_E_FILTER_NOT_FOUND)
+		{
+			SetOwned(item->FilterId, false);
+			item->Error = ERROR_SUCCESS;
+		}
+		else
+		{
+			FirewallStats::RecordError(FirewallOperation::RemoveBatch, item->Error);
+		}
+	}
+	FirewallStats::AddFilters(-removed);
+
+	OutputDebugString(L"Firewall::RemoveBatch OK");
+}
+
+
+// Remove filters with given ids in (size capped) WFP transactions
+array<int>^ Firewall::RemoveMany(IList<UInt64>^ ids)
+{
+	OutputDebugString(L"Firewall::RemoveMany");
+
+	if (ids == nullptr)
+	{
+		throw gcnew System::ArgumentNullException("ids", "Firewall::RemoveMany: no filter ids");
+	}
+
+	FirewallOperationTimer timer((int)FirewallOperation::RemoveBatch);
+	FirewallSession session(m_sessions);
+	if (session.rc != ERROR_SUCCESS) {
+		timer.rc = session.rc;
+		throw gcnew FirewallException(session.rc, "Firewall::RemoveMany: FwpmEngineOpen failed (" + GetErrorText(session.rc) + ")");
+	}
+	FirewallEngine *engine = session.Engine();
+
+	// filters that doesn't belong to F2B or no longer exists are
+	// excluded from transactions
+	List<FirewallBatchItem^>^ items = gcnew List<FirewallBatchItem^>(ids->Count);
+	for (int i = 0; i < ids->Count; i++)
+	{
+		FirewallBatchItem^ item = gcnew FirewallBatchItem(nullptr, nullptr, false);
+		item->FilterId = ids[i];
+		item->Error = (ids[i] == 0 ? ERROR_INVALID_PARAMETER : CheckOwner(engine, ids[i]));
+		if (item->Error == ERROR_SUCCESS)
+			item->Error = ERROR_IO_PENDING;
+		items->Add(item);
+	}
+
+	FirewallRemoveBatch batch(engine, items);
+	for (int start = 0; start < items->Count; start += m_batchSize)
+	{
+		int end = start + m_batchSize;
+		if (end > items->Count)
+			end = items->Count;
+
+		batch.Run(start, end);
+	}
+
+	int removed = 0;
+	array<int>^ ret = gcnew array<int>(items->Count);
+	for (int i = 0; i < items->Count; i++)
+	{
+		FirewallBatchItem^ item = items[i];
+		ret[i] = item->Error;
+
+		if (item->Error == ERROR_SUCCESS)
+		{
+			SetOwned(item->FilterId, false);
+			removed++;
+		}
+		else if (item->Error == FWP_E_FILTER_NOT_FOUND)
+		{
+			SetOwned(item->FilterId, false);
+		}
+		else
+		{
+			FirewallStats::RecordError(FirewallOperation::RemoveBatch, item->Error);
+		}
+	}
+	FirewallStats::AddFilters(-removed);
+
+	OutputDebugString(L"Firewall::RemoveMany OK");
+
+	return ret;
+}
+
+
+// Verify that filter belongs to F2B, returns ERROR_ACCESS_DENIED for
+// filters with different provider and sublayer
+DWORD Firewall::CheckOwner(FirewallEngine *engine, UINT64 id)
+{
+	if (IsOwned(id))
+		return ERROR_SUCCESS;
+
+	FWPM_FILTER *pFilter = NULL;
+	DWORD rc = engine->FilterGetById(id, &pFilter);
+	if (rc != ERROR_SUCCESS)
+		return rc;
+
+	BOOL f2bGUIDs = ((pFilter->providerKey != NULL && IsEqualGUID(*pFilter->providerKey, F2BFW_PROVIDER_KEY)) || IsEqualGUID(pFilter->subLayerKey, F2BFW_SUBLAYER_KEY));
+	engine->FreeMemory((void **)&pFilter);
+
+	if (!f2bGUIDs)
+		return ERROR_ACCESS_DENIED;
+
+	SetOwned(id, true);
+
+	return ERROR_SUCCESS;
+}
+
+
+bool Firewall::IsOwned(UInt64 id)
+{
+	msclr::lock lock(m_owned);
+	return m_owned->ContainsKey(id);
+}
+
+
+void Firewall::SetOwned(UInt64 id, bool owned)
+{
+	msclr::lock lock(m_owned);
+	if (owned)
+		m_owned[id] = true;
+	else
+		m_owned->Remove(id);
+}
+
+
+void Firewall::ClearOwned()
+{
+	msclr::lock lock(m_owned);
+	m_owned->Clear();
+}
+
+
+// Remove all filter rules added by this module
+void Firewall::Cleanup()
+{
+	OutputDebugString(L"Firewall::Cleanup");
+
+	DWORD rc = ERROR_SUCCESS;
+	FirewallOperationTimer timer((int)FirewallOperation::Cleanup);
+	FirewallSession session(m_sessions);
+	if (session.rc != ERROR_SUCCESS) {
+		timer.rc = session.rc;
+		throw gcnew FirewallException(session.rc, "Firewall::Cleanup: FwpmEngineOpen failed (" + GetErrorText(session.rc) + ")");
+	}
+	FirewallEngine *engine = session.Engine();
+
+	// Collect filter ids from all layers used by this module, enumeration
+	// template restricts returned filters to our provider
+	std::vector<UINT64> ids;
+	try
+	{
+		ListIds(engine, FWPM_LAYER_INBOUND_IPPACKET_V4, ids);
+		ListIds(engine, FWPM_LAYER_INBOUND_IPPACKET_V6, ids);
+		ListIds(engine, FWPM_LAYER_INBOUND_TRANSPORT_V4, ids);
+		ListIds(engine, FWPM_LAYER_INBOUND_TRANSPORT_V6, ids);
+	}
+	catch (FirewallException^ ex)
+	{
+		timer.rc = ex->HResult;
+		throw;
+	}
+
+	if (ids.size() == 0)
+	{
+		OutputDebugString(L"Firewall::Cleanup: no filters");
+		FirewallStats::SetFilters(0);
+		return;
+	}
+
+	// Use transaction to remove filters
+	rc = engine->TransactionBegin();
+	if (rc != ERROR_SUCCESS) {
+		timer.rc = rc;
+		throw gcnew FirewallException(rc, "Firewall::Cleanup: FwpmTransactionBegin failed (" + GetErrorText(rc) + ")");
+	}
+
+	for (size_t i = 0; i < ids.size(); i++)
+	{
+		rc = engine->FilterDeleteById(ids[i]);
+		if (rc == FWP_E_TXN_ABORTED || rc == FWP_E_SESSION_ABORTED || rc == FWP_E_TIMEOUT) {
+			engine->TransactionAbort();
+			timer.rc = rc;
+			throw gcnew FirewallException(rc, "Firewall::Cleanup: FwpmFilterDeleteById failed (" + GetErrorText(rc) + ")");
+		}
+		else if (rc != ERROR_SUCCESS) {
+			OutputDebugString(FormatErrorText(L"Firewall::Cleanup: FwpmFilterDeleteById failed: ", rc));
+			//throw new std::exception("FwpmFilterDeleteById failed");
+		}
+	}
+
+	rc = engine->TransactionCommit();
+	if (rc != ERROR_SUCCESS) {
+		timer.rc = rc;
+		throw gcnew FirewallException(rc, "Firewall::Cleanup: FwpmTransactionCommit failed (" + GetErrorText(rc) + ")");
+	}
+
+	ClearOwned();
+	FirewallStats::SetFilters(0);
+
+	OutputDebugString(L"Firewall::Cleanup OK");
+}
+
+
+// Append ids of our filters from given layer (paged enumeration)
+void Firewall::ListIds(FirewallEngine *engine, const GUID &layer, std::vector<UINT64> &ids)
+{
+	DWORD rc = ERROR_SUCCESS;
+
+	HANDLE m_hFilterEnumHandle = NULL;
+	FWPM_FILTER** pFilter = NULL;
+	UINT32 nFilter;
+
+	// return only subset of filter rules
+	FWPM_FILTER_ENUM_TEMPLATE enumTemplate;
+	ZeroMemory(&enumTemplate, sizeof(FWPM_FILTER_ENUM_TEMPLATE));
+	enumTemplate.layerKey = layer;
+	enumTemplate.providerKey = (GUID *)&F2BFW_PROVIDER_KEY;
+	enumTemplate.actionMask = 0xFFFFFFFF;
+
+	rc = engine->FilterCreateEnumHandle(&enumTemplate, &m_hFilterEnumHandle);
+	if (rc != ERROR_SUCCESS) {
+		throw gcnew FirewallException(rc, "Firewall::ListIds: FwpmFilterCreateEnumHandle failed (" + GetErrorText(rc) + ")");
+	}
+
+	do
+	{
+		rc = engine->FilterEnum(m_hFilterEnumHandle, m_enumPageSize, &pFilter, &nFilter);
+		if (rc != ERROR_SUCCESS) {
+			engine->FilterDestroyEnumHandle(m_hFilterEnumHandle);
+			throw gcnew FirewallException(rc, "Firewall::ListIds: FwpmFilterEnum failed (" + GetErrorText(rc) + ")");
+		}
+
+		UINT32 nMatch = 0;
+		for (UINT32 i = 0; i < nFilter; i++)
+		{
+			FWPM_FILTER *f = pFilter[i];
+			if (!((f->providerKey != NULL && IsEqualGUID(*f->providerKey, F2BFW_PROVIDER_KEY)) || IsEqualGUID(f->subLayerKey, F2BFW_SUBLAYER_KEY)))
+				continue;
+
+			ids.push_back(f->filterId);
+			SetOwned(f->filterId, true);
+			nMatch++;
+		}
+
+		Interlocked::Add(m_enumScanned, (Int64)nFilter);
+		Interlocked::Add(m_enumMatched, (Int64)nMatch);
+
+		if (pFilter != NULL)
+		{
+			engine->FreeMemory((void**)&pFilter);
+		}
+	} while (nFilter == (UINT32)m_enumPageSize);
+
+	rc = engine->FilterDestroyEnumHandle(m_hFilterEnumHandle);
+	if (rc != ERROR_SUCCESS) {
+		OutputDebugString(FormatErrorText(L"Firewall::ListIds: FwpmFilterDestroyEnumHandle failed: ", rc));
+	}
+}
+
+
+// List all filter rules added by this module with decoded metadata
+List<FirewallFilter>^ Firewall::ListFilters()
+{
+	FirewallOperationTimer timer((int)FirewallOperation::List);
+	FirewallSession session(m_sessions);
+	if (session.rc != ERROR_SUCCESS) {
+		timer.rc = session.rc;
+		throw gcnew FirewallException(session.rc, "Firewall::ListFilters: FwpmEngineOpen failed (" + GetErrorText(session.rc) + ")");
+	}
+	FirewallEngine *engine = session.Engine();
+
+	List<FirewallFilter>^ ret = gcnew List<FirewallFilter>();
+	try
+	{
+		ListFilters(engine, FWPM_LAYER_INBOUND_IPPACKET_V4, ret);
+		ListFilters(engine, FWPM_LAYER_INBOUND_IPPACKET_V6, ret);
+		ListFilters(engine, FWPM_LAYER_INBOUND_TRANSPORT_V4, ret);
+		ListFilters(engine, FWPM_LAYER_INBOUND_TRANSPORT_V6, ret);
+	}
+	catch (FirewallException^ ex)
+	{
+		timer.rc = ex->HResult;
+		throw;
+	}
+
+	FirewallStats::SetFilters(ret->Count);
+
+	return ret;
+}
+
+
+// Append our filters from given layer (paged enumeration), filter name
+// is converted to managed string only for filters without metadata
+void Firewall::ListFilters(FirewallEngine *engine, const GUID &layer, List<FirewallFilter>^ list)
+{
+	DWORD rc = ERROR_SUCCESS;
+
+	HANDLE m_hFilterEnumHandle = NULL;
+	FWPM_FILTER** pFilter = NULL;
+	UINT32 nFilter;
+
+	// return only subset of filter rules
+	FWPM_FILTER_ENUM_TEMPLATE enumTemplate;
+	ZeroMemory(&enumTemplate, sizeof(FWPM_FILTER_ENUM_TEMPLATE));
+	enumTemplate.layerKey = layer;
+	enumTemplate.providerKey = (GUID *)&F2BFW_PROVIDER_KEY;
+	enumTemplate.actionMask = 0xFFFFFFFF;
+
+	rc = engine->FilterCreateEnumHandle(&enumTemplate, &m_hFilterEnumHandle);
+	if (rc != ERROR_SUCCESS) {
+		throw gcnew FirewallException(rc, "Firewall::ListFilters: FwpmFilterCreateEnumHandle failed (" + GetErrorText(rc) + ")");
 	}
+
+	do
+	{
+		rc = engine->FilterEnum(m_hFilterEnumHandle, m_enumPageSize, &pFilter, &nFilter);
+		if (rc != ERROR_SUCCESS) {
+			engine->FilterDestroyEnumHandle(m_hFilterEnumHandle);
+			throw gcnew FirewallException(rc, "Firewall::ListFilters: FwpmFilterEnum failed (" + GetErrorText(rc) + ")");
+		}
+
+		UINT32 nMatch = 0;
+		for (UINT32 i = 0; i < nFilter; i++)
+		{
+			FWPM_FILTER *f = pFilter[i];
+			if (!((f->providerKey != NULL && IsEqualGUID(*f->providerKey, F2BFW_PROVIDER_KEY)) || IsEqualGUID(f->subLayerKey, F2BFW_SUBLAYER_KEY)))
+				continue;
+
+			FirewallFilter filter;
+			filter.Id = f->filterId;
+			filter.HasMetadata = false;
+			filter.Expiration = 0;
+
+			const F2B_FILTER_METADATA0 *metadata = (const F2B_FILTER_METADATA0 *)f->providerData.data;
+			UINT32 size = f->providerData.size;
+			if (metadata != NULL && size > sizeof(F2B_FILTER_METADATA0)
+				&& metadata->magic[0] == 'F' && metadata->magic[1] == '2' && metadata->magic[2] == 'B'
+				&& metadata->version == F2B_FILTER_METADATA_VERSION)
+			{
+				UINT32 hashSize = size - sizeof(F2B_FILTER_METADATA0);
+				array<Byte>^ hash = gcnew array<Byte>(hashSize);
+				pin_ptr<Byte> pHash = &hash[0];
+				CopyMemory(pHash, (const BYTE *)metadata + sizeof(F2B_FILTER_METADATA0), hashSize);
+
+				filter.HasMetadata = true;
+				filter.Expiration = metadata->expiration;
+				filter.Hash = hash;
+			}
+			else
+			{
+				filter.Name = gcnew String(f->displayData.name);
+			}
+
+			list->Add(filter);
+			SetOwned(f->filterId, true);
+			nMatch++;
+		}
+
+		Interlocked::Add(m_enumScanned, (Int64)nFilter);
+		Interlocked::Add(m_enumMatched, (Int64)nMatch);
+
+		if (pFilter != NULL)
+		{
+			engine->FreeMemory((void**)&pFilter);
+		}
+	} while (nFilter == (UINT32)m_enumPageSize);
+
+	rc = engine->FilterDestroyEnumHandle(m_hFilterEnumHandle);
+	if (rc != ERROR_SUCCESS) {
+		OutputDebugString(FormatErrorText(L"Firewall::ListFilters: FwpmFilterDestroyEnumHandle failed: ", rc));
+	}
+}
+
+
+// List all filter rules added by this module
+Dictionary<UInt64, String^>^ Firewall::List(bool details)
+{
+	FirewallOperationTimer timer((int)FirewallOperation::List);
+	FirewallSession session(m_sessions);
+	if (session.rc != ERROR_SUCCESS) {
+		timer.rc = session.rc;
+		throw gcnew FirewallException(session.rc, "Firewall::List: FwpmEngineOpen failed (" + GetErrorText(session.rc) + ")");
+	}
+	FirewallEngine *engine = session.Engine();
+
+	Dictionary<UInt64, String^>^ ret = gcnew Dictionary<UInt64, String^>();
+	try
+	{
+		List(engine, details, FWPM_LAYER_INBOUND_IPPACKET_V4, ret);
+		List(engine, details, FWPM_LAYER_INBOUND_IPPACKET_V6, ret);
+		List(engine, details, FWPM_LAYER_INBOUND_TRANSPORT_V4, ret);
+		List(engine, details, FWPM_LAYER_INBOUND_TRANSPORT_V6, ret);
+	}
+	catch (FirewallException^ ex)
+	{
+		timer.rc = ex->HResult;
+		throw;
+	}
+
+	FirewallStats::SetFilters(ret->Count);
+
+	return ret;
+}
+
+
+void Firewall::List(FirewallEngine *engine, bool details, GUID layer, Dictionary<UInt64, String^>^ list)
+{
+	OutputDebugString(L"Firewall::List");
+
+	DWORD rc = ERROR_SUCCESS;
+
+	HANDLE m_hFilterEnumHandle = NULL;
+	FWPM_FILTER** pFilter = NULL;
+	UINT32 nFilter;
+
+	// return only subset of filter rules
+	FWPM_FILTER_ENUM_TEMPLATE enumTemplate;
+	ZeroMemory(&enumTemplate, sizeof(FWPM_FILTER_ENUM_TEMPLATE));
+	enumTemplate.layerKey = layer;
+	enumTemplate.providerKey = (GUID *)&F2BFW_PROVIDER_KEY;
+	enumTemplate.actionMask = 0xFFFFFFFF;
+
+	// filter
+	rc = engine->FilterCreateEnumHandle(&enumTemplate, &m_hFilterEnumHandle);
+	if (rc != ERROR_SUCCESS) {
+		throw gcnew FirewallException(rc, "Firewall::List: FwpmFilterCreateEnumHandle failed (" + GetErrorText(rc) + ")");
+	}
+
+	// fetch filters in fixed size pages to limit memory allocated by WFP
+	do
+	{
+		rc = engine->FilterEnum(m_hFilterEnumHandle, m_enumPageSize, &pFilter, &nFilter);
+		if (rc != ERROR_SUCCESS) {
+			engine->FilterDestroyEnumHandle(m_hFilterEnumHandle);
+			throw gcnew FirewallException(rc, "Firewall::List: FwpmFilterEnum failed (" + GetErrorText(rc) + ")");
+		}
+
+		Interlocked::Add(m_enumScanned, (Int64)nFilter);
+
+		for (UINT32 i = 0; i < nFilter; i++)
+		{
+			FWPM_FILTER *f = pFilter[i];
+			//if (f->providerKey == NULL)
+			//	continue;
+			//if (!IsEqualGUID(*f->providerKey, F2BFW_PROVIDER_KEY))
+			//	continue;
+			if (!IsEqualGUID(f->subLayerKey, F2BFW_SUBLAYER_KEY))
+				continue;
+
+			Interlocked::Increment(m_enumMatched);
+			SetOwned(f->filterId, true);
+
+			if (!details)
+			{
+				list[f->filterId] = gcnew String(f->displayData.name);
+				continue;
+			}
+
+			StringBuilder^ detail = gcnew StringBuilder();
+			detail->Append("name[");
+			detail->Append(gcnew String(f->displayData.name));
+			detail->Append("]");
+			detail->Append("/");
+			// description
+			if (f->displayData.description)
+			{
+				detail->Append("desc[");
+				detail->Append(gcnew String(f->displayData.description));
+				detail->Append("]");
+				detail->Append("/");
+			}
+			// GUID
+			detail->Append("GUID[");
+			detail->Append(String::Format("{0:X08}-{1:X04}-{2:X04}-{3:X02}{4:X02}-{5:X02}{6:X02}{7:X02}{8:X02}{9:X02}{10:X02}",
+				f->filterKey.Data1, f->filterKey.Data2, f->filterKey.Data3,
+				f->filterKey.Data4[0], f->filterKey.Data4[1], f->filterKey.Data4[2], f->filterKey.Data4[3],
+				f->filterKey.Data4[4], f->filterKey.Data4[5], f->filterKey.Data4[6], f->filterKey.Data4[7]));
+			detail->Append("]");
+			detail->Append("/");
+			// action
+			detail->Append("action[");
+			switch (f->action.type)
+			{
+			case FWP_ACTION_BLOCK:
+				detail->Append("block");
+				break;
+			case FWP_ACTION_PERMIT:
+				detail->Append("permit");
+				break;
+			default:
+				detail->Append("unknown");
+				break;
+			}
+			detail->Append("]");
+			detail->Append("/");
+			// flags
+			detail->Append("flags[");
+			detail->Append(f->flags);
+			detail->Append("]");
+			detail->Append("/");
+			// weight
+			detail->Append("weight[");
+			switch (f->weight.type)
+			{
+			case FWP_UINT8:
+				detail->Append("range_index_");
+				detail->Append(f->weight.uint8);
+				break;
+			case FWP_UINT64:
+				detail->Append(*f->weight.uint64);
+				break;
+			case FWP_EMPTY:
+				detail->Append("empty");
+				break;
+			default:
+				detail->Append("unknown");
+				break;
+			}
+			detail->Append("]");
+			detail->Append("/");
+	        // effectiveWeight
+			detail->Append("effectiveWeight[");
+			switch (f->effectiveWeight.type)
+			{
+			case FWP_UINT8:
+				detail->Append("range_index_");
+				detail->Append(f->effectiveWeight.uint8);
+				break;
+			case FWP_UINT64:
+				detail->Append(*f->effectiveWeight.uint64);
+				break;
+			case FWP_EMPTY:
+				detail->Append("empty");
+				break;
+			default:
+				detail->Append("unknown");
+				break;
+			}
+			detail->Append("]");
+			detail->Append("/");
+			// conditions
+			detail->Append("conditions[");
+			for (UINT32 j = 0; j < f->numFilterConditions; j++)
+			{
+				FWPM_FILTER_CONDITION *c = &f->filterCondition[j];
+				if (j != 0)
+					detail->Append(",");
+				detail->Append("(");
+				detail->Append("fieldKey[");
+				detail->Append(String::Format("{0:X08}-{1:X04}-{2:X04}-{3:X02}{4:X02}-{5:X02}{6:X02}{7:X02}{8:X02}{9:X02}{10:X02}",
+					c->fieldKey.Data1, c->fieldKey.Data2, c->fieldKey.Data3,
+					c->fieldKey.Data4[0], c->fieldKey.Data4[1], c->fieldKey.Data4[2], c->fieldKey.Data4[3],
+					c->fieldKey.Data4[4], c->fieldKey.Data4[5], c->fieldKey.Data4[6], c->fieldKey.Data4[7]));
+				detail->Append("],match[");
+				switch (c->matchType)
+				{
+				case FWP_MATCH_EQUAL: detail->Append("equal"); break;
+				case FWP_MATCH_GREATER: detail->Append("greater"); break;
+				case FWP_MATCH_LESS: detail->Append("less"); break;
+				case FWP_MATCH_GREATER_OR_EQUAL: detail->Append("greater_or_equal"); break;
+				case FWP_MATCH_LESS_OR_EQUAL: detail->Append("less_or_equal"); break;
+				case FWP_MATCH_RANGE: detail->Append("range"); break;
+				case FWP_MATCH_FLAGS_ALL_SET: detail->Append("flags_all_set"); break;
+				case FWP_MATCH_FLAGS_ANY_SET: detail->Append("flags_any_set"); break;
+				case FWP_MATCH_FLAGS_NONE_SET: detail->Append("flags_none_set"); break;
+				case FWP_MATCH_EQUAL_CASE_INSENSITIVE: detail->Append("equal_case_insensitive"); break;
+				case FWP_MATCH_NOT_EQUAL: detail->Append("not_equal"); break;
+				default: detail->Append("unknown"); break;
+				}
+				detail->Append("],value[");
+				switch (c->conditionValue.type)
+				{
+				case FWP_EMPTY: detail->Append("empty"); break;
+				case FWP_UINT8: detail->Append("uint8="); detail->Append(c->conditionValue.uint8); break;
+				case FWP_UINT16: detail->Append("uint16="); detail->Append(c->conditionValue.uint16); break;
+				case FWP_UINT32: detail->Append("uint32="); detail->Append(c->conditionValue.uint32); break;
+				case FWP_UINT64: detail->Append("uint64="); detail->Append(*c->conditionValue.uint64); break;
+				case FWP_INT8: detail->Append("int8="); detail->Append(c->conditionValue.int8); break;
+				case FWP_INT16: detail->Append("int16="); detail->Append(c->conditionValue.int16); break;
+				case FWP_INT32: detail->Append("int32="); detail->Append(c->conditionValue.int32); break;
+				case FWP_INT64: detail->Append("int64="); detail->Append(*c->conditionValue.int64); break;
+				case FWP_FLOAT: detail->Append("float="); detail->Append(c->conditionValue.float32); break;
+				case FWP_DOUBLE: detail->Append("double="); detail->Append(*c->conditionValue.double64); break;
+				case FWP_BYTE_ARRAY16_TYPE: detail->Append("byte16"); break;
+				case FWP_BYTE_BLOB_TYPE: detail->Append("blob"); break;
+				case FWP_SID: detail->Append("sid"); break;
+				case FWP_SECURITY_DESCRIPTOR_TYPE: detail->Append("sd"); break;
+				case FWP_TOKEN_INFORMATION_TYPE: detail->Append("token_info"); break;
+				case FWP_TOKEN_ACCESS_INFORMATION_TYPE: detail->Append("token_access"); break;
+				case FWP_UNICODE_STRING_TYPE: detail->Append("string"); break;
+				case FWP_BYTE_ARRAY6_TYPE: detail->Append("byte6"); break;
+				case FWP_V4_ADDR_MASK:
+				{
+					detail->Append("IPv4=");
+					IPAddress^ addr = gcnew IPAddress(ntohl(c->conditionValue.v4AddrMask->addr));
+					UINT8 prefix = 0;
+					while (prefix < 32)
+					{
+						if ((c->conditionValue.v4AddrMask->mask & ((UINT32)1 << (31 - prefix))) == 0)
+						{
+							break;
+						}
+						prefix++;
+					}
+					detail->Append(addr->ToString());
+					detail->Append("/");
+					detail->Append(prefix);
+					break;
+				}
+				case FWP_V6_ADDR_MASK:
+				{
+					detail->Append("IPv6=");
+					array<Byte>^ buf = gcnew array<Byte>(16);
+					Marshal::Copy((IntPtr)c->conditionValue.v6AddrMask->addr, buf, 0, 16);
+					IPAddress^ addr = gcnew IPAddress(buf);
+					UINT8 prefix = c->conditionValue.v6AddrMask->prefixLength;
+					detail->Append(addr->ToString());
+					detail->Append("/");
+					detail->Append(prefix);
+					break;
+				}
+				case FWP_RANGE_TYPE:
+				{
+					detail->Append("range=(");
+#define XXXXXXXXXX(CV) \
+					switch (CV.type) \
+					{ \
+					case FWP_EMPTY: detail->Append("empty"); break; \
+					case FWP_UINT8: detail->Append("uint8="); detail->Append(CV.uint8); break; \
+					case FWP_UINT16: detail->Append("uint16="); detail->Append(CV.uint16); break; \
+					case FWP_UINT32: detail->Append("uint32="); detail->Append(CV.uint32); break; \
+					case FWP_UINT64: detail->Append("uint64="); detail->Append(*CV.uint64); break; \
+					case FWP_INT8: detail->Append("int8="); detail->Append(CV.int8); break; \
+					case FWP_INT16: detail->Append("int16="); detail->Append(CV.int16); break; \
+					case FWP_INT32: detail->Append("int32="); detail->Append(CV.int32); break; \
+					case FWP_INT64: detail->Append("int64="); detail->Append(*CV.int64); break; \
+					case FWP_FLOAT: detail->Append("float="); detail->Append(CV.float32); break; \
+					case FWP_DOUBLE: detail->Append("double="); detail->Append(*CV.double64); break; \
+					case FWP_BYTE_ARRAY16_TYPE: detail->Append("byte16"); break; \
+					case FWP_BYTE_BLOB_TYPE: detail->Append("blob"); break; \
+					case FWP_SID: detail->Append("sid"); break; \
+					case FWP_SECURITY_DESCRIPTOR_TYPE: detail->Append("sd"); break; \
+					case FWP_TOKEN_INFORMATION_TYPE: detail->Append("token_info"); break; \
+					case FWP_TOKEN_ACCESS_INFORMATION_TYPE: detail->Append("token_access"); break; \
+					case FWP_UNICODE_STRING_TYPE: detail->Append("string"); break; \
+					case FWP_BYTE_ARRAY6_TYPE: detail->Append("byte6"); break; \
+					case FWP_V4_ADDR_MASK: \
+					{ \
+						detail->Append("IPv4="); \
+						IPAddress^ addr = gcnew IPAddress(ntohl(CV.uint32)); \
+						detail->Append(addr->ToString()); \
+						break; \
+					} \
+					case FWP_V6_ADDR_MASK: \
+					{ \
+						detail->Append("IPv6="); \
+						array<Byte>^ buf = gcnew array<Byte>(16); \
+						Marshal::Copy((IntPtr)CV.byteArray16, buf, 0, 16); \
+						IPAddress^ addr = gcnew IPAddress(buf); \
+						detail->Append(addr->ToString()); \
+						break; \
+					} \
+					default: detail->Append("unknown"); break; \
+					}
+
+					XXXXXXXXXX(c->conditionValue.rangeValue->valueLow)
+					detail->Append(",");
+					XXXXXXXXXX(c->conditionValue.rangeValue->valueHigh)
+					detail->Append(")");
+					break;
+				}
+				default: detail->Append("unknown"); break;
+				}
+				detail->Append("])");
+			}
+			detail->Append("]");
+
+			list[f->filterId] = detail->ToString();
+		}
+
+		if (pFilter != NULL)
+		{
+			engine->FreeMemory((void**)&pFilter);
+		}
+	} while (nFilter == (UINT32)m_enumPageSize);
+
+	rc = engine->FilterDestroyEnumHandle(m_hFilterEnumHandle);
+	if (rc != ERROR_SUCCESS) {
+		OutputDebugString(FormatErrorText(L"Firewall::List: FwpmFilterDestroyEnumHandle failed: ", rc));
+		//throw gcnew FirewallException(rc, "Firewall::List: FwpmFilterDestroyEnumHandle failed (" + GetErrorText(rc) + ")");
+	}
+}
+
+
+
+// Binary F2B_FWDATA_TYPE0 record types and their sizes (must be
+// kept in sync with F2B_FWDATA_TYPE0_ENUM in F2BShared/Fw.cs)
+enum F2B_FWDATA_TYPE0 : BYTE {
+	F2B_FWDATA_EXPIRATION,
+	F2B_FWDATA_IPv4, F2B_FWDATA_IPv4_AND_PREFIX, F2B_FWDATA_IPv4_RANGE,
+	F2B_FWDATA_IPv6, F2B_FWDATA_IPv6_AND_PREFIX, F2B_FWDATA_IPv6_RANGE,
+	F2B_FWDATA_PORT, F2B_FWDATA_PORT_RANGE, F2B_FWDATA_PROTOCOL,
+};
+
+static const size_t F2B_FWDATA_SIZE[] = {
+	1 + 8,
+	1 + 4, 1 + 4 + 1, 1 + 4 + 4,
+	1 + 16, 1 + 16 + 1, 1 + 16 + 16,
+	1 + 2, 1 + 2 + 2, 1 + 1,
+};
+
+// Read integer stored in network byte order
+static inline UINT32 ReadUInt32(const BYTE *buf)
+{
+	return ((UINT32)buf[0] << 24) | ((UINT32)buf[1] << 16) | ((UINT32)buf[2] << 8) | (UINT32)buf[3];
+}
+static inline UINT16 ReadUInt16(const BYTE *buf)
+{
+	return (UINT16)((buf[0] << 8) | buf[1]);
+}
+
+// IPv6 address with ::ffff:0:0/96 prefix
+static inline bool IsIPv4Mapped(const BYTE *addr)
+{
+	static const BYTE mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+	return memcmp(addr, mapped, sizeof(mapped)) == 0;
+}
+
+// Append new condition (vector capacity is reserved by caller)
+static inline FWPM_FILTER_CONDITION *NextCondition(std::vector<FWPM_FILTER_CONDITION> *conditions, const GUID &fieldKey, FWP_MATCH_TYPE matchType, FWP_DATA_TYPE type)
+{
+	FWPM_FILTER_CONDITION cond;
+	::ZeroMemory(&cond, sizeof(FWPM_FILTER_CONDITION));
+	cond.fieldKey = fieldKey;
+	cond.matchType = matchType;
+	cond.conditionValue.type = type;
+	conditions->push_back(cond);
+	return &conditions->back();
+}
+
+
+// Chunk header size (keeps chunk data aligned)
+#define ARENA_CHUNK_HEADER ((sizeof(FirewallArena::Chunk) + 7) & ~(size_t)7)
+
+FirewallArena::FirewallArena(size_t chunkSize)
+{
+	this->head = NULL;
+	this->pos = NULL;
+	this->left = 0;
+	this->total = 0;
+	this->chunkSize = chunkSize;
+}
+
+
+FirewallArena::~FirewallArena()
+{
+	FreeChunks();
+}
+
+
+void *FirewallArena::Alloc(size_t size)
+{
+	size = (size + 7) & ~(size_t)7;
+	if (size > left)
+	{
+		NewChunk(size > chunkSize ? size : chunkSize);
+	}
+
+	void *ret = pos;
+	::ZeroMemory(ret, size);
+	pos += size;
+	left -= size;
+
+	return ret;
+}
+
+
+void FirewallArena::Reset()
+{
+	if (head == NULL)
+		return;
+
+	// values didn't fit in one chunk, replace all chunks with
+	// one chunk big enough for same amount of values
+	if (head->next != NULL)
+	{
+		size_t size = total;
+		FreeChunks();
+		NewChunk(size);
+	}
+
+	pos = (BYTE *)head + ARENA_CHUNK_HEADER;
+	left = head->size;
+}
+
+
+void FirewallArena::FreeChunks()
+{
+	while (head != NULL)
+	{
+		Chunk *next = head->next;
+		delete[] (BYTE *)head;
+		head = next;
+	}
+
+	pos = NULL;
+	left = 0;
+	total = 0;
+}
+
+
+void FirewallArena::NewChunk(size_t size)
+{
+	Chunk *chunk = (Chunk *)new BYTE[ARENA_CHUNK_HEADER + size];
+	chunk->next = head;
+	chunk->size = size;
+
+	head = chunk;
+	pos = (BYTE *)chunk + ARENA_CHUNK_HEADER;
+	left = size;
+	total += size;
+}
+
+
+WfpEngine::WfpEngine()
+{
+	hEngine = NULL;
+}
+
+
+WfpEngine::~WfpEngine()
+{
+	if (hEngine == NULL)
+		return;
+
+	if (transaction)
+		FwpmTransactionAbort(hEngine);
+
+	DWORD rc = FwpmEngineClose(hEngine);
+	if (rc != ERROR_SUCCESS)
+	{
+		OutputDebugString(FormatErrorText(L"WfpEngine::~WfpEngine: Unable to close packet filter engine", rc));
+	}
+
+	hEngine = NULL;
+}
+
+
+DWORD WfpEngine::Open(FWPM_SESSION *session)
+{
+	return FwpmEngineOpen(NULL, RPC_C_AUTHN_WINNT, NULL, session, &hEngine);
+}
+
+
+DWORD WfpEngine::TransactionBegin()
+{
+	DWORD rc = FwpmTransactionBegin(hEngine, 0);
+	transaction = (rc == ERROR_SUCCESS);
+	return rc;
+}
+
+
+DWORD WfpEngine::TransactionCommit()
+{
+	transaction = false;
+	return FwpmTransactionCommit(hEngine);
+}
+
+
+DWORD WfpEngine::TransactionAbort()
+{
+	transaction = false;
+	return FwpmTransactionAbort(hEngine);
+}
+
+
+DWORD WfpEngine::FilterAdd(const FWPM_FILTER *filter, UINT64 *id)
+{
+	return FwpmFilterAdd(hEngine, filter, NULL, id);
+}
+
+
+DWORD WfpEngine::FilterDeleteById(UINT64 id)
+{
+	return FwpmFilterDeleteById(hEngine, id);
+}
+
+
+DWORD WfpEngine::FilterGetById(UINT64 id, FWPM_FILTER **filter)
+{
+	return FwpmFilterGetById(hEngine, id, filter);
+}
+
+
+DWORD WfpEngine::FilterCreateEnumHandle(const FWPM_FILTER_ENUM_TEMPLATE *enumTemplate, HANDLE *enumHandle)
+{
+	return FwpmFilterCreateEnumHandle(hEngine, enumTemplate, enumHandle);
+}
+
+
+DWORD WfpEngine::FilterEnum(HANDLE enumHandle, UINT32 numEntriesRequested, FWPM_FILTER ***entries, UINT32 *numEntriesReturned)
+{
+	return FwpmFilterEnum(hEngine, enumHandle, numEntriesRequested, entries, numEntriesReturned);
+}
+
+
+DWORD WfpEngine::FilterDestroyEnumHandle(HANDLE enumHandle)
+{
+	return FwpmFilterDestroyEnumHandle(hEngine, enumHandle);
+}
+
+
+void WfpEngine::FreeMemory(void **p)
+{
+	FwpmFreeMemory(p);
+}
+
+
+FirewallSessionPool::FirewallSessionPool(FWPM_SESSION *session)
+{
+	this->session = session;
+	::InitializeCriticalSection(&lock);
+}
+
+
+FirewallSessionPool::~FirewallSessionPool()
+{
+	for (size_t i = 0; i < idle.size(); i++)
+		delete idle[i];
+	idle.clear();
+
+	::DeleteCriticalSection(&lock);
+}
+
+
+// Idle session or new session when all existing sessions are in use
+FirewallEngine *FirewallSessionPool::Acquire(DWORD *rc)
+{
+	FirewallEngine *engine = NULL;
+
+	::EnterCriticalSection(&lock);
+	if (idle.size() > 0)
+	{
+		engine = idle.back();
+		idle.pop_back();
+	}
+	::LeaveCriticalSection(&lock);
+
+	*rc = ERROR_SUCCESS;
+	if (engine == NULL)
+		engine = CreateEngine(rc);
+
+	return engine;
+}
+
+
+// Return session to pool, transaction left open by failed operation
+// is aborted so it can't be mixed with next operation
+void FirewallSessionPool::Release(FirewallEngine *engine)
+{
+	if (engine->InTransaction())
+		engine->TransactionAbort();
+
+	::EnterCriticalSection(&lock);
+	if (idle.size() < F2B_SESSION_POOL_SIZE)
+	{
+		idle.push_back(engine);
+		engine = NULL;
+	}
+	::LeaveCriticalSection(&lock);
+
+	if (engine != NULL)
+		delete engine;
+}
+
+
+FirewallEngine *FirewallSessionPool::CreateEngine(DWORD *rc)
+{
+	OutputDebugString(L"FirewallSessionPool::CreateEngine");
+
+	WfpEngine *engine = new WfpEngine();
+	*rc = engine->Open(session);
+	if (*rc != ERROR_SUCCESS)
+	{
+		delete engine;
+		return NULL;
+	}
+
+	return engine;
+}
+
+
+FirewallSession::FirewallSession(FirewallSessionPool *pool)
+{
+	this->pool = pool;
+	this->engine = pool->Acquire(&rc);
+}
+
+
+FirewallSession::~FirewallSession()
+{
+	if (engine != NULL)
+		pool->Release(engine);
+}
+
+
+// Filter rule stored by in-memory engine, returned filters are separate
+// copies released by FreeMemory (FWPM_FILTER must be first member)
+struct MemoryFilter
+{
+	FWPM_FILTER filter;
+	GUID providerKey;
+	UINT64 weight;
+	std::wstring name;
+	std::vector<BYTE> data;
+	std::vector<FWPM_FILTER_CONDITION> conditions;
+	std::list<std::vector<BYTE> > values; // data referenced by conditions
+};
+
+
+// Copy of data referenced by condition value (owned by filter)
+static void *KeepMemoryValue(MemoryFilter *f, const void *src, size_t size)
+{
+	f->values.push_back(std::vector<BYTE>((const BYTE *)src, (const BYTE *)src + size));
+	return &f->values.back()[0];
+}
+
+
+// Copy range boundary (value types that are not used by F2B are not kept)
+static void CopyMemoryValue(MemoryFilter *f, FWP_VALUE0 *dst, const FWP_VALUE0 *src)
+{
+	*dst = *src;
+	switch (src->type)
+	{
+	case FWP_EMPTY:
+	case FWP_UINT8:
+	case FWP_UINT16:
+	case FWP_UINT32:
+		break;
+	case FWP_UINT64:
+		dst->uint64 = (UINT64 *)KeepMemoryValue(f, src->uint64, sizeof(UINT64));
+		break;
+	case FWP_BYTE_ARRAY16_TYPE:
+		dst->byteArray16 = (FWP_BYTE_ARRAY16 *)KeepMemoryValue(f, src->byteArray16, sizeof(FWP_BYTE_ARRAY16));
+		break;
+	default:
+		dst->type = FWP_EMPTY;
+		break;
+	}
+}
+
+
+// Copy filter condition (value types that are not used by F2B are not kept)
+static void CopyMemoryCondition(MemoryFilter *f, FWPM_FILTER_CONDITION *dst, const FWPM_FILTER_CONDITION *src)
+{
+	*dst = *src;
+	FWP_CONDITION_VALUE0 &value = dst->conditionValue;
+	switch (src->conditionValue.type)
+	{
+	case FWP_EMPTY:
+	case FWP_UINT8:
+	case FWP_UINT16:
+	case FWP_UINT32:
+		break;
+	case FWP_UINT64:
+		value.uint64 = (UINT64 *)KeepMemoryValue(f, src->conditionValue.uint64, sizeof(UINT64));
+		break;
+	case FWP_BYTE_ARRAY16_TYPE:
+		value.byteArray16 = (FWP_BYTE_ARRAY16 *)KeepMemoryValue(f, src->conditionValue.byteArray16, sizeof(FWP_BYTE_ARRAY16));
+		break;
+	case FWP_V4_ADDR_MASK:
+		value.v4AddrMask = (FWP_V4_ADDR_AND_MASK *)KeepMemoryValue(f, src->conditionValue.v4AddrMask, sizeof(FWP_V4_ADDR_AND_MASK));
+		break;
+	case FWP_V6_ADDR_MASK:
+		value.v6AddrMask = (FWP_V6_ADDR_AND_MASK *)KeepMemoryValue(f, src->conditionValue.v6AddrMask, sizeof(FWP_V6_ADDR_AND_MASK));
+		break;
+	case FWP_RANGE_TYPE:
+	{
+		FWP_RANGE0 *range = (FWP_RANGE0 *)KeepMemoryValue(f, src->conditionValue.rangeValue, sizeof(FWP_RANGE0));
+		CopyMemoryValue(f, &range->valueLow, &src->conditionValue.rangeValue->valueLow);
+		CopyMemoryValue(f, &range->valueHigh, &src->conditionValue.rangeValue->valueHigh);
+		value.rangeValue = range;
+		break;
+	}
+	default:
+		value.type = FWP_EMPTY;
+		break;
+	}
+}
+
+
+// Copy fields used by F2B (filter conditions keep only value types
+// created by FirewallConditions)
+static MemoryFilter *NewMemoryFilter(const FWPM_FILTER *src, UINT64 id)
+{
+	MemoryFilter *f = new MemoryFilter();
+	ZeroMemory(&f->filter, sizeof(FWPM_FILTER));
+
+	f->filter.filterId = id;
+	f->filter.layerKey = src->layerKey;
+	f->filter.subLayerKey = src->subLayerKey;
+	f->filter.action = src->action;
+	if (src->providerKey != NULL)
+	{
+		f->providerKey = *src->providerKey;
+		f->filter.providerKey = &f->providerKey;
+	}
+
+	f->weight = 0;
+	if (src->weight.type == FWP_UINT64 && src->weight.uint64 != NULL)
+		f->weight = *src->weight.uint64;
+	else if (src->weight.type == FWP_UINT8)
+		f->weight = src->weight.uint8;
+	f->filter.weight.type = FWP_UINT64;
+	f->filter.weight.uint64 = &f->weight;
+
+	if (src->displayData.name != NULL)
+		f->name = src->displayData.name;
+	f->filter.displayData.name = (wchar_t *)f->name.c_str();
+
+	if (src->providerData.data != NULL && src->providerData.size > 0)
+	{
+		f->data.assign(src->providerData.data, src->providerData.data + src->providerData.size);
+		f->filter.providerData.size = (UINT32)f->data.size();
+		f->filter.providerData.data = &f->data[0];
+	}
+
+	if (src->filterCondition != NULL && src->numFilterConditions > 0)
+	{
+		f->conditions.resize(src->numFilterConditions);
+		for (UINT32 i = 0; i < src->numFilterConditions; i++)
+			CopyMemoryCondition(f, &f->conditions[i], &src->filterCondition[i]);
+		f->filter.numFilterConditions = src->numFilterConditions;
+		f->filter.filterCondition = &f->conditions[0];
+	}
+
+	return f;
+}
+
+
+// Filter rules shared by all sessions of in-memory engine
+class MemoryFilterStore
+{
+public:
+	MemoryFilterStore()
+	{
+		nextId = 0;
+		::InitializeCriticalSection(&lock);
+	}
+
+	~MemoryFilterStore()
+	{
+		for (std::map<UINT64, MemoryFilter *>::iterator it = filters.begin(); it != filters.end(); ++it)
+			delete it->second;
+		::DeleteCriticalSection(&lock);
+	}
+
+	UINT64 NextId()
+	{
+		return (UINT64)::InterlockedIncrement64(&nextId);
+	}
+
+	CRITICAL_SECTION lock;
+	std::map<UINT64, MemoryFilter *> filters;
+
+private:
+	volatile LONG64 nextId;
+};
+
+
+// Stand-in for WFP engine session used by tests, changes made inside
+// transaction are applied to shared store only by commit
+class MemoryEngine : public FirewallEngine
+{
+public:
+	MemoryEngine(MemoryFilterStore *store)
+	{
+		this->store = store;
+	}
+
+	virtual ~MemoryEngine()
+	{
+		Discard();
+	}
+
+	virtual DWORD TransactionBegin()
+	{
+		if (transaction)
+			return FWP_E_TXN_IN_PROGRESS;
+
+		transaction = true;
+		return ERROR_SUCCESS;
+	}
+
+	virtual DWORD TransactionCommit()
+	{
+		if (!transaction)
+			return FWP_E_NO_TXN_IN_PROGRESS;
+
+		::EnterCriticalSection(&store->lock);
+		for (size_t i = 0; i < pending.size(); i++)
+		{
+			Change &change = pending[i];
+			if (change.filter != NULL)
+			{
+				store->filters[change.id] = change.filter;
+				change.filter = NULL;
+			}
+			else
+			{
+				std::map<UINT64, MemoryFilter *>::iterator it = store->filters.find(change.id);
+				if (it != store->filters.end())
+				{
+					delete it->second;
+					store->filters.erase(it);
+				}
+			}
+		}
+		::LeaveCriticalSection(&store->lock);
+
+		pending.clear();
+		transaction = false;
+		return ERROR_SUCCESS;
+	}
+
+	virtual DWORD TransactionAbort()
+	{
+		if (!transaction)
+			return FWP_E_NO_TXN_IN_PROGRESS;
+
+		Discard();
+		transaction = false;
+		return ERROR_SUCCESS;
+	}
+
+	virtual DWORD FilterAdd(const FWPM_FILTER *filter, UINT64 *id)
+	{
+		Change change;
+		change.id = store->NextId();
+		change.filter = NewMemoryFilter(filter, change.id);
+
+		if (id != NULL)
+			*id = change.id;
+
+		pending.push_back(change);
+		if (!transaction)
+			return TransactionCommitted();
+
+		return ERROR_SUCCESS;
+	}
+
+	virtual DWORD FilterDeleteById(UINT64 id)
+	{
+		bool found = false;
+
+		::EnterCriticalSection(&store->lock);
+		found = (store->filters.find(id) != store->filters.end());
+		::LeaveCriticalSection(&store->lock);
+
+		for (size_t i = 0; i < pending.size(); i++)
+		{
+			if (pending[i].id == id)
+				found = (pending[i].filter != NULL);
+		}
+
+		if (!found)
+			return FWP_E_FILTER_NOT_FOUND;
+
+		Change change;
+		change.id = id;
+		change.filter = NULL;
+
+		pending.push_back(change);
+		if (!transaction)
+			return TransactionCommitted();
+
+		return ERROR_SUCCESS;
+	}
+
+	virtual DWORD FilterGetById(UINT64 id, FWPM_FILTER **filter)
+	{
+		DWORD rc = FWP_E_FILTER_NOT_FOUND;
+
+		::EnterCriticalSection(&store->lock);
+		std::map<UINT64, MemoryFilter *>::iterator it = store->filters.find(id);
+		if (it != store->filters.end())
+		{
+			*filter = &NewMemoryFilter(&it->second->filter, id)->filter;
+			rc = ERROR_SUCCESS;
+		}
+		::LeaveCriticalSection(&store->lock);
+
+		return rc;
+	}
+
+	virtual DWORD FilterCreateEnumHandle(const FWPM_FILTER_ENUM_TEMPLATE *enumTemplate, HANDLE *enumHandle)
+	{
+		std::vector<UINT64> *ids = new std::vector<UINT64>();
+
+		::EnterCriticalSection(&store->lock);
+		for (std::map<UINT64, MemoryFilter *>::iterator it = store->filters.begin(); it != store->filters.end(); ++it)
+		{
+			const FWPM_FILTER &f = it->second->filter;
+			if (enumTemplate != NULL)
+			{
+				if (!IsEqualGUID(f.layerKey, enumTemplate->layerKey))
+					continue;
+				if (enumTemplate->providerKey != NULL && (f.providerKey == NULL || !IsEqualGUID(*f.providerKey, *enumTemplate->providerKey)))
+					continue;
+			}
+			ids->push_back(it->first);
+		}
+		::LeaveCriticalSection(&store->lock);
+
+		// remaining ids are returned by FilterEnum from the end
+		std::reverse(ids->begin(), ids->end());
+		*enumHandle = (HANDLE)ids;
+
+		return ERROR_SUCCESS;
+	}
+
+	virtual DWORD FilterEnum(HANDLE enumHandle, UINT32 numEntriesRequested, FWPM_FILTER ***entries, UINT32 *numEntriesReturned)
+	{
+		std::vector<UINT64> *ids = (std::vector<UINT64> *)enumHandle;
+		std::vector<FWPM_FILTER *> page;
+
+		::EnterCriticalSection(&store->lock);
+		while (page.size() < numEntriesRequested && ids->size() > 0)
+		{
+			UINT64 id = ids->back();
+			ids->pop_back();
+
+			std::map<UINT64, MemoryFilter *>::iterator it = store->filters.find(id);
+			if (it != store->filters.end())
+				page.push_back(&NewMemoryFilter(&it->second->filter, id)->filter);
+		}
+		::LeaveCriticalSection(&store->lock);
+
+		*entries = NULL;
+		*numEntriesReturned = (UINT32)page.size();
+		if (page.size() > 0)
+		{
+			*entries = new FWPM_FILTER *[page.size()];
+			std::copy(page.begin(), page.end(), *entries);
+			pages[*entries] = (UINT32)page.size();
+		}
+
+		return ERROR_SUCCESS;
+	}
+
+	virtual DWORD FilterDestroyEnumHandle(HANDLE enumHandle)
+	{
+		delete (std::vector<UINT64> *)enumHandle;
+		return ERROR_SUCCESS;
+	}
+
+	virtual void FreeMemory(void **p)
+	{
+		if (*p == NULL)
+			return;
+
+		std::map<void *, UINT32>::iterator it = pages.find(*p);
+		if (it != pages.end())
+		{
+			FWPM_FILTER **page = (FWPM_FILTER **)*p;
+			for (UINT32 i = 0; i < it->second; i++)
+				delete (MemoryFilter *)page[i];
+			delete[] page;
+			pages.erase(it);
+		}
+		else
+		{
+			delete (MemoryFilter *)*p;
+		}
+
+		*p = NULL;
+	}
+
+private:
+	// added filter or removed filter id (filter == NULL)
+	struct Change
+	{
+		UINT64 id;
+		MemoryFilter *filter;
+	};
+
+	MemoryFilterStore *store;
+	std::vector<Change> pending;
+	std::map<void *, UINT32> pages; // filters returned by FilterEnum
+
+	// operation called outside transaction is applied immediately
+	DWORD TransactionCommitted()
+	{
+		transaction = true;
+		return TransactionCommit();
+	}
+
+	void Discard()
+	{
+		for (size_t i = 0; i < pending.size(); i++)
+			delete pending[i].filter;
+		pending.clear();
+	}
+};
+
+
+// Sessions of in-memory engine share one filter store
+class MemorySessionPool : public FirewallSessionPool
+{
+public:
+	MemorySessionPool() : FirewallSessionPool(NULL)
+	{
+		store = new MemoryFilterStore();
+	}
+
+	virtual ~MemorySessionPool()
+	{
+		// idle sessions are closed by base destructor and they don't
+		// access the store
+		delete store;
+	}
+
+protected:
+	virtual FirewallEngine *CreateEngine(DWORD *rc)
+	{
+		*rc = ERROR_SUCCESS;
+		return new MemoryEngine(store);
+	}
+
+private:
+	MemoryFilterStore *store;
+};
+
+
+static FirewallSessionPool *NewMemorySessionPool()
+{
+	return new MemorySessionPool();
+}
+
+
+FirewallConditions::FirewallConditions()
+{
+	OutputDebugString(L"FirewallConditions::FirewallConditions");
+
+	conditions4 = new std::vector<FWPM_FILTER_CONDITION>();
+	conditions6 = new std::vector<FWPM_FILTER_CONDITION>();
+	hasIPv4 = false;
+	hasIPv6 = false;
+	needTransportLayer = false;
+	arena = new FirewallArena(F2B_CONDITIONS_ARENA_SIZE);
+
+	OutputDebugString(L"FirewallConditions::FirewallConditions OK");
+}
+
+
+FirewallConditions::~FirewallConditions()
+{
+	// clean up code to release managed resource
+	OutputDebugString(L"FirewallConditions::~FirewallConditions");
+
+	// call finalizer to release unmanaged resources
+	this->!FirewallConditions();
+
+	OutputDebugString(L"FirewallConditions::~FirewallConditions OK");
+}
+
+
+FirewallConditions::!FirewallConditions()
+{
+	// clean up code to release unmanaged resources
+	OutputDebugString(L"FirewallConditions::!FirewallConditions");
+
+	// values of all conditions are released together with arena
+	if (conditions4)
+	{
+		delete conditions4;
+		conditions4 = NULL;
+	}
+	if (conditions6)
+	{
+		delete conditions6;
+		conditions6 = NULL;
+	}
+	if (arena)
+	{
+		delete arena;
+		arena = NULL;
+	}
+
+	OutputDebugString(L"FirewallConditions::!FirewallConditions OK");
+}
+
+
+FirewallConditions^ FirewallConditions::Acquire()
+{
+	{
+		msclr::lock lock(s_pool);
+		if (s_pool->Count > 0)
+		{
+			return s_pool->Pop();
+		}
+	}
+
+	return gcnew FirewallConditions();
+}
+
+
+void FirewallConditions::Release(FirewallConditions^ conds)
+{
+	if (conds == nullptr)
+		return;
+
+	conds->Reset();
+
+	{
+		msclr::lock lock(s_pool);
+		if (s_pool->Count < F2B_CONDITIONS_POOL_SIZE)
+		{
+			s_pool->Push(conds);
+			return;
+		}
+	}
+
+	delete conds;
+}
+
+
+// Vectors keep their capacity and arena its memory, so reused
+// object doesn't allocate memory for similar set of conditions
+void FirewallConditions::Reset()
+{
+	conditions4->clear();
+	conditions6->clear();
+	arena->Reset();
+	hasIPv4 = false;
+	hasIPv6 = false;
+	needTransportLayer = false;
+}
+
+
+// Add new filtering rule condition
+void FirewallConditions::Add(IPAddress^ addr)
+{
+	return this->Add(addr, 128);
+}
+
+void FirewallConditions::Add(IPAddress^ addr, int prefix)
+{
+	OutputDebugString(L"FirewallConditions::Add(addr, prefix)");
+
+	// IPv4 address mapped to IPv6 with prefix shorter than 96 covers
+	// also addresses outside ::ffff:0:0/96 and it must stay IPv6 prefix
+	if (addr->IsIPv4MappedToIPv6 && prefix >= 96)
+	{
+		addr = addr->MapToIPv4();
+		prefix -= 96;
+	}
+
+	FWPM_FILTER_CONDITION fwpFilterCondition;
+	::ZeroMemory(&fwpFilterCondition, sizeof(FWPM_FILTER_CONDITION));
+
+	fwpFilterCondition.fieldKey = FWPM_CONDITION_IP_REMOTE_ADDRESS;
+	fwpFilterCondition.matchType = FWP_MATCH_EQUAL;
+	if (addr->AddressFamily == Sockets::AddressFamily::InterNetwork)
+	{
+		// IPv4 address
+		hasIPv4 = true;
+
+		FWP_V4_ADDR_AND_MASK *fwpAddr4AndMask = (FWP_V4_ADDR_AND_MASK *)arena->Alloc(sizeof(FWP_V4_ADDR_AND_MASK));
+
+		fwpFilterCondition.conditionValue.type = FWP_V4_ADDR_MASK;
+		fwpFilterCondition.conditionValue.v4AddrMask = fwpAddr4AndMask;
+		array<unsigned char>^ addrBytes = addr->GetAddressBytes();
+		pin_ptr<unsigned char> pAddrBytes = &addrBytes[0];
+		fwpAddr4AndMask->addr = htonl(*((u_long *)&pAddrBytes[0]));
+		fwpAddr4AndMask->mask = (prefix <= 0 ? 0 : (prefix >= 32 ? 0xffffffff : 0xffffffff << (32 - prefix)));
+
+		conditions4->push_back(fwpFilterCondition);
+	}
+	else
+	{
+		// IPv6 address
+		hasIPv6 = true;
+
+		FWP_V6_ADDR_AND_MASK *fwpAddr6AndMask = (FWP_V6_ADDR_AND_MASK *)arena->Alloc(sizeof(FWP_V6_ADDR_AND_MASK));
+
+		fwpFilterCondition.conditionValue.type = FWP_V6_ADDR_MASK;
+		fwpFilterCondition.conditionValue.v6AddrMask = fwpAddr6AndMask;
+		array<unsigned char>^ addrBytes = addr->GetAddressBytes();
+		pin_ptr<unsigned char> pAddrBytes = &addrBytes[0];
+		CopyMemory(&fwpAddr6AndMask->addr, pAddrBytes, 16);
+		fwpAddr6AndMask->prefixLength = (UINT8)(prefix > 128 ? 128 : prefix);
+
+		conditions6->push_back(fwpFilterCondition);
+	}
+}
+
+void FirewallConditions::Add(IPAddress^ addrLow, IPAddress^ addrHigh)
+{
+	OutputDebugString(L"FirewallConditions::Add(addrLow, addrHigh)");
+
+	if (addrLow->IsIPv4MappedToIPv6)
+	{
+		addrLow = addrLow->MapToIPv4();
+	}
+	if (addrHigh->IsIPv4MappedToIPv6)
+	{
+		addrHigh = addrHigh->MapToIPv4();
+	}
+	if (addrLow->AddressFamily != addrHigh->AddressFamily)
+	{
+		throw gcnew System::ArgumentException("Firewall::Add: Can't create range from IPv4 and IPv6 address");
+	}
+
+	array<unsigned char>^ addrLowBytes = addrLow->GetAddressBytes();
+	array<unsigned char>^ addrHighBytes = addrHigh->GetAddressBytes();
+
+	int addrSize = (addrLow->AddressFamily == Sockets::AddressFamily::InterNetwork ? 4 : 16);
+	for (int i = 0; i < addrSize; i++)
+	{
+		if (addrLowBytes[i] > addrHighBytes[i])
+		{
+			throw gcnew System::ArgumentException("FirewallConditions::Add: Address range invalid (Low address is bigger then High address");
+		}
+		else if (addrLowBytes[i] < addrHighBytes[i])
+		{
+			break;
+		}
+	}
+
+	FWPM_FILTER_CONDITION fwpFilterCondition;
+	FWP_RANGE *fwpRange = (FWP_RANGE *)arena->Alloc(sizeof(FWP_RANGE));
+	::ZeroMemory(&fwpFilterCondition, sizeof(FWPM_FILTER_CONDITION));
+
+	fwpFilterCondition.fieldKey = FWPM_CONDITION_IP_REMOTE_ADDRESS;
+	fwpFilterCondition.matchType = FWP_MATCH_RANGE;
+	fwpFilterCondition.conditionValue.type = FWP_RANGE_TYPE;
+	fwpFilterCondition.conditionValue.rangeValue = fwpRange;
+	if (addrLow->AddressFamily == Sockets::AddressFamily::InterNetwork)
+	{
+		// IPv4 address
+		hasIPv4 = true;
+
+		pin_ptr<unsigned char> pAddrLowBytes = &addrLowBytes[0];
+		pin_ptr<unsigned char> pAddrHighBytes = &addrHighBytes[0];
+
+		fwpRange->valueLow.type = FWP_UINT32;
+		fwpRange->valueHigh.type = FWP_UINT32;
+		fwpRange->valueLow.uint32 = htonl(*((u_long *)&pAddrLowBytes[0]));
+		fwpRange->valueHigh.uint32 = htonl(*((u_long *)&pAddrHighBytes[0]));
+
+		conditions4->push_back(fwpFilterCondition);
+	}
+	else
+	{
+		// IPv6 address
+		hasIPv6 = true;
+
+		FWP_BYTE_ARRAY16 *fwpByteArray16Low = (FWP_BYTE_ARRAY16 *)arena->Alloc(sizeof(FWP_BYTE_ARRAY16));
+		FWP_BYTE_ARRAY16 *fwpByteArray16High = (FWP_BYTE_ARRAY16 *)arena->Alloc(sizeof(FWP_BYTE_ARRAY16));
+
+		pin_ptr<unsigned char> pAddrLowBytes = &addrLowBytes[0];
+		pin_ptr<unsigned char> pAddrHighBytes = &addrHighBytes[0];
+
+		CopyMemory(fwpByteArray16Low, pAddrLowBytes, 16);
+		CopyMemory(fwpByteArray16High, pAddrHighBytes, 16);
+
+		fwpRange->valueLow.type = FWP_BYTE_ARRAY16_TYPE;
+		fwpRange->valueHigh.type = FWP_BYTE_ARRAY16_TYPE;
+		fwpRange->valueLow.byteArray16 = fwpByteArray16Low;
+		fwpRange->valueHigh.byteArray16 = fwpByteArray16High;
+
+		conditions6->push_back(fwpFilterCondition);
+	}
+}
+
+void FirewallConditions::Add(short port)
+{
+	OutputDebugString(L"FirewallConditions::Add(port)");
+
+	FWPM_FILTER_CONDITION fwpFilterCondition;
+	::ZeroMemory(&fwpFilterCondition, sizeof(FWPM_FILTER_CONDITION));
+
+	// layerThis = FWPM_LAYER_INBOUND_TRANSPORT_V4 + FWPM_LAYER_INBOUND_TRANSPORT_V6;
+	needTransportLayer = true;
+	fwpFilterCondition.fieldKey = FWPM_CONDITION_IP_LOCAL_PORT;
+	fwpFilterCondition.matchType = FWP_MATCH_EQUAL;
+	fwpFilterCondition.conditionValue.type = FWP_UINT16;
+	fwpFilterCondition.conditionValue.uint16 = port;
+
+	conditions4->push_back(fwpFilterCondition);
+	conditions6->push_back(fwpFilterCondition);
+}
+
+void FirewallConditions::Add(short portLow, short portHigh)
+{
+	OutputDebugString(L"FirewallConditions::Add(portLow, portHigh)");
+
+	// port numbers above 32767 are negative short values
+	if ((UINT16)portLow > (UINT16)portHigh)
+	{
+		throw gcnew System::ArgumentException("FirewallConditions::Add: Port range invalid (low port number is bigger then high port number");
+	}
+
+	FWPM_FILTER_CONDITION fwpFilterCondition;
+	FWP_RANGE *fwpRange = (FWP_RANGE *)arena->Alloc(sizeof(FWP_RANGE));
+	::ZeroMemory(&fwpFilterCondition, sizeof(FWPM_FILTER_CONDITION));
+
+	// layerThis = FWPM_LAYER_INBOUND_TRANSPORT_V4 + FWPM_LAYER_INBOUND_TRANSPORT_V6;
+	needTransportLayer = true;
+	fwpRange->valueLow.type = FWP_UINT16;
+	fwpRange->valueLow.uint16 = portLow;
+	fwpRange->valueHigh.type = FWP_UINT16;
+	fwpRange->valueHigh.uint16 = portHigh;
+	fwpFilterCondition.fieldKey = FWPM_CONDITION_IP_LOCAL_PORT;
+	fwpFilterCondition.matchType = FWP_MATCH_RANGE;
+	fwpFilterCondition.conditionValue.type = FWP_RANGE_TYPE;
+	fwpFilterCondition.conditionValue.rangeValue = fwpRange;
+
+	conditions4->push_back(fwpFilterCondition);
+	conditions6->push_back(fwpFilterCondition);
+}
+
+void FirewallConditions::Add(ProtocolType^ protocol)
+{
+	OutputDebugString(L"FirewallConditions::Add(protocol)");
+
+	FWPM_FILTER_CONDITION fwpFilterCondition;
+	::ZeroMemory(&fwpFilterCondition, sizeof(FWPM_FILTER_CONDITION));
+
+	// layerThis = FWPM_LAYER_INBOUND_TRANSPORT_V4 + FWPM_LAYER_INBOUND_TRANSPORT_V6;
+	needTransportLayer = true;
+	fwpFilterCondition.fieldKey = FWPM_CONDITION_IP_PROTOCOL;
+	fwpFilterCondition.matchType = FWP_MATCH_EQUAL;
+	fwpFilterCondition.conditionValue.type = FWP_UINT8;
+	fwpFilterCondition.conditionValue.uint8 = Convert::ToByte(protocol);
+
+	conditions4->push_back(fwpFilterCondition);
+	conditions6->push_back(fwpFilterCondition);
+}
+
+// Values used by FirewallConditions (FWP_VALUE and FWP_CONDITION_VALUE
+// share member names for these types)
+template <typename T>
+static bool AppendValue(StringBuilder^ sb, const T &value)
+{
+	switch (value.type)
+	{
+	case FWP_UINT8: sb->Append("uint8="); sb->Append(value.uint8); return true;
+	case FWP_UINT16: sb->Append("uint16="); sb->Append(value.uint16); return true;
+	case FWP_UINT32: sb->Append("uint32="); sb->AppendFormat("{0:X08}", value.uint32); return true;
+	case FWP_BYTE_ARRAY16_TYPE:
+		sb->Append("byte16=");
+		for (int i = 0; i < 16; i++)
+			sb->AppendFormat("{0:X02}", value.byteArray16->byteArray16[i]);
+		return true;
+	}
+	return false;
+}
+
+static void AppendConditionValue(StringBuilder^ sb, const FWP_CONDITION_VALUE &value)
+{
+	if (AppendValue(sb, value))
+		return;
+
+	switch (value.type)
+	{
+	case FWP_V4_ADDR_MASK:
+		sb->AppendFormat("v4={0:X08}/{1:X08}", value.v4AddrMask->addr, value.v4AddrMask->mask);
+		break;
+	case FWP_V6_ADDR_MASK:
+		sb->Append("v6=");
+		for (int i = 0; i < 16; i++)
+			sb->AppendFormat("{0:X02}", value.v6AddrMask->addr[i]);
+		sb->Append("/");
+		sb->Append(value.v6AddrMask->prefixLength);
+		break;
+	case FWP_RANGE_TYPE:
+		sb->Append("range=(");
+		if (!AppendValue(sb, value.rangeValue->valueLow))
+			sb->Append((int)value.rangeValue->valueLow.type);
+		sb->Append(",");
+		if (!AppendValue(sb, value.rangeValue->valueHigh))
+			sb->Append((int)value.rangeValue->valueHigh.type);
+		sb->Append(")");
+		break;
+	default:
+		sb->Append("type=");
+		sb->Append((int)value.type);
+		break;
+	}
+}
+
+static void AppendConditions(StringBuilder^ sb, const FWPM_FILTER_CONDITION *conds, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		const FWPM_FILTER_CONDITION *c = &conds[i];
+		sb->Append(i == 0 ? "" : ",");
+		sb->AppendFormat("({0:X08}:{1}:", c->fieldKey.Data1, (int)c->matchType);
+		AppendConditionValue(sb, c->conditionValue);
+		sb->Append(")");
+	}
+}
+
+String^ FirewallConditions::ToString()
+{
+	StringBuilder^ sb = gcnew StringBuilder();
+
+	sb->Append(needTransportLayer ? "transport" : "ippacket");
+	sb->Append(" IPv4[");
+	if (hasIPv4)
+		AppendConditions(sb, conditions4->data(), conditions4->size());
+	sb->Append("] IPv6[");
+	if (hasIPv6)
+		AppendConditions(sb, conditions6->data(), conditions6->size());
+	sb->Append("]");
+
+	return sb->ToString();
+}
+
+
+// Create filter rule conditions from F2B_FWDATA_TYPE0 binary data
+FirewallConditions^ FirewallConditions::FromFwData(array<Byte>^ data)
+{
+	OutputDebugString(L"FirewallConditions::FromFwData");
+
+	FirewallConditions^ conds = gcnew FirewallConditions();
+
+	try
+	{
+		conds->Load(data);
+	}
+	catch (Exception^)
+	{
+		delete conds;
+		throw;
+	}
+
+	OutputDebugString(L"FirewallConditions::FromFwData OK");
+
+	return conds;
+}
+
+
+// Parse F2B_FWDATA_TYPE0 binary data without any managed allocations
+// per address (condition values are stored in arena)
+void FirewallConditions::Load(array<Byte>^ data)
+{
+	OutputDebugString(L"FirewallConditions::Load");
+
+	if (data == nullptr)
+	{
+		throw gcnew System::ArgumentNullException("data");
+	}
+
+	size_t len = data->Length;
+	if (len < F2B_FWDATA_SIZE[F2B_FWDATA_EXPIRATION] || data[0] != F2B_FWDATA_EXPIRATION)
+	{
+		throw gcnew System::IO::InvalidDataException("No expiration record at the beginning of FwData data");
+	}
+
+	pin_ptr<Byte> pData = &data[0];
+	const BYTE *buf = pData;
+
+	// validate records and count them to allocate all required memory
+	size_t records = 0;
+	for (size_t pos = F2B_FWDATA_SIZE[F2B_FWDATA_EXPIRATION]; pos < len; pos += F2B_FWDATA_SIZE[buf[pos]])
+	{
+		if (buf[pos] >= _countof(F2B_FWDATA_SIZE))
+		{
+			throw gcnew System::IO::InvalidDataException("Unknown FwData type: " + buf[pos]);
+		}
+		if (buf[pos] == F2B_FWDATA_EXPIRATION)
+		{
+			throw gcnew System::IO::InvalidDataException("More expiration records in FwData");
+		}
+		if (pos + F2B_FWDATA_SIZE[buf[pos]] > len)
+		{
+			throw gcnew System::IO::InvalidDataException("Truncated FwData data with type: " + buf[pos]);
+		}
+		records++;
+	}
+
+	// each record needs at most one condition for IPv4 and IPv6 layer
+	Reset();
+	conditions4->reserve(records);
+	conditions6->reserve(records);
+
+	try
+	{
+		for (size_t pos = F2B_FWDATA_SIZE[F2B_FWDATA_EXPIRATION]; pos < len; pos += F2B_FWDATA_SIZE[buf[pos]])
+		{
+			BYTE type = buf[pos];
+			const BYTE *rec = &buf[pos + 1];
+			FWPM_FILTER_CONDITION *cond;
+
+			// IPv4 address mapped to IPv6 is used as plain IPv4 address,
+			// prefix shorter than 96 stays IPv6 (same behavior as Add methods)
+			int prefix = 0;
+			if (type == F2B_FWDATA_IPv4 || type == F2B_FWDATA_IPv4_AND_PREFIX)
+			{
+				prefix = (type == F2B_FWDATA_IPv4 ? 32 : rec[4]);
+			}
+			else if (type == F2B_FWDATA_IPv6 || type == F2B_FWDATA_IPv6_AND_PREFIX)
+			{
+				prefix = (type == F2B_FWDATA_IPv6 ? 128 : rec[16]);
+				if (IsIPv4Mapped(rec) && prefix >= 96)
+				{
+					rec += 12;
+					prefix -= 96;
+					type = F2B_FWDATA_IPv4_AND_PREFIX;
+				}
+			}
+
+			switch (type)
+			{
+			case F2B_FWDATA_IPv4:
+			case F2B_FWDATA_IPv4_AND_PREFIX:
+			{
+				// prefix length bigger than address can't be represented by mask
+				if (prefix > 32)
+					prefix = 32;
+
+				FWP_V4_ADDR_AND_MASK *fwpAddr4AndMask = (FWP_V4_ADDR_AND_MASK *)arena->Alloc(sizeof(FWP_V4_ADDR_AND_MASK));
+				fwpAddr4AndMask->addr = ReadUInt32(rec);
+				fwpAddr4AndMask->mask = (prefix == 0 ? 0 : 0xffffffff << (32 - prefix));
+
+				cond = NextCondition(conditions4, FWPM_CONDITION_IP_REMOTE_ADDRESS, FWP_MATCH_EQUAL, FWP_V4_ADDR_MASK);
+				cond->conditionValue.v4AddrMask = fwpAddr4AndMask;
+				hasIPv4 = true;
+				break;
+			}
+			case F2B_FWDATA_IPv4_RANGE:
+			case F2B_FWDATA_IPv6_RANGE:
+			{
+				bool ipv6 = (type == F2B_FWDATA_IPv6_RANGE);
+				const BYTE *recLow = rec;
+				const BYTE *recHigh = rec + (ipv6 ? 16 : 4);
+
+				if (ipv6 && IsIPv4Mapped(recLow) != IsIPv4Mapped(recHigh))
+				{
+					throw gcnew System::ArgumentException("Firewall::Add: Can't create range from IPv4 and IPv6 address");
+				}
+				if (memcmp(recLow, recHigh, ipv6 ? 16 : 4) > 0)
+				{
+					throw gcnew System::ArgumentException("FirewallConditions::Add: Address range invalid (Low address is bigger then High address");
+				}
+				if (ipv6 && IsIPv4Mapped(recLow))
+				{
+					ipv6 = false;
+					recLow += 12;
+					recHigh += 12;
+				}
+
+				FWP_RANGE *fwpRange = (FWP_RANGE *)arena->Alloc(sizeof(FWP_RANGE));
+				if (!ipv6)
+				{
+					fwpRange->valueLow.type = FWP_UINT32;
+					fwpRange->valueHigh.type = FWP_UINT32;
+					fwpRange->valueLow.uint32 = ReadUInt32(recLow);
+					fwpRange->valueHigh.uint32 = ReadUInt32(recHigh);
+
+					cond = NextCondition(conditions4, FWPM_CONDITION_IP_REMOTE_ADDRESS, FWP_MATCH_RANGE, FWP_RANGE_TYPE);
+					hasIPv4 = true;
+				}
+				else
+				{
+					FWP_BYTE_ARRAY16 *fwpByteArray16Low = (FWP_BYTE_ARRAY16 *)arena->Alloc(2 * sizeof(FWP_BYTE_ARRAY16));
+					FWP_BYTE_ARRAY16 *fwpByteArray16High = fwpByteArray16Low + 1;
+					CopyMemory(fwpByteArray16Low, recLow, 16);
+					CopyMemory(fwpByteArray16High, recHigh, 16);
+
+					fwpRange->valueLow.type = FWP_BYTE_ARRAY16_TYPE;
+					fwpRange->valueHigh.type = FWP_BYTE_ARRAY16_TYPE;
+					fwpRange->valueLow.byteArray16 = fwpByteArray16Low;
+					fwpRange->valueHigh.byteArray16 = fwpByteArray16High;
+
+					cond = NextCondition(conditions6, FWPM_CONDITION_IP_REMOTE_ADDRESS, FWP_MATCH_RANGE, FWP_RANGE_TYPE);
+					hasIPv6 = true;
+				}
+				cond->conditionValue.rangeValue = fwpRange;
+				break;
+			}
+			case F2B_FWDATA_IPv6:
+			case F2B_FWDATA_IPv6_AND_PREFIX:
+			{
+				if (prefix > 128)
+					prefix = 128;
+
+				FWP_V6_ADDR_AND_MASK *fwpAddr6AndMask = (FWP_V6_ADDR_AND_MASK *)arena->Alloc(sizeof(FWP_V6_ADDR_AND_MASK));
+				CopyMemory(&fwpAddr6AndMask->addr, rec, 16);
+				fwpAddr6AndMask->prefixLength = (UINT8)prefix;
+
+				cond = NextCondition(conditions6, FWPM_CONDITION_IP_REMOTE_ADDRESS, FWP_MATCH_EQUAL, FWP_V6_ADDR_MASK);
+				cond->conditionValue.v6AddrMask = fwpAddr6AndMask;
+				hasIPv6 = true;
+				break;
+			}
+			case F2B_FWDATA_PORT:
+			{
+				// layerThis = FWPM_LAYER_INBOUND_TRANSPORT_V4 + FWPM_LAYER_INBOUND_TRANSPORT_V6;
+				needTransportLayer = true;
+				cond = NextCondition(conditions4, FWPM_CONDITION_IP_LOCAL_PORT, FWP_MATCH_EQUAL, FWP_UINT16);
+				cond->conditionValue.uint16 = ReadUInt16(rec);
+				cond = NextCondition(conditions6, FWPM_CONDITION_IP_LOCAL_PORT, FWP_MATCH_EQUAL, FWP_UINT16);
+				cond->conditionValue.uint16 = ReadUInt16(rec);
+				break;
+			}
+			case F2B_FWDATA_PORT_RANGE:
+			{
+				UINT16 portLow = ReadUInt16(rec);
+				UINT16 portHigh = ReadUInt16(rec + 2);
+				if (portLow > portHigh)
+				{
+					throw gcnew System::ArgumentException("FirewallConditions::Add: Port range invalid (low port number is bigger then high port number");
+				}
+
+				FWP_RANGE *fwpRange = (FWP_RANGE *)arena->Alloc(sizeof(FWP_RANGE));
+				fwpRange->valueLow.type = FWP_UINT16;
+				fwpRange->valueLow.uint16 = portLow;
+				fwpRange->valueHigh.type = FWP_UINT16;
+				fwpRange->valueHigh.uint16 = portHigh;
+
+				// layerThis = FWPM_LAYER_INBOUND_TRANSPORT_V4 + FWPM_LAYER_INBOUND_TRANSPORT_V6;
+				needTransportLayer = true;
+				cond = NextCondition(conditions4, FWPM_CONDITION_IP_LOCAL_PORT, FWP_MATCH_RANGE, FWP_RANGE_TYPE);
+				cond->conditionValue.rangeValue = fwpRange;
+				cond = NextCondition(conditions6, FWPM_CONDITION_IP_LOCAL_PORT, FWP_MATCH_RANGE, FWP_RANGE_TYPE);
+				cond->conditionValue.rangeValue = fwpRange;
+				break;
+			}
+			case F2B_FWDATA_PROTOCOL:
+			{
+				// layerThis = FWPM_LAYER_INBOUND_TRANSPORT_V4 + FWPM_LAYER_INBOUND_TRANSPORT_V6;
+				needTransportLayer = true;
+				cond = NextCondition(conditions4, FWPM_CONDITION_IP_PROTOCOL, FWP_MATCH_EQUAL, FWP_UINT8);
+				cond->conditionValue.uint8 = rec[0];
+				cond = NextCondition(conditions6, FWPM_CONDITION_IP_PROTOCOL, FWP_MATCH_EQUAL, FWP_UINT8);
+				cond->conditionValue.uint8 = rec[0];
+				break;
+			}
+			}
+		}
+	}
+	catch (Exception^)
+	{
+		// don't keep partially loaded conditions
+		Reset();
+		throw;
+	}
+
+	OutputDebugString(L"FirewallConditions::Load OK");
+}
+
+
+
+// Create queue with capacity rounded up to power of two and start
+// worker thread
+FirewallQueue::FirewallQueue(int capacity)
+{
+	OutputDebugString(L"FirewallQueue::FirewallQueue");
+
+	if (capacity < 2)
+		capacity = 2;
+
+	int size = 2;
+	while (size < capacity && size < (1 << 30))
+		size <<= 1;
+
+	m_items = gcnew array<FirewallQueueItem^>(size);
+	m_sequence = gcnew array<Int64>(size);
+	m_mask = size - 1;
+	for (int i = 0; i < size; i++)
+	{
+		m_sequence[i] = i;
+	}
+
+	m_signal = gcnew AutoResetEvent(false);
+	m_worker = gcnew Thread(gcnew ThreadStart(this, &FirewallQueue::Run));
+	m_worker->Name = "F2B WFP queue";
+	m_worker->IsBackground = true;
+	m_worker->Start();
+
+	OutputDebugString(L"FirewallQueue::FirewallQueue OK");
+}
+
+
+FirewallQueue::~FirewallQueue()
+{
+	OutputDebugString(L"FirewallQueue::~FirewallQueue");
+
+	Stop();
+
+	OutputDebugString(L"FirewallQueue::~FirewallQueue OK");
+}
+
+
+bool FirewallQueue::TryEnqueue(FirewallQueueItem^ item)
+{
+	if (item == nullptr || item->Item == nullptr)
+	{
+		throw gcnew System::ArgumentNullException("item", "FirewallQueue::TryEnqueue: no filter rule");
+	}
+
+	if (Thread::VolatileRead(m_stop) != 0)
+	{
+		throw gcnew System::InvalidOperationException("FirewallQueue::TryEnqueue: queue was stopped");
+	}
+
+	// reserve slot by moving enqueue position and publish item
+	// by updating slot sequence number
+	Int64 pos = Interlocked::Read(m_enqueuePos);
+	while (true)
+	{
+		int index = (int)(pos & m_mask);
+		Int64 diff = Thread::VolatileRead(m_sequence[index]) - pos;
+
+		if (diff == 0)
+		{
+			Int64 prev = Interlocked::CompareExchange(m_enqueuePos, pos + 1, pos);
+			if (prev == pos)
+			{
+				m_items[index] = item;
+				Thread::VolatileWrite(m_sequence[index], pos + 1);
+				break;
+			}
+			pos = prev;
+		}
+		else if (diff < 0)
+		{
+			// slot still used by item from previous round
+			return false;
+		}
+		else
+		{
+			pos = Interlocked::Read(m_enqueuePos);
+		}
+	}
+
+	Interlocked::Increment(m_submitted);
+
+	// wake up worker thread only when it waits for new items
+	if (Interlocked::CompareExchange(m_sleeping, 0, 1) == 1)
+	{
+		m_signal->Set();
+	}
+
+	return true;
+}
+
+
+// Worker thread frees slots before it processes items and it pulses m_sync
+// after each processed batch, so producer blocks instead of spinning
+bool FirewallQueue::Enqueue(FirewallQueueItem^ item, int millisecondsTimeout)
+{
+	if (TryEnqueue(item))
+		return true;
+
+	int started = Environment::TickCount;
+
+	Monitor::Enter(m_sync);
+	try
+	{
+		while (!TryEnqueue(item))
+		{
+			int wait = Timeout::Infinite;
+			if (millisecondsTimeout != Timeout::Infinite)
+			{
+				wait = millisecondsTimeout - (Environment::TickCount - started);
+				if (wait <= 0)
+					return false;
+			}
+
+			Monitor::Wait(m_sync, wait);
+		}
+	}
+	finally
+	{
+		Monitor::Exit(m_sync);
+	}
+
+	return true;
+}
+
+
+// Single consumer (worker thread) doesn't need atomic operations
+// to move dequeue position
+bool FirewallQueue::TryDequeue(FirewallQueueItem^% item)
+{
+	Int64 pos = m_dequeuePos;
+	int index = (int)(pos & m_mask);
+
+	if (Thread::VolatileRead(m_sequence[index]) != pos + 1)
+	{
+		item = nullptr;
+		return false;
+	}
+
+	item = m_items[index];
+	m_items[index] = nullptr;
+	Thread::VolatileWrite(m_sequence[index], pos + m_mask + 1);
+	Interlocked::Exchange(m_dequeuePos, pos + 1);
+
+	return true;
+}
+
+
+bool FirewallQueue::IsPending()
+{
+	Int64 pos = m_dequeuePos;
+	return Thread::VolatileRead(m_sequence[(int)(pos & m_mask)]) == pos + 1;
 }
 
 
-
-FirewallConditions::FirewallConditions()
+bool FirewallQueue::Flush(int millisecondsTimeout)
 {
-	OutputDebugString(L"FirewallConditions::FirewallConditions");
+	Int64 submitted = Interlocked::Read(m_submitted);
+	int started = Environment::TickCount;
 
-	conditions4 = new std::vector<FWPM_FILTER_CONDITION>();
-	conditions6 = new std::vector<FWPM_FILTER_CONDITION>();
-	hasIPv4 = false;
-	hasIPv6 = false;
-	needTransportLayer = false;
+	Monitor::Enter(m_sync);
+	try
+	{
+		while (Interlocked::Read(m_completed) < submitted)
+		{
+			int wait = Timeout::Infinite;
+			if (millisecondsTimeout != Timeout::Infinite)
+			{
+				wait = millisecondsTimeout - (Environment::TickCount - started);
+				if (wait <= 0)
+					return false;
+			}
 
-	OutputDebugString(L"FirewallConditions::FirewallConditions OK");
+			Monitor::Wait(m_sync, wait);
+		}
+	}
+	finally
+	{
+		Monitor::Exit(m_sync);
+	}
+
+	return true;
 }
 
 
-FirewallConditions::~FirewallConditions()
+void FirewallQueue::Stop()
 {
-	// clean up code to release managed resource
-	OutputDebugString(L"FirewallConditions::~FirewallConditions");
+	if (Interlocked::Exchange(m_stop, 1) != 0)
+		return;
 
-	// call finalizer to release unmanaged resources
-	this->!FirewallConditions();
+	OutputDebugString(L"FirewallQueue::Stop");
 
-	OutputDebugString(L"FirewallConditions::~FirewallConditions OK");
+	m_signal->Set();
+	m_worker->Join();
+
+	OutputDebugString(L"FirewallQueue::Stop OK");
 }
 
 
-FirewallConditions::!FirewallConditions()
+// Worker thread takes all available items, they are split in WFP
+// transactions according Firewall::BatchSize
+void FirewallQueue::Run()
 {
-	// clean up code to release unmanaged resources
-	OutputDebugString(L"FirewallConditions::!FirewallConditions");
+	List<FirewallQueueItem^>^ pending = gcnew List<FirewallQueueItem^>();
 
-	// release memory allocated in any Add method
-	if (conditions4)
+	while (true)
 	{
-		for (FWPM_FILTER_CONDITION cond : *conditions4)
+		FirewallQueueItem^ item;
+
+		while (pending->Count < m_items->Length && TryDequeue(item))
 		{
-			FreeCondition(cond);
+			pending->Add(item);
 		}
 
-		delete conditions4;
-	}
-	if (conditions6)
-	{
-		for (FWPM_FILTER_CONDITION cond : *conditions6)
+		if (pending->Count > 0)
 		{
-			FreeCondition(cond);
+			Process(pending);
+			pending->Clear();
+			continue;
 		}
 
-		delete conditions6;
-	}
+		if (Thread::VolatileRead(m_stop) != 0)
+			break;
 
-	OutputDebugString(L"FirewallConditions::!FirewallConditions OK");
+		// announce waiting before last check for new items, producer
+		// that publish item after this check always signals event
+		Interlocked::Exchange(m_sleeping, 1);
+		if (IsPending() || Thread::VolatileRead(m_stop) != 0)
+		{
+			Interlocked::Exchange(m_sleeping, 0);
+			continue;
+		}
+
+		m_signal->WaitOne();
+		Interlocked::Exchange(m_sleeping, 0);
+	}
 }
 
 
-void FirewallConditions::FreeCondition(FWPM_FILTER_CONDITION &fwpFilterCondition)
+void FirewallQueue::Process(List<FirewallQueueItem^>^ items)
 {
-	FWP_CONDITION_VALUE *cvalue = &fwpFilterCondition.conditionValue;
-	FWP_MATCH_TYPE mtype = fwpFilterCondition.matchType;
-	FWP_DATA_TYPE vtype = fwpFilterCondition.conditionValue.type;
-	if (mtype == FWP_MATCH_EQUAL)
+	array<bool>^ done = gcnew array<bool>(items->Count);
+
+	// items keep this state until AddBatch / RemoveBatch set their
+	// result, so commited items are not marked as failed when batch
+	// throws exception
+	for (int i = 0; i < items->Count; i++)
+	{
+		items[i]->Item->Error = ERROR_IO_PENDING;
+	}
+
+	try
 	{
-		if (vtype == FWP_V4_ADDR_MASK)
+		Firewall^ firewall = Firewall::Instance;
+
+		// add filter rules with same options in one batch
+		for (int i = 0; i < items->Count; i++)
+		{
+			FirewallQueueItem^ item = items[i];
+			if (done[i] || item->Remove)
+				continue;
+
+			List<FirewallBatchItem^>^ batch = gcnew List<FirewallBatchItem^>();
+			for (int j = i; j < items->Count; j++)
+			{
+				FirewallQueueItem^ other = items[j];
+				if (done[j] || other->Remove || other->Weight != item->Weight || other->Permit != item->Permit || other->Persistent != item->Persistent)
+					continue;
+
+				batch->Add(other->Item);
+				done[j] = true;
+			}
+
+			firewall->AddBatch(batch, item->Weight, item->Permit, item->Persistent);
+			Interlocked::Increment(m_batches);
+		}
+
+		// remove filter rules
+		List<FirewallBatchItem^>^ remove = gcnew List<FirewallBatchItem^>();
+		for (int i = 0; i < items->Count; i++)
 		{
-			delete cvalue->v4AddrMask;
+			if (items[i]->Remove)
+			{
+				remove->Add(items[i]->Item);
+			}
 		}
-		else if (vtype == FWP_V6_ADDR_MASK)
+
+		if (remove->Count > 0)
 		{
-			delete cvalue->v6AddrMask;
+			firewall->RemoveBatch(remove);
+			Interlocked::Increment(m_batches);
 		}
-		else if (vtype == FWP_BYTE_ARRAY16_TYPE)
+	}
+	catch (Exception^)
+	{
+		// unexpected failure (e.g. WFP engine not available)
+		OutputDebugString(L"FirewallQueue::Process: firewall operation failed");
+		for (int i = 0; i < items->Count; i++)
 		{
-			delete cvalue->byteArray16;
+			if (items[i]->Item->Error == ERROR_IO_PENDING)
+				items[i]->Item->Error = ERROR_GEN_FAILURE;
 		}
 	}
-	else if (mtype == FWP_RANGE_TYPE)
+
+	for (int i = 0; i < items->Count; i++)
 	{
-		if (cvalue->rangeValue->valueLow.type == FWP_BYTE_ARRAY16_TYPE)
+		FirewallQueueItem^ item = items[i];
+		if (item->Completion == nullptr)
+			continue;
+
+		try
 		{
-			delete cvalue->rangeValue->valueLow.byteArray16;
+			item->Completion(item);
 		}
-		if (cvalue->rangeValue->valueHigh.type == FWP_BYTE_ARRAY16_TYPE)
+		catch (Exception^)
 		{
-			delete cvalue->rangeValue->valueHigh.byteArray16;
+			OutputDebugString(L"FirewallQueue::Process: completion callback failed");
 		}
-		delete cvalue->rangeValue;
+	}
+
+	Interlocked::Add(m_completed, items->Count);
+
+	Monitor::Enter(m_sync);
+	try
+	{
+		Monitor::PulseAll(m_sync);
+	}
+	finally
+	{
+		Monitor::Exit(m_sync);
 	}
 }
 
 
-// Add new filtering rule condition
-void FirewallConditions::Add(IPAddress^ addr)
+
+FirewallOperationTimer::FirewallOperationTimer(int op)
 {
-	return this->Add(addr, 128);
+	this->op = op;
+	this->started = System::Diagnostics::Stopwatch::GetTimestamp();
+	this->rc = ERROR_SUCCESS;
 }
 
-void FirewallConditions::Add(IPAddress^ addr, int prefix)
+
+FirewallOperationTimer::~FirewallOperationTimer()
 {
-	OutputDebugString(L"FirewallConditions::Add(addr, prefix)");
+	FirewallStats::Record((FirewallOperation)op, started, rc);
+}
 
-	if (addr->IsIPv4MappedToIPv6)
+
+// Counters for current thread (created and registered on first use)
+FirewallCounters^ FirewallStats::Counters()
+{
+	FirewallCounters^ counters = t_counters;
+	if (counters == nullptr)
 	{
-		addr = addr->MapToIPv4();
-		if (prefix >= 96)
+		counters = gcnew FirewallCounters(Thread::CurrentThread);
+
+		Monitor::Enter(s_counters);
+		try
 		{
-			prefix -= 96;
+			Retire();
+			s_counters->Add(counters);
+		}
+		finally
+		{
+			Monitor::Exit(s_counters);
 		}
-	}
-
-	FWPM_FILTER_CONDITION fwpFilterCondition;
-	::ZeroMemory(&fwpFilterCondition, sizeof(FWPM_FILTER_CONDITION));
 
-	fwpFilterCondition.fieldKey = FWPM_CONDITION_IP_REMOTE_ADDRESS;
-	fwpFilterCondition.matchType = FWP_MATCH_EQUAL;
-	if (addr->AddressFamily == Sockets::AddressFamily::InterNetwork)
-	{
-		// IPv4 address
-		hasIPv4 = true;
+		t_counters = counters;
+	}
 
-		FWP_V4_ADDR_AND_MASK *fwpAddr4AndMask = new FWP_V4_ADDR_AND_MASK;
-		::ZeroMemory(fwpAddr4AndMask, sizeof(FWP_V4_ADDR_AND_MASK));
+	return counters;
+}
 
-		fwpFilterCondition.conditionValue.type = FWP_V4_ADDR_MASK;
-		fwpFilterCondition.conditionValue.v4AddrMask = fwpAddr4AndMask;
-		array<unsigned char>^ addrBytes = addr->GetAddressBytes();
-		pin_ptr<unsigned char> pAddrBytes = &addrBytes[0];
-		fwpAddr4AndMask->addr = htonl(*((u_long *)&pAddrBytes[0]));
-		fwpAddr4AndMask->mask = 0xffffffff << (32 - prefix);
 
-		conditions4->push_back(fwpFilterCondition);
-	}
-	else
+// Fold counters of exited threads in s_retired (caller holds s_counters
+// lock), counters of exited thread can't be modified anymore
+void FirewallStats::Retire()
+{
+	for (int i = s_counters->Count - 1; i >= 0; i--)
 	{
-		// IPv6 address
-		hasIPv6 = true;
-
-		FWP_V6_ADDR_AND_MASK *fwpAddr6AndMask = new FWP_V6_ADDR_AND_MASK;
-		::ZeroMemory(fwpAddr6AndMask, sizeof(FWP_V6_ADDR_AND_MASK));
-
-		fwpFilterCondition.conditionValue.type = FWP_V6_ADDR_MASK;
-		fwpFilterCondition.conditionValue.v6AddrMask = fwpAddr6AndMask;
-		array<unsigned char>^ addrBytes = addr->GetAddressBytes();
-		pin_ptr<unsigned char> pAddrBytes = &addrBytes[0];
-		CopyMemory(&fwpAddr6AndMask->addr, pAddrBytes, 16);
-		fwpAddr6AndMask->prefixLength = prefix;
+		FirewallCounters^ counters = s_counters[i];
+		if (counters->owner->IsAlive)
+			continue;
 
-		conditions6->push_back(fwpFilterCondition);
+		Merge(counters, s_retired);
+		s_counters->RemoveAt(i);
 	}
 }
 
-void FirewallConditions::Add(IPAddress^ addrLow, IPAddress^ addrHigh)
-{
-	OutputDebugString(L"FirewallConditions::Add(addrLow, addrHigh)");
 
-	if (addrLow->IsIPv4MappedToIPv6)
+// Add values from counters that can be modified by their owner thread
+// to counters used only by caller
+void FirewallStats::Merge(FirewallCounters^ from, FirewallCounters^ to)
+{
+	for (int op = 0; op < F2B_STATS_OPERATIONS; op++)
 	{
-		addrLow = addrLow->MapToIPv4();
+		to->calls[op] += Interlocked::Read(from->calls[op]);
+		to->errors[op] += Interlocked::Read(from->errors[op]);
+		to->max[op] = Math::Max(to->max[op], Interlocked::Read(from->max[op]));
 	}
-	if (addrHigh->IsIPv4MappedToIPv6)
+
+	for (int i = 0; i < F2B_STATS_OPERATIONS * F2B_STATS_BUCKETS; i++)
 	{
-		addrHigh = addrHigh->MapToIPv4();
+		to->histogram[i] += Interlocked::Read(from->histogram[i]);
 	}
-	if (addrLow->AddressFamily != addrHigh->AddressFamily)
+
+	for (int i = 0; i < F2B_STATS_ERRORS; i++)
 	{
-		throw gcnew System::ArgumentException("Firewall::Add: Can't create range from IPv4 and IPv6 address");
+		int code = Thread::VolatileRead(from->errorCodes[i]);
+		if (code == 0)
+			break;
+
+		Int64 count = Interlocked::Read(from->errorCounts[i]);
+		if (count > 0)
+			AddError(to, code, count);
 	}
+}
 
-	array<unsigned char>^ addrLowBytes = addrLow->GetAddressBytes();
-	array<unsigned char>^ addrHighBytes = addrHigh->GetAddressBytes();
 
-	int addrSize = (addrLow->AddressFamily == Sockets::AddressFamily::InterNetwork ? 4 : 16);
-	for (int i = 0; i < addrSize; i++)
+// Error codes are kept in fixed slots, slots are used in order and
+// they are never released
+void FirewallStats::AddError(FirewallCounters^ counters, int code, Int64 count)
+{
+	for (int i = 0; i < F2B_STATS_ERRORS; i++)
 	{
-		if (addrLowBytes[i] > addrHighBytes[i])
+		int slot = counters->errorCodes[i];
+		if (slot == 0)
 		{
-			throw gcnew System::ArgumentException("FirewallConditions::Add: Address range invalid (Low address is bigger then High address");
+			Thread::VolatileWrite(counters->errorCodes[i], code);
+			slot = code;
 		}
-		else if (addrLowBytes[i] < addrHighBytes[i])
+
+		if (slot == code)
 		{
-			break;
+			counters->errorCounts[i] += count;
+			return;
 		}
 	}
+}
 
-	FWPM_FILTER_CONDITION fwpFilterCondition;
-	FWP_RANGE *fwpRange = new FWP_RANGE;
-	::ZeroMemory(&fwpFilterCondition, sizeof(FWPM_FILTER_CONDITION));
-	::ZeroMemory(fwpRange, sizeof(FWP_RANGE));
-
-	fwpFilterCondition.fieldKey = FWPM_CONDITION_IP_REMOTE_ADDRESS;
-	fwpFilterCondition.matchType = FWP_MATCH_RANGE;
-	fwpFilterCondition.conditionValue.type = FWP_RANGE_TYPE;
-	fwpFilterCondition.conditionValue.rangeValue = fwpRange;
-	if (addrLow->AddressFamily == Sockets::AddressFamily::InterNetwork)
-	{
-		// IPv4 address
-		hasIPv4 = true;
 
-		pin_ptr<unsigned char> pAddrLowBytes = &addrLowBytes[0];
-		pin_ptr<unsigned char> pAddrHighBytes = &addrHighBytes[0];
+// Only owner thread modifies its counters, so plain increments are
+// enough (Snapshot can see values that are few updates behind)
+void FirewallStats::Record(FirewallOperation op, Int64 started, DWORD rc)
+{
+	FirewallCounters^ counters = Counters();
+	int index = (int)op;
 
-		fwpRange->valueLow.type = FWP_UINT32;
-		fwpRange->valueHigh.type = FWP_UINT32;
-		fwpRange->valueLow.uint32 = htonl(*((u_long *)&pAddrLowBytes[0]));
-		fwpRange->valueHigh.uint32 = htonl(*((u_long *)&pAddrHighBytes[0]));
+	Int64 elapsed = System::Diagnostics::Stopwatch::GetTimestamp() - started;
+	Int64 usec = elapsed * 1000000 / System::Diagnostics::Stopwatch::Frequency;
 
-		conditions4->push_back(fwpFilterCondition);
-	}
-	else
+	int bucket = 0;
+	while (bucket < F2B_STATS_BUCKETS - 1 && usec >= (1LL << bucket))
 	{
-		// IPv6 address
-		hasIPv6 = true;
+		bucket++;
+	}
 
-		FWP_BYTE_ARRAY16 *fwpByteArray16Low = new FWP_BYTE_ARRAY16;
-		FWP_BYTE_ARRAY16 *fwpByteArray16High = new FWP_BYTE_ARRAY16;
-		::ZeroMemory(fwpByteArray16Low, sizeof(FWP_BYTE_ARRAY16));
-		::ZeroMemory(fwpByteArray16High, sizeof(FWP_BYTE_ARRAY16));
+	counters->calls[index]++;
+	counters->histogram[index * F2B_STATS_BUCKETS + bucket]++;
+	if (elapsed > counters->max[index])
+	{
+		counters->max[index] = elapsed;
+	}
 
-		pin_ptr<unsigned char> pAddrLowBytes = &addrLowBytes[0];
-		pin_ptr<unsigned char> pAddrHighBytes = &addrHighBytes[0];
+	if (rc != ERROR_SUCCESS)
+	{
+		RecordError(op, rc);
+	}
+}
 
-		CopyMemory(fwpByteArray16Low, pAddrLowBytes, 16);
-		CopyMemory(fwpByteArray16High, pAddrHighBytes, 16);
 
-		fwpRange->valueLow.type = FWP_BYTE_ARRAY16_TYPE;
-		fwpRange->valueHigh.type = FWP_BYTE_ARRAY16_TYPE;
-		fwpRange->valueLow.byteArray16 = fwpByteArray16Low;
-		fwpRange->valueHigh.byteArray16 = fwpByteArray16High;
+void FirewallStats::RecordError(FirewallOperation op, DWORD rc)
+{
+	FirewallCounters^ counters = Counters();
 
-		conditions6->push_back(fwpFilterCondition);
-	}
+	counters->errors[(int)op]++;
+	AddError(counters, (int)rc, 1);
 }
 
-void FirewallConditions::Add(short port)
-{
-	OutputDebugString(L"FirewallConditions::Add(port)");
 
-	FWPM_FILTER_CONDITION fwpFilterCondition;
-	::ZeroMemory(&fwpFilterCondition, sizeof(FWPM_FILTER_CONDITION));
+// Histogram bucket upper limit where given percentile of calls belongs
+double FirewallStats::Percentile(array<Int64>^ histogram, Int64 calls, double percentile, double max)
+{
+	if (calls == 0)
+		return 0;
 
-	// layerThis = FWPM_LAYER_INBOUND_TRANSPORT_V4 + FWPM_LAYER_INBOUND_TRANSPORT_V6;
-	needTransportLayer = true;
-	fwpFilterCondition.fieldKey = FWPM_CONDITION_IP_LOCAL_PORT;
-	fwpFilterCondition.matchType = FWP_MATCH_EQUAL;
-	fwpFilterCondition.conditionValue.type = FWP_UINT16;
-	fwpFilterCondition.conditionValue.uint16 = port;
+	Int64 target = (Int64)Math::Ceiling(calls * percentile);
+	Int64 sum = 0;
+	for (int bucket = 0; bucket < histogram->Length; bucket++)
+	{
+		sum += histogram[bucket];
+		if (sum >= target)
+		{
+			return Math::Min(FirewallOperationStats::BucketLimit(bucket), max);
+		}
+	}
 
-	conditions4->push_back(fwpFilterCondition);
-	conditions6->push_back(fwpFilterCondition);
+	return max;
 }
 
-void FirewallConditions::Add(short portLow, short portHigh)
+
+// Merge counters from all threads (including threads that already exited)
+FirewallStats^ FirewallStats::Snapshot()
 {
-	OutputDebugString(L"FirewallConditions::Add(portLow, portHigh)");
+	FirewallCounters^ total = gcnew FirewallCounters(nullptr);
 
-	if (portLow > portHigh)
+	Monitor::Enter(s_counters);
+	try
 	{
-		throw gcnew System::ArgumentException("FirewallConditions::Add: Port range invalid (low port number is bigger then high port number");
+		Retire();
+		Merge(s_retired, total);
+		for each (FirewallCounters^ counters in s_counters)
+		{
+			Merge(counters, total);
+		}
+	}
+	finally
+	{
+		Monitor::Exit(s_counters);
 	}
 
-	FWPM_FILTER_CONDITION fwpFilterCondition;
-	FWP_RANGE *fwpRange = new FWP_RANGE;
-	::ZeroMemory(&fwpFilterCondition, sizeof(FWPM_FILTER_CONDITION));
-	::ZeroMemory(fwpRange, sizeof(FWP_RANGE));
+	FirewallStats^ stats = gcnew FirewallStats();
+	stats->Time = DateTime::Now;
+	stats->Filters = Math::Max(Interlocked::Read(s_filters), 0LL);
+	stats->Operations = gcnew array<FirewallOperationStats^>(F2B_STATS_OPERATIONS);
+	stats->Errors = gcnew Dictionary<WFPErrorCode, Int64>();
 
-	// layerThis = FWPM_LAYER_INBOUND_TRANSPORT_V4 + FWPM_LAYER_INBOUND_TRANSPORT_V6;
-	needTransportLayer = true;
-	fwpRange->valueLow.type = FWP_UINT16;
-	fwpRange->valueLow.uint16 = portLow;
-	fwpRange->valueHigh.type = FWP_UINT16;
-	fwpRange->valueHigh.uint16 = portHigh;
-	fwpFilterCondition.fieldKey = FWPM_CONDITION_IP_LOCAL_PORT;
-	fwpFilterCondition.matchType = FWP_MATCH_RANGE;
-	fwpFilterCondition.conditionValue.type = FWP_RANGE_TYPE;
-	fwpFilterCondition.conditionValue.rangeValue = fwpRange;
+	double msecPerTick = 1000.0 / System::Diagnostics::Stopwatch::Frequency;
 
-	conditions4->push_back(fwpFilterCondition);
-	conditions6->push_back(fwpFilterCondition);
+	for (int op = 0; op < F2B_STATS_OPERATIONS; op++)
+	{
+		FirewallOperationStats^ opstats = gcnew FirewallOperationStats();
+		array<Int64>^ histogram = gcnew array<Int64>(F2B_STATS_BUCKETS);
+		Array::Copy(total->histogram, op * F2B_STATS_BUCKETS, histogram, 0, F2B_STATS_BUCKETS);
+
+		// histogram and calls are not updated atomically together
+		Int64 histogramCalls = 0;
+		for (int bucket = 0; bucket < F2B_STATS_BUCKETS; bucket++)
+		{
+			histogramCalls += histogram[bucket];
+		}
+
+		opstats->Operation = (FirewallOperation)op;
+		opstats->Calls = total->calls[op];
+		opstats->Errors = total->errors[op];
+		opstats->Histogram = histogram;
+		opstats->Max = total->max[op] * msecPerTick;
+		opstats->P50 = Percentile(histogram, histogramCalls, 0.50, opstats->Max);
+		opstats->P99 = Percentile(histogram, histogramCalls, 0.99, opstats->Max);
+
+		stats->Operations[op] = opstats;
+	}
+
+	for (int i = 0; i < F2B_STATS_ERRORS && total->errorCodes[i] != 0; i++)
+	{
+		stats->Errors[(WFPErrorCode)total->errorCodes[i]] = total->errorCounts[i];
+	}
+
+	return stats;
 }
 
-void FirewallConditions::Add(ProtocolType^ protocol)
-{
-	OutputDebugString(L"FirewallConditions::Add(protocol)");
 
-	FWPM_FILTER_CONDITION fwpFilterCondition;
-	::ZeroMemory(&fwpFilterCondition, sizeof(FWPM_FILTER_CONDITION));
+String^ FirewallStats::ToString()
+{
+	StringBuilder^ sb = gcnew StringBuilder();
 
-	// layerThis = FWPM_LAYER_INBOUND_TRANSPORT_V4 + FWPM_LAYER_INBOUND_TRANSPORT_V6;
-	needTransportLayer = true;
-	fwpFilterCondition.fieldKey = FWPM_CONDITION_IP_PROTOCOL;
-	fwpFilterCondition.matchType = FWP_MATCH_EQUAL;
-	fwpFilterCondition.conditionValue.type = FWP_UINT8;
-	fwpFilterCondition.conditionValue.uint8 = Convert::ToByte(protocol);
+	sb->AppendLine(String::Format("filters: {0} (snapshot {1})", Filters, Time));
+	for each (FirewallOperationStats^ opstats in Operations)
+	{
+		sb->AppendLine(String::Format("{0}: calls {1}, errors {2}, p50 {3:0.###} ms, p99 {4:0.###} ms, max {5:0.###} ms",
+			opstats->Operation, opstats->Calls, opstats->Errors, opstats->P50, opstats->P99, opstats->Max));
+	}
+	for each (KeyValuePair<WFPErrorCode, Int64> item in Errors)
+	{
+		sb->AppendLine(String::Format("error {0} (0x{1:x}): {2}", item.Key, (int)item.Key, item.Value));
+	}
 
-	conditions4->push_back(fwpFilterCondition);
-	conditions6->push_back(fwpFilterCondition);
+	return sb->ToString();
 }
 
 		
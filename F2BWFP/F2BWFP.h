@@ -109,6 +109,39 @@ namespace F2B {
 
 
 
+	// Bump allocator for filter condition values, memory is allocated
+	// in chunks and all values are released at once by Reset or delete
+	class FirewallArena
+	{
+	public:
+		FirewallArena(size_t chunkSize);
+		~FirewallArena();
+
+		// Allocate zeroed memory aligned for any WFP structure
+		void *Alloc(size_t size);
+		// Release all allocated values (memory is kept for reuse)
+		void Reset();
+
+	private:
+		struct Chunk {
+			Chunk *next;
+			size_t size;
+		};
+
+		Chunk *head;
+		BYTE *pos;
+		size_t left;
+		size_t chunkSize;
+		size_t total; // size of all chunks
+
+		void FreeChunks();
+		void NewChunk(size_t size);
+	};
+
+
+#define F2B_CONDITIONS_ARENA_SIZE 1024
+#define F2B_CONDITIONS_POOL_SIZE 64
+
 	public ref class FirewallConditions sealed
 	{
 	private:
@@ -117,12 +150,31 @@ namespace F2B {
 		bool hasIPv4;
 		bool hasIPv6;
 		bool needTransportLayer;
+		// Memory for values referenced by conditions
+		FirewallArena *arena;
+		// Released objects ready for reuse (see Acquire and Release)
+		static Stack<FirewallConditions^>^ s_pool = gcnew Stack<FirewallConditions^>();
 	public:
 		// Object initializations / destruction
 		FirewallConditions();
 		~FirewallConditions();
 		!FirewallConditions();
 
+		// Create conditions directly from binary F2B_FWDATA_TYPE0 data
+		static FirewallConditions^ FromFwData(array<Byte>^ data);
+
+		// Get empty conditions object from pool (or new object if pool
+		// is empty) and return it back to the pool when it is no longer
+		// used, conditions must not be accessed after Release
+		static FirewallConditions^ Acquire();
+		static void Release(FirewallConditions^ conds);
+
+		// Remove all conditions and release memory used by their values
+		void Reset();
+
+		// Replace conditions with records from F2B_FWDATA_TYPE0 data
+		void Load(array<Byte>^ data);
+
 		// Add new filtering rule condition
 		void Add(IPAddress^ addr);
 		void Add(IPAddress^ addr, int prefix);
@@ -143,15 +195,306 @@ namespace F2B {
 		size_t CountIPv6() { return conditions6->size(); };
 
 		// Get conditions
-		FWPM_FILTER_CONDITION* GetIPv4() { return &(*conditions4)[0]; };
-		FWPM_FILTER_CONDITION* GetIPv6() { return &(*conditions6)[0]; };
+		FWPM_FILTER_CONDITION* GetIPv4() { return conditions4->data(); };
+		FWPM_FILTER_CONDITION* GetIPv6() { return conditions6->data(); };
 
 		// Get filtering layer required by conditions
 		GUID LayerIPv4() { return needTransportLayer ? FWPM_LAYER_INBOUND_TRANSPORT_V4 : FWPM_LAYER_INBOUND_IPPACKET_V4; };
 		GUID LayerIPv6() { return needTransportLayer ? FWPM_LAYER_INBOUND_TRANSPORT_V6 : FWPM_LAYER_INBOUND_IPPACKET_V6; };
+
+		// Raw condition values (conditions created by Add and Load
+		// from the same rules must have same string representation)
+		virtual String^ ToString() override;
+	};
+
+
+
+	// Binary metadata stored in filter providerData, expiration is
+	// followed by rule hash (same layout is used for data encoded in
+	// filter name by FwData.EncodeName, see F2BShared/Fw.cs)
+#define F2B_FILTER_METADATA_VERSION 1
+#pragma pack(push, 1)
+	typedef struct F2B_FILTER_METADATA0_ {
+		BYTE magic[3]; // "F2B"
+		BYTE version; // F2B_FILTER_METADATA_VERSION
+		INT64 expiration; // UTC ticks
+		// BYTE hash[]; // rest of providerData
+	} F2B_FILTER_METADATA0;
+#pragma pack(pop)
+
+
+
+	// Filter rule returned by Firewall::ListFilters, expiration and hash
+	// are filled for filters with F2B metadata and name only for filters
+	// without metadata (e.g. filters installed by older versions)
+	public value struct FirewallFilter
+	{
+		UInt64 Id;
+		bool HasMetadata;
+		Int64 Expiration;
+		array<Byte>^ Hash;
+		String^ Name;
+	};
+
+
+
+	// One filter rule of Firewall::AddBatch request, FilterId and Error
+	// are filled with result of this rule installation
+	public ref class FirewallBatchItem sealed
+	{
+	public:
+		FirewallBatchItem(String^ name, FirewallConditions^ conditions, bool ipv6)
+		{
+			Name = name;
+			Conditions = conditions;
+			IPv6 = ipv6;
+			Metadata = nullptr;
+			FilterId = 0;
+			Error = ERROR_SUCCESS;
+		};
+
+		// Filter rule definition
+		property String^ Name;
+		property array<Byte>^ Metadata; // stored in filter providerData
+		property FirewallConditions^ Conditions;
+		property bool IPv6;
+
+		// Filter rule installation result (FilterId is valid only for Error == 0)
+		property UInt64 FilterId;
+		property int Error;
+	};
+
+
+
+	// Firewall operations with collected statistics
+	public enum class FirewallOperation {
+		Install = 0,
+		Add,
+		AddBatch,
+		Replace,
+		Remove,
+		RemoveBatch,
+		Cleanup,
+		List,
+	};
+
+	// Number of FirewallOperation values and latency histogram buckets
+	// (bucket i contains calls that took less than 2^i microseconds)
+#define F2B_STATS_OPERATIONS 8
+#define F2B_STATS_BUCKETS 32
+	// Number of distinct error codes counted by one thread (errors with
+	// other codes are included only in per operation error count)
+#define F2B_STATS_ERRORS 32
+
+
+
+	// Counters updated only by their owner thread, they are merged
+	// by FirewallStats::Snapshot and folded in retired counters when
+	// owner thread exits (not visible outside this assembly)
+	ref class FirewallCounters sealed
+	{
+	public:
+		FirewallCounters(Thread^ owner)
+		{
+			this->owner = owner;
+			calls = gcnew array<Int64>(F2B_STATS_OPERATIONS);
+			errors = gcnew array<Int64>(F2B_STATS_OPERATIONS);
+			max = gcnew array<Int64>(F2B_STATS_OPERATIONS);
+			histogram = gcnew array<Int64>(F2B_STATS_OPERATIONS * F2B_STATS_BUCKETS);
+			errorCodes = gcnew array<int>(F2B_STATS_ERRORS);
+			errorCounts = gcnew array<Int64>(F2B_STATS_ERRORS);
+		};
+
+		Thread^ owner; // nullptr for retired counters
+		array<Int64>^ calls;
+		array<Int64>^ errors;
+		array<Int64>^ max; // Stopwatch ticks
+		array<Int64>^ histogram;
+		// error code slots (code 0 is free slot, code is published
+		// before its count is incremented)
+		array<int>^ errorCodes;
+		array<Int64>^ errorCounts;
+	};
+
+
+
+	// Statistics of one firewall operation (times in milliseconds)
+	public ref class FirewallOperationStats sealed
+	{
+	public:
+		property FirewallOperation Operation;
+		property Int64 Calls;
+		property Int64 Errors;
+		property double P50;
+		property double P99;
+		property double Max;
+		property array<Int64>^ Histogram;
+
+		// Upper limit of histogram bucket in milliseconds
+		static double BucketLimit(int bucket) { return (double)(1LL << bucket) / 1000.0; };
+	};
+
+
+
+	// Snapshot of statistics for all firewall operations performed
+	// by this process
+	public ref class FirewallStats sealed
+	{
 	private:
-		// Free memory allocated for filter condition options
-		void FreeCondition(FWPM_FILTER_CONDITION &fwpFilterCondition);
+		// per-thread counters (thread creates its counters on first use)
+		[ThreadStatic] static FirewallCounters^ t_counters;
+		static List<FirewallCounters^>^ s_counters = gcnew List<FirewallCounters^>();
+		// counters of exited threads (modified with s_counters lock)
+		static FirewallCounters^ s_retired = gcnew FirewallCounters(nullptr);
+		static Int64 s_filters = 0;
+
+		static FirewallCounters^ Counters();
+		static void Retire();
+		static void Merge(FirewallCounters^ from, FirewallCounters^ to);
+		static void AddError(FirewallCounters^ counters, int code, Int64 count);
+		static double Percentile(array<Int64>^ histogram, Int64 calls, double percentile, double max);
+
+	public:
+		property DateTime Time;
+		// Number of F2B filters (last enumeration adjusted by successful
+		// add and remove operations)
+		property Int64 Filters;
+		property array<FirewallOperationStats^>^ Operations;
+		property Dictionary<WFPErrorCode, Int64>^ Errors;
+
+		static FirewallStats^ Snapshot();
+
+		virtual String^ ToString() override;
+
+	internal:
+		static void Record(FirewallOperation op, Int64 started, DWORD rc);
+		static void RecordError(FirewallOperation op, DWORD rc);
+		static void SetFilters(Int64 count) { Interlocked::Exchange(s_filters, count); };
+		static void AddFilters(Int64 count) { Interlocked::Add(s_filters, count); };
+	};
+
+
+
+	// Measure duration of firewall operation (destructor is called
+	// also when operation throws managed exception, rc must be set
+	// before throwing exception)
+	class FirewallOperationTimer
+	{
+	public:
+		FirewallOperationTimer(int op);
+		~FirewallOperationTimer();
+
+		int op;
+		INT64 started;
+		DWORD rc;
+	};
+
+
+
+	// Filter engine calls used by filter operations, every instance
+	// has its own WFP session (WFP transaction belongs to whole session
+	// and not just to thread that started it)
+	class FirewallEngine
+	{
+	public:
+		virtual ~FirewallEngine() {}
+
+		virtual DWORD TransactionBegin() = 0;
+		virtual DWORD TransactionCommit() = 0;
+		virtual DWORD TransactionAbort() = 0;
+		virtual DWORD FilterAdd(const FWPM_FILTER *filter, UINT64 *id) = 0;
+		virtual DWORD FilterDeleteById(UINT64 id) = 0;
+		virtual DWORD FilterGetById(UINT64 id, FWPM_FILTER **filter) = 0;
+		virtual DWORD FilterCreateEnumHandle(const FWPM_FILTER_ENUM_TEMPLATE *enumTemplate, HANDLE *enumHandle) = 0;
+		virtual DWORD FilterEnum(HANDLE enumHandle, UINT32 numEntriesRequested, FWPM_FILTER ***entries, UINT32 *numEntriesReturned) = 0;
+		virtual DWORD FilterDestroyEnumHandle(HANDLE enumHandle) = 0;
+		virtual void FreeMemory(void **p) = 0;
+
+		// Transaction was started and not yet commited or aborted
+		bool InTransaction() const { return transaction; }
+
+	protected:
+		bool transaction = false;
+	};
+
+
+
+	// Engine session opened by FwpmEngineOpen
+	class WfpEngine : public FirewallEngine
+	{
+	public:
+		WfpEngine();
+		virtual ~WfpEngine();
+
+		DWORD Open(FWPM_SESSION *session);
+
+		virtual DWORD TransactionBegin();
+		virtual DWORD TransactionCommit();
+		virtual DWORD TransactionAbort();
+		virtual DWORD FilterAdd(const FWPM_FILTER *filter, UINT64 *id);
+		virtual DWORD FilterDeleteById(UINT64 id);
+		virtual DWORD FilterGetById(UINT64 id, FWPM_FILTER **filter);
+		virtual DWORD FilterCreateEnumHandle(const FWPM_FILTER_ENUM_TEMPLATE *enumTemplate, HANDLE *enumHandle);
+		virtual DWORD FilterEnum(HANDLE enumHandle, UINT32 numEntriesRequested, FWPM_FILTER ***entries, UINT32 *numEntriesReturned);
+		virtual DWORD FilterDestroyEnumHandle(HANDLE enumHandle);
+		virtual void FreeMemory(void **p);
+
+	private:
+		HANDLE hEngine;
+
+		WfpEngine(const WfpEngine &);
+		WfpEngine &operator=(const WfpEngine &);
+	};
+
+
+
+	// Maximum number of idle engine sessions kept for reuse
+#define F2B_SESSION_POOL_SIZE 16
+
+	// Engine sessions for concurrent filter operations, lock protects
+	// only list of idle sessions and it is not held during WFP calls
+	// (new session is opened when all existing sessions are in use)
+	class FirewallSessionPool
+	{
+	public:
+		FirewallSessionPool(FWPM_SESSION *session);
+		virtual ~FirewallSessionPool();
+
+		FirewallEngine *Acquire(DWORD *rc);
+		void Release(FirewallEngine *engine);
+
+	protected:
+		virtual FirewallEngine *CreateEngine(DWORD *rc);
+
+	private:
+		CRITICAL_SECTION lock;
+		std::vector<FirewallEngine *> idle;
+		FWPM_SESSION *session;
+
+		FirewallSessionPool(const FirewallSessionPool &);
+		FirewallSessionPool &operator=(const FirewallSessionPool &);
+	};
+
+
+
+	// Engine session borrowed from pool for one firewall operation
+	// (check rc before using engine)
+	class FirewallSession
+	{
+	public:
+		FirewallSession(FirewallSessionPool *pool);
+		~FirewallSession();
+
+		FirewallEngine *Engine() { return engine; }
+
+		DWORD rc;
+
+	private:
+		FirewallSessionPool *pool;
+		FirewallEngine *engine;
+
+		FirewallSession(const FirewallSession &);
+		FirewallSession &operator=(const FirewallSession &);
 	};
 
 
@@ -162,6 +505,7 @@ namespace F2B {
 		// Singleton data
 		static Object^ sync = gcnew Object();
 		static Firewall^ m_instance;
+		static bool m_memoryEngine = false;
 		// Singleton constructor
 		Firewall();
 		Firewall(const Firewall%) { throw gcnew System::InvalidOperationException("Cannot copy-construct singleton"); }
@@ -177,7 +521,30 @@ namespace F2B {
 		HANDLE *p_hEngineHandle = NULL;
 		FWPM_SESSION *m_Session = NULL;
 
+		// Maximum number of filter operations in one WFP transaction
+		int m_batchSize = 1000;
+
+		// Number of filters fetched by one FwpmFilterEnum call and
+		// enumeration statistics (all filters returned by WFP vs. F2B filters)
+		int m_enumPageSize = 256;
+		Int64 m_enumScanned = 0;
+		Int64 m_enumMatched = 0;
+
+		// Engine sessions used by filter operations, each operation uses
+		// its own session so concurrent transactions are not mixed
+		FirewallSessionPool *m_sessions = NULL;
+
+		// Ids of filters that are known to belong to F2B (added or
+		// enumerated by this instance), such filters can be removed
+		// without FwpmFilterGetById ownership check
+		Dictionary<UInt64, bool>^ m_owned = gcnew Dictionary<UInt64, bool>();
+
 	public:
+		// Use in-memory filter engine instead of WFP for filter operations
+		// (rules are not installed, only for tests), it must be called
+		// before first use of Instance
+		static void UseMemoryEngine();
+
 		// Singleton instance
 		static property Firewall^ Instance {
 			Firewall^ get() {
@@ -211,6 +578,32 @@ namespace F2B {
 			F2BFW_SUBLAYER_KEY.Data4[0], F2BFW_SUBLAYER_KEY.Data4[1], F2BFW_SUBLAYER_KEY.Data4[2], F2BFW_SUBLAYER_KEY.Data4[3],
 			F2BFW_SUBLAYER_KEY.Data4[4], F2BFW_SUBLAYER_KEY.Data4[5], F2BFW_SUBLAYER_KEY.Data4[6], F2BFW_SUBLAYER_KEY.Data4[7]);
 
+		// Maximum number of filter operations in one WFP transaction
+		property int BatchSize {
+			int get() { return m_batchSize; }
+			void set(int value) { m_batchSize = (value > 0 ? value : 1); }
+		}
+
+		// Number of filters fetched from WFP by one enumeration call
+		property int EnumPageSize {
+			int get() { return m_enumPageSize; }
+			void set(int value) { m_enumPageSize = (value > 0 ? value : 1); }
+		}
+
+		// Number of filters processed by all enumerations and number
+		// of F2B filters within these enumerated filters
+		property Int64 EnumScanned {
+			Int64 get() { return Interlocked::Read(m_enumScanned); }
+		}
+		property Int64 EnumMatched {
+			Int64 get() { return Interlocked::Read(m_enumMatched); }
+		}
+
+		// Call counters, error counters and latency of firewall operations
+		property FirewallStats^ Stats {
+			FirewallStats^ get() { return FirewallStats::Snapshot(); }
+		}
+
 		// Create required WFP provider and sublayer for this module
 		void Install();
 
@@ -241,15 +634,42 @@ namespace F2B {
 		//UInt64 Add(String^ name, List<Object^>^ rules);
 		//UInt64 Add(String^ name, char *data, UInt32 size);
 		UInt64 AddIPv4(String^ name, FirewallConditions^ conditions) { return AddIPv4(name, conditions, 0, false, false); };
-		UInt64 AddIPv4(String^ name, FirewallConditions^ conditions, UInt64 weight, bool permit, bool persistent);
+		UInt64 AddIPv4(String^ name, FirewallConditions^ conditions, UInt64 weight, bool permit, bool persistent) { return AddIPv4(name, nullptr, conditions, weight, permit, persistent); };
+		UInt64 AddIPv4(String^ name, array<Byte>^ metadata, FirewallConditions^ conditions, UInt64 weight, bool permit, bool persistent);
 		UInt64 AddIPv6(String^ name, FirewallConditions^ conditions) { return AddIPv6(name, conditions, 0, false, false); };
-		UInt64 AddIPv6(String^ name, FirewallConditions^ conditions, UInt64 weight, bool permit, bool persistent);
+		UInt64 AddIPv6(String^ name, FirewallConditions^ conditions, UInt64 weight, bool permit, bool persistent) { return AddIPv6(name, nullptr, conditions, weight, permit, persistent); };
+		UInt64 AddIPv6(String^ name, array<Byte>^ metadata, FirewallConditions^ conditions, UInt64 weight, bool permit, bool persistent);
 		//UInt64 Add(String^ name, const GUID &layerKey, FWPM_FILTER_CONDITION &fwpFilterCondition, UInt32 iFilterCondition) { return Add(name, layerKey, fwpFilterCondition, iFilterCondition, 0, false); };
-		UInt64 Add(String^ name, const GUID &layerKey, FWPM_FILTER_CONDITION &fwpFilterCondition, UInt32 iFilterCondition, UInt64 weight, bool permit, bool persistent);
+		UInt64 Add(String^ name, const GUID &layerKey, FWPM_FILTER_CONDITION &fwpFilterCondition, UInt32 iFilterCondition, UInt64 weight, bool permit, bool persistent) { return Add(name, nullptr, layerKey, fwpFilterCondition, iFilterCondition, weight, permit, persistent); };
+		UInt64 Add(String^ name, array<Byte>^ metadata, const GUID &layerKey, FWPM_FILTER_CONDITION &fwpFilterCondition, UInt32 iFilterCondition, UInt64 weight, bool permit, bool persistent);
+
+		// Add new filtering rules using (size capped) WFP transactions,
+		// rule that can't be added is reported in its FirewallBatchItem
+		// and it doesn't prevent installation of other rules
+		void AddBatch(IList<FirewallBatchItem^>^ items) { AddBatch(items, 0, false, false); };
+		void AddBatch(IList<FirewallBatchItem^>^ items, UInt64 weight, bool permit, bool persistent);
+
+		// Add new filtering rule and remove existing rule in one WFP
+		// transaction (no rule is added for empty conditions and no rule
+		// is removed for zero id)
+		UInt64 Replace(String^ name, FirewallConditions^ conditions, bool ipv6, UInt64 weight, bool permit, bool persistent, UInt64 id) { return Replace(name, nullptr, conditions, ipv6, weight, permit, persistent, id); };
+		UInt64 Replace(String^ name, array<Byte>^ metadata, FirewallConditions^ conditions, bool ipv6, UInt64 weight, bool permit, bool persistent, UInt64 id);
 
 		// Remove filter with defined Id
 		void Remove(UInt64 id);
 
+		// Remove filtering rules with ids from FirewallBatchItem::FilterId
+		// using (size capped) WFP transactions, rule that no longer exists
+		// is treated as removed
+		void RemoveBatch(IList<FirewallBatchItem^>^ items);
+
+		// Remove filtering rules with given ids using (size capped) WFP
+		// transactions and return result for each id (FilterNotFound for
+		// filters that no longer exists, ERROR_ACCESS_DENIED for filters
+		// that doesn't belong to F2B), ownership is verified only for ids
+		// that were not added or enumerated by this instance
+		array<int>^ RemoveMany(IList<UInt64>^ ids);
+
 		// Remove all filter rules added by this module
 		void Cleanup();
 
@@ -257,8 +677,18 @@ namespace F2B {
 		Dictionary<UInt64, String^>^ List() { return List(false); };
 		Dictionary<UInt64, String^>^ List(bool details);
 
+		// List all filter rules added by this module with decoded binary
+		// metadata (no filter name conversion for filters with metadata)
+		List<FirewallFilter>^ ListFilters();
+
 	private:
-		void List(bool details, GUID layer, Dictionary<UInt64, String^>^ list);
+		DWORD CheckOwner(FirewallEngine *engine, UINT64 id);
+		bool IsOwned(UInt64 id);
+		void SetOwned(UInt64 id, bool owned);
+		void ClearOwned();
+		void List(FirewallEngine *engine, bool details, GUID layer, Dictionary<UInt64, String^>^ list);
+		void ListIds(FirewallEngine *engine, const GUID &layer, std::vector<UINT64> &ids);
+		void ListFilters(FirewallEngine *engine, const GUID &layer, List<FirewallFilter>^ list);
 		//void SetCondition(FWPM_FILTER_CONDITION &fwpFilterCondition, IPAddress^ addr);
 		//void SetCondition(FWPM_FILTER_CONDITION &fwpFilterCondition, IPAddress^ addr, int prefix);
 		//void SetCondition(FWPM_FILTER_CONDITION &fwpFilterCondition, IPAddress^ addrFirst, IPAddress^ addrLast);
@@ -270,6 +700,130 @@ namespace F2B {
 
 
 
+	ref class FirewallQueueItem;
+
+	// Callback executed by FirewallQueue worker thread when queued
+	// operation was processed (result is available in item Error/FilterId)
+	public delegate void FirewallQueueCompletion(FirewallQueueItem^ item);
+
+
+
+	// Add or remove operation submitted to FirewallQueue
+	public ref class FirewallQueueItem sealed
+	{
+	public:
+		// Add new filter rule
+		FirewallQueueItem(FirewallBatchItem^ item, UInt64 weight, bool permit, bool persistent, FirewallQueueCompletion^ completion)
+		{
+			Remove = false;
+			Item = item;
+			Weight = weight;
+			Permit = permit;
+			Persistent = persistent;
+			Completion = completion;
+		};
+
+		// Remove existing filter rule
+		FirewallQueueItem(UInt64 filterId, FirewallQueueCompletion^ completion)
+		{
+			Remove = true;
+			Item = gcnew FirewallBatchItem(nullptr, nullptr, false);
+			Item->FilterId = filterId;
+			Weight = 0;
+			Permit = false;
+			Persistent = false;
+			Completion = completion;
+		};
+
+		property bool Remove;
+		property FirewallBatchItem^ Item;
+		property UInt64 Weight;
+		property bool Permit;
+		property bool Persistent;
+		property FirewallQueueCompletion^ Completion;
+
+		// Caller data passed back to completion callback
+		property Object^ State;
+	};
+
+
+
+	// Bounded lock-free multi-producer / single-consumer queue of filter
+	// operations processed by dedicated worker thread. Operations waiting
+	// in the queue are installed together using Firewall::AddBatch and
+	// Firewall::RemoveBatch (new rules are always added before removal
+	// of rules from same batch, so replaced rules never leave a gap).
+	public ref class FirewallQueue sealed
+	{
+	private:
+		// ring buffer with per-slot sequence numbers (slot is free for
+		// producer at position pos when sequence == pos and it contains
+		// item for consumer when sequence == pos + 1)
+		array<FirewallQueueItem^>^ m_items;
+		array<Int64>^ m_sequence;
+		int m_mask;
+		Int64 m_enqueuePos = 0;
+		Int64 m_dequeuePos = 0;
+
+		// worker thread data
+		Thread^ m_worker;
+		AutoResetEvent^ m_signal;
+		int m_sleeping = 0;
+		int m_stop = 0;
+
+		// statistics and Flush synchronization
+		Object^ m_sync = gcnew Object();
+		Int64 m_submitted = 0;
+		Int64 m_completed = 0;
+		Int64 m_batches = 0;
+
+		void Run();
+		bool TryDequeue(FirewallQueueItem^% item);
+		bool IsPending();
+		void Process(List<FirewallQueueItem^>^ items);
+	public:
+		// Create queue for at least capacity items and start worker thread
+		FirewallQueue(int capacity);
+		~FirewallQueue();
+
+		property int Capacity {
+			int get() { return m_items->Length; }
+		}
+
+		// Number of items waiting for worker thread
+		property int Count {
+			int get() { return (int)(Interlocked::Read(m_enqueuePos) - Interlocked::Read(m_dequeuePos)); }
+		}
+
+		// Number of submitted / processed items and WFP batches
+		property Int64 Submitted {
+			Int64 get() { return Interlocked::Read(m_submitted); }
+		}
+		property Int64 Completed {
+			Int64 get() { return Interlocked::Read(m_completed); }
+		}
+		property Int64 Batches {
+			Int64 get() { return Interlocked::Read(m_batches); }
+		}
+
+		// Submit operation without blocking (false when queue is full)
+		bool TryEnqueue(FirewallQueueItem^ item);
+
+		// Submit operation, wait for free space when queue is full (false
+		// when no space was freed within timeout, must not be called from
+		// completion callback)
+		bool Enqueue(FirewallQueueItem^ item, int millisecondsTimeout);
+
+		// Wait until all operations submitted before this call are
+		// processed (must not be called from completion callback)
+		bool Flush(int millisecondsTimeout);
+
+		// Process remaining operations and stop worker thread
+		void Stop();
+	};
+
+
+
 	static String^ GetErrorText(DWORD rc);
 	//static WCHAR * GetErrorText(DWORD rc);
 	static WCHAR * FormatErrorText(WCHAR * msg, DWORD rc);
@@ -0,0 +1,124 @@
+#pragma once
+// Transaction handling for batch filter operations. This header doesn't
+// depend on WFP or CLR, so batching semantics can be verified with an
+// in-process stand-in of Fwpm* functions (see tests/FirewallBatchTest.cpp).
+
+#include <vector>
+
+namespace F2B {
+
+	// Rules [start, end) are applied in WFP transaction. Rule that fails
+	// aborts the transaction (WFP transaction can't be partially commited),
+	// so the failed rule gets its own error and rules applied before it
+	// are commited again in separate transaction, processing continues with
+	// rules after failed one. Each rule is applied at most twice in normal
+	// transactions and number of transactions grows linearly with number
+	// of failed rules.
+	class FirewallBatch
+	{
+	public:
+		virtual ~FirewallBatch() {}
+
+		// Rule still waits for its result (rules with result are skipped)
+		virtual bool Pending(size_t i) = 0;
+
+		virtual DWORD Begin() = 0;
+		virtual DWORD Apply(size_t i, UINT64 *id) = 0;
+		virtual DWORD Commit() = 0;
+		virtual DWORD Abort() = 0;
+
+		// Final result of rule (id is valid only for commited rule)
+		virtual void Result(size_t i, DWORD rc, UINT64 id) = 0;
+
+		// Error of rule that doesn't require transaction abort (e.g.
+		// removal of filter that no longer exists)
+		virtual bool Tolerated(DWORD rc) { return false; }
+
+		// Error that fails whole transaction and not just one rule
+		virtual bool Fatal(DWORD rc) = 0;
+
+		// Number of transactions started by Run
+		size_t Transactions() const { return transactions; }
+
+		void Run(size_t start, size_t end)
+		{
+			std::vector<UINT64> ids(end - start, 0);
+			size_t pos = start;
+
+			while (pos < end)
+			{
+				DWORD rc = Begin();
+				if (rc != ERROR_SUCCESS)
+				{
+					Fail(pos, end, rc);
+					return;
+				}
+				transactions++;
+
+				size_t i = pos;
+				for (; i < end; i++)
+				{
+					if (!Pending(i))
+						continue;
+
+					UINT64 id = 0;
+					rc = Apply(i, &id);
+					if (rc == ERROR_SUCCESS)
+					{
+						ids[i - start] = id;
+					}
+					else if (Tolerated(rc))
+					{
+						Result(i, rc, 0);
+						rc = ERROR_SUCCESS;
+					}
+					else
+					{
+						break;
+					}
+				}
+
+				if (rc == ERROR_SUCCESS)
+				{
+					rc = Commit();
+					if (rc != ERROR_SUCCESS)
+					{
+						Fail(pos, end, rc);
+						return;
+					}
+
+					for (size_t j = pos; j < end; j++)
+					{
+						if (Pending(j))
+							Result(j, ERROR_SUCCESS, ids[j - start]);
+					}
+					return;
+				}
+
+				DWORD rcAbort = Abort();
+				if (Fatal(rc) || rcAbort != ERROR_SUCCESS)
+				{
+					Fail(pos, end, rc);
+					return;
+				}
+
+				// only this rule failed, rules before it are applied again
+				Result(i, rc, 0);
+				Run(pos, i);
+				pos = i + 1;
+			}
+		}
+
+	private:
+		size_t transactions = 0;
+
+		void Fail(size_t start, size_t end, DWORD rc)
+		{
+			for (size_t i = start; i < end; i++)
+			{
+				if (Pending(i))
+					Result(i, rc, 0);
+			}
+		}
+	};
+}
@@ -0,0 +1,385 @@
+// Test of batch transaction handling (FirewallBatch.h) with in-process
+// stand-in of Fwpm* transaction and filter functions. It doesn't need
+// WFP or CLR, so it can be compiled also on Linux:
+//
+//   g++ -std=c++11 -Wall -o FirewallBatchTest FirewallBatchTest.cpp && ./FirewallBatchTest
+//   cl /EHsc FirewallBatchTest.cpp && FirewallBatchTest.exe
+//
+#ifdef _WIN32
+#include <windows.h>
+#include <fwpmu.h>
+#else
+#include <stdint.h>
+typedef uint32_t DWORD;
+typedef uint64_t UINT64;
+#define ERROR_SUCCESS 0
+#define ERROR_INVALID_PARAMETER 87
+#define ERROR_IO_PENDING 997
+#define FWP_E_FILTER_NOT_FOUND 0x80320003
+#define FWP_E_ALREADY_EXISTS 0x80320009
+#define FWP_E_NO_TXN_IN_PROGRESS 0x8032000D
+#define FWP_E_TXN_IN_PROGRESS 0x8032000E
+#define FWP_E_TXN_ABORTED 0x8032000F
+#define FWP_E_SESSION_ABORTED 0x80320010
+#endif
+
+#include <stdio.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../FirewallBatch.h"
+
+using namespace F2B;
+
+
+// Filter engine stand-in, filters added or removed in transaction are
+// visible in "filters" only after commit
+struct FakeEngine
+{
+	std::map<UINT64, std::string> filters;
+	UINT64 nextId = 1;
+
+	bool txn = false;
+	std::map<UINT64, std::string> added; // pending in transaction
+	std::set<UINT64> removed; // pending in transaction
+
+	// injected failures
+	std::set<std::string> failNames; // FwpmFilterAdd fails for these names
+	std::string abortName; // FwpmFilterAdd aborts whole transaction
+	DWORD commitError = ERROR_SUCCESS;
+
+	// number of calls
+	size_t begins = 0, adds = 0, deletes = 0, commits = 0, aborts = 0;
+
+	DWORD TransactionBegin()
+	{
+		if (txn)
+			return FWP_E_TXN_IN_PROGRESS;
+		begins++;
+		txn = true;
+		added.clear();
+		removed.clear();
+		return ERROR_SUCCESS;
+	}
+
+	DWORD TransactionCommit()
+	{
+		if (!txn)
+			return FWP_E_NO_TXN_IN_PROGRESS;
+		txn = false;
+		if (commitError != ERROR_SUCCESS)
+			return commitError;
+		commits++;
+		for (std::set<UINT64>::iterator it = removed.begin(); it != removed.end(); ++it)
+			filters.erase(*it);
+		filters.insert(added.begin(), added.end());
+		return ERROR_SUCCESS;
+	}
+
+	DWORD TransactionAbort()
+	{
+		if (!txn)
+			return FWP_E_NO_TXN_IN_PROGRESS;
+		aborts++;
+		txn = false;
+		return ERROR_SUCCESS;
+	}
+
+	DWORD FilterAdd(const std::string &name, UINT64 *id)
+	{
+		adds++;
+		*id = 0;
+		if (name == abortName)
+			return FWP_E_TXN_ABORTED;
+		if (failNames.count(name) > 0)
+			return FWP_E_ALREADY_EXISTS;
+		*id = nextId++;
+		if (txn)
+			added[*id] = name;
+		else
+			filters[*id] = name;
+		return ERROR_SUCCESS;
+	}
+
+	DWORD FilterDeleteById(UINT64 id)
+	{
+		deletes++;
+		if (filters.count(id) == 0 || removed.count(id) > 0)
+			return FWP_E_FILTER_NOT_FOUND;
+		if (txn)
+			removed.insert(id);
+		else
+			filters.erase(id);
+		return ERROR_SUCCESS;
+	}
+};
+
+
+struct Item
+{
+	std::string name;
+	UINT64 id;
+	DWORD error;
+};
+
+
+// Same mapping to engine calls as FirewallAddBatch in F2BWFP.cpp
+class FakeAddBatch : public FirewallBatch
+{
+public:
+	FakeAddBatch(FakeEngine &engine, std::vector<Item> &items) : engine(engine), items(items) {}
+
+	virtual bool Pending(size_t i) { return items[i].error == ERROR_IO_PENDING; }
+	virtual DWORD Begin() { return engine.TransactionBegin(); }
+	virtual DWORD Apply(size_t i, UINT64 *id) { return engine.FilterAdd(items[i].name, id); }
+	virtual DWORD Commit() { return engine.TransactionCommit(); }
+	virtual DWORD Abort() { return engine.TransactionAbort(); }
+	virtual void Result(size_t i, DWORD rc, UINT64 id) { items[i].error = rc; items[i].id = id; }
+	virtual bool Fatal(DWORD rc) { return rc == FWP_E_TXN_ABORTED || rc == FWP_E_SESSION_ABORTED; }
+
+private:
+	FakeEngine &engine;
+	std::vector<Item> &items;
+};
+
+
+// Same mapping to engine calls as FirewallRemoveBatch in F2BWFP.cpp
+class FakeRemoveBatch : public FirewallBatch
+{
+public:
+	FakeRemoveBatch(FakeEngine &engine, std::vector<Item> &items) : engine(engine), items(items) {}
+
+	virtual bool Pending(size_t i) { return items[i].error == ERROR_IO_PENDING; }
+	virtual DWORD Begin() { return engine.TransactionBegin(); }
+	virtual DWORD Apply(size_t i, UINT64 *id) { *id = 0; return engine.FilterDeleteById(items[i].id); }
+	virtual DWORD Commit() { return engine.TransactionCommit(); }
+	virtual DWORD Abort() { return engine.TransactionAbort(); }
+	virtual void Result(size_t i, DWORD rc, UINT64 id) { items[i].error = rc; }
+	virtual bool Tolerated(DWORD rc) { return rc == FWP_E_FILTER_NOT_FOUND; }
+	virtual bool Fatal(DWORD rc) { return rc == FWP_E_TXN_ABORTED || rc == FWP_E_SESSION_ABORTED; }
+
+private:
+	FakeEngine &engine;
+	std::vector<Item> &items;
+};
+
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+
+static std::vector<Item> Items(size_t count)
+{
+	std::vector<Item> items(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "F2B rule %zu", i);
+		items[i].name = name;
+		items[i].id = 0;
+		items[i].error = ERROR_IO_PENDING;
+	}
+	return items;
+}
+
+
+// Run batch in chunks of batchSize like Firewall::AddBatch
+static size_t Run(FirewallBatch &batch, size_t count, size_t batchSize)
+{
+	for (size_t start = 0; start < count; start += batchSize)
+	{
+		size_t end = start + batchSize;
+		batch.Run(start, end < count ? end : count);
+	}
+	return batch.Transactions();
+}
+
+
+static void TestAddAll()
+{
+	FakeEngine engine;
+	std::vector<Item> items = Items(2500);
+	FakeAddBatch batch(engine, items);
+
+	size_t transactions = Run(batch, items.size(), 1000);
+
+	CHECK(transactions == 3);
+	CHECK(engine.commits == 3);
+	CHECK(engine.adds == items.size());
+	CHECK(engine.filters.size() == items.size());
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		CHECK(items[i].error == ERROR_SUCCESS);
+		CHECK(engine.filters[items[i].id] == items[i].name);
+	}
+}
+
+
+static void TestAddPartialFailure()
+{
+	FakeEngine engine;
+	std::vector<Item> items = Items(1000);
+	engine.failNames.insert(items[0].name);
+	engine.failNames.insert(items[500].name);
+	engine.failNames.insert(items[999].name);
+	FakeAddBatch batch(engine, items);
+
+	Run(batch, items.size(), 1000);
+
+	// failed rules have their own error, all other rules are installed
+	CHECK(engine.filters.size() == items.size() - 3);
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		if (i == 0 || i == 500 || i == 999)
+		{
+			CHECK(items[i].error == FWP_E_ALREADY_EXISTS);
+			CHECK(items[i].id == 0);
+		}
+		else
+		{
+			CHECK(items[i].error == ERROR_SUCCESS);
+			CHECK(engine.filters.count(items[i].id) == 1);
+		}
+	}
+
+	// aborted transactions left no filters behind
+	for (std::map<UINT64, std::string>::iterator it = engine.filters.begin(); it != engine.filters.end(); ++it)
+	{
+		CHECK(engine.failNames.count(it->second) == 0);
+	}
+	CHECK(engine.aborts == 3);
+	CHECK(!engine.txn);
+}
+
+
+static void TestAddAllFail()
+{
+	// worst case: every rule fails, number of engine calls must
+	// grow linearly (not quadratically) with number of rules
+	FakeEngine engine;
+	std::vector<Item> items = Items(1000);
+	for (size_t i = 0; i < items.size(); i++)
+		engine.failNames.insert(items[i].name);
+	FakeAddBatch batch(engine, items);
+
+	Run(batch, items.size(), 1000);
+
+	CHECK(engine.filters.size() == 0);
+	CHECK(engine.adds == items.size());
+	CHECK(engine.begins <= 2 * items.size());
+	for (size_t i = 0; i < items.size(); i++)
+		CHECK(items[i].error == FWP_E_ALREADY_EXISTS);
+
+	// every other rule fails
+	FakeEngine engine2;
+	std::vector<Item> items2 = Items(1000);
+	for (size_t i = 0; i < items2.size(); i += 2)
+		engine2.failNames.insert(items2[i + 1].name);
+	FakeAddBatch batch2(engine2, items2);
+
+	Run(batch2, items2.size(), 1000);
+
+	CHECK(engine2.filters.size() == items2.size() / 2);
+	CHECK(engine2.adds <= 2 * items2.size());
+	CHECK(engine2.begins <= items2.size() + 1);
+}
+
+
+static void TestAddCommitRollback()
+{
+	// failed commit rolls back whole transaction, all rules report error
+	FakeEngine engine;
+	engine.commitError = FWP_E_SESSION_ABORTED;
+	std::vector<Item> items = Items(100);
+	FakeAddBatch batch(engine, items);
+
+	Run(batch, items.size(), 1000);
+
+	CHECK(engine.filters.size() == 0);
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		CHECK(items[i].error == FWP_E_SESSION_ABORTED);
+		CHECK(items[i].id == 0);
+	}
+}
+
+
+static void TestAddFatal()
+{
+	// error that aborts transaction fails remaining rules of this batch,
+	// rules commited in previous batch are kept
+	FakeEngine engine;
+	std::vector<Item> items = Items(20);
+	engine.abortName = items[15].name;
+	FakeAddBatch batch(engine, items);
+
+	Run(batch, items.size(), 10);
+
+	CHECK(engine.filters.size() == 10);
+	for (size_t i = 0; i < items.size(); i++)
+		CHECK(items[i].error == (i < 10 ? ERROR_SUCCESS : (DWORD)FWP_E_TXN_ABORTED));
+	CHECK(!engine.txn);
+}
+
+
+static void TestAddSkipsDone()
+{
+	// rules with result (e.g. invalid conditions) are not installed
+	FakeEngine engine;
+	std::vector<Item> items = Items(10);
+	items[3].error = ERROR_INVALID_PARAMETER;
+	FakeAddBatch batch(engine, items);
+
+	Run(batch, items.size(), 4);
+
+	CHECK(engine.filters.size() == 9);
+	CHECK(engine.adds == 9);
+	CHECK(items[3].error == ERROR_INVALID_PARAMETER);
+}
+
+
+static void TestRemove()
+{
+	FakeEngine engine;
+	std::vector<Item> items = Items(10);
+	FakeAddBatch add(engine, items);
+	Run(add, items.size(), 1000);
+
+	// removed outside of batch, must be reported without abort
+	engine.filters.erase(items[4].id);
+
+	for (size_t i = 0; i < items.size(); i++)
+		items[i].error = ERROR_IO_PENDING;
+	FakeRemoveBatch remove(engine, items);
+	Run(remove, items.size(), 1000);
+
+	CHECK(engine.filters.size() == 0);
+	CHECK(engine.aborts == 0);
+	CHECK(remove.Transactions() == 1);
+	for (size_t i = 0; i < items.size(); i++)
+		CHECK(items[i].error == (i == 4 ? (DWORD)FWP_E_FILTER_NOT_FOUND : (DWORD)ERROR_SUCCESS));
+}
+
+
+int main()
+{
+	TestAddAll();
+	TestAddPartialFailure();
+	TestAddAllFail();
+	TestAddCommitRollback();
+	TestAddFatal();
+	TestAddSkipsDone();
+	TestRemove();
+
+	if (failures > 0)
+	{
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+
+	printf("all tests passed\n");
+	return 0;
+}